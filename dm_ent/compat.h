@@ -0,0 +1,45 @@
+#ifndef _ENT_COMPAT_H_
+#define _ENT_COMPAT_H_
+
+/*
+    The entanglement core (core.c) is compiled both into the kernel module and into a userspace library (see user/).
+    This header pulls in everything the core needs: the kernel headers when building the module,
+    or their userspace replacements otherwise.
+*/
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/printk.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/atomic.h>
+#include <linux/mempool.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/bitmap.h>
+#include <linux/bitops.h>
+#include <linux/random.h>
+#include <linux/highmem.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+
+#include "ent_trace.h"
+
+#else
+
+#include "user/kcompat.h"
+
+#endif
+
+#endif
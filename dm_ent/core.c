@@ -0,0 +1,2519 @@
+#include "core.h"
+
+// Accounts for a page taken from the pool of the device, keeping track of the peak usage.
+static void ent_page_pool_get(struct entanglement_device *ent_dev) {
+
+    int in_use = atomic_inc_return(&ent_dev->pages_in_use);
+
+    // Racy, but only ever off by a concurrent allocation: this is a statistic.
+    if (in_use > READ_ONCE(ent_dev->pages_peak)) {
+        WRITE_ONCE(ent_dev->pages_peak, in_use);
+    }
+}
+
+/*
+    Allocates a page from the page pool of the device. A failed non-blocking attempt means the pool is exhausted and we have to wait
+    for a page to be returned, which is counted in the statistics.
+*/
+struct page *ent_alloc_page(struct entanglement_device *ent_dev) {
+
+    struct page *page = mempool_alloc(ent_dev->page_pool, GFP_NOWAIT | __GFP_NOWARN);
+
+    if (unlikely(!page)) {
+        ent_stats_inc(ent_dev->stats, ENT_STAT_MEMPOOL_WAITS);
+        page = mempool_alloc(ent_dev->page_pool, GFP_NOIO);
+    }
+    if (likely(page)) {
+        ent_page_pool_get(ent_dev);
+    }
+    return page;
+}
+
+// Same, but fails instead of waiting when the pool is exhausted (for REQ_NOWAIT bios).
+struct page *ent_try_alloc_page(struct entanglement_device *ent_dev) {
+
+    struct page *page = mempool_alloc(ent_dev->page_pool, GFP_NOWAIT | __GFP_NOWARN);
+
+    if (likely(page)) {
+        ent_page_pool_get(ent_dev);
+    }
+    return page;
+}
+
+void ent_free_page(struct entanglement_device *ent_dev, struct page *page) {
+
+    mempool_free(page, ent_dev->page_pool);
+    atomic_dec(&ent_dev->pages_in_use);
+}
+
+struct ent_cache_entry {
+    u64 chain_pos;
+    struct page *page;
+    struct list_head lru_node;
+    struct list_head hash_node;
+};
+
+static struct list_head *ent_cache_bucket(struct ent_cache *cache, u64 chain_pos) {
+    return &cache->buckets[chain_pos % ENT_CACHE_BUCKETS];
+}
+
+static struct ent_cache_entry *ent_cache_find(struct ent_cache *cache, u64 chain_pos) {
+
+    struct ent_cache_entry *entry;
+
+    list_for_each_entry(entry, ent_cache_bucket(cache, chain_pos), hash_node) {
+        if (entry->chain_pos == chain_pos) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Unlinks up to nr entries from the cold end of the LRU list onto the given list, to be freed by the caller without the lock held.
+static unsigned long ent_cache_evict(struct ent_cache *cache, unsigned long nr, struct list_head *evicted) {
+
+    struct ent_cache_entry *entry;
+    unsigned long freed = 0;
+
+    while (freed < nr && !list_empty(&cache->lru)) {
+        entry = list_last_entry(&cache->lru, struct ent_cache_entry, lru_node);
+        list_del(&entry->hash_node);
+        list_del(&entry->lru_node);
+        list_add(&entry->lru_node, evicted);
+        cache->nr_pages--;
+        freed++;
+    }
+    return freed;
+}
+
+static void ent_cache_free_entries(struct ent_cache *cache, struct list_head *entries) {
+
+    struct ent_cache_entry *entry, *tmp;
+
+    list_for_each_entry_safe(entry, tmp, entries, lru_node) {
+        list_del(&entry->lru_node);
+        __free_pages(entry->page, cache->order);
+        kfree(entry);
+    }
+}
+
+static void ent_cache_init(struct ent_cache *cache, uint capacity, uint order) {
+
+    spin_lock_init(&cache->lock);
+    cache->capacity = capacity;
+    cache->nr_pages = 0;
+    cache->order = order;
+    INIT_LIST_HEAD(&cache->lru);
+    for (int i = 0 ; i < ENT_CACHE_BUCKETS ; i++) {
+        INIT_LIST_HEAD(&cache->buckets[i]);
+    }
+}
+
+static void ent_cache_exit(struct ent_cache *cache) {
+
+    LIST_HEAD(evicted);
+
+    spin_lock(&cache->lock);
+    ent_cache_evict(cache, cache->nr_pages, &evicted);
+    spin_unlock(&cache->lock);
+    ent_cache_free_entries(cache, &evicted);
+}
+
+/*
+    Caches the contents of the unit at the given chain position, replacing what was cached for it. Called from the write path, so nothing
+    here may block: when a page cannot be allocated right away the block is simply not cached.
+*/
+void ent_cache_insert(struct entanglement_device *ent_dev, u64 chain_pos, const u8 *block) {
+
+    struct ent_cache *cache = &ent_dev->cache;
+    struct ent_cache_entry *entry, *new_entry = NULL;
+    bool full;
+
+    if (!READ_ONCE(cache->capacity)) {
+        return;
+    }
+
+    // Only allocate when the cache has room left: at capacity, the coldest entry is recycled instead.
+    spin_lock(&cache->lock);
+    full = cache->nr_pages >= cache->capacity;
+    spin_unlock(&cache->lock);
+
+    if (!full) {
+        new_entry = kmalloc(sizeof(*new_entry), GFP_NOWAIT | __GFP_NOWARN);
+        if (new_entry) {
+            new_entry->page = alloc_pages(GFP_NOWAIT | __GFP_NOWARN, cache->order);
+            if (!new_entry->page) {
+                kfree(new_entry);
+                new_entry = NULL;
+            }
+        }
+    }
+
+    spin_lock(&cache->lock);
+
+    entry = ent_cache_find(cache, chain_pos);
+    if (entry) {
+        list_del(&entry->lru_node);
+    }else {
+        if (new_entry && cache->nr_pages < cache->capacity) {
+            entry = new_entry;
+            new_entry = NULL;
+            cache->nr_pages++;
+        }else if (!list_empty(&cache->lru)) {
+            entry = list_last_entry(&cache->lru, struct ent_cache_entry, lru_node);
+            list_del(&entry->hash_node);
+            list_del(&entry->lru_node);
+        }
+        if (entry) {
+            entry->chain_pos = chain_pos;
+            list_add(&entry->hash_node, ent_cache_bucket(cache, chain_pos));
+        }
+    }
+
+    if (entry) {
+        memcpy(page_address(entry->page), block, ent_unit_size(ent_dev));
+        list_add(&entry->lru_node, &cache->lru);
+    }
+
+    spin_unlock(&cache->lock);
+
+    if (new_entry) {
+        __free_pages(new_entry->page, cache->order);
+        kfree(new_entry);
+    }
+}
+
+// Copies the cached block at the given chain position into page. Returns false, without touching page, if the block is not cached.
+bool ent_cache_read(struct entanglement_device *ent_dev, u64 chain_pos, struct page *page) {
+
+    struct ent_cache *cache = &ent_dev->cache;
+    struct ent_cache_entry *entry;
+
+    // A disabled cache does not count misses.
+    if (!READ_ONCE(cache->capacity)) {
+        return false;
+    }
+
+    spin_lock(&cache->lock);
+    entry = ent_cache_find(cache, chain_pos);
+    if (entry) {
+        memcpy(page_address(page), page_address(entry->page), ent_unit_size(ent_dev));
+        list_del(&entry->lru_node);
+        list_add(&entry->lru_node, &cache->lru);
+    }
+    spin_unlock(&cache->lock);
+
+    ent_stats_inc(ent_dev->stats, entry ? ENT_STAT_CACHE_HITS : ENT_STAT_CACHE_MISSES);
+    return entry != NULL;
+}
+
+// Frees up to nr of the least recently used pages, and returns how many were freed.
+unsigned long ent_cache_shrink(struct ent_cache *cache, unsigned long nr) {
+
+    LIST_HEAD(evicted);
+    unsigned long freed;
+
+    spin_lock(&cache->lock);
+    freed = ent_cache_evict(cache, nr, &evicted);
+    spin_unlock(&cache->lock);
+
+    ent_cache_free_entries(cache, &evicted);
+    return freed;
+}
+
+// Changes the capacity of the cache, evicting what does not fit anymore. A capacity of 0 disables the cache.
+void ent_cache_resize(struct ent_cache *cache, uint capacity) {
+
+    LIST_HEAD(evicted);
+
+    spin_lock(&cache->lock);
+    WRITE_ONCE(cache->capacity, capacity);
+    if (cache->nr_pages > capacity) {
+        ent_cache_evict(cache, cache->nr_pages - capacity, &evicted);
+    }
+    spin_unlock(&cache->lock);
+
+    ent_cache_free_entries(cache, &evicted);
+}
+
+/*
+    Chain segments (see struct ent_chain_segment). The table and the LRU list are protected by entanglement_lock.
+*/
+
+static void ent_chain_insert_segment(struct entanglement_device *ent_dev, struct ent_chain_segment *segment) {
+
+    ent_dev->segments[segment->index] = segment;
+    list_add(&segment->lru_node, &ent_dev->segment_lru);
+    ent_dev->nr_resident_segments++;
+}
+
+static void ent_chain_drop_segment(struct entanglement_device *ent_dev, struct ent_chain_segment *segment) {
+
+    ent_dev->segments[segment->index] = NULL;
+    list_del(&segment->lru_node);
+    ent_dev->nr_resident_segments--;
+    kfree(segment);
+}
+
+static void ent_chain_drop_all(struct entanglement_device *ent_dev) {
+
+    struct ent_chain_segment *segment, *tmp;
+
+    list_for_each_entry_safe(segment, tmp, &ent_dev->segment_lru, lru_node) {
+        ent_chain_drop_segment(ent_dev, segment);
+    }
+}
+
+/*
+    Drops the least recently used segments beyond the chain window. Only segments whose metadata block is on disk can be dropped
+    (the buffered one is still being appended to), and never the most recently used one, which the caller may be reading, nor
+    those a compaction has changed.
+*/
+static void ent_chain_trim(struct entanglement_device *ent_dev) {
+
+    u64 on_disk = READ_ONCE(ent_dev->next_sector) - ent_dev->metadata_base;
+    struct ent_chain_segment *segment, *prev, *first;
+
+    if (!ent_dev->chain_window || list_empty(&ent_dev->segment_lru)) {
+        return;
+    }
+
+    first = list_first_entry(&ent_dev->segment_lru, struct ent_chain_segment, lru_node);
+    segment = list_last_entry(&ent_dev->segment_lru, struct ent_chain_segment, lru_node);
+    while (ent_dev->nr_resident_segments > ent_dev->chain_window && segment != first) {
+        prev = list_prev_entry(segment, lru_node);
+        if (segment->index < on_disk && !segment->dirty) {
+            ent_chain_drop_segment(ent_dev, segment);
+        }
+        segment = prev;
+    }
+}
+
+// Reads segment index back from the metadata log.
+static int ent_chain_page_in(struct entanglement_device *ent_dev, u64 index, struct ent_chain_segment **segmentp) {
+
+    struct ent_chain_segment *segment;
+    struct page *sector_page;
+    struct page *checksum_page;
+    int err;
+
+    segment = kmalloc(sizeof(*segment), GFP_NOIO);
+    if (!segment) {
+        pr_err("Error while allocating chain segment %llu.\n", index);
+        return -ENOMEM;
+    }
+
+    sector_page = ent_alloc_page(ent_dev);
+    if (!sector_page) {
+        err = -ENOMEM;
+        goto err_sector_page;
+    }
+
+    checksum_page = ent_alloc_page(ent_dev);
+    if (!checksum_page) {
+        err = -ENOMEM;
+        goto err_checksum_page;
+    }
+
+    err = ent_meta_rwSector(ent_dev, sector_page, ent_dev->metadata_base + index, READ);
+    if (err) {
+        pr_err("Error while paging in the sectors of chain segment %llu: %d\n", index, err);
+        goto out;
+    }
+
+    // The checksum block is shared with the next segment, and may still be buffered when that one is the last.
+    if (ent_dev->metadata_base + ent_dev->metadata_sector_size + index / 2 == ent_dev->next_checksum) {
+        memcpy(kmap(checksum_page), ent_dev->block_checksum_buffer, ENT_BLOCK_SIZE);
+        kunmap(checksum_page);
+    }else {
+        err = ent_meta_rwSector(ent_dev, checksum_page, ent_dev->metadata_base + ent_dev->metadata_sector_size + index / 2, READ);
+        if (err) {
+            pr_err("Error while paging in the checksums of chain segment %llu: %d\n", index, err);
+            goto out;
+        }
+    }
+
+    segment->index = index;
+    segment->dirty = false;
+    segment->nr_records = ent_metadata_decode(kmap(sector_page), kmap(checksum_page), (index % 2) * ENT_SECTORS_PER_BLOCK, 
+                                              segment->sectors, segment->checksums);
+    kunmap(checksum_page);
+    kunmap(sector_page);
+
+    ent_chain_insert_segment(ent_dev, segment);
+    ent_stats_inc(ent_dev->stats, ENT_STAT_CHAIN_PAGE_INS);
+    ent_chain_trim(ent_dev);
+    *segmentp = segment;
+    segment = NULL;
+
+out:
+    ent_free_page(ent_dev, checksum_page);
+err_checksum_page:
+    ent_free_page(ent_dev, sector_page);
+err_sector_page:
+    kfree(segment);
+    return err;
+}
+
+/*
+    Looks up the record of the block at chain_pos (which must be below chain_length) as stored, with the anchor flag of its sector 
+    (see ent_record_sector()), paging its segment in from the metadata log when it is not in memory. checksum may be NULL. 
+    Must be called with entanglement_lock held.
+*/
+int ent_chain_record_raw(struct entanglement_device *ent_dev, u64 chain_pos, sector_t *record, uint *checksum) {
+
+    u64 index = chain_pos / ENT_SECTORS_PER_BLOCK;
+    uint offset = chain_pos % ENT_SECTORS_PER_BLOCK;
+    struct ent_chain_segment *segment = ent_dev->segments[index];
+    int err;
+
+    if (!segment) {
+        err = ent_chain_page_in(ent_dev, index, &segment);
+        if (err) {
+            return err;
+        }
+    }else if (ent_dev->segment_lru.next != &segment->lru_node) {
+        list_del(&segment->lru_node);
+        list_add(&segment->lru_node, &ent_dev->segment_lru);
+    }
+
+    if (offset >= segment->nr_records) {
+        pr_err("Chain position %llu is past the end of the metadata log.\n", chain_pos);
+        return -EIO;
+    }
+
+    *record = segment->sectors[offset];
+    if (checksum) {
+        *checksum = segment->checksums[offset];
+    }
+    return 0;
+}
+
+// Same as ent_chain_record_raw(), with the sector of the block only.
+int ent_chain_record(struct entanglement_device *ent_dev, u64 chain_pos, sector_t *sector, uint *checksum) {
+
+    int err = ent_chain_record_raw(ent_dev, chain_pos, sector, checksum);
+
+    if (!err) {
+        *sector = ent_record_sector(*sector);
+    }
+    return err;
+}
+
+// Sets how many chain segments stay in memory, 0 for the whole chain.
+void ent_chain_set_window(struct entanglement_device *ent_dev, uint window) {
+
+    mutex_lock(&ent_dev->entanglement_lock);
+    ent_dev->chain_window = window;
+    ent_chain_trim(ent_dev);
+    mutex_unlock(&ent_dev->entanglement_lock);
+}
+
+/*
+    Computes the layout of the device and allocates the in-memory state of the entanglement. 
+    dev_size is the size of the underlying device in 4KB blocks, and queue_depth the number of writes it can have in flight
+    (0 for the default), which sizes the page pool. The unit (unit_blocks) is set by the caller beforehand.
+*/
+int ent_core_init(struct entanglement_device *ent_dev, uint dev_size, uint queue_depth) {
+
+    uint metadata_units;
+    int err;
+
+    if (!ent_dev->unit_blocks) {
+        ent_dev->unit_blocks = 1;
+    }
+    if (!is_power_of_2(ent_dev->unit_blocks) || ent_dev->unit_blocks > ENT_MAX_UNIT_BLOCKS) {
+        pr_err("Invalid entanglement unit of %u blocks.\n", ent_dev->unit_blocks);
+        return -EINVAL;
+    }
+    // From here on, the device is counted in units.
+    dev_size /= ent_dev->unit_blocks;
+
+    ent_dev->stats = ent_stats_alloc();
+    if (!ent_dev->stats) {
+        pr_err("Could not allocate the statistics of the entanglement_device.\n");
+        err = -ENOMEM;
+        goto err_stats_alloc;
+    }
+
+    ent_dev->queue_depth = clamp_t(uint, queue_depth ? queue_depth : ENT_DEFAULT_QUEUE_DEPTH, 1, ENT_MAX_QUEUE_DEPTH);
+    ent_dev->page_pool_size = ent_page_pool_size(ent_dev->queue_depth, ent_dev->unit_blocks);
+    ent_dev->tuning[ENT_TUNE_QUEUE_DEPTH] = ent_dev->queue_depth;
+    ent_dev->tuning[ENT_TUNE_IO_BATCH] = ENT_IO_BATCH;
+    ent_dev->tuning[ENT_TUNE_SCRUB_BATCH] = ENT_DEFAULT_SCRUB_BATCH;
+    ent_dev->tuning[ENT_TUNE_SCRUB_RATE] = ENT_DEFAULT_SCRUB_RATE / ent_dev->unit_blocks;
+    ent_dev->tuning[ENT_TUNE_LAG_BLOCKS] = ENT_DEFAULT_LAG_BLOCKS;
+    ent_dev->tuning[ENT_TUNE_LAG_MS] = ENT_DEFAULT_LAG_MS;
+    ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL] = ENT_DEFAULT_ANCHOR_INTERVAL;
+    ent_dev->tuning[ENT_TUNE_COMPACT_FILL] = ENT_DEFAULT_COMPACT_FILL;
+    atomic_set(&ent_dev->pages_in_use, 0);
+    ent_dev->pages_peak = 0;
+
+    ent_dev->page_pool = mempool_create_page_pool(ent_dev->page_pool_size, ent_unit_order(ent_dev));
+    if (!ent_dev->page_pool) {
+        pr_err("Could not create the page pool of the entanglement_device.\n");
+        err = -ENOMEM;
+        goto err_page_pool_alloc;
+    }
+
+    ent_dev->dev_size = dev_size;
+
+    // Number of blocks for metadata. Calculated as number of units (dev_size) * 0.002929688.
+    // This number (0.002929688) we get from the fact that for every unit, we have a 12-byte overhead in 4096-byte blocks. (12/4096) 
+    ent_dev->metadata_size = (dev_size * 3U) >> 10;
+    ent_dev->metadata_sector_size = (ent_dev->metadata_size * 2U) / 3U;
+    ent_dev->metadata_checksum_size = (ent_dev->metadata_size * 1U) / 3U;
+    // The metadata region takes whole units of the underlying device.
+    metadata_units = DIV_ROUND_UP(ent_dev->metadata_size, ent_dev->unit_blocks);
+
+    // Calculating the starting sector of the metadata, and the scale with which we redirect the writes of parity blocks.
+    // With a metadata device (set by the caller beforehand), the metadata is moved there, after the scrub checkpoint, 
+    // and the whole underlying device is left for data and parities.
+    if (ent_dev->meta_dev) {
+        ent_dev->metadata_start_sector = (dev_size / 2) / 8 * 8;
+        ent_dev->write_sector_scale = ent_dev->metadata_start_sector;
+        ent_dev->metadata_base = ENT_CHECKPOINT_BLOCKS;
+
+        // The chain can then fill the whole device, so the records are sized for it, plus one block for the unused entries
+        // that end the sector records once the last block is full (sector block i has its checksums in checksum block i/2).
+        ent_dev->metadata_sector_size = DIV_ROUND_UP(2 * ent_dev->metadata_start_sector, ENT_SECTORS_PER_BLOCK) + 1;
+        ent_dev->metadata_checksum_size = DIV_ROUND_UP(ent_dev->metadata_sector_size, 2);
+        ent_dev->metadata_size = ent_dev->metadata_sector_size + ent_dev->metadata_checksum_size;
+    }else {
+        ent_dev->metadata_start_sector = ((dev_size - metadata_units) / 2) / 8 * 8;
+        ent_dev->write_sector_scale = ((dev_size - metadata_units)/2 / 8 * 8) + metadata_units;
+        ent_dev->metadata_base = ent_dev->metadata_start_sector * ent_dev->unit_blocks;
+
+        // Large units on a small device leave less than a block of records, and the chain would have no room at all.
+        if (!ent_dev->metadata_sector_size || !ent_dev->metadata_checksum_size) {
+            pr_err("Device of %u units too small for units of %u blocks.\n", dev_size, ent_dev->unit_blocks);
+            err = -EINVAL;
+            goto err_geometry;
+        }
+    }
+
+    // We have this initialization here and also in the load function, 
+    // since we do not call load in the case when the device is being opened for the first time.
+    ent_dev->next_sector = ent_dev->metadata_base;
+    ent_dev->next_checksum = ent_dev->metadata_base + ent_dev->metadata_sector_size;
+
+    mutex_init(&ent_dev->entanglement_lock);
+    INIT_LIST_HEAD(&ent_dev->segment_lru);
+    ent_dev->nr_resident_segments = 0;
+    ent_dev->chain_window = 0;
+    ent_dev->nr_segment_slots = ent_dev->metadata_sector_size;
+    ent_dev->segments = kvzalloc(ent_dev->nr_segment_slots * sizeof(*ent_dev->segments), GFP_KERNEL);
+    if (!ent_dev->segments) {
+        pr_err("Error while allocating the chain segment table.\n");
+        err = -ENOMEM;
+        goto err_segments_alloc;
+    }
+
+    mutex_init(&ent_dev->corrupted_blocks_lock);
+
+    ent_dev->corrupted_blocks = bitmap_zalloc(dev_size, GFP_KERNEL);
+    if (!ent_dev->corrupted_blocks) {
+        pr_err("Error while allocating bitmap for corrupted blocks.\n");
+        err = -ENOMEM;
+        goto err_bitmap_alloc;
+    }
+
+    ent_dev->sector_checksum_map = kzalloc(dev_size * sizeof(uint), GFP_KERNEL);
+    if (!ent_dev->sector_checksum_map) {
+        pr_err("Error while allocating sector->checksum map.\n");
+        err = -ENOMEM;
+        goto err_sector_checksum_map_alloc;
+    }
+
+    ent_dev->last_entangled_block = kzalloc(ent_unit_size(ent_dev), GFP_KERNEL);
+    if (!ent_dev->last_entangled_block) {
+        pr_err("Error while allocating the last_entangled_block buffer.\n");
+        err = -ENOMEM;
+        goto err_last_buffer_alloc;
+    }
+
+    mutex_init(&ent_dev->metadata_buffers_lock);
+
+    // The buffers start filled with the unused sector/checksum values, which mark the end of the metadata on disk.
+    ent_dev->block_sector_buffer = kmalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
+    if (!ent_dev->block_sector_buffer) {
+        pr_err("Error while allocating the buffer for periodically writing block sectors to disk.\n");
+        err = -ENOMEM;
+        goto err_sector_buffer_alloc;
+    }
+    memset(ent_dev->block_sector_buffer, 0xFF, ENT_BLOCK_SIZE);
+    ent_dev->sector_buffer_size = 0;
+
+    ent_dev->block_checksum_buffer = kmalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
+    if (!ent_dev->block_checksum_buffer) {
+        pr_err("Error while allocating the buffer for periodically writing block checksums to disk.\n");
+        err = -ENOMEM;
+        goto err_checksum_buffer_alloc;
+    }
+    memset(ent_dev->block_checksum_buffer, 0xFF, ENT_BLOCK_SIZE);
+    ent_dev->checksum_buffer_size = 0;
+
+    ent_cache_init(&ent_dev->cache, max_t(uint, ENT_CACHE_DEFAULT_PAGES / ent_dev->unit_blocks, 1), ent_unit_order(ent_dev));
+
+    return 0;
+
+err_checksum_buffer_alloc:
+    kfree(ent_dev->block_sector_buffer);
+err_sector_buffer_alloc:
+    kfree(ent_dev->last_entangled_block);
+err_last_buffer_alloc:
+    kfree(ent_dev->sector_checksum_map);
+err_sector_checksum_map_alloc:
+    bitmap_free(ent_dev->corrupted_blocks);
+err_bitmap_alloc:
+    kvfree(ent_dev->segments);
+err_segments_alloc:
+err_geometry:
+    mempool_destroy(ent_dev->page_pool);
+err_page_pool_alloc:
+    ent_stats_free(ent_dev->stats);
+err_stats_alloc:
+    return err;
+}
+
+void ent_core_exit(struct entanglement_device *ent_dev) {
+
+    ent_compact_exit(ent_dev);
+
+    // Normally already emptied by store_entanglement_and_checksums(), but not when the constructor fails half-way.
+    ent_chain_drop_all(ent_dev);
+    kvfree(ent_dev->segments);
+
+    ent_cache_exit(&ent_dev->cache);
+    kfree(ent_dev->block_checksum_buffer);
+    kfree(ent_dev->block_sector_buffer);
+    kfree(ent_dev->last_entangled_block);
+    kfree(ent_dev->sector_checksum_map);
+    bitmap_free(ent_dev->corrupted_blocks);
+    mempool_destroy(ent_dev->page_pool);
+    ent_stats_free(ent_dev->stats);
+}
+
+/*
+    Moves the in-memory state of the entanglement (chain, checksums, corrupted blocks, tail block, metadata buffers and compaction) of from to to, which
+    must have the same layout and no chain yet. The cache of to takes the capacity set on from, but starts empty. from is left with the empty state of to, so both can be freed with ent_core_exit().
+    Neither device may be in use.
+*/
+void ent_core_handover(struct entanglement_device *to, struct entanglement_device *from) {
+
+    struct ent_chain_segment *segment, *tmp;
+
+    ent_chain_drop_all(to);
+    swap(to->segments, from->segments);
+    list_for_each_entry_safe(segment, tmp, &from->segment_lru, lru_node) {
+        list_del(&segment->lru_node);
+        list_add_tail(&segment->lru_node, &to->segment_lru);
+    }
+    to->nr_resident_segments = from->nr_resident_segments;
+    from->nr_resident_segments = 0;
+    to->chain_window = from->chain_window;
+    ent_cache_resize(&to->cache, READ_ONCE(from->cache.capacity));
+    to->chain_length = from->chain_length;
+    from->chain_length = 0;
+    swap(to->compact, from->compact);
+    swap(to->gap_start, from->gap_start);
+    swap(to->gap_end, from->gap_end);
+    swap(to->compact_base, from->compact_base);
+    swap(to->last_anchor, from->last_anchor);
+    swap(to->nr_anchors, from->nr_anchors);
+
+    swap(to->corrupted_blocks, from->corrupted_blocks);
+    swap(to->sector_checksum_map, from->sector_checksum_map);
+    swap(to->last_entangled_block, from->last_entangled_block);
+
+    swap(to->block_sector_buffer, from->block_sector_buffer);
+    swap(to->block_checksum_buffer, from->block_checksum_buffer);
+    swap(to->sector_buffer_size, from->sector_buffer_size);
+    swap(to->checksum_buffer_size, from->checksum_buffer_size);
+    swap(to->next_sector, from->next_sector);
+    swap(to->next_checksum, from->next_checksum);
+}
+
+/*
+    Fault injection. The blocks to corrupt are selected on the chain positions with a generator seeded from the spec, and every selected block
+    gets one byte XORed with a non-zero value, also drawn from the seed. The chain is only locked while selecting the blocks: they are then
+    read, damaged and written back in batches of asynchronous I/Os (see ent_io_batch()).
+*/
+const char * const ent_inject_pattern_names[ENT_INJECT_NR] = {
+    [ENT_INJECT_UNIFORM] = "uniform",
+    [ENT_INJECT_BURST] = "burst",
+    [ENT_INJECT_DATA] = "data",
+    [ENT_INJECT_PARITY] = "parity",
+    [ENT_INJECT_PAIR] = "pair",
+};
+
+int ent_inject_pattern_parse(const char *name) {
+
+    for (int i = 0 ; i < ENT_INJECT_NR ; i++) {
+        if (!strcmp(name, ent_inject_pattern_names[i])) {
+            return i;
+        }
+    }
+    return -EINVAL;
+}
+
+// splitmix64: the same sequence in the kernel and in userspace, for any seed (including 0).
+static u64 ent_inject_rand(u64 *state) {
+
+    u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+    Selects the chain positions to corrupt, in a bitmap of chain_length bits. One number is drawn per position whatever the pattern,
+    so that the same seed selects comparable positions across patterns. Returns the number of selected positions.
+*/
+u64 ent_inject_select(const struct ent_inject_spec *spec, u64 chain_length, unsigned long *selected) {
+
+    u64 state = spec->seed;
+    uint burst_length = max_t(uint, spec->burst_length, 1);
+
+    for (u64 pos = 0 ; pos < chain_length ; pos++) {
+        u64 r = ent_inject_rand(&state);
+        bool data = (pos % 2 == 0);
+
+        switch (spec->pattern) {
+        case ENT_INJECT_UNIFORM:
+            if (r % 100 < spec->percent) {
+                set_bit(pos, selected);
+            }
+            break;
+        case ENT_INJECT_BURST:
+            // A burst starts with probability percent / burst_length, so that about percent of the chain is covered.
+            if (r % (100 * (u64)burst_length) < spec->percent) {
+                bitmap_set(selected, pos, min_t(u64, burst_length, chain_length - pos));
+            }
+            break;
+        case ENT_INJECT_DATA:
+            if (data && r % 100 < spec->percent) {
+                set_bit(pos, selected);
+            }
+            break;
+        case ENT_INJECT_PARITY:
+            if (!data && r % 100 < spec->percent) {
+                set_bit(pos, selected);
+            }
+            break;
+        case ENT_INJECT_PAIR:
+            // percent is the share of blocks corrupted, two per pair.
+            if (data && pos + 1 < chain_length && r % 100 < spec->percent) {
+                bitmap_set(selected, pos, 2);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    return bitmap_weight(selected, chain_length);
+}
+
+int corrupt_blocks(struct entanglement_device *ent_dev, const struct ent_inject_spec *spec, u64 *injected) {
+
+    int err = 0;
+    struct page *pages[ENT_IO_BATCH] = { NULL };
+    unsigned long *selected;
+    sector_t *sectors;
+    u64 chain_length, nr_selected, i = 0;
+    unsigned long pos;
+    uint batch = ent_io_batch(ent_dev);
+    // A separate stream for the damage, so that it does not depend on the number of positions drawn by the selection.
+    u64 state = spec->seed ^ 0xDA3A6EDA3A6EULL;
+
+    *injected = 0;
+
+    if (ent_chain_compacting(ent_dev)) {
+        pr_err("The chain is being compacted, faults cannot be injected before the compaction is finished.\n");
+        return -EBUSY;
+    }
+
+    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
+        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
+        return -EINTR;
+    }
+
+    chain_length = ent_dev->chain_length;
+    if (!chain_length) {
+        mutex_unlock(&ent_dev->entanglement_lock);
+        return 0;
+    }
+
+    selected = bitmap_zalloc(chain_length, GFP_KERNEL);
+    if (!selected) {
+        pr_err("Error while allocating bitmap for fault injection.\n");
+        mutex_unlock(&ent_dev->entanglement_lock);
+        return -ENOMEM;
+    }
+
+    nr_selected = ent_inject_select(spec, chain_length, selected);
+
+    sectors = kvmalloc_array(max_t(u64, nr_selected, 1), sizeof(sector_t), GFP_KERNEL);
+    if (!sectors) {
+        pr_err("Error while allocating the sectors to corrupt.\n");
+        err = -ENOMEM;
+        mutex_unlock(&ent_dev->entanglement_lock);
+        goto err_sectors_alloc;
+    }
+
+    for_each_set_bit(pos, selected, chain_length) {
+        err = ent_chain_record(ent_dev, pos, &sectors[i], NULL);
+        if (err) {
+            mutex_unlock(&ent_dev->entanglement_lock);
+            goto out;
+        }
+        i++;
+    }
+    nr_selected = i;
+
+    mutex_unlock(&ent_dev->entanglement_lock);
+
+    for (i = 0 ; i < min_t(u64, nr_selected, batch) ; i++) {
+        pages[i] = ent_alloc_page(ent_dev);
+        if (!pages[i]) {
+            pr_err("Could not allocate data page.\n");
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    for (i = 0 ; i < nr_selected ; i += batch) {
+        uint nr = min_t(u64, nr_selected - i, batch);
+
+        err = ent_dev_rwBatch(ent_dev, pages, sectors + i, nr, READ);
+        if (err) {
+            pr_err("Error while reading blocks in order to corrupt them\n");
+            goto out;
+        }
+
+        for (uint j = 0 ; j < nr ; j++) {
+            u8 *page_ptr = kmap(pages[j]);
+            u64 r = ent_inject_rand(&state);
+
+            page_ptr[r % ent_unit_size(ent_dev)] ^= ((r >> 32) & 0xFF) | 1;
+            kunmap(pages[j]);
+        }
+
+        err = ent_dev_rwBatch(ent_dev, pages, sectors + i, nr, WRITE);
+        if (err) {
+            pr_err("Error while writing corrupted blocks back\n");
+            goto out;
+        }
+
+        *injected += nr;
+        ent_stats_add(ent_dev->stats, ENT_STAT_INJECTED, nr);
+    }
+
+out:
+    for (i = 0 ; i < ENT_IO_BATCH ; i++) {
+        if (pages[i]) {
+            ent_free_page(ent_dev, pages[i]);
+        }
+    }
+    kvfree(sectors);
+err_sectors_alloc:
+    bitmap_free(selected);
+    return err;
+}
+
+/*
+    Decodes the records of a sector metadata block, whose checksums start at entry checksum_offset of the checksum metadata block.
+    Stops at the first unused entry, and returns the number of records. sectors and checksums must have room for ENT_SECTORS_PER_BLOCK records.
+*/
+uint ent_metadata_decode(const u8 *sector_block, const u8 *checksum_block, uint checksum_offset, sector_t *sectors, uint *checksums) {
+
+    uint j;
+
+    for (j = 0 ; j < ENT_SECTORS_PER_BLOCK ; j++) {
+        sectors[j] = ent_metadata_get_sector(sector_block, j);
+        if (sectors[j] == DEFAULT_SECTOR_VALUE) {
+            break;
+        }
+        checksums[j] = ent_metadata_get_checksum(checksum_block, checksum_offset + j);
+    }
+
+    return j;
+}
+
+/*
+    Loads the entanglement from the metadata region. Sector metadata block i holds the sectors of ENT_SECTORS_PER_BLOCK blocks of the chain, 
+    and their checksums are in one half of checksum metadata block i / 2. The last, partially filled blocks become the metadata buffers.
+    The void records of an interrupted compaction are kept as chain positions, and set the gap of the device. Anchors are counted, and
+    the next one is placed from the last.
+*/
+int load_entanglement_and_checksums(struct entanglement_device *ent_dev) {
+    
+    struct page *sector_page;
+    u8 *sector_page_ptr;
+    struct page *checksum_page;
+    u8 *checksum_page_ptr;
+    sector_t sector;
+    sector_t checksum_sector;
+    struct ent_chain_segment *segment;
+    uint nr_records = 0;
+    uint checksum_offset = 0;
+    int err;
+
+    sector_t last_entangled_block_sector = DEFAULT_SECTOR_VALUE;
+
+    sector_page = ent_alloc_page(ent_dev);
+    if (!sector_page) {
+        pr_err("Could not allocate data page.\n");
+        return -ENOMEM;
+    }
+
+    checksum_page = ent_alloc_page(ent_dev);
+    if (!checksum_page) {
+        pr_err("Could not allocate checksum page.\n");
+        err = -ENOMEM;
+        goto err_page_allocation;
+    }
+
+    sector_page_ptr = kmap(sector_page);
+    checksum_page_ptr = kmap(checksum_page);
+
+    // Grab the lock for the entanglement list.  
+    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
+        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
+        err = -EINTR;
+        goto err_lock;
+    }
+
+    // First we load the entanglement. 
+    sector = ent_dev->metadata_base;
+    checksum_sector = ent_dev->metadata_base + ent_dev->metadata_sector_size;
+    int i;
+
+    for (i = 0 ; i < ent_dev->metadata_sector_size ; i++) {
+        err = ent_meta_rwSector(ent_dev, sector_page, sector, READ);
+        if (err) {
+            pr_err("Error while reading block %d at sector %llu which contains information about the entanglement: %d\n", i, sector, err);
+            goto out;
+        }
+
+        // Only read a new checksum block for every two entanglement blocks, since sectors are twice as large as checksums. 
+        checksum_offset = (i % 2) * ENT_SECTORS_PER_BLOCK;
+        if (i % 2 == 0) {
+            err = ent_meta_rwSector(ent_dev, checksum_page, checksum_sector, READ);
+            if (err) {
+                pr_err("Error while reading block %d at sector %llu which contains information about a checksum: %d\n", i, checksum_sector, err);
+                goto out;
+            }
+        }
+
+        segment = kmalloc(sizeof(*segment), GFP_KERNEL);
+        if (!segment) {
+            pr_err("Error while allocating chain segment %d.\n", i);
+            err = -ENOMEM;
+            goto out;
+        }
+
+        segment->index = i;
+        segment->dirty = false;
+        segment->nr_records = ent_metadata_decode(sector_page_ptr, checksum_page_ptr, checksum_offset, segment->sectors, segment->checksums);
+        nr_records = segment->nr_records;
+        if (!nr_records) {
+            kfree(segment);
+            break;
+        }
+
+        for (uint j = 0 ; j < nr_records ; j++) {
+            sector_t record = segment->sectors[j];
+
+            // Void records are the gap left by a compaction under way.
+            if (record == ENT_VOID_SECTOR) {
+                if (ent_dev->gap_end <= ent_dev->gap_start) {
+                    ent_dev->gap_start = ent_dev->chain_length + j;
+                }
+                ent_dev->gap_end = ent_dev->chain_length + j + 1;
+                continue;
+            }
+            if (ent_record_anchor(record)) {
+                ent_dev->last_anchor = ent_dev->chain_length + j;
+                ent_dev->nr_anchors++;
+            }
+            if (ent_record_sector(record) < ent_dev->dev_size) {
+                ent_dev->sector_checksum_map[ent_record_sector(record)] = segment->checksums[j];
+            }
+            // Constantly update the sector of last block, so we can read it afterwards. 
+            last_entangled_block_sector = ent_record_sector(record);
+        }
+        ent_dev->chain_length += nr_records;
+        ent_chain_insert_segment(ent_dev, segment);
+
+        // A partially filled block is the last one.
+        if (nr_records < ENT_SECTORS_PER_BLOCK) {
+            break;
+        }
+
+        // The full blocks are on disk, so only the chain window of them stays in memory.
+        ent_dev->next_sector = sector + 1;
+        ent_chain_trim(ent_dev);
+
+        sector += 1;
+        if (i % 2 == 1) {
+            checksum_sector += 1;
+        }
+    }
+
+    // The last blocks become the buffers, to which the next writes append. 
+    if (nr_records < ENT_SECTORS_PER_BLOCK) {
+        memcpy(ent_dev->block_sector_buffer, sector_page_ptr, ENT_BLOCK_SIZE);
+        ent_dev->sector_buffer_size = nr_records * sizeof(sector_t);
+        memcpy(ent_dev->block_checksum_buffer, checksum_page_ptr, ENT_BLOCK_SIZE);
+        ent_dev->checksum_buffer_size = (checksum_offset + nr_records) * sizeof(uint);
+    }
+    
+    ent_dev->next_sector = sector;
+    ent_dev->next_checksum = checksum_sector;
+
+    err = 0;
+
+    // Nothing to load, this device was never written to.
+    if (last_entangled_block_sector == DEFAULT_SECTOR_VALUE) {
+        goto out;
+    }
+
+    // I use the sector page here because it is unnecessary to allocate a new page for this. 
+    err = ent_dev_rwSector(ent_dev, sector_page, last_entangled_block_sector, READ);
+    if (err) {
+        pr_err("Error while reading data from the last block in the entanglement, while loading the entanglement.\n");
+        goto out;
+    }
+
+    // Put the data in the last entangled block buffer. 
+    memcpy(ent_dev->last_entangled_block, sector_page_ptr, ent_unit_size(ent_dev));
+
+out:
+    mutex_unlock(&ent_dev->entanglement_lock);
+err_lock:
+    kunmap(sector_page);
+    kunmap(checksum_page);
+    ent_free_page(ent_dev, checksum_page);
+err_page_allocation:
+    ent_free_page(ent_dev, sector_page);
+    return err;
+}
+
+int ent_checkpoint_store(struct entanglement_device *ent_dev, const struct ent_scrub_checkpoint *checkpoint) {
+
+    struct page *page;
+    u8 *page_ptr;
+    int err;
+
+    if (!ent_dev->meta_dev) {
+        return 0;
+    }
+
+    page = ent_alloc_page(ent_dev);
+    if (!page) {
+        pr_err("Could not allocate the scrub checkpoint page.\n");
+        return -ENOMEM;
+    }
+    page_ptr = kmap(page);
+
+    memset(page_ptr, 0, ENT_BLOCK_SIZE);
+    memcpy(page_ptr, checkpoint, sizeof(*checkpoint));
+    err = ent_meta_rwSector(ent_dev, page, 0, WRITE);
+    if (err) {
+        pr_err("Error while writing the scrub checkpoint: %d\n", err);
+    }
+
+    kunmap(page);
+    ent_free_page(ent_dev, page);
+    return err;
+}
+
+// Returns -ENOENT when there is no checkpoint: no metadata device, or a scrub never ran on it.
+int ent_checkpoint_load(struct entanglement_device *ent_dev, struct ent_scrub_checkpoint *checkpoint) {
+
+    struct page *page;
+    u8 *page_ptr;
+    int err;
+
+    if (!ent_dev->meta_dev) {
+        return -ENOENT;
+    }
+
+    page = ent_alloc_page(ent_dev);
+    if (!page) {
+        pr_err("Could not allocate the scrub checkpoint page.\n");
+        return -ENOMEM;
+    }
+    page_ptr = kmap(page);
+
+    err = ent_meta_rwSector(ent_dev, page, 0, READ);
+    if (err) {
+        pr_err("Error while reading the scrub checkpoint: %d\n", err);
+        goto out;
+    }
+    memcpy(checkpoint, page_ptr, sizeof(*checkpoint));
+    if (checkpoint->magic != ENT_CHECKPOINT_MAGIC || checkpoint->scrub_pos > ent_dev->dev_size) {
+        err = -ENOENT;
+    }
+
+out:
+    kunmap(page);
+    ent_free_page(ent_dev, page);
+    return err;
+}
+
+/*
+    Writes the current (possibly partially filled) metadata buffers in place, at next_sector and next_checksum, without advancing them.
+    Later records are appended to the same buffers, and they are written again once full. Must be called with metadata_buffers_lock held.
+*/
+int write_metadata_buffers(struct entanglement_device *ent_dev) {
+
+    struct page *page;
+    u8 *page_ptr;
+    int err;
+
+    page = ent_alloc_page(ent_dev);
+    if (!page) {
+        pr_err("Could not allocate metadata page.\n");
+        return -ENOMEM;
+    }
+    page_ptr = kmap(page);
+
+    memcpy(page_ptr, ent_dev->block_sector_buffer, ENT_BLOCK_SIZE);
+    err = ent_meta_rwSector(ent_dev, page, ent_dev->next_sector, WRITE);
+    if (err) {
+        pr_err("Error while writing block at sector %llu which contains information about the entanglement: %d\n", ent_dev->next_sector, err);
+        goto out;
+    }
+
+    memcpy(page_ptr, ent_dev->block_checksum_buffer, ENT_BLOCK_SIZE);
+    err = ent_meta_rwSector(ent_dev, page, ent_dev->next_checksum, WRITE);
+    if (err) {
+        pr_err("Error while writing block at sector %llu which contains information about the checksums: %d\n", ent_dev->next_checksum, err);
+        goto out;
+    }
+
+out:
+    kunmap(page);
+    ent_free_page(ent_dev, page);
+    return err;
+}
+
+int store_entanglement_and_checksums(struct entanglement_device *ent_dev) {
+
+    int err;
+
+    // Two last writes of the buffers, in case of any leftovers in the buffers. 
+    err = write_metadata_buffers(ent_dev);
+    if (err) {
+        return err;
+    }
+
+    // Grab the lock for the entanglement list.  
+    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
+        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
+        return -EINTR;
+    }
+
+    // Free the memory that was allocated in load_entanglement_and_checksums() and while this device mapper was being used.
+    ent_chain_drop_all(ent_dev);
+    ent_dev->chain_length = 0;
+
+    mutex_unlock(&ent_dev->entanglement_lock);
+
+    return 0;
+}
+
+/*
+    Repair of corrupted blocks.
+
+    In the chain, data block d_k is at position 2k and its parity p_k at position 2k + 1, with p_k = d_k ^ p_(k-1) and p_0 = d_0.
+    A corrupted block can be rebuilt from two intact neighbours:
+        d_k = p_k ^ p_(k-1)                     (d_0 = p_0)
+        p_k = d_k ^ p_(k-1)         (left)      (p_0 = d_0)
+        p_k = d_(k+1) ^ p_(k+1)     (right)
+    An anchor k is a head (d_k = p_k), and the right rule does not cross it: p_(k-1) can only be rebuilt from its left.
+    Only live entries take part: the entry of a sector written again later is dead, since its data and parity sectors now hold the blocks
+    of the later entry. A dead entry is neither repaired nor used to repair its neighbours.
+    Every repaired block can in turn be used to repair its neighbours. The planner below finds all the blocks that can be repaired this way,
+    and the order in which to repair them. It only works on chain positions, so it is independent of the device.
+*/
+
+// Whether the data block at chain position pos starts the chain, or a run of it (see ENT_ANCHOR_FLAG).
+static inline bool ent_repair_head(const unsigned long *anchors, u64 pos) {
+    return pos == 0 || (anchors && test_bit(pos, anchors));
+}
+
+// Whether the block at chain position pos holds its entry: it is neither corrupted nor dead.
+static inline bool ent_repair_intact(const unsigned long *corrupted, const unsigned long *dead, u64 pos) {
+    return !test_bit(pos, corrupted) && !(dead && test_bit(pos, dead));
+}
+
+// Returns whether the block at chain position pos can be rebuilt from its currently intact neighbours, and from which ones.
+static bool ent_repair_sources(const unsigned long *corrupted, const unsigned long *dead, const unsigned long *anchors, u64 chain_length,
+                               u64 pos, struct ent_repair_step *step) {
+
+    step->target = pos;
+
+    if (pos % 2 == 0) {
+        if (pos + 1 >= chain_length || !ent_repair_intact(corrupted, dead, pos + 1)) {
+            return false;
+        }
+        step->src[0] = pos + 1;
+        if (ent_repair_head(anchors, pos)) {
+            step->src[1] = ENT_REPAIR_COPY;
+            return true;
+        }
+        if (!ent_repair_intact(corrupted, dead, pos - 1)) {
+            return false;
+        }
+        step->src[1] = pos - 1;
+        return true;
+    }
+
+    // Parity: try the left side of the chain first, which is the one it was computed from.
+    if (ent_repair_intact(corrupted, dead, pos - 1)) {
+        step->src[0] = pos - 1;
+        if (ent_repair_head(anchors, pos - 1)) {
+            step->src[1] = ENT_REPAIR_COPY;
+            return true;
+        }
+        if (ent_repair_intact(corrupted, dead, pos - 2)) {
+            step->src[1] = pos - 2;
+            return true;
+        }
+    }
+
+    if (pos + 2 < chain_length && !ent_repair_head(anchors, pos + 1) && ent_repair_intact(corrupted, dead, pos + 1) && 
+        ent_repair_intact(corrupted, dead, pos + 2)) {
+        step->src[0] = pos + 1;
+        step->src[1] = pos + 2;
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    Plans the repair of the chain positions set in corrupted. Repairs only propagate to the neighbours, so the corrupted positions are 
+    swept alternately upwards (left repairs chain towards the tail) and downwards (right repairs chain towards the head), until a sweep 
+    repairs nothing. The steps are stored in repair order in steps, which must have room for one step per corrupted position.
+    dead holds the dead positions, and anchors the data positions of the anchors of the chain (see ent_repair_mark()), either NULL when
+    there are none. On return, corrupted only holds the irrecoverable positions.
+*/
+void ent_plan_repair(unsigned long *corrupted, const unsigned long *dead, const unsigned long *anchors, u64 chain_length, 
+                     struct ent_repair_step *steps, u64 *nr_steps) {
+
+    struct ent_repair_step step;
+    unsigned long pos, end;
+    bool progress = true;
+    bool downwards = false;
+
+    *nr_steps = 0;
+
+    while (progress) {
+        progress = false;
+
+        if (!downwards) {
+            for_each_set_bit(pos, corrupted, chain_length) {
+                if (ent_repair_sources(corrupted, dead, anchors, chain_length, pos, &step)) {
+                    clear_bit(pos, corrupted);
+                    steps[(*nr_steps)++] = step;
+                    progress = true;
+                }
+            }
+        }else {
+            for (end = chain_length ; end > 0 ; end = pos) {
+                // find_last_bit() returns its size argument when no bit is set below it.
+                pos = find_last_bit(corrupted, end);
+                if (pos >= end) {
+                    break;
+                }
+                if (ent_repair_sources(corrupted, dead, anchors, chain_length, pos, &step)) {
+                    clear_bit(pos, corrupted);
+                    steps[(*nr_steps)++] = step;
+                    progress = true;
+                }
+            }
+        }
+
+        downwards = !downwards;
+    }
+}
+
+/*
+    Marks the chain positions [0, chain_length) for ent_plan_repair(): in corrupted, the live entries of the sectors marked in the corrupted
+    blocks bitmap, in dead, the entries of sectors written again later (whose checksum is not the current one of their sector anymore), and
+    in anchors, when it is not NULL, the anchors. The bitmaps must be zeroed. Must be called with entanglement_lock held.
+*/
+int ent_repair_mark(struct entanglement_device *ent_dev, u64 chain_length, unsigned long *corrupted, unsigned long *dead,
+                    unsigned long *anchors) {
+
+    sector_t record, sector;
+    uint checksum;
+    int err;
+
+    for (u64 pos = 0 ; pos < chain_length ; pos++) {
+        err = ent_chain_record_raw(ent_dev, pos, &record, &checksum);
+        if (err) {
+            return err;
+        }
+        sector = ent_record_sector(record);
+        if (anchors && ent_record_anchor(record)) {
+            set_bit(pos, anchors);
+        }
+        if (sector >= ent_dev->dev_size || checksum != ent_dev->sector_checksum_map[sector]) {
+            set_bit(pos, dead);
+        }else if (test_bit(sector, ent_dev->corrupted_blocks)) {
+            set_bit(pos, corrupted);
+        }
+    }
+    return 0;
+}
+
+// Reads the block at the given chain position into page, from the cache when it holds it.
+static int ent_read_chain_block(struct entanglement_device *ent_dev, u64 chain_pos, struct page *page) {
+
+    sector_t sector;
+    int err;
+
+    if (ent_cache_read(ent_dev, chain_pos, page)) {
+        return 0;
+    }
+
+    err = ent_chain_record(ent_dev, chain_pos, &sector, NULL);
+    if (err) {
+        return err;
+    }
+
+    err = ent_dev_rwSector(ent_dev, page, sector, READ);
+    if (err) {
+        pr_err("Error while reading block %llu in repair process.\n", sector);
+    }
+    return err;
+}
+
+/*
+    Executes one repair step: reads its sources (from the cache when possible), rebuilds the block and writes it back to target_sector.
+    A rebuilt block that does not match the checksum of its entry (a source was corrupted without being marked) is not written, and
+    -EBADMSG is returned.
+*/
+static int ent_repair_step_exec(struct entanglement_device *ent_dev, const struct ent_repair_step *step, sector_t target_sector,
+                                uint checksum, struct page **pages) {
+
+    u8 *src_0 = kmap(pages[0]);
+    u8 *src_1 = kmap(pages[1]);
+    u8 *repaired = kmap(pages[2]);
+    int err;
+
+    err = ent_read_chain_block(ent_dev, step->src[0], pages[0]);
+    if (err) {
+        goto out;
+    }
+
+    if (step->src[1] == ENT_REPAIR_COPY) {
+        memcpy(repaired, src_0, ent_unit_size(ent_dev));
+    }else {
+        err = ent_read_chain_block(ent_dev, step->src[1], pages[1]);
+        if (err) {
+            goto out;
+        }
+        ent_xor_buffer(repaired, src_0, src_1, ent_unit_size(ent_dev));
+    }
+
+    if (crc32b(repaired, ent_unit_size(ent_dev)) != checksum) {
+        err = -EBADMSG;
+        goto out;
+    }
+
+    // Later steps may use this block as a source.
+    ent_cache_insert(ent_dev, step->target, repaired);
+
+    err = ent_dev_rwSector(ent_dev, pages[2], target_sector, WRITE);
+    if (err) {
+        pr_err("Error while writing the repaired block in repair process.\n");
+        goto out;
+    }
+
+out:
+    kunmap(pages[2]);
+    kunmap(pages[1]);
+    kunmap(pages[0]);
+    return err;
+}
+
+static enum RepairStep ent_repair_step_type(const struct ent_repair_step *step) {
+
+    if (step->target % 2 == 0) {
+        return REPAIR_STEP_DATA;
+    }
+    return (step->src[0] < step->target) ? REPAIR_STEP_PARITY_LEFT : REPAIR_STEP_PARITY_RIGHT;
+}
+
+/*
+    Repairs all blocks marked in the corrupted blocks bitmap that can be repaired. Must be called with corrupted_blocks_lock held.
+*/
+int repair_corrupted_blocks(struct entanglement_device *ent_dev) {
+
+    int err = 0;
+    unsigned long *corrupted, *dead = NULL, *anchors = NULL;
+    struct ent_repair_step *steps;
+    struct page *pages[3] = { NULL, NULL, NULL };
+    u64 chain_length, nr_corrupted, nr_steps, i;
+    unsigned long pos;
+    sector_t sector;
+    uint checksum;
+
+    if (ent_chain_compacting(ent_dev)) {
+        pr_err("The chain is being compacted, it cannot be repaired before the compaction is finished.\n");
+        return -EBUSY;
+    }
+
+    // Writes append to the chain concurrently when the repair is triggered on a live device.
+    mutex_lock(&ent_dev->entanglement_lock);
+
+    chain_length = ent_dev->chain_length;
+    if (!chain_length) {
+        goto out_unlock;
+    }
+
+    // The corrupted blocks by chain position. Sectors are looked up again when needed, so that the chain can be paged out meanwhile.
+    corrupted = bitmap_zalloc(chain_length, GFP_KERNEL);
+    if (!corrupted) {
+        pr_err("Error while allocating bitmap for corrupted chain positions.\n");
+        err = -ENOMEM;
+        goto out_unlock;
+    }
+
+    dead = bitmap_zalloc(chain_length, GFP_KERNEL);
+    if (!dead) {
+        pr_err("Error while allocating bitmap for dead chain positions.\n");
+        err = -ENOMEM;
+        goto out;
+    }
+
+    if (ent_dev->nr_anchors) {
+        anchors = bitmap_zalloc(chain_length, GFP_KERNEL);
+        if (!anchors) {
+            pr_err("Error while allocating bitmap for the anchors of the chain.\n");
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    err = ent_repair_mark(ent_dev, chain_length, corrupted, dead, anchors);
+    if (err) {
+        goto out;
+    }
+
+    nr_corrupted = bitmap_weight(corrupted, chain_length);
+    if (!nr_corrupted) {
+        goto out;
+    }
+
+    steps = kvmalloc_array(nr_corrupted, sizeof(*steps), GFP_KERNEL);
+    if (!steps) {
+        pr_err("Error while allocating the repair plan.\n");
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for (i = 0 ; i < 3 ; i++) {
+        pages[i] = ent_alloc_page(ent_dev);
+        if (!pages[i]) {
+            pr_err("Error while allocating page for repair.\n");
+            err = -ENOMEM;
+            goto out_pages;
+        }
+    }
+
+    // The cache holds good copies of recent blocks: corrupted blocks it still has are written back as is, and then serve as sources of the plan.
+    for_each_set_bit(pos, corrupted, chain_length) {
+        if (!ent_cache_read(ent_dev, pos, pages[2])) {
+            continue;
+        }
+        err = ent_chain_record(ent_dev, pos, &sector, NULL);
+        if (err) {
+            goto out_pages;
+        }
+        err = ent_dev_rwSector(ent_dev, pages[2], sector, WRITE);
+        if (err) {
+            pr_err("Error while writing the repaired block in repair process.\n");
+            goto out_pages;
+        }
+        clear_bit(pos, corrupted);
+        bitmap_clear(ent_dev->corrupted_blocks, sector, 1);
+        ent_stats_inc(ent_dev->stats, ENT_STAT_REPAIRED);
+    }
+
+    ent_plan_repair(corrupted, dead, anchors, chain_length, steps, &nr_steps);
+
+    for (i = 0 ; i < nr_steps ; i++) {
+        u64 target = steps[i].target;
+        enum RepairStep type = ent_repair_step_type(&steps[i]);
+        u64 start_ns = ktime_get_ns();
+
+        err = ent_chain_record(ent_dev, target, &sector, &checksum);
+        if (err) {
+            break;
+        }
+
+        trace_ent_repair_start(sector, target, type);
+        err = ent_repair_step_exec(ent_dev, &steps[i], sector, checksum, pages);
+        ent_stats_latency(ent_dev->stats, ENT_HIST_REPAIR, start_ns);
+        trace_ent_repair_end(sector, target, type, !err, ktime_get_ns() - start_ns);
+        // The block stays corrupted, and so do those the later steps rebuild from it.
+        if (err == -EBADMSG) {
+            set_bit(target, corrupted);
+            err = 0;
+            continue;
+        }
+        if (err) {
+            break;
+        }
+
+        // Current block is repaired, so clear the bit in the corrupted blocks bitmap.
+        bitmap_clear(ent_dev->corrupted_blocks, sector, 1);
+        ent_stats_inc(ent_dev->stats, ENT_STAT_REPAIRED);
+    }
+
+    // At this point I have repaired all blocks that can be repaired. 
+    ent_stats_add(ent_dev->stats, ENT_STAT_IRRECOVERABLE, bitmap_weight(corrupted, chain_length));
+
+out_pages:
+    for (i = 0 ; i < 3 ; i++) {
+        if (pages[i]) {
+            ent_free_page(ent_dev, pages[i]);
+        }
+    }
+    kvfree(steps);
+out:
+    bitmap_free(anchors);
+    bitmap_free(dead);
+    bitmap_free(corrupted);
+out_unlock:
+    mutex_unlock(&ent_dev->entanglement_lock);
+
+    return err;
+}
+
+/*
+    Streaming rebuild, for when a whole region of the device is lost (the data half after a bad zone, or a replaced device) rather than 
+    scattered blocks. Instead of planning block by block, the chain is walked in order: the parities are read a batch at a time, each data
+    block is rebuilt with a running XOR (d_k = p_k ^ p_(k-1), with p_(-1) = 0, and d_k = p_k at an anchor), and the rebuilt blocks of the
+    batch are written back sorted by sector, so that the block layer can merge them. The data half is never read.
+    A data block is only written back when it is the current version of its sector and its checksum matches: a corrupted parity makes
+    the data blocks on both sides of it fail, and they are counted as such.
+*/
+void ent_rebuild_init(struct entanglement_device *ent_dev, struct ent_rebuild *rebuild, sector_t start, sector_t end) {
+
+    rebuild->start = start;
+    rebuild->end = end;
+    rebuild->pos = 0;
+    rebuild->end_pos = READ_ONCE(ent_dev->chain_length);
+    memset(rebuild->parity, 0, ent_unit_size(ent_dev));
+    rebuild->parity_valid = true;
+    rebuild->rebuilt = 0;
+    rebuild->failed = 0;
+}
+
+/*
+    Rebuilds the next batch of data blocks of the walk, and moves it forward. Must be called with corrupted_blocks_lock held, and the
+    entanglement lock is held for the batch, so that writes do not change the blocks being rebuilt.
+*/
+int ent_rebuild_step(struct entanglement_device *ent_dev, struct ent_rebuild *rebuild) {
+
+    // Slot 0 holds the previous parity when it has to be read, then serves as scratch space. The parities of the batch follow.
+    struct page *pages[ENT_IO_BATCH + 1] = { NULL };
+    sector_t sectors[ENT_IO_BATCH + 1];
+    sector_t data_sectors[ENT_IO_BATCH];
+    uint checksums[ENT_IO_BATCH];
+    bool anchors[ENT_IO_BATCH];
+    struct page *writes[ENT_IO_BATCH];
+    sector_t write_sectors[ENT_IO_BATCH];
+    uint batch = ent_io_batch(ent_dev);
+    uint nr, nr_writes = 0, first, i, j;
+    size_t unit_size = ent_unit_size(ent_dev);
+    u8 *scratch, *parity;
+    int err = 0;
+
+    if (rebuild->pos >= rebuild->end_pos) {
+        return 0;
+    }
+    if (ent_chain_compacting(ent_dev)) {
+        pr_err("The chain is being compacted, it cannot be walked by a rebuild before the compaction is finished.\n");
+        return -EBUSY;
+    }
+    nr = min_t(u64, batch, (rebuild->end_pos - rebuild->pos) / 2);
+    first = (rebuild->parity_valid) ? 1 : 0;
+
+    for (i = 0 ; i <= nr ; i++) {
+        pages[i] = ent_alloc_page(ent_dev);
+        if (!pages[i]) {
+            pr_err("Error while allocating page for rebuild.\n");
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    mutex_lock(&ent_dev->entanglement_lock);
+
+    if (!first) {
+        err = ent_chain_record(ent_dev, rebuild->pos - 1, &sectors[0], NULL);
+        if (err) {
+            goto out_unlock;
+        }
+    }
+    for (i = 0 ; i < nr ; i++) {
+        err = ent_chain_record_raw(ent_dev, rebuild->pos + 2 * i, &data_sectors[i], &checksums[i]);
+        if (err) {
+            goto out_unlock;
+        }
+        anchors[i] = ent_record_anchor(data_sectors[i]);
+        data_sectors[i] = ent_record_sector(data_sectors[i]);
+        err = ent_chain_record(ent_dev, rebuild->pos + 2 * i + 1, &sectors[i + 1], NULL);
+        if (err) {
+            goto out_unlock;
+        }
+    }
+
+    err = ent_dev_rwBatch(ent_dev, pages + first, sectors + first, nr + 1 - first, READ);
+    if (err) {
+        pr_err("Error while reading the parities from chain position %llu in rebuild: %d\n", rebuild->pos, err);
+        goto out_unlock;
+    }
+
+    scratch = kmap(pages[0]);
+    if (!first) {
+        memcpy(rebuild->parity, scratch, unit_size);
+    }
+
+    for (i = 0 ; i < nr ; i++) {
+        sector_t sector = data_sectors[i];
+
+        parity = kmap(pages[i + 1]);
+        if (anchors[i]) {
+            memset(rebuild->parity, 0, unit_size);
+        }
+
+        // Blocks out of the range, and older versions of a sector written again later, are only used to carry the XOR forward.
+        if (sector < rebuild->start || sector >= rebuild->end || checksums[i] != ent_dev->sector_checksum_map[sector]) {
+            memcpy(rebuild->parity, parity, unit_size);
+            kunmap(pages[i + 1]);
+            continue;
+        }
+
+        // The page of the parity receives the data, once the parity is kept for the next block.
+        memcpy(scratch, parity, unit_size);
+        ent_xor_buffer(parity, scratch, rebuild->parity, unit_size);
+        memcpy(rebuild->parity, scratch, unit_size);
+
+        if (crc32b(parity, unit_size) != checksums[i]) {
+            rebuild->failed++;
+        }else {
+            // Insertion in sector order.
+            for (j = nr_writes ; j > 0 && write_sectors[j - 1] > sector ; j--) {
+                write_sectors[j] = write_sectors[j - 1];
+                writes[j] = writes[j - 1];
+            }
+            write_sectors[j] = sector;
+            writes[j] = pages[i + 1];
+            nr_writes++;
+        }
+        kunmap(pages[i + 1]);
+    }
+    kunmap(pages[0]);
+
+    err = ent_dev_rwBatch(ent_dev, writes, write_sectors, nr_writes, WRITE);
+    if (err) {
+        pr_err("Error while writing the rebuilt blocks from chain position %llu: %d\n", rebuild->pos, err);
+        goto out_unlock;
+    }
+
+    for (i = 0 ; i < nr_writes ; i++) {
+        bitmap_clear(ent_dev->corrupted_blocks, write_sectors[i], 1);
+    }
+    rebuild->rebuilt += nr_writes;
+
+    rebuild->parity_valid = true;
+    rebuild->pos += 2 * nr;
+
+out_unlock:
+    mutex_unlock(&ent_dev->entanglement_lock);
+    // The running XOR is lost when the batch did not go through: the next one reads the previous parity again.
+    if (err) {
+        rebuild->parity_valid = false;
+    }
+out:
+    for (i = 0 ; i <= nr ; i++) {
+        if (pages[i]) {
+            ent_free_page(ent_dev, pages[i]);
+        }
+    }
+    return err;
+}
+
+/*
+    Chain compaction. A block written again leaves its previous entry in the chain: that entry is dead, and so is its parity, since the 
+    parity sector of the block was overwritten too. Dead entries fill the metadata region, and break the chain for the repair, as a block 
+    cannot be rebuilt from a dead neighbour. The compaction walks the chain in order and moves every live entry down over the dead ones, 
+    recomputing its parity along the compacted chain (p_k = d_k ^ p_(k-1)), until the chain only holds live entries.
+    It works in place, a batch at a time with the metadata buffers lock held, so that writes wait for the batch rather than for the whole
+    compaction. After every batch, the new parities are written, then the changed records, the positions left behind becoming void records
+    in the metadata log: a compaction interrupted by a reload leaves a gap, which load_entanglement_and_checksums() finds again, and it
+    goes on from there. The last batch moves the end of the chain, and the metadata buffers with it, down to the end of the compacted chain.
+    Data blocks are verified on the way, and a corrupted one is repaired from the parities it was entangled with when they are intact.
+*/
+
+// Sets the record of the chain position pos, which must be below chain_length. Must be called with entanglement_lock held.
+static int ent_chain_set_record(struct entanglement_device *ent_dev, u64 pos, sector_t sector, uint checksum) {
+
+    sector_t old_sector;
+    struct ent_chain_segment *segment;
+    int err;
+
+    // Pages the segment in, and makes it the most recently used one.
+    err = ent_chain_record(ent_dev, pos, &old_sector, NULL);
+    if (err) {
+        return err;
+    }
+
+    segment = ent_dev->segments[pos / ENT_SECTORS_PER_BLOCK];
+    segment->sectors[pos % ENT_SECTORS_PER_BLOCK] = sector;
+    segment->checksums[pos % ENT_SECTORS_PER_BLOCK] = checksum;
+    segment->dirty = true;
+    return 0;
+}
+
+// Puts the checksums of a segment in its half of a checksum metadata block, unused entries included.
+static void ent_chain_encode_checksums(const struct ent_chain_segment *segment, u8 *block) {
+
+    uint offset = (segment->index % 2) * ENT_SECTORS_PER_BLOCK;
+    uint j;
+
+    for (j = 0 ; j < ENT_SECTORS_PER_BLOCK ; j++) {
+        ent_metadata_put_checksum(block, offset + j, (j < segment->nr_records) ? segment->checksums[j] : DEFAULT_CHECKSUM_VALUE);
+    }
+}
+
+/*
+    Writes the records of a segment changed by a compaction back to the metadata log, or to the metadata buffers when its blocks are 
+    the buffered ones. The other half of its checksum block is read back from the log. Must be called with both locks held.
+*/
+static int ent_chain_store_segment(struct entanglement_device *ent_dev, struct ent_chain_segment *segment, struct page *page) {
+
+    sector_t sector_block = ent_dev->metadata_base + segment->index;
+    sector_t checksum_block = ent_dev->metadata_base + ent_dev->metadata_sector_size + segment->index / 2;
+    u8 *page_ptr;
+    uint j;
+    int err;
+
+    if (sector_block == ent_dev->next_sector) {
+        for (j = 0 ; j < segment->nr_records ; j++) {
+            ent_metadata_put_sector((u8 *)ent_dev->block_sector_buffer, j, segment->sectors[j]);
+        }
+    }else {
+        page_ptr = kmap(page);
+        memset(page_ptr, 0xFF, ENT_BLOCK_SIZE);
+        for (j = 0 ; j < segment->nr_records ; j++) {
+            ent_metadata_put_sector(page_ptr, j, segment->sectors[j]);
+        }
+        kunmap(page);
+
+        err = ent_meta_rwSector(ent_dev, page, sector_block, WRITE);
+        if (err) {
+            pr_err("Error while writing back the sectors of chain segment %llu: %d\n", segment->index, err);
+            return err;
+        }
+    }
+
+    if (checksum_block == ent_dev->next_checksum) {
+        ent_chain_encode_checksums(segment, (u8 *)ent_dev->block_checksum_buffer);
+    }else {
+        err = ent_meta_rwSector(ent_dev, page, checksum_block, READ);
+        if (err) {
+            pr_err("Error while reading the checksums of chain segment %llu: %d\n", segment->index, err);
+            return err;
+        }
+        ent_chain_encode_checksums(segment, kmap(page));
+        kunmap(page);
+
+        err = ent_meta_rwSector(ent_dev, page, checksum_block, WRITE);
+        if (err) {
+            pr_err("Error while writing back the checksums of chain segment %llu: %d\n", segment->index, err);
+            return err;
+        }
+    }
+
+    segment->dirty = false;
+    return 0;
+}
+
+/*
+    Starts (or resumes, after the gap left in the chain) a compaction, which is then run with ent_compact_step(). Does nothing if one
+    is under way already.
+*/
+int ent_compact_init(struct entanglement_device *ent_dev) {
+
+    struct ent_compact *compact;
+    u64 max_entries = (u64)ent_dev->nr_segment_slots * ENT_SECTORS_PER_BLOCK / 2;
+
+    if (ent_dev->compact) {
+        return 0;
+    }
+
+    compact = kzalloc(sizeof(*compact), GFP_KERNEL);
+    if (!compact) {
+        goto err_alloc;
+    }
+    compact->live = bitmap_zalloc(max_entries, GFP_KERNEL);
+    compact->written = bitmap_zalloc(ent_dev->dev_size, GFP_KERNEL);
+    compact->parity = kzalloc(ent_unit_size(ent_dev), GFP_KERNEL);
+    compact->old_parity = kzalloc(ent_unit_size(ent_dev), GFP_KERNEL);
+    if (!compact->live || !compact->written || !compact->parity || !compact->old_parity) {
+        goto err_alloc;
+    }
+
+    // The first step starts a round at src. At the head of the chain, the running XOR starts from zeros.
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+    if (ent_dev->gap_end > ent_dev->gap_start) {
+        compact->dst = ent_dev->gap_start;
+        compact->src = ent_dev->gap_end;
+    }
+    compact->round_start = compact->src;
+    compact->round_end = compact->src;
+    compact->parity_valid = !compact->dst;
+    ent_dev->compact = compact;
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+    return 0;
+
+err_alloc:
+    pr_err("Error while allocating the state of the compaction.\n");
+    if (compact) {
+        kfree(compact->old_parity);
+        kfree(compact->parity);
+        bitmap_free(compact->written);
+        bitmap_free(compact->live);
+        kfree(compact);
+    }
+    return -ENOMEM;
+}
+
+// Frees the state of the compaction under way. Its gap stays in the chain, and the next ent_compact_init() resumes it.
+void ent_compact_exit(struct entanglement_device *ent_dev) {
+
+    struct ent_compact *compact;
+
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+    compact = ent_dev->compact;
+    ent_dev->compact = NULL;
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+    if (compact) {
+        kfree(compact->old_parity);
+        kfree(compact->parity);
+        bitmap_free(compact->written);
+        bitmap_free(compact->live);
+        kfree(compact);
+    }
+}
+
+/*
+    Starts a round on the chain as it is: its data entries are walked backwards, and those that are the last one of their sector are live. 
+    The bitmap of the written sectors serves to find them, before it starts over for the writes of the round.
+*/
+static int ent_compact_round(struct entanglement_device *ent_dev, struct ent_compact *compact) {
+
+    u64 pos;
+    sector_t sector;
+    int err;
+
+    compact->round_start = compact->src;
+    compact->round_end = ent_dev->chain_length;
+    bitmap_zero(compact->live, (compact->round_end - compact->round_start) / 2);
+    bitmap_zero(compact->written, ent_dev->dev_size);
+
+    for (pos = compact->round_end ; pos > compact->round_start ; ) {
+        pos -= 2;
+        err = ent_chain_record(ent_dev, pos, &sector, NULL);
+        if (err) {
+            return err;
+        }
+        if (sector < ent_dev->dev_size && !test_and_set_bit(sector, compact->written)) {
+            set_bit((pos - compact->round_start) / 2, compact->live);
+        }
+    }
+
+    bitmap_zero(compact->written, ent_dev->dev_size);
+    return 0;
+}
+
+/*
+    Ends the chain at the end of the compacted chain, once it has all been walked: the segments past it are dropped, and the metadata 
+    buffers start again from its last segment, which the next writes append to. Writing them ends the chain in the metadata log.
+*/
+static int ent_compact_finish(struct entanglement_device *ent_dev, struct ent_compact *compact) {
+
+    u64 end = compact->dst;
+    u64 index = end / ENT_SECTORS_PER_BLOCK;
+    uint offset = end % ENT_SECTORS_PER_BLOCK;
+    struct ent_chain_segment *segment, *tmp;
+    sector_t sector;
+    uint j;
+    int err;
+
+    memset(ent_dev->block_sector_buffer, 0xFF, ENT_BLOCK_SIZE);
+    memset(ent_dev->block_checksum_buffer, 0xFF, ENT_BLOCK_SIZE);
+
+    // The checksum block of the last segment starts with the checksums of the previous one when it is the second half of it.
+    if (index % 2) {
+        err = ent_chain_record(ent_dev, index * ENT_SECTORS_PER_BLOCK - 1, &sector, NULL);
+        if (err) {
+            return err;
+        }
+        ent_chain_encode_checksums(ent_dev->segments[index - 1], (u8 *)ent_dev->block_checksum_buffer);
+    }
+
+    if (offset) {
+        err = ent_chain_record(ent_dev, end - 1, &sector, NULL);
+        if (err) {
+            return err;
+        }
+        segment = ent_dev->segments[index];
+        segment->nr_records = offset;
+        segment->dirty = false;
+        for (j = 0 ; j < offset ; j++) {
+            ent_metadata_put_sector((u8 *)ent_dev->block_sector_buffer, j, segment->sectors[j]);
+        }
+        ent_chain_encode_checksums(segment, (u8 *)ent_dev->block_checksum_buffer);
+    }
+
+    list_for_each_entry_safe(segment, tmp, &ent_dev->segment_lru, lru_node) {
+        if (segment->index >= DIV_ROUND_UP(end, ENT_SECTORS_PER_BLOCK)) {
+            ent_chain_drop_segment(ent_dev, segment);
+        }
+    }
+
+    ent_dev->sector_buffer_size = offset * sizeof(sector_t);
+    ent_dev->checksum_buffer_size = ((index % 2) * ENT_SECTORS_PER_BLOCK + offset) * sizeof(uint);
+    ent_dev->next_sector = ent_dev->metadata_base + index;
+    ent_dev->next_checksum = ent_dev->metadata_base + ent_dev->metadata_sector_size + index / 2;
+    ent_dev->chain_length = end;
+    ent_dev->compact_base = end;
+    ent_dev->gap_start = 0;
+    ent_dev->gap_end = 0;
+
+    // The running XOR is the parity of the last entry, or zeros for an empty chain.
+    memcpy(ent_dev->last_entangled_block, compact->parity, ent_unit_size(ent_dev));
+    ent_dev->last_anchor = compact->anchor;
+
+    return write_metadata_buffers(ent_dev);
+}
+
+/*
+    Position of the last anchor of the chain before position end (0, the head, if there is none), from which the next one is placed. 
+    Only the last anchor_interval data blocks are looked at: the next anchor is due anyway past them. Must be called with entanglement_lock held.
+*/
+static int ent_chain_last_anchor(struct entanglement_device *ent_dev, u64 end, u64 *anchor) {
+
+    u64 interval = READ_ONCE(ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL]);
+    u64 pos = end;
+    sector_t record;
+    int err;
+
+    *anchor = (interval && end > 2 * interval) ? end - 2 * interval : 0;
+    while (interval && pos > *anchor) {
+        pos -= 2;
+        err = ent_chain_record_raw(ent_dev, pos, &record, NULL);
+        if (err) {
+            return err;
+        }
+        if (ent_record_anchor(record)) {
+            *anchor = pos;
+            break;
+        }
+    }
+    return 0;
+}
+
+/*
+    Walks the next nr entries (data and parity pairs) of the compaction, a batch of I/O at a time, and sets done once the chain has been
+    walked entirely and compacted. The data blocks and their parities are read together, and the new parities written with one batch of
+    I/O. Anchors are placed again along the compacted chain, with the current interval. Must be called with corrupted_blocks_lock and 
+    metadata_buffers_lock held: the writes wait for the step, and the caller makes sure that those appended before it are on disk.
+*/
+int ent_compact_step(struct entanglement_device *ent_dev, uint nr, bool *done) {
+
+    struct ent_compact *compact = ent_dev->compact;
+    // Data blocks of a batch, then their parities, which receive the new ones. The last page is scratch space.
+    struct page *pages[ENT_IO_BATCH + 1] = { NULL };
+    sector_t sectors[ENT_IO_BATCH];
+    uint checksums[ENT_IO_BATCH];
+    uint new_checksums[ENT_IO_BATCH / 2];
+    bool adjacent[ENT_IO_BATCH / 2];
+    // Whether the entry was an anchor where it was, and is one where it goes.
+    bool was_anchor[ENT_IO_BATCH / 2];
+    bool anchor[ENT_IO_BATCH / 2];
+    u64 interval = READ_ONCE(ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL]);
+    u64 last_anchor, walked_anchors, new_anchors;
+    struct page *writes[ENT_IO_BATCH];
+    sector_t write_sectors[ENT_IO_BATCH];
+    uint batch = max_t(uint, ent_io_batch(ent_dev) / 2, 1);
+    size_t unit_size = ent_unit_size(ent_dev);
+    u64 first = compact->dst, src = compact->src, void_start, index, pos, batch_src, reclaimed;
+    uint n, nr_writes, i;
+    bool skipped;
+    u8 *data, *parity, *scratch;
+    int err = 0;
+
+    *done = false;
+
+    for (i = 0 ; i <= 2 * batch ; i++) {
+        pages[i] = ent_alloc_page(ent_dev);
+        if (!pages[i]) {
+            pr_err("Error while allocating page for compaction.\n");
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+    scratch = kmap(pages[2 * batch]);
+
+    mutex_lock(&ent_dev->entanglement_lock);
+
+    // After a resume, the running XOR is the parity at the end of the compacted chain.
+    if (!compact->parity_valid) {
+        err = ent_chain_record(ent_dev, compact->dst - 1, &sectors[0], NULL);
+        if (!err) {
+            err = ent_chain_last_anchor(ent_dev, compact->dst, &compact->anchor);
+        }
+        if (!err) {
+            err = ent_dev_rwSector(ent_dev, pages[2 * batch], sectors[0], READ);
+        }
+        if (err) {
+            pr_err("Error while reading the parity at chain position %llu in compaction: %d\n", compact->dst - 1, err);
+            goto out_unlock;
+        }
+        memcpy(compact->parity, scratch, unit_size);
+        compact->parity_valid = true;
+        compact->old_parity_valid = false;
+    }
+
+    while (nr) {
+        if (compact->src >= compact->round_end) {
+            if (compact->src >= ent_dev->chain_length) {
+                *done = true;
+                break;
+            }
+            err = ent_compact_round(ent_dev, compact);
+            if (err) {
+                break;
+            }
+            continue;
+        }
+
+        // The live entries of the next batch. The parity of a dead entry belongs to a later one: it cannot repair the next block.
+        batch_src = compact->src;
+        reclaimed = 0;
+        walked_anchors = 0;
+        skipped = false;
+        for (n = 0 ; n < batch && nr && compact->src < compact->round_end ; nr--) {
+            pos = compact->src;
+            compact->src += 2;
+
+            err = ent_chain_record_raw(ent_dev, pos, &sectors[n], &checksums[n]);
+            if (err) {
+                break;
+            }
+            was_anchor[n] = ent_record_anchor(sectors[n]);
+            walked_anchors += was_anchor[n];
+            sectors[n] = ent_record_sector(sectors[n]);
+            if (!test_bit((pos - compact->round_start) / 2, compact->live) || test_bit(sectors[n], compact->written)) {
+                reclaimed += 2;
+                skipped = true;
+                continue;
+            }
+            err = ent_chain_record(ent_dev, pos + 1, &sectors[batch + n], &checksums[batch + n]);
+            if (err) {
+                break;
+            }
+            adjacent[n++] = !skipped;
+            skipped = false;
+        }
+        if (err) {
+            compact->src = batch_src;
+            break;
+        }
+
+        // Data blocks then parities, contiguous for the batch of reads.
+        for (i = 0 ; i < n ; i++) {
+            sectors[n + i] = sectors[batch + i];
+            checksums[n + i] = checksums[batch + i];
+        }
+        err = ent_dev_rwBatch(ent_dev, pages, sectors, 2 * n, READ);
+        if (err) {
+            pr_err("Error while reading the blocks from chain position %llu in compaction: %d\n", batch_src, err);
+            compact->src = batch_src;
+            break;
+        }
+
+        nr_writes = 0;
+        new_anchors = 0;
+        last_anchor = compact->anchor;
+        for (i = 0 ; i < n ; i++) {
+            bool parity_intact, repairable;
+
+            data = kmap(pages[i]);
+            parity = kmap(pages[n + i]);
+            parity_intact = crc32b(parity, unit_size) == checksums[n + i];
+            repairable = parity_intact && (was_anchor[i] || (adjacent[i] && compact->old_parity_valid));
+
+            // d_k = p_k ^ p_(k-1), both as they were before the compaction (d_k = p_k at an anchor).
+            if (crc32b(data, unit_size) != checksums[i]) {
+                if (repairable && was_anchor[i]) {
+                    memcpy(scratch, parity, unit_size);
+                }else if (repairable) {
+                    ent_xor_buffer(scratch, parity, compact->old_parity, unit_size);
+                }
+                if (repairable && crc32b(scratch, unit_size) == checksums[i]) {
+                    memcpy(data, scratch, unit_size);
+                    writes[nr_writes] = pages[i];
+                    write_sectors[nr_writes++] = sectors[i];
+                    bitmap_clear(ent_dev->corrupted_blocks, sectors[i], 1);
+                    compact->repaired++;
+                }else {
+                    // Entangled as it is: it could not have been repaired without the compaction either.
+                    bitmap_set(ent_dev->corrupted_blocks, sectors[i], 1);
+                    compact->failed++;
+                }
+            }
+
+            memcpy(compact->old_parity, parity, unit_size);
+            compact->old_parity_valid = parity_intact;
+
+            anchor[i] = interval && compact->dst + 2 * i - last_anchor >= 2 * interval;
+            if (anchor[i]) {
+                memset(compact->parity, 0, unit_size);
+                last_anchor = compact->dst + 2 * i;
+                new_anchors++;
+            }
+
+            // The page of the old parity receives the new one, which is only written when it differs (it does not, up to the first dead entry).
+            ent_xor_buffer(parity, data, compact->parity, unit_size);
+            memcpy(compact->parity, parity, unit_size);
+            new_checksums[i] = crc32b(parity, unit_size);
+            if (!parity_intact || new_checksums[i] != checksums[n + i] || memcmp(parity, compact->old_parity, unit_size)) {
+                writes[nr_writes] = pages[n + i];
+                write_sectors[nr_writes++] = sectors[n + i];
+            }
+
+            ent_cache_insert(ent_dev, compact->dst + 2 * i, data);
+            ent_cache_insert(ent_dev, compact->dst + 2 * i + 1, parity);
+
+            kunmap(pages[n + i]);
+            kunmap(pages[i]);
+        }
+        if (skipped) {
+            compact->old_parity_valid = false;
+        }
+
+        err = ent_dev_rwBatch(ent_dev, writes, write_sectors, nr_writes, WRITE);
+        if (err) {
+            pr_err("Error while writing the parities from chain position %llu in compaction: %d\n", compact->dst, err);
+            // The batch is walked again, from the parities on disk.
+            compact->src = batch_src;
+            compact->parity_valid = false;
+            break;
+        }
+
+        for (i = 0 ; i < n ; i++) {
+            err = ent_chain_set_record(ent_dev, compact->dst, anchor[i] ? sectors[i] | ENT_ANCHOR_FLAG : sectors[i], checksums[i]);
+            if (!err) {
+                err = ent_chain_set_record(ent_dev, compact->dst + 1, sectors[n + i], new_checksums[i]);
+            }
+            if (err) {
+                break;
+            }
+            ent_dev->sector_checksum_map[sectors[n + i]] = new_checksums[i];
+            compact->dst += 2;
+            compact->moved += 2;
+        }
+        if (err) {
+            break;
+        }
+        compact->reclaimed += reclaimed;
+        compact->anchor = last_anchor;
+        ent_dev->nr_anchors += new_anchors - walked_anchors;
+    }
+
+    // The positions walked that no entry was moved to are void. Those before src were already.
+    void_start = max(compact->dst, src);
+    for (pos = void_start ; !err && pos < compact->src ; pos++) {
+        err = ent_chain_set_record(ent_dev, pos, ENT_VOID_SECTOR, DEFAULT_CHECKSUM_VALUE);
+    }
+    ent_dev->gap_start = compact->dst;
+    ent_dev->gap_end = compact->src;
+
+    // The changed records go to the metadata log even after an error, as the parities of the batches before it are on disk.
+    for (index = first / ENT_SECTORS_PER_BLOCK ; index < DIV_ROUND_UP(compact->src, ENT_SECTORS_PER_BLOCK) ; index++) {
+        struct ent_chain_segment *segment = ent_dev->segments[index];
+        int store_err;
+
+        if (segment && segment->dirty) {
+            store_err = ent_chain_store_segment(ent_dev, segment, pages[2 * batch]);
+            if (store_err && !err) {
+                err = store_err;
+            }
+        }
+    }
+
+    if (!err && *done) {
+        err = ent_compact_finish(ent_dev, compact);
+        if (err) {
+            *done = false;
+        }
+    }
+
+out_unlock:
+    mutex_unlock(&ent_dev->entanglement_lock);
+    kunmap(pages[2 * batch]);
+out:
+    for (i = 0 ; i <= 2 * batch ; i++) {
+        if (pages[i]) {
+            ent_free_page(ent_dev, pages[i]);
+        }
+    }
+    return err;
+}
+
+/*
+    Verifies the checksums of all blocks in the range of sectors [start, end), marking the mismatching ones in the corrupted blocks bitmap. 
+    Sectors without a checksum (never written, or holding metadata) are skipped. Must be called with corrupted_blocks_lock held.
+*/
+int scrub_range(struct entanglement_device *ent_dev, sector_t start, sector_t end, u64 *checked, u64 *corrupted) {
+
+    int err = 0;
+    sector_t sector = start;
+    struct page *pages[ENT_IO_BATCH] = { NULL };
+    sector_t sectors[ENT_IO_BATCH];
+    uint batch = ent_io_batch(ent_dev);
+    uint i, nr;
+
+    for (i = 0 ; i < batch ; i++) {
+        pages[i] = ent_alloc_page(ent_dev);
+        if (!pages[i]) {
+            pr_err("Error while allocating page from pool.\n");
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+
+    // The written blocks of the range are read a batch at a time.
+    while (sector < end) {
+        for (nr = 0 ; sector < end && nr < batch ; sector++) {
+            if (ent_dev->sector_checksum_map[sector] != 0) {
+                sectors[nr++] = sector;
+            }
+        }
+        if (!nr) {
+            break;
+        }
+
+        err = ent_dev_rwBatch(ent_dev, pages, sectors, nr, READ);
+        if (err) {
+            pr_err("Error while reading the blocks from sector %llu which contain data: %d\n", sectors[0], err);
+            goto out;
+        }
+        *checked += nr;
+
+        for (i = 0 ; i < nr ; i++) {
+            uint checksum = crc32b(kmap(pages[i]), ent_unit_size(ent_dev));
+
+            kunmap(pages[i]);
+            if (checksum != ent_dev->sector_checksum_map[sectors[i]]) {
+                // Set the bit corresponding to the sector of this block. 
+                bitmap_set(ent_dev->corrupted_blocks, sectors[i], 1);
+                ent_stats_inc(ent_dev->stats, ENT_STAT_CORRUPTED);
+                (*corrupted)++;
+            }
+        }
+    }
+
+out:
+    for (i = 0 ; i < batch ; i++) {
+        if (pages[i]) {
+            ent_free_page(ent_dev, pages[i]);
+        }
+    }
+
+    return err;
+}
+
+int check_corruption(struct entanglement_device *ent_dev) {
+
+    int err;
+    u64 checked = 0;
+    u64 corrupted = 0;
+    u64 start_ns = trace_ent_check_corruption_end_enabled() ? ktime_get_ns() : 0;
+
+    trace_ent_check_corruption_start(0, ent_dev->dev_size);
+
+    // Grab the lock for the corrupted blocks bitmap.  
+    if (mutex_lock_interruptible(&ent_dev->corrupted_blocks_lock)) {
+        pr_err("Interrupted while waiting for the lock to the corrputed blocks bitmap.\n");
+        return -EINTR;
+    }
+ 
+    // The corrupted blocks of a chain being compacted stay marked, for a repair once the compaction is finished.
+    err = scrub_range(ent_dev, 0, ent_dev->dev_size, &checked, &corrupted);
+    if (!err && !ent_chain_compacting(ent_dev)) {
+        err = repair_corrupted_blocks(ent_dev);
+    }
+
+    mutex_unlock(&ent_dev->corrupted_blocks_lock);
+
+    if (start_ns) {
+        trace_ent_check_corruption_end(checked, corrupted, ktime_get_ns() - start_ns, err);
+    }
+
+    return err;
+}
+
+int flush_metadata(struct entanglement_device *ent_dev, enum BufferType type) {
+
+    char *buffer = (type == SECTOR) ? ent_dev->block_sector_buffer : ent_dev->block_checksum_buffer;
+    sector_t sector = (type == SECTOR) ? ent_dev->next_sector : ent_dev->next_checksum;
+    struct page *page;
+    u8 *page_ptr;
+    int err;
+    u64 start_ns = ktime_get_ns();
+
+    trace_ent_flush_metadata_start(type, sector);
+
+    page = ent_alloc_page(ent_dev);
+    if (!page) {
+        pr_err("Error while allocating new page for parity.\n");
+        return -ENOMEM;
+    }
+
+    page_ptr = kmap(page);
+    memcpy(page_ptr, buffer, ENT_BLOCK_SIZE);
+
+    err = ent_meta_rwSector(ent_dev, page, sector, WRITE);
+    if (err) {
+        pr_err("Error while flushing buffer of type %d.\n", type);
+        goto out;
+    }
+
+    // Reset buffer. 
+    if (type == SECTOR) {
+        memset(buffer, 0xFF, ENT_BLOCK_SIZE);
+        ent_dev->sector_buffer_size = 0;
+
+        // Update sector. 
+        ent_dev->next_sector += 1;
+    }else {
+        memset(buffer, 0xFF, ENT_BLOCK_SIZE);
+        ent_dev->checksum_buffer_size = 0;
+
+        // Update sector. 
+        ent_dev->next_checksum += 1;
+    }
+
+    ent_stats_inc(ent_dev->stats, ENT_STAT_METADATA_FLUSHES);
+    ent_stats_latency(ent_dev->stats, ENT_HIST_FLUSH, start_ns);
+
+out:   
+    kunmap(page);
+    // Free the page. 
+    ent_free_page(ent_dev, page);
+
+    trace_ent_flush_metadata_end(type, sector, ktime_get_ns() - start_ns, err);
+
+    return err;
+}
+
+// Appends the sector and the checksum of a block to the metadata buffers, which must not be full.
+static void ent_buffer_metadata(struct entanglement_device *ent_dev, sector_t sector, uint checksum) {
+
+    ent_metadata_put_sector((u8 *)ent_dev->block_sector_buffer, ent_dev->sector_buffer_size / sizeof(sector_t), sector);
+    ent_dev->sector_buffer_size += sizeof(sector_t);
+
+    ent_metadata_put_checksum((u8 *)ent_dev->block_checksum_buffer, ent_dev->checksum_buffer_size / sizeof(uint), checksum);
+    ent_dev->checksum_buffer_size += sizeof(uint);
+}
+
+static int ent_flush_full_buffers(struct entanglement_device *ent_dev) {
+
+    int err;
+
+    if (ent_dev->sector_buffer_size == ENT_BLOCK_SIZE) {
+        err = flush_metadata(ent_dev, SECTOR);
+        if (err) {
+            return err;
+        }
+    }
+
+    if (ent_dev->checksum_buffer_size == ENT_BLOCK_SIZE) {
+        err = flush_metadata(ent_dev, CHECKSUM);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Whether the next ent_chain_append() would block on more than its CPU work: to flush a metadata buffer it fills (or failed to flush
+    earlier), or to allocate the chain segment it starts. Writes that must not block are turned away then. Must be called with
+    metadata_buffers_lock held.
+*/
+bool ent_chain_append_would_block(struct entanglement_device *ent_dev) {
+
+    return ent_dev->sector_buffer_size + 2 * (int)sizeof(sector_t) >= ENT_BLOCK_SIZE ||
+           ent_dev->checksum_buffer_size + 2 * (int)sizeof(uint) >= ENT_BLOCK_SIZE ||
+           ent_dev->chain_length % ENT_SECTORS_PER_BLOCK == 0;
+}
+
+/*
+    Adds a newly written data block to the end of the entanglement. Computes its parity into the provided buffer (the caller writes it to
+    info->parity_sector), records the data and the parity in the last chain segment, and buffers their sectors and checksums, flushing
+    the metadata buffers when they are full. Blocks are whole units, with one checksum each, and sectors are unit indices (4KB block
+    indices with the default unit). Must be called with metadata_buffers_lock held.
+*/
+int ent_chain_append(struct entanglement_device *ent_dev, const u8 *data, sector_t data_sector, u8 *parity,
+                     bool timed, struct ent_append_info *info) {
+
+    struct ent_chain_segment *segment;
+    struct ent_chain_segment *new_segment = NULL;
+    sector_t parity_sector = data_sector + ent_dev->write_sector_scale;
+    size_t unit_size = ent_unit_size(ent_dev);
+    u64 chain_pos = ent_dev->chain_length;
+    u64 index = chain_pos / ENT_SECTORS_PER_BLOCK;
+    uint offset = chain_pos % ENT_SECTORS_PER_BLOCK;
+    uint anchor_interval = READ_ONCE(ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL]);
+    bool anchor = anchor_interval && chain_pos - ent_dev->last_anchor >= 2 * (u64)anchor_interval;
+    sector_t data_record = anchor ? data_sector | ENT_ANCHOR_FLAG : data_sector;
+    u64 t;
+    int err;
+
+    if (index >= ent_dev->nr_segment_slots) {
+        pr_err("The metadata region has no room left for the entanglement.\n");
+        return -ENOSPC;
+    }
+
+    t = timed ? ktime_get_ns() : 0;
+
+    // Using this function from utils.h because I had a weird error with memcmp.
+    // If this is empty, it means we are at the start of the entanglement, and the first parity is just the first data block copied. 
+    // So is the parity at an anchor.
+    if (anchor || is_buffer_empty(ent_dev->last_entangled_block, unit_size)) {
+        memcpy(parity, data, unit_size);
+    }else {
+        ent_xor_buffer(parity, data, (u8 *)ent_dev->last_entangled_block, unit_size);
+    }
+
+    if (timed) {
+        info->xor_ns = ktime_get_ns() - t;
+    }
+
+    // Segments hold an even number of records, so the data and its parity always go to the same one, which starts with the data.
+    if (!offset) {
+        new_segment = kmalloc(sizeof(*new_segment), GFP_NOIO);
+        if (!new_segment) {
+            pr_err("Error while allocating chain segment %llu.\n", index);
+            return -ENOMEM;
+        }
+        new_segment->index = index;
+        new_segment->nr_records = 0;
+        new_segment->dirty = false;
+    }
+
+    // Calculate checksums and add them to the buffer, flushing the buffer if needed. When flushing, update next_checksum. Also update curr_buffer_size.
+    t = timed ? ktime_get_ns() : 0;
+    uint data_checksum = crc32b(data, unit_size);
+    uint parity_checksum = crc32b(parity, unit_size);
+    if (timed) {
+        info->crc_ns = ktime_get_ns() - t;
+    }
+
+    // Maintenance work (repair, fault injection) reads the chain under the entanglement lock, concurrently with writes.
+    // The last segment is never dropped from memory, as its metadata block is still buffered.
+    mutex_lock(&ent_dev->entanglement_lock);
+    if (new_segment) {
+        ent_chain_insert_segment(ent_dev, new_segment);
+    }
+    segment = ent_dev->segments[index];
+    segment->sectors[offset] = data_record;
+    segment->checksums[offset] = data_checksum;
+    segment->sectors[offset + 1] = parity_sector;
+    segment->checksums[offset + 1] = parity_checksum;
+    segment->nr_records = offset + 2;
+    if (new_segment) {
+        ent_chain_trim(ent_dev);
+    }
+    mutex_unlock(&ent_dev->entanglement_lock);
+
+    t = timed ? ktime_get_ns() : 0;
+
+    // The buffers are only full here if flushing them failed during an earlier write, so retry it first.
+    err = ent_flush_full_buffers(ent_dev);
+    if (err) {
+        goto err_metadata_flush;
+    }
+
+    // Both buffers hold an even number of entries, so they have room for the two blocks.
+    ent_buffer_metadata(ent_dev, data_record, data_checksum);
+    ent_buffer_metadata(ent_dev, parity_sector, parity_checksum);
+
+    // Full buffers are flushed right away, so that the buffers written in place by write_metadata_buffers() always end with unused entries,
+    // which mark the end of the metadata when loading it. A failure is not an error of this write: the entries stay buffered.
+    ent_flush_full_buffers(ent_dev);
+
+    if (timed) {
+        info->flush_ns = ktime_get_ns() - t;
+    }
+
+    // Update the last_entangled_block. 
+    memcpy(ent_dev->last_entangled_block, parity, unit_size);
+
+    ent_cache_insert(ent_dev, chain_pos, data);
+    ent_cache_insert(ent_dev, chain_pos + 1, parity);
+
+    // Entries of this sector in the round of a compaction under way are dead now.
+    if (ent_dev->compact) {
+        set_bit(data_sector, ent_dev->compact->written);
+    }
+
+    // Update the sector-checksum map. 
+    ent_dev->sector_checksum_map[data_sector] = data_checksum;
+    ent_dev->sector_checksum_map[parity_sector] = parity_checksum;
+
+    if (anchor) {
+        ent_dev->last_anchor = chain_pos;
+        ent_dev->nr_anchors++;
+    }
+    ent_dev->chain_length += 2;
+    ent_stats_inc(ent_dev->stats, ENT_STAT_WRITES);
+    ent_stats_add(ent_dev->stats, ENT_STAT_PARITY_BYTES, unit_size);
+
+    info->parity_sector = parity_sector;
+    info->chain_pos = chain_pos;
+
+    return 0;
+
+err_metadata_flush:
+    mutex_lock(&ent_dev->entanglement_lock);
+    if (new_segment) {
+        ent_chain_drop_segment(ent_dev, new_segment);
+    }else {
+        segment->nr_records = offset;
+    }
+    mutex_unlock(&ent_dev->entanglement_lock);
+    return err;
+}
+
@@ -0,0 +1,268 @@
+#ifndef _ENT_CORE_H_
+#define _ENT_CORE_H_
+
+/*
+    The entanglement core: the chain of entangled blocks, parity computation, metadata buffering and load/store, 
+    corruption check (scrub) and repair. It does not depend on bios or on the device mapper, and only accesses 
+    the underlying device through ent_dev_rwSector(), so the same code is built into the kernel target (target.c) 
+    and into the userspace library (user/).
+*/
+
+#include "compat.h"
+#include "utils.h"
+#include "device.h"
+
+// Number of records in a sector/checksum metadata block.
+#define ENT_SECTORS_PER_BLOCK (ENT_BLOCK_SIZE / sizeof(sector_t))
+#define ENT_CHECKSUMS_PER_BLOCK (ENT_BLOCK_SIZE / sizeof(uint))
+
+/*
+    These constants are used to represent an unused block sector/checksum. 
+    In more detail, these values are present on disk, and when for example you read blocks and their metadata, 
+    if you come across one of these values, it means you got to the end and read all sectors/checksums.  
+*/
+#define DEFAULT_SECTOR_VALUE 0xFFFFFFFFFFFFFFFFULL
+#define DEFAULT_CHECKSUM_VALUE 0xFFFFFFFF
+
+// Sector of the records of the chain positions left without a block by a compaction under way (see struct ent_compact).
+#define ENT_VOID_SECTOR 0xFFFFFFFFFFFFFFFEULL
+
+/*
+    Chain anchors. Every anchor_interval data blocks (see ENT_TUNE_ANCHOR_INTERVAL), the chain starts over as at its head: the parity
+    of the data block at an anchor is a copy of it (p_k = d_k), not d_k ^ p_(k-1). The chain is then a series of runs that are repaired
+    independently of each other, so a repair never reads further than the run of the block, and a lost run does not make its neighbours
+    irrecoverable. In exchange, the last parity of a run can only be rebuilt from its left. Anchors are recorded in the metadata log, with 
+    this flag in the sector record of their data block, so that the interval can change over the life of the chain.
+*/
+#define ENT_ANCHOR_FLAG (1ULL << 62)
+
+// Sector and anchor flag of a sector record as stored (see ent_chain_record_raw()).
+static inline sector_t ent_record_sector(sector_t record) {
+    return (record >= ENT_VOID_SECTOR) ? record : (record & ~ENT_ANCHOR_FLAG);
+}
+
+static inline bool ent_record_anchor(sector_t record) {
+    return record < ENT_VOID_SECTOR && (record & ENT_ANCHOR_FLAG);
+}
+
+// Enum used to describe a buffer which is being flushed in the writing process.
+enum BufferType {
+    SECTOR,
+    CHECKSUM
+};
+
+// Repair steps, as reported by the ent_repair_start/ent_repair_end tracepoints.
+enum RepairStep {
+    REPAIR_STEP_DATA,
+    REPAIR_STEP_PARITY_LEFT,
+    REPAIR_STEP_PARITY_RIGHT
+};
+
+/*
+    One step of a repair plan (see ent_plan_repair()): the block at chain position target is rebuilt as the XOR of the blocks at positions 
+    src[0] and src[1], or as a copy of src[0] when src[1] is ENT_REPAIR_COPY.
+*/
+#define ENT_REPAIR_COPY ((u64)-1)
+
+struct ent_repair_step {
+    u64 target;
+    u64 src[2];
+};
+
+/*
+    The entanglement is held in segments of ENT_SECTORS_PER_BLOCK consecutive chain positions (starting from 0 at the head): segment i
+    holds the records of sector metadata block i, so a segment that is not in memory can be read back from the metadata log.
+    With a chain window set, only that many segments stay in memory and the least recently used ones are dropped, except the last
+    segment and those whose metadata block is not on disk yet.
+*/
+struct ent_chain_segment {
+    u64 index;
+    uint nr_records;
+    // Records changed by a compaction and not written back to the metadata log yet: the segment cannot be dropped meanwhile.
+    bool dirty;
+    struct list_head lru_node;
+    sector_t sectors[ENT_SECTORS_PER_BLOCK];
+    uint checksums[ENT_SECTORS_PER_BLOCK];
+};
+
+/*
+    Metadata blocks are arrays of sectors (sector_t) or checksums (uint), in the byte order of the host. 
+    Unused entries hold DEFAULT_SECTOR_VALUE/DEFAULT_CHECKSUM_VALUE.
+*/
+static inline sector_t ent_metadata_get_sector(const u8 *block, uint index) {
+    sector_t sector;
+
+    memcpy(&sector, block + index * sizeof(sector_t), sizeof(sector_t));
+    return sector;
+}
+
+static inline void ent_metadata_put_sector(u8 *block, uint index, sector_t sector) {
+    memcpy(block + index * sizeof(sector_t), &sector, sizeof(sector_t));
+}
+
+static inline uint ent_metadata_get_checksum(const u8 *block, uint index) {
+    uint checksum;
+
+    memcpy(&checksum, block + index * sizeof(uint), sizeof(uint));
+    return checksum;
+}
+
+static inline void ent_metadata_put_checksum(u8 *block, uint index, uint checksum) {
+    memcpy(block + index * sizeof(uint), &checksum, sizeof(uint));
+}
+
+/*
+    Per-write information returned by ent_chain_append(). The durations are only measured when requested, for the tracepoints.
+*/
+struct ent_append_info {
+    sector_t parity_sector;
+    u64 chain_pos;
+    u64 xor_ns;
+    u64 crc_ns;
+    u64 flush_ns;
+};
+
+/*
+    Entanglement units. The chain is made of units of unit_blocks 4KB blocks: data unit i is 4KB blocks [i * unit_blocks, (i + 1) * unit_blocks)
+    of the device, so the data region keeps the layout of the virtual device. Every page of the page pool holds one unit.
+*/
+#define ENT_MAX_UNIT_BLOCKS 64
+
+static inline size_t ent_unit_size(const struct entanglement_device *ent_dev) {
+    return (size_t)ent_dev->unit_blocks * ENT_BLOCK_SIZE;
+}
+
+// Order of the pages holding a unit.
+static inline uint ent_unit_order(const struct entanglement_device *ent_dev) {
+    return ilog2(ent_dev->unit_blocks);
+}
+
+/*
+    The block I/O abstraction used by the core. Synchronously reads/writes one unit (sector is a unit index) from/to the underlying
+    device to/from the provided page. Implemented by target.c in the kernel, and by user/blkio.c in userspace.
+*/
+int ent_dev_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw);
+// Same for one 4096-byte block of the metadata region (sector is a 4KB block of the device holding it, see meta_dev).
+int ent_meta_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw);
+// Same as ent_dev_rwSector() for nr units at once (at most ENT_IO_BATCH): all the I/Os are submitted before waiting for any of them.
+#define ENT_IO_BATCH 64
+int ent_dev_rwBatch(struct entanglement_device *ent_dev, struct page **pages, const sector_t *sectors, uint nr, int rw);
+
+/*
+    Every device has its own pool of pages, so that a busy device cannot starve the others. The reserve covers the data and parity pages
+    of every write in flight, one batch of block I/O, and the two metadata blocks being flushed. With larger units, it covers the same
+    number of bytes: queue_depth 4KB writes are queue_depth / unit_blocks unit writes.
+*/
+#define ENT_DEFAULT_QUEUE_DEPTH 128
+#define ENT_MAX_QUEUE_DEPTH 4096
+
+// Defaults of the other tunables (see enum ent_tunable), used as is in userspace.
+#define ENT_DEFAULT_SCRUB_BATCH 1024
+// 100MB/s of 4KB blocks.
+#define ENT_DEFAULT_SCRUB_RATE 25600
+#define ENT_DEFAULT_LAG_BLOCKS 256
+#define ENT_DEFAULT_LAG_MS 100
+#define ENT_DEFAULT_ANCHOR_INTERVAL 0
+#define ENT_DEFAULT_COMPACT_FILL 75
+
+// Units per batched I/O of this device, within what the batch arrays and the page pool can hold.
+static inline uint ent_io_batch(const struct entanglement_device *ent_dev) {
+    return clamp_t(uint, ent_dev->tuning[ENT_TUNE_IO_BATCH], 1, ENT_IO_BATCH / ent_dev->unit_blocks);
+}
+
+static inline uint ent_page_pool_size(uint queue_depth, uint unit_blocks) {
+    return 2 * DIV_ROUND_UP(queue_depth, unit_blocks) + ENT_IO_BATCH / unit_blocks + 2;
+}
+
+struct page *ent_alloc_page(struct entanglement_device *ent_dev);
+struct page *ent_try_alloc_page(struct entanglement_device *ent_dev);
+void ent_free_page(struct entanglement_device *ent_dev, struct page *page);
+
+/*
+    Scrub checkpoint, in the first block of the metadata device, so that a scrub interrupted by a reload can be resumed where it stopped.
+    Only devices with a metadata device have one: the metadata region of the underlying device has no room left for it.
+*/
+#define ENT_CHECKPOINT_BLOCKS 1
+#define ENT_CHECKPOINT_MAGIC 0x454E54434B505431ULL
+
+struct ent_scrub_checkpoint {
+    u64 magic;
+    u64 scrub_pos;
+    u64 scrub_passes;
+    // Set while a pass is under way, cleared when it completes.
+    u64 in_progress;
+};
+
+// Blocks the metadata device must have at least.
+static inline sector_t ent_meta_dev_blocks(const struct entanglement_device *ent_dev) {
+    return ent_dev->metadata_base + ent_dev->metadata_size;
+}
+
+int ent_checkpoint_store(struct entanglement_device *ent_dev, const struct ent_scrub_checkpoint *checkpoint);
+int ent_checkpoint_load(struct entanglement_device *ent_dev, struct ent_scrub_checkpoint *checkpoint);
+
+// Default capacity of the chain block cache, in 4KB pages (4MB, whatever the unit). It can be changed at runtime with the cache_size
+// message, which gives it in units.
+#define ENT_CACHE_DEFAULT_PAGES 1024
+
+void ent_cache_insert(struct entanglement_device *ent_dev, u64 chain_pos, const u8 *block);
+bool ent_cache_read(struct entanglement_device *ent_dev, u64 chain_pos, struct page *page);
+unsigned long ent_cache_shrink(struct ent_cache *cache, unsigned long nr);
+void ent_cache_resize(struct ent_cache *cache, uint capacity);
+
+int ent_chain_record(struct entanglement_device *ent_dev, u64 chain_pos, sector_t *sector, uint *checksum);
+int ent_chain_record_raw(struct entanglement_device *ent_dev, u64 chain_pos, sector_t *record, uint *checksum);
+void ent_chain_set_window(struct entanglement_device *ent_dev, uint window);
+
+int ent_core_init(struct entanglement_device *ent_dev, uint dev_size, uint queue_depth);
+void ent_core_exit(struct entanglement_device *ent_dev);
+void ent_core_handover(struct entanglement_device *to, struct entanglement_device *from);
+
+bool ent_chain_append_would_block(struct entanglement_device *ent_dev);
+int ent_chain_append(struct entanglement_device *ent_dev, const u8 *data, sector_t data_sector, u8 *parity,
+                     bool timed, struct ent_append_info *info);
+int flush_metadata(struct entanglement_device *ent_dev, enum BufferType type);
+int write_metadata_buffers(struct entanglement_device *ent_dev);
+uint ent_metadata_decode(const u8 *sector_block, const u8 *checksum_block, uint checksum_offset, sector_t *sectors, uint *checksums);
+int load_entanglement_and_checksums(struct entanglement_device *ent_dev);
+int store_entanglement_and_checksums(struct entanglement_device *ent_dev);
+
+extern const char * const ent_inject_pattern_names[ENT_INJECT_NR];
+int ent_inject_pattern_parse(const char *name);
+u64 ent_inject_select(const struct ent_inject_spec *spec, u64 chain_length, unsigned long *selected);
+int corrupt_blocks(struct entanglement_device *ent_dev, const struct ent_inject_spec *spec, u64 *injected);
+int scrub_range(struct entanglement_device *ent_dev, sector_t start, sector_t end, u64 *checked, u64 *corrupted);
+void ent_plan_repair(unsigned long *corrupted, const unsigned long *dead, const unsigned long *anchors, u64 chain_length, 
+                     struct ent_repair_step *steps, u64 *nr_steps);
+int ent_repair_mark(struct entanglement_device *ent_dev, u64 chain_length, unsigned long *corrupted, unsigned long *dead,
+                    unsigned long *anchors);
+int repair_corrupted_blocks(struct entanglement_device *ent_dev);
+void ent_rebuild_init(struct entanglement_device *ent_dev, struct ent_rebuild *rebuild, sector_t start, sector_t end);
+int ent_rebuild_step(struct entanglement_device *ent_dev, struct ent_rebuild *rebuild);
+int check_corruption(struct entanglement_device *ent_dev);
+
+/*
+    The repair, the rebuild and fault injection work on chain positions, so they are refused (-EBUSY) while a compaction is under way 
+    or has left a gap in the chain: the compaction has to be resumed and finished first.
+*/
+static inline bool ent_chain_compacting(const struct entanglement_device *ent_dev) {
+    return ent_dev->compact || ent_dev->gap_end > ent_dev->gap_start;
+}
+
+/*
+    Whether a compaction should start on its own: the chain has filled compact_fill percent of the room the last compaction left it,
+    or half as much when the device is idle. The chain has room for one entry per record of the metadata region.
+*/
+static inline bool ent_compact_due(const struct entanglement_device *ent_dev, bool idle) {
+    u64 capacity = (u64)ent_dev->nr_segment_slots * ENT_SECTORS_PER_BLOCK;
+    u64 base = min(ent_dev->compact_base, capacity);
+    u64 fill = div_u64((capacity - base) * ent_dev->tuning[ENT_TUNE_COMPACT_FILL], idle ? 200 : 100);
+
+    return !ent_chain_compacting(ent_dev) && ent_dev->chain_length > base && ent_dev->chain_length >= base + fill;
+}
+
+int ent_compact_init(struct entanglement_device *ent_dev);
+int ent_compact_step(struct entanglement_device *ent_dev, uint nr, bool *done);
+void ent_compact_exit(struct entanglement_device *ent_dev);
+
+#endif
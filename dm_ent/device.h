@@ -1,16 +1,235 @@
 #ifndef _ENT_DEVICE_H_
 #define _ENT_DEVICE_H_
 
-#include <linux/fs.h>
-#include <linux/list.h>
-#include <linux/blkdev.h>
+#include "compat.h"
+
+#include "stats.h"
+
+enum ent_scrub_state {
+    ENT_SCRUB_IDLE,
+    ENT_SCRUB_RUNNING,
+    ENT_SCRUB_PAUSED,
+    // Stopped by a suspend of the device, and started again by its resume.
+    ENT_SCRUB_SUSPENDED
+};
+
+/*
+    Fault injection patterns, selecting which blocks of the chain get corrupted (see corrupt_blocks()).
+        uniform     every block with the given probability
+        burst       runs of burst_length consecutive chain positions, covering the given percentage of the chain
+        data        data blocks only
+        parity      parity blocks only
+        pair        a data block together with its parity, which the repair cannot always recover from (type B/C failures)
+*/
+enum ent_inject_pattern {
+    ENT_INJECT_UNIFORM,
+    ENT_INJECT_BURST,
+    ENT_INJECT_DATA,
+    ENT_INJECT_PARITY,
+    ENT_INJECT_PAIR,
+    ENT_INJECT_NR
+};
+
+// The same spec and seed always corrupt the same blocks of the same chain, and in the same way.
+struct ent_inject_spec {
+    enum ent_inject_pattern pattern;
+    uint percent;
+    uint burst_length;
+    u64 seed;
+};
+
+/*
+    Progress of a streaming rebuild (see ent_rebuild_step()): the chain positions [pos, end_pos) are walked in order, and the data blocks
+    whose sector is in [start, end) are rebuilt from their parities.
+*/
+struct ent_rebuild {
+    sector_t start;
+    sector_t end;
+    u64 pos;
+    u64 end_pos;
+    // The parity preceding pos (the running XOR), when parity_valid is set. Otherwise it is read again from the device.
+    u8 *parity;
+    bool parity_valid;
+    // Data blocks rewritten, and data blocks of the range that could not be rebuilt.
+    u64 rebuilt;
+    u64 failed;
+};
+
+/*
+    Progress of a chain compaction (see ent_compact_step()), which moves the live entries of the chain down over the dead ones (older
+    versions of sectors written again later) and recomputes their parities. The compacted chain is [0, dst), the positions [dst, src) 
+    hold no block anymore (see gap_start in struct entanglement_device), and [src, chain_length) is still to be walked. The walk goes in
+    rounds: a round covers the chain as it was when the round started, up to round_end, and the next one the blocks appended meanwhile.
+*/
+struct ent_compact {
+    u64 src;
+    u64 dst;
+    u64 round_start;
+    u64 round_end;
+    // Data entries of the round that are the last one of their sector in it, by (position - round_start) / 2.
+    unsigned long *live;
+    // Sectors written since the round started (see ent_chain_append()), whose entries in the round are dead too.
+    unsigned long *written;
+    // The parity at dst - 1 in the compacted chain (the running XOR), when parity_valid is set. Otherwise it is read again from the device,
+    // and the last anchor of the compacted chain (anchors are placed again along it) is looked up again.
+    u8 *parity;
+    bool parity_valid;
+    u64 anchor;
+    // The parity that preceded src in the chain before it was compacted, to repair a corrupted data block from, when old_parity_valid is set.
+    u8 *old_parity;
+    bool old_parity_valid;
+    // Chain positions moved and reclaimed, and data blocks found corrupted on the way that were repaired, or could not be.
+    u64 moved;
+    u64 reclaimed;
+    u64 repaired;
+    u64 failed;
+};
+
+/*
+    State of the maintenance operations (scrub, repair, rebuild, metadata flush, fault injection) that are triggered at runtime 
+    through target messages. They run asynchronously on an ordered workqueue, so they never run concurrently with each other.
+*/
+struct ent_maintenance {
+
+    struct workqueue_struct *wq;
+    struct work_struct scrub_work;
+    struct work_struct repair_work;
+    struct work_struct flush_work;
+    struct work_struct inject_work;
+    struct work_struct rebuild_work;
+    struct work_struct compact_work;
+    // Checks every ENT_COMPACT_IDLE_MS whether the device is idle, to compact the chain meanwhile (see ent_compact_idle_work()).
+    struct delayed_work idle_work;
+    u64 idle_chain_length;
+
+    // Protects the fields below, which are also read by the status callback.
+    spinlock_t lock;
+
+    // The scrub walks the device in batches, so it can be paused between two of them. 
+    enum ent_scrub_state scrub_state;
+    sector_t scrub_pos;
+    u64 scrub_checked;
+    u64 scrub_corrupted;
+    u64 scrub_passes;
+
+    // Outcome of the last repair: blocks repaired, and corrupted blocks left (irrecoverable).
+    u64 last_repaired;
+    u64 last_irrecoverable;
+
+    struct ent_inject_spec inject;
+    u64 last_injected;
+
+    // The rebuild walks the chain in batches too. rebuild_restart asks its next batch to start over on the range of rebuild.
+    enum ent_scrub_state rebuild_state;
+    struct ent_rebuild rebuild;
+    bool rebuild_restart;
+
+    // The compaction walks the chain in batches too. Its progress is copied from the one of the device after every batch.
+    enum ent_scrub_state compact_state;
+    u64 compact_pos;
+    u64 compact_end;
+    u64 compact_moved;
+    u64 compact_reclaimed;
+    u64 compact_repaired;
+    u64 compact_failed;
+
+    // Last error returned by a maintenance operation, 0 if none.
+    int last_error;
+
+    // Set from the postsuspend to the resume of the device: no operation is queued meanwhile.
+    bool suspended;
+
+    // Task running the scrub, repair, rebuild or fault injection under way, whose I/O takes the priority below (kernel only, 
+    // see ent_bio_set_origin() in target.c). Idle class by default, so that they only use the device when nothing else does.
+    struct task_struct *task;
+    unsigned short ioprio;
+};
+
+/*
+    I/O tuning of a device. The constructor derives it from the queue limits of the underlying device (see ent_tune() in target.c),
+    and every value can be overridden with a <name>=<value> constructor argument.
+*/
+enum ent_tunable {
+    // Writes in flight the page pool and the bioset are sized for.
+    ENT_TUNE_QUEUE_DEPTH,
+    // Blocks read or written at once by the scrub, fault injection and the relaxed parity stage (at most ENT_IO_BATCH).
+    ENT_TUNE_IO_BATCH,
+    // Blocks verified by one scrub work item, and chain entries walked by one compaction work item. Both can be paused between two of them.
+    ENT_TUNE_SCRUB_BATCH,
+    // Units the scrub reads per second at most, so that it leaves the device to the writes.
+    ENT_TUNE_SCRUB_RATE,
+    // Bounds of the parity lag of relaxed durability, when the durability message does not give them.
+    ENT_TUNE_LAG_BLOCKS,
+    ENT_TUNE_LAG_MS,
+    // Data blocks between two anchors of the chain (see ENT_ANCHOR_FLAG), 0 for none. Not derived: only set by an override.
+    ENT_TUNE_ANCHOR_INTERVAL,
+    // Percentage of the room left in the chain by the last compaction that fills before the next one starts (see ent_compact_due()).
+    ENT_TUNE_COMPACT_FILL,
+    ENT_TUNE_NR
+};
+
+/*
+    Cache of the most recently written (or repaired) chain blocks, keyed by chain position, so that the repair does not have to read
+    back blocks that were just written. Entries are hashed on their position and kept on an LRU list; at capacity, the least recently
+    used entry is recycled. The shrinker of the target can take pages back under memory pressure (see ent_cache_shrink()).
+*/
+#define ENT_CACHE_BUCKETS 1024
+
+struct ent_cache {
+    // Protects the fields below. Taken from the write path and by the shrinker, so it is never held across I/O.
+    spinlock_t lock;
+    // In entries, of one unit each (pages of the given order).
+    uint capacity;
+    uint nr_pages;
+    uint order;
+    // Most recently used entry first.
+    struct list_head lru;
+    struct list_head buckets[ENT_CACHE_BUCKETS];
+};
+
+/*
+    Relaxed durability, an opt-in mode set with the durability message. Writes complete as soon as their data is on disk: they are
+    entangled, and their parities written, by a background stage afterwards. The stage may lag behind by at most max_blocks writes
+    and max_ms milliseconds, beyond which writers wait for it; flushes wait for it to catch up entirely.
+*/
+struct ent_parity_lag {
+    struct workqueue_struct *wq;
+    struct work_struct work;
+
+    // Held for reading by every write from the choice of its path until it is entangled or queued, and for writing to switch modes.
+    struct rw_semaphore mode_sem;
+
+    // Protects the fields below, which are also read by the status callback.
+    spinlock_t lock;
+    bool relaxed;
+    uint max_blocks;
+    uint max_ms;
+    // Writes whose parity is not on disk yet, oldest first (struct ent_lag_entry, in target.c), and their number.
+    struct list_head pending;
+    uint nr_pending;
+    uint peak_blocks;
+
+    // Writers beyond the bounds and flushes wait here for the stage.
+    wait_queue_head_t wait;
+};
+
+// Slots counting the unit writes in flight (see struct entanglement_device).
+#define ENT_UNIT_WRITE_SLOTS 64
 
 struct entanglement_device {
     
     // Underlying block device. 
     struct dm_dev *dev;
 
-    // Size of device in 4KB blocks.
+    // Optional separate device holding the metadata (sector/checksum records and the scrub checkpoint). NULL when the metadata
+    // lives on the underlying device, which then has a metadata region in its middle.
+    struct dm_dev *meta_dev;
+
+    // Entanglement unit, in 4KB blocks (1, 4, 16 or 64), set by the caller before ent_core_init(). The chain, the checksums and the
+    // parities work on whole units: every chain record, checksum and parity write covers a unit. 0 stands for 1.
+    uint unit_blocks;
+
+    // Size of device in units.
     int dev_size;
 
     // These numbers correspond to the number of 4KB blocks that are needed to store the metadata at the beginning of the disk. 
@@ -18,14 +237,23 @@ struct entanglement_device {
     uint metadata_sector_size;
     uint metadata_checksum_size;
     
+    // End of the data region (in units), where the metadata region starts when it is on the underlying device.
     sector_t metadata_start_sector;
+    // First block of the sector records, on the device that holds the metadata (in 4KB blocks, like everything about the metadata).
+    sector_t metadata_base;
 
-    // Number used to move parity blocks to the appropriate sector in the other half of the disk. 
+    // Number used to move parity blocks to the appropriate sector (in units) in the other half of the disk. 
     uint write_sector_scale;
     
-    // The entanglement represented as a list of struct entangled_block, and its mutex. 
+    // The entanglement, in segments (see struct ent_chain_segment), and its mutex. The table has a slot for every segment the metadata
+    // region can hold, NULL when the segment is not in memory; resident segments are also on an LRU list, most recently used first.
     struct mutex entanglement_lock;
-    struct list_head entanglement;
+    struct ent_chain_segment **segments;
+    uint nr_segment_slots;
+    uint nr_resident_segments;
+    struct list_head segment_lru;
+    // Maximum number of resident segments, 0 to keep the whole chain in memory. Set with the chain_window message.
+    uint chain_window;
 
     // Bitmap of corrupted blocks, used in data corruption check/repair. 
     struct mutex corrupted_blocks_lock;
@@ -48,6 +276,73 @@ struct entanglement_device {
     int sector_buffer_size; 
     int checksum_buffer_size;
 
+    // Number of blocks (data and parity) currently in the entanglement.
+    u64 chain_length;
+
+    // Chain compaction under way (see struct ent_compact), NULL if none. Set and cleared with metadata_buffers_lock held.
+    struct ent_compact *compact;
+    // Positions [gap_start, gap_end) of the chain hold no block: a compaction is under way, or was interrupted and can be resumed. 
+    // Their records are void (ENT_VOID_SECTOR) in the metadata log, so that the gap is found again by load_entanglement_and_checksums().
+    u64 gap_start;
+    u64 gap_end;
+    // Length of the chain left by the last compaction (0 before the first one), from which the next one is due.
+    u64 compact_base;
+    // Chain position of the last anchor (0, the head, if none), from which the next one is placed, and the number of anchors.
+    u64 last_anchor;
+    u64 nr_anchors;
+
+    // Constructor arguments, kept to report the table line.
+    int redundancy_flag;
+    int init_flag;
+    uint corrupt_chance;
+
+    // Pool of pages of this device (see ent_page_pool_size()), and its usage.
+    uint queue_depth;
+    uint page_pool_size;
+    mempool_t *page_pool;
+    atomic_t pages_in_use;
+    int pages_peak;
+
+    // Effective tuning (ENT_TUNE_QUEUE_DEPTH is queue_depth), the values given in the table (0 when derived), and whether the 
+    // underlying device is rotational.
+    uint tuning[ENT_TUNE_NR];
+    uint tuning_overrides[ENT_TUNE_NR];
+    bool rotational;
+
+    // Recent chain blocks, and the shrinker that gives their memory back (kernel only).
+    struct ent_cache cache;
+    struct shrinker *cache_shrinker;
+
+    // Bios of this device: clones of the incoming bios, parities and the core's block I/O. Unused in userspace.
+    uint bioset_size;
+    struct bio_set bioset;
+
+    // Unit writes in flight, counted in slots hashed on the unit (kernel only, see ent_unit_writes() in target.c). A write that covers
+    // only part of its unit reads the rest of it back, once no write of the same slot is in flight anymore.
+    atomic_t unit_writes[ENT_UNIT_WRITE_SLOTS];
+    wait_queue_head_t unit_wait;
+    // Writes accepted and not completed yet (kernel only): maintenance waits on unit_wait for those appended before it to be on disk,
+    // so that it reads their final contents (see ent_maintenance_lock() in target.c).
+    atomic_t writes_in_flight;
+
+    // Write being entangled by the task holding the metadata buffers lock (kernel only, see ent_bio_set_origin() in target.c): the 
+    // metadata and read-modify-write I/O of its append is charged to its cgroup, with its priority.
+    struct task_struct *append_task;
+    struct bio *append_bio;
+
+    // Per-CPU counters and latency histograms, reported by the status callback.
+    struct ent_stats __percpu *stats;
+
+    struct ent_maintenance maintenance;
+    struct ent_parity_lag lag;
+
+    // Live devices, for the handover of the chain on table reloads (kernel only, see entanglement_tgt_preresume()).
+    struct list_head dev_node;
+    // The chain is to be taken over from the table this one replaces, and was not loaded by the constructor.
+    bool handover_pending;
+    // This device holds the chain, and stores its metadata when it goes away. Cleared once the chain is handed over.
+    bool owns_chain;
+
 };
 
 
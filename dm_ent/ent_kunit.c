@@ -0,0 +1,685 @@
+/*
+    KUnit tests of the entanglement core, built into the module with CONFIG_ENT_KUNIT=y (make kunit).
+    They need no device: the parity, checksum, metadata encoding and repair planning are checked against simple reference implementations,
+    and the time per block of every kernel is reported, as a guard for performance work on these paths.
+    The suite runs when the module is loaded on a kernel with CONFIG_KUNIT (e.g. under UML or QEMU), see dmesg or debugfs/kunit/.
+*/
+
+#include <kunit/test.h>
+
+#include "core.h"
+
+#define ENT_TEST_SEED 0x5EEDULL
+#define ENT_TEST_BENCH_BLOCKS 1024
+
+// Deterministic generator, so that failures can be reproduced.
+static u64 ent_test_rand(u64 *state) {
+
+    u64 x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void ent_test_fill(u8 *buf, size_t len, u64 *state) {
+
+    for (size_t i = 0 ; i < len ; i++) {
+        buf[i] = ent_test_rand(state);
+    }
+}
+
+/*****************************************************
+ *              REFERENCE IMPLEMENTATIONS            *
+ *****************************************************/
+
+static u32 ent_ref_crc_table[256];
+
+// Table driven CRC-32 (IEEE 802.3, reflected), a byte at a time: the reference for the sliced crc32b().
+static u32 ent_ref_crc32(const u8 *buf, size_t len) {
+
+    u32 crc = 0xFFFFFFFF;
+
+    if (!ent_ref_crc_table[1]) {
+        for (u32 i = 0 ; i < 256 ; i++) {
+            u32 c = i;
+            for (int j = 0 ; j < 8 ; j++) {
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            }
+            ent_ref_crc_table[i] = c;
+        }
+    }
+
+    for (size_t i = 0 ; i < len ; i++) {
+        crc = ent_ref_crc_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void ent_ref_xor(u8 *dst, const u8 *a, const u8 *b) {
+
+    for (int i = 0 ; i < ENT_BLOCK_SIZE ; i++) {
+        dst[i] = a[i] ^ b[i];
+    }
+}
+
+/*
+    Which chain positions can be repaired, computed from the parity equations p_k ^ d_k ^ p_(k-1) = 0 (p_(-1) = 0, and likewise at
+    an anchor) instead of from the repair rules: an equation with a single unknown block gives that block, until no equation does.
+*/
+static void ent_ref_recoverable(unsigned long *unknown, const unsigned long *anchors, u64 chain_length) {
+
+    bool progress = true;
+
+    while (progress) {
+        progress = false;
+        for (u64 k = 0 ; 2 * k + 1 < chain_length ; k++) {
+            u64 members[3] = { 2 * k + 1, 2 * k, 2 * k - 1 };
+            int nr_members = (k && !(anchors && test_bit(2 * k, anchors))) ? 3 : 2;
+            int nr_unknown = 0;
+            u64 last_unknown = 0;
+
+            for (int m = 0 ; m < nr_members ; m++) {
+                if (test_bit(members[m], unknown)) {
+                    nr_unknown++;
+                    last_unknown = members[m];
+                }
+            }
+            if (nr_unknown == 1) {
+                clear_bit(last_unknown, unknown);
+                progress = true;
+            }
+        }
+    }
+}
+
+/*****************************************************
+ *                       TESTS                       *
+ *****************************************************/
+
+static void ent_test_crc32b(struct kunit *test) {
+
+    u64 state = ENT_TEST_SEED;
+    u8 *block = kunit_kzalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    uint before;
+
+    KUNIT_ASSERT_NOT_NULL(test, block);
+
+    // The standard check value of CRC-32.
+    KUNIT_EXPECT_EQ(test, crc32b((const u8 *)"123456789", 9), 0xCBF43926U);
+
+    // A block full of zeros is not an empty message.
+    KUNIT_EXPECT_EQ(test, crc32b(block, ENT_BLOCK_SIZE), ent_ref_crc32(block, ENT_BLOCK_SIZE));
+    KUNIT_EXPECT_NE(test, crc32b(block, ENT_BLOCK_SIZE), 0U);
+
+    for (int i = 0 ; i < 16 ; i++) {
+        ent_test_fill(block, ENT_BLOCK_SIZE, &state);
+        block[ent_test_rand(&state) % ENT_BLOCK_SIZE] = 0;
+        KUNIT_EXPECT_EQ(test, crc32b(block, ENT_BLOCK_SIZE), ent_ref_crc32(block, ENT_BLOCK_SIZE));
+    }
+
+    // Lengths and offsets that are not multiples of the 8 bytes of a slice.
+    for (size_t len = 0 ; len < 24 ; len++) {
+        KUNIT_EXPECT_EQ(test, crc32b(block + 3, len), ent_ref_crc32(block + 3, len));
+    }
+
+    // Bytes after a zero byte are covered.
+    block[0] = 0;
+    before = crc32b(block, ENT_BLOCK_SIZE);
+    block[ENT_BLOCK_SIZE - 1] ^= 1;
+    KUNIT_EXPECT_NE(test, crc32b(block, ENT_BLOCK_SIZE), before);
+}
+
+static void ent_test_xor_block(struct kunit *test) {
+
+    u64 state = ENT_TEST_SEED;
+    u8 *a = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *b = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *out = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *ref = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, a);
+    KUNIT_ASSERT_NOT_NULL(test, b);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    KUNIT_ASSERT_NOT_NULL(test, ref);
+
+    for (int i = 0 ; i < 16 ; i++) {
+        ent_test_fill(a, ENT_BLOCK_SIZE, &state);
+        ent_test_fill(b, ENT_BLOCK_SIZE, &state);
+        ent_xor_block(out, a, b);
+        ent_ref_xor(ref, a, b);
+        KUNIT_EXPECT_MEMEQ(test, out, ref, ENT_BLOCK_SIZE);
+    }
+
+    // In place (dst == a).
+    ent_xor_block(a, a, b);
+    KUNIT_EXPECT_MEMEQ(test, a, ref, ENT_BLOCK_SIZE);
+}
+
+static void ent_test_metadata_decode(struct kunit *test) {
+
+    u8 *sector_block = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *checksum_block = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    sector_t *sectors = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(sector_t), GFP_KERNEL);
+    uint *checksums = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(uint), GFP_KERNEL);
+    uint nr;
+
+    KUNIT_ASSERT_NOT_NULL(test, sector_block);
+    KUNIT_ASSERT_NOT_NULL(test, checksum_block);
+    KUNIT_ASSERT_NOT_NULL(test, sectors);
+    KUNIT_ASSERT_NOT_NULL(test, checksums);
+
+    // Full block, whose checksums are in the second half of the checksum block.
+    memset(checksum_block, 0xFF, ENT_BLOCK_SIZE);
+    for (uint j = 0 ; j < ENT_SECTORS_PER_BLOCK ; j++) {
+        ent_metadata_put_sector(sector_block, j, 1000 + j);
+        ent_metadata_put_checksum(checksum_block, ENT_SECTORS_PER_BLOCK + j, 0xC0DE0000 + j);
+    }
+
+    nr = ent_metadata_decode(sector_block, checksum_block, ENT_SECTORS_PER_BLOCK, sectors, checksums);
+    KUNIT_EXPECT_EQ(test, nr, (uint)ENT_SECTORS_PER_BLOCK);
+    for (uint j = 0 ; j < nr ; j++) {
+        KUNIT_EXPECT_EQ(test, sectors[j], (sector_t)(1000 + j));
+        KUNIT_EXPECT_EQ(test, checksums[j], 0xC0DE0000 + j);
+    }
+
+    // Checksums above 255 must be read whole, not byte by byte.
+    KUNIT_EXPECT_EQ(test, ent_metadata_get_checksum(checksum_block, ENT_SECTORS_PER_BLOCK + 7), 0xC0DE0007U);
+    KUNIT_EXPECT_EQ(test, ent_metadata_get_sector(sector_block, 300), (sector_t)1300);
+
+    // Partially filled block: decoding stops at the first unused entry.
+    memset(sector_block + 37 * sizeof(sector_t), 0xFF, ENT_BLOCK_SIZE - 37 * sizeof(sector_t));
+    nr = ent_metadata_decode(sector_block, checksum_block, ENT_SECTORS_PER_BLOCK, sectors, checksums);
+    KUNIT_EXPECT_EQ(test, nr, 37U);
+
+    memset(sector_block, 0xFF, ENT_BLOCK_SIZE);
+    KUNIT_EXPECT_EQ(test, ent_metadata_decode(sector_block, checksum_block, 0, sectors, checksums), 0U);
+}
+
+static void ent_test_device_exit(void *ent_dev) {
+
+    ent_core_exit(ent_dev);
+}
+
+/*
+    Appends blocks to a device without I/O (the metadata buffers never fill up), and checks the parity chain, the checksums and
+    the buffered metadata against a reference computed here.
+*/
+static void ent_test_chain_append(struct kunit *test) {
+
+    const int nr_blocks = 100;
+    u64 state = ENT_TEST_SEED;
+    struct entanglement_device *ent_dev = kunit_kzalloc(test, sizeof(*ent_dev), GFP_KERNEL);
+    u8 *data = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *parity = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *ref_parity = kunit_kzalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    sector_t *sectors = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(sector_t), GFP_KERNEL);
+    uint *checksums = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(uint), GFP_KERNEL);
+    uint *ref_checksums = kunit_kmalloc_array(test, 2 * nr_blocks, sizeof(uint), GFP_KERNEL);
+    struct ent_append_info info;
+    u64 pos;
+    uint nr;
+
+    KUNIT_ASSERT_NOT_NULL(test, ent_dev);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    KUNIT_ASSERT_NOT_NULL(test, parity);
+    KUNIT_ASSERT_NOT_NULL(test, ref_parity);
+    KUNIT_ASSERT_NOT_NULL(test, sectors);
+    KUNIT_ASSERT_NOT_NULL(test, checksums);
+    KUNIT_ASSERT_NOT_NULL(test, ref_checksums);
+
+    KUNIT_ASSERT_EQ(test, ent_core_init(ent_dev, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, ent_dev), 0);
+
+    for (int k = 0 ; k < nr_blocks ; k++) {
+        ent_test_fill(data, ENT_BLOCK_SIZE, &state);
+        // Some zero bytes, which the checksum must not stop at.
+        data[k] = 0;
+
+        // Only the first block starts a chain segment, and the metadata buffers never fill up.
+        KUNIT_EXPECT_EQ(test, ent_chain_append_would_block(ent_dev), k == 0);
+        KUNIT_ASSERT_EQ(test, ent_chain_append(ent_dev, data, k, parity, false, &info), 0);
+
+        ent_ref_xor(ref_parity, data, ref_parity);
+        KUNIT_EXPECT_MEMEQ(test, parity, ref_parity, ENT_BLOCK_SIZE);
+        KUNIT_EXPECT_MEMEQ(test, (u8 *)ent_dev->last_entangled_block, ref_parity, ENT_BLOCK_SIZE);
+        KUNIT_EXPECT_EQ(test, info.parity_sector, (sector_t)k + ent_dev->write_sector_scale);
+        KUNIT_EXPECT_EQ(test, info.chain_pos, (u64)2 * k);
+
+        ref_checksums[2 * k] = ent_ref_crc32(data, ENT_BLOCK_SIZE);
+        ref_checksums[2 * k + 1] = ent_ref_crc32(ref_parity, ENT_BLOCK_SIZE);
+        KUNIT_EXPECT_EQ(test, ent_dev->sector_checksum_map[k], ref_checksums[2 * k]);
+        KUNIT_EXPECT_EQ(test, ent_dev->sector_checksum_map[info.parity_sector], ref_checksums[2 * k + 1]);
+    }
+
+    KUNIT_EXPECT_EQ(test, ent_dev->chain_length, (u64)2 * nr_blocks);
+
+    for (pos = 0 ; pos < ent_dev->chain_length ; pos++) {
+        sector_t expected = (pos % 2) ? pos / 2 + ent_dev->write_sector_scale : pos / 2;
+        sector_t sector;
+        uint checksum;
+
+        KUNIT_ASSERT_EQ(test, ent_chain_record(ent_dev, pos, &sector, &checksum), 0);
+        KUNIT_EXPECT_EQ(test, sector, expected);
+        KUNIT_EXPECT_EQ(test, checksum, ref_checksums[pos]);
+    }
+
+    // The buffered metadata decodes to the chain.
+    nr = ent_metadata_decode((u8 *)ent_dev->block_sector_buffer, (u8 *)ent_dev->block_checksum_buffer, 0, sectors, checksums);
+    KUNIT_ASSERT_EQ(test, nr, (uint)(2 * nr_blocks));
+    for (uint j = 0 ; j < nr ; j++) {
+        sector_t expected = (j % 2) ? j / 2 + ent_dev->write_sector_scale : j / 2;
+
+        KUNIT_EXPECT_EQ(test, sectors[j], expected);
+        KUNIT_EXPECT_EQ(test, checksums[j], ref_checksums[j]);
+    }
+}
+
+/*
+    With an anchor interval, the chain restarts every interval data blocks: the parity of an anchor is a copy of its data, and the
+    anchor is flagged in its data record, in memory and in the buffered metadata.
+*/
+static void ent_test_chain_append_anchors(struct kunit *test) {
+
+    const int nr_blocks = 40;
+    const uint interval = 8;
+    u64 state = ENT_TEST_SEED;
+    struct entanglement_device *ent_dev = kunit_kzalloc(test, sizeof(*ent_dev), GFP_KERNEL);
+    u8 *data = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *parity = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *ref_parity = kunit_kzalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    sector_t *sectors = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(sector_t), GFP_KERNEL);
+    uint *checksums = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(uint), GFP_KERNEL);
+    struct ent_append_info info;
+    uint nr;
+
+    KUNIT_ASSERT_NOT_NULL(test, ent_dev);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    KUNIT_ASSERT_NOT_NULL(test, parity);
+    KUNIT_ASSERT_NOT_NULL(test, ref_parity);
+    KUNIT_ASSERT_NOT_NULL(test, sectors);
+    KUNIT_ASSERT_NOT_NULL(test, checksums);
+
+    KUNIT_ASSERT_EQ(test, ent_core_init(ent_dev, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, ent_dev), 0);
+    ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL] = interval;
+
+    for (int k = 0 ; k < nr_blocks ; k++) {
+        bool anchor = k && k % interval == 0;
+        sector_t sector, record;
+
+        ent_test_fill(data, ENT_BLOCK_SIZE, &state);
+        KUNIT_ASSERT_EQ(test, ent_chain_append(ent_dev, data, k, parity, false, &info), 0);
+
+        if (anchor) {
+            memset(ref_parity, 0, ENT_BLOCK_SIZE);
+        }
+        ent_ref_xor(ref_parity, data, ref_parity);
+        KUNIT_EXPECT_MEMEQ(test, parity, ref_parity, ENT_BLOCK_SIZE);
+
+        KUNIT_ASSERT_EQ(test, ent_chain_record_raw(ent_dev, info.chain_pos, &record, NULL), 0);
+        KUNIT_ASSERT_EQ(test, ent_chain_record(ent_dev, info.chain_pos, &sector, NULL), 0);
+        KUNIT_EXPECT_EQ(test, ent_record_anchor(record), anchor);
+        KUNIT_EXPECT_EQ(test, ent_record_sector(record), (sector_t)k);
+        KUNIT_EXPECT_EQ(test, sector, (sector_t)k);
+    }
+
+    KUNIT_EXPECT_EQ(test, ent_dev->nr_anchors, (u64)(nr_blocks - 1) / interval);
+    KUNIT_EXPECT_EQ(test, ent_dev->last_anchor, (u64)2 * interval * ((nr_blocks - 1) / interval));
+
+    nr = ent_metadata_decode((u8 *)ent_dev->block_sector_buffer, (u8 *)ent_dev->block_checksum_buffer, 0, sectors, checksums);
+    KUNIT_ASSERT_EQ(test, nr, (uint)(2 * nr_blocks));
+    for (uint j = 0 ; j < nr ; j += 2) {
+        KUNIT_EXPECT_EQ(test, ent_record_anchor(sectors[j]), j && j % (2 * interval) == 0);
+        KUNIT_EXPECT_EQ(test, ent_record_sector(sectors[j]), (sector_t)j / 2);
+    }
+}
+
+/*
+    Same with 64KB units: the parity of a unit is the XOR of its 4KB blocks with those of the previous parity, with one checksum per
+    unit, and the layout (data units, then parity units, then the metadata) is counted in units.
+*/
+static void ent_test_chain_append_unit(struct kunit *test) {
+
+    const int nr_units = 20;
+    const uint unit_blocks = 16;
+    const size_t unit_size = unit_blocks * ENT_BLOCK_SIZE;
+    u64 state = ENT_TEST_SEED;
+    struct entanglement_device *ent_dev = kunit_kzalloc(test, sizeof(*ent_dev), GFP_KERNEL);
+    u8 *data = kunit_kmalloc(test, unit_size, GFP_KERNEL);
+    u8 *parity = kunit_kmalloc(test, unit_size, GFP_KERNEL);
+    u8 *ref_parity = kunit_kzalloc(test, unit_size, GFP_KERNEL);
+    struct ent_append_info info;
+
+    KUNIT_ASSERT_NOT_NULL(test, ent_dev);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    KUNIT_ASSERT_NOT_NULL(test, parity);
+    KUNIT_ASSERT_NOT_NULL(test, ref_parity);
+
+    ent_dev->unit_blocks = unit_blocks;
+    KUNIT_ASSERT_EQ(test, ent_core_init(ent_dev, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, ent_dev), 0);
+
+    KUNIT_EXPECT_EQ(test, ent_unit_size(ent_dev), unit_size);
+    KUNIT_EXPECT_EQ(test, (u64)ent_dev->dev_size, (u64)(1 << 16) / unit_blocks);
+    KUNIT_EXPECT_LE(test, (u64)2 * ent_dev->write_sector_scale, (u64)ent_dev->dev_size);
+    KUNIT_EXPECT_EQ(test, (u64)ent_dev->metadata_base, (u64)ent_dev->metadata_start_sector * unit_blocks);
+
+    for (int k = 0 ; k < nr_units ; k++) {
+        ent_test_fill(data, unit_size, &state);
+        KUNIT_ASSERT_EQ(test, ent_chain_append(ent_dev, data, k, parity, false, &info), 0);
+
+        for (uint b = 0 ; b < unit_blocks ; b++) {
+            ent_ref_xor(ref_parity + b * ENT_BLOCK_SIZE, data + b * ENT_BLOCK_SIZE, ref_parity + b * ENT_BLOCK_SIZE);
+        }
+        KUNIT_EXPECT_MEMEQ(test, parity, ref_parity, unit_size);
+        KUNIT_EXPECT_EQ(test, info.parity_sector, (sector_t)k + ent_dev->write_sector_scale);
+        KUNIT_EXPECT_EQ(test, ent_dev->sector_checksum_map[k], ent_ref_crc32(data, unit_size));
+        KUNIT_EXPECT_EQ(test, ent_dev->sector_checksum_map[info.parity_sector], ent_ref_crc32(ref_parity, unit_size));
+    }
+
+    KUNIT_EXPECT_EQ(test, ent_dev->chain_length, (u64)2 * nr_units);
+}
+
+/*
+    With 256KB units, a device of 128MB leaves less than a block of chain records, and is turned away; one of 256MB is not.
+*/
+static void ent_test_core_init_geometry(struct kunit *test) {
+
+    struct entanglement_device *ent_dev = kunit_kzalloc(test, sizeof(*ent_dev), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, ent_dev);
+
+    ent_dev->unit_blocks = 64;
+    KUNIT_EXPECT_EQ(test, ent_core_init(ent_dev, 1 << 15, 0), -EINVAL);
+
+    KUNIT_ASSERT_EQ(test, ent_core_init(ent_dev, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, ent_dev), 0);
+    KUNIT_EXPECT_GT(test, ent_dev->metadata_sector_size, 0U);
+    KUNIT_EXPECT_GT(test, ent_dev->metadata_checksum_size, 0U);
+}
+
+/*
+    Hands the chain of a device over to a second one with the same layout, as a table reload does, and checks that the second one
+    holds the chain and carries on appending to it, while the first one is left empty.
+*/
+static void ent_test_chain_handover(struct kunit *test) {
+
+    const int nr_blocks = 50;
+    u64 state = ENT_TEST_SEED;
+    struct entanglement_device *from = kunit_kzalloc(test, sizeof(*from), GFP_KERNEL);
+    struct entanglement_device *to = kunit_kzalloc(test, sizeof(*to), GFP_KERNEL);
+    u8 *data = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *parity = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *ref_parity = kunit_kzalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    struct ent_append_info info;
+    sector_t sector;
+    uint checksum;
+
+    KUNIT_ASSERT_NOT_NULL(test, from);
+    KUNIT_ASSERT_NOT_NULL(test, to);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    KUNIT_ASSERT_NOT_NULL(test, parity);
+    KUNIT_ASSERT_NOT_NULL(test, ref_parity);
+
+    KUNIT_ASSERT_EQ(test, ent_core_init(from, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, from), 0);
+    KUNIT_ASSERT_EQ(test, ent_core_init(to, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, to), 0);
+
+    for (int k = 0 ; k < nr_blocks ; k++) {
+        ent_test_fill(data, ENT_BLOCK_SIZE, &state);
+        KUNIT_ASSERT_EQ(test, ent_chain_append(from, data, k, parity, false, &info), 0);
+        ent_ref_xor(ref_parity, data, ref_parity);
+    }
+    bitmap_set(from->corrupted_blocks, 7, 1);
+    ent_cache_resize(&from->cache, 3);
+
+    ent_core_handover(to, from);
+
+    KUNIT_EXPECT_EQ(test, from->chain_length, 0ULL);
+    KUNIT_EXPECT_EQ(test, from->nr_resident_segments, 0U);
+    KUNIT_EXPECT_EQ(test, to->chain_length, (u64)2 * nr_blocks);
+    KUNIT_EXPECT_EQ(test, to->sector_buffer_size, (int)(2 * nr_blocks * sizeof(sector_t)));
+    KUNIT_EXPECT_TRUE(test, test_bit(7, to->corrupted_blocks));
+    KUNIT_EXPECT_FALSE(test, test_bit(7, from->corrupted_blocks));
+    KUNIT_EXPECT_MEMEQ(test, (u8 *)to->last_entangled_block, ref_parity, ENT_BLOCK_SIZE);
+    KUNIT_EXPECT_EQ(test, to->cache.capacity, 3U);
+
+    KUNIT_ASSERT_EQ(test, ent_chain_record(to, 2 * nr_blocks - 1, &sector, &checksum), 0);
+    KUNIT_EXPECT_EQ(test, sector, (sector_t)nr_blocks - 1 + to->write_sector_scale);
+    KUNIT_EXPECT_EQ(test, checksum, to->sector_checksum_map[sector]);
+
+    // The chain goes on from the tail it was handed.
+    ent_test_fill(data, ENT_BLOCK_SIZE, &state);
+    KUNIT_ASSERT_EQ(test, ent_chain_append(to, data, nr_blocks, parity, false, &info), 0);
+    ent_ref_xor(ref_parity, data, ref_parity);
+    KUNIT_EXPECT_MEMEQ(test, parity, ref_parity, ENT_BLOCK_SIZE);
+    KUNIT_EXPECT_EQ(test, info.chain_pos, (u64)2 * nr_blocks);
+}
+
+/*
+    Random corruption patterns on short chains, including adjacent and long runs of corrupted blocks, with and without anchors. The
+    planner must repair exactly the blocks the parity equations determine, and executing its steps on the chain must give back the
+    original blocks.
+*/
+static void ent_test_repair_plan(struct kunit *test) {
+
+    const u64 max_length = 128;
+    u64 state = ENT_TEST_SEED;
+    unsigned long *corrupted = kunit_kzalloc(test, BITS_TO_LONGS(max_length) * sizeof(long), GFP_KERNEL);
+    unsigned long *unknown = kunit_kzalloc(test, BITS_TO_LONGS(max_length) * sizeof(long), GFP_KERNEL);
+    unsigned long *anchors = kunit_kzalloc(test, BITS_TO_LONGS(max_length) * sizeof(long), GFP_KERNEL);
+    struct ent_repair_step *steps = kunit_kmalloc_array(test, max_length, sizeof(*steps), GFP_KERNEL);
+    // A block is modelled by one word, which is enough to check that the steps XOR the right blocks in the right order.
+    u64 *original = kunit_kmalloc_array(test, max_length, sizeof(u64), GFP_KERNEL);
+    u64 *chain = kunit_kmalloc_array(test, max_length, sizeof(u64), GFP_KERNEL);
+
+    KUNIT_ASSERT_NOT_NULL(test, corrupted);
+    KUNIT_ASSERT_NOT_NULL(test, unknown);
+    KUNIT_ASSERT_NOT_NULL(test, anchors);
+    KUNIT_ASSERT_NOT_NULL(test, steps);
+    KUNIT_ASSERT_NOT_NULL(test, original);
+    KUNIT_ASSERT_NOT_NULL(test, chain);
+
+    for (int round = 0 ; round < 2000 ; round++) {
+        u64 chain_length = 2 * (1 + ent_test_rand(&state) % (max_length / 2));
+        uint percent = 5 + ent_test_rand(&state) % 60;
+        // Every other round, the chain restarts every interval data blocks, and the parity of an anchor is a copy of its data.
+        u64 interval = (round % 2) ? 1 + ent_test_rand(&state) % 8 : 0;
+        u64 nr_steps;
+
+        bitmap_zero(corrupted, max_length);
+        bitmap_zero(anchors, max_length);
+        for (u64 pos = 0 ; pos < chain_length ; pos++) {
+            if (interval && pos && pos % (2 * interval) == 0) {
+                set_bit(pos, anchors);
+            }
+            original[pos] = (pos % 2) ? original[pos - 1] ^ (pos > 1 && !test_bit(pos - 1, anchors) ? original[pos - 2] : 0)
+                                      : ent_test_rand(&state);
+            chain[pos] = original[pos];
+            if (ent_test_rand(&state) % 100 < percent) {
+                set_bit(pos, corrupted);
+                chain[pos] = ~0ULL;
+            }
+        }
+        bitmap_copy(unknown, corrupted, max_length);
+
+        ent_plan_repair(corrupted, NULL, interval ? anchors : NULL, chain_length, steps, &nr_steps);
+        ent_ref_recoverable(unknown, interval ? anchors : NULL, chain_length);
+
+        KUNIT_EXPECT_TRUE_MSG(test, bitmap_equal(corrupted, unknown, chain_length), "round %d, chain length %llu, interval %llu", round,
+                              chain_length, interval);
+
+        for (u64 i = 0 ; i < nr_steps ; i++) {
+            const struct ent_repair_step *step = &steps[i];
+
+            chain[step->target] = chain[step->src[0]] ^ (step->src[1] == ENT_REPAIR_COPY ? 0 : chain[step->src[1]]);
+        }
+        for (u64 pos = 0 ; pos < chain_length ; pos++) {
+            if (!test_bit(pos, corrupted)) {
+                KUNIT_EXPECT_EQ_MSG(test, chain[pos], original[pos], "round %d, position %llu", round, pos);
+            }
+        }
+    }
+}
+
+/*
+    Blocks 0-19 are written, then block 5 again: its first entry is dead, as its data and parity sectors hold the second one. With
+    blocks 5, 6 and 8 corrupted, only the live entries are to be repaired, block 6 is lost with the parity it was entangled with,
+    and no step reads a dead entry.
+*/
+static void ent_test_repair_dead(struct kunit *test) {
+
+    const int nr_blocks = 20;
+    u64 state = ENT_TEST_SEED;
+    struct entanglement_device *ent_dev = kunit_kzalloc(test, sizeof(*ent_dev), GFP_KERNEL);
+    u8 *data = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *parity = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    unsigned long *corrupted = kunit_kzalloc(test, BITS_TO_LONGS(2 * nr_blocks + 2) * sizeof(long), GFP_KERNEL);
+    unsigned long *dead = kunit_kzalloc(test, BITS_TO_LONGS(2 * nr_blocks + 2) * sizeof(long), GFP_KERNEL);
+    struct ent_repair_step *steps = kunit_kmalloc_array(test, 2 * nr_blocks + 2, sizeof(*steps), GFP_KERNEL);
+    struct ent_append_info info;
+    u64 chain_length, nr_steps;
+
+    KUNIT_ASSERT_NOT_NULL(test, ent_dev);
+    KUNIT_ASSERT_NOT_NULL(test, data);
+    KUNIT_ASSERT_NOT_NULL(test, parity);
+    KUNIT_ASSERT_NOT_NULL(test, corrupted);
+    KUNIT_ASSERT_NOT_NULL(test, dead);
+    KUNIT_ASSERT_NOT_NULL(test, steps);
+
+    KUNIT_ASSERT_EQ(test, ent_core_init(ent_dev, 1 << 16, 0), 0);
+    KUNIT_ASSERT_EQ(test, kunit_add_action_or_reset(test, ent_test_device_exit, ent_dev), 0);
+
+    for (int k = 0 ; k <= nr_blocks ; k++) {
+        ent_test_fill(data, ENT_BLOCK_SIZE, &state);
+        KUNIT_ASSERT_EQ(test, ent_chain_append(ent_dev, data, k < nr_blocks ? k : 5, parity, false, &info), 0);
+    }
+    chain_length = ent_dev->chain_length;
+
+    bitmap_set(ent_dev->corrupted_blocks, 5, 2);
+    bitmap_set(ent_dev->corrupted_blocks, 8, 1);
+    KUNIT_ASSERT_EQ(test, ent_repair_mark(ent_dev, chain_length, corrupted, dead, NULL), 0);
+
+    KUNIT_EXPECT_EQ(test, bitmap_weight(dead, chain_length), 2U);
+    KUNIT_EXPECT_TRUE(test, test_bit(10, dead) && test_bit(11, dead));
+    KUNIT_EXPECT_EQ(test, bitmap_weight(corrupted, chain_length), 3U);
+    KUNIT_EXPECT_TRUE(test, test_bit(12, corrupted) && test_bit(16, corrupted) && test_bit(2 * nr_blocks, corrupted));
+
+    ent_plan_repair(corrupted, dead, NULL, chain_length, steps, &nr_steps);
+
+    KUNIT_EXPECT_EQ(test, nr_steps, 2ULL);
+    KUNIT_EXPECT_EQ(test, bitmap_weight(corrupted, chain_length), 1U);
+    KUNIT_EXPECT_TRUE(test, test_bit(12, corrupted));
+    for (u64 i = 0 ; i < nr_steps ; i++) {
+        KUNIT_EXPECT_TRUE(test, steps[i].target == 16 || steps[i].target == 2 * nr_blocks);
+        for (int j = 0 ; j < 2 ; j++) {
+            KUNIT_EXPECT_TRUE(test, steps[i].src[j] == ENT_REPAIR_COPY || !test_bit(steps[i].src[j], dead));
+        }
+    }
+}
+
+/*
+    Time per block of each kernel, next to its reference implementation. Only reported, never checked, since it depends on the machine.
+*/
+static void ent_test_benchmark(struct kunit *test) {
+
+    u64 state = ENT_TEST_SEED;
+    u8 *a = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *b = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    u8 *out = kunit_kmalloc(test, ENT_BLOCK_SIZE, GFP_KERNEL);
+    sector_t *sectors = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(sector_t), GFP_KERNEL);
+    uint *checksums = kunit_kmalloc_array(test, ENT_SECTORS_PER_BLOCK, sizeof(uint), GFP_KERNEL);
+    const u64 chain_length = 1 << 16;
+    unsigned long *corrupted = kunit_kzalloc(test, BITS_TO_LONGS(chain_length) * sizeof(long), GFP_KERNEL);
+    struct ent_repair_step *steps = kunit_kmalloc_array(test, chain_length, sizeof(*steps), GFP_KERNEL);
+    volatile uint sink = 0;
+    u64 nr_steps, nr_corrupted, start;
+
+    KUNIT_ASSERT_NOT_NULL(test, a);
+    KUNIT_ASSERT_NOT_NULL(test, b);
+    KUNIT_ASSERT_NOT_NULL(test, out);
+    KUNIT_ASSERT_NOT_NULL(test, sectors);
+    KUNIT_ASSERT_NOT_NULL(test, checksums);
+    KUNIT_ASSERT_NOT_NULL(test, corrupted);
+    KUNIT_ASSERT_NOT_NULL(test, steps);
+
+    ent_test_fill(a, ENT_BLOCK_SIZE, &state);
+    ent_test_fill(b, ENT_BLOCK_SIZE, &state);
+    // Warm up the output buffer, so that the first kernel measured does not pay for it.
+    memset(out, 0, ENT_BLOCK_SIZE);
+
+    start = ktime_get_ns();
+    for (int i = 0 ; i < ENT_TEST_BENCH_BLOCKS ; i++) {
+        ent_xor_block(out, a, b);
+        sink += out[i];
+    }
+    kunit_info(test, "ent_xor_block: %llu ns/block\n", (ktime_get_ns() - start) / ENT_TEST_BENCH_BLOCKS);
+
+    start = ktime_get_ns();
+    for (int i = 0 ; i < ENT_TEST_BENCH_BLOCKS ; i++) {
+        ent_ref_xor(out, a, b);
+        sink += out[i];
+    }
+    kunit_info(test, "reference xor: %llu ns/block\n", (ktime_get_ns() - start) / ENT_TEST_BENCH_BLOCKS);
+
+    start = ktime_get_ns();
+    for (int i = 0 ; i < ENT_TEST_BENCH_BLOCKS ; i++) {
+        sink += crc32b(a, ENT_BLOCK_SIZE);
+    }
+    kunit_info(test, "crc32b: %llu ns/block\n", (ktime_get_ns() - start) / ENT_TEST_BENCH_BLOCKS);
+
+    start = ktime_get_ns();
+    for (int i = 0 ; i < ENT_TEST_BENCH_BLOCKS ; i++) {
+        sink += ent_ref_crc32(a, ENT_BLOCK_SIZE);
+    }
+    kunit_info(test, "reference crc32: %llu ns/block\n", (ktime_get_ns() - start) / ENT_TEST_BENCH_BLOCKS);
+
+    for (uint j = 0 ; j < ENT_SECTORS_PER_BLOCK ; j++) {
+        ent_metadata_put_sector(a, j, j);
+    }
+    start = ktime_get_ns();
+    for (int i = 0 ; i < ENT_TEST_BENCH_BLOCKS ; i++) {
+        sink += ent_metadata_decode(a, b, 0, sectors, checksums);
+    }
+    kunit_info(test, "ent_metadata_decode: %llu ns/block\n", (ktime_get_ns() - start) / ENT_TEST_BENCH_BLOCKS);
+
+    // Planning, per corrupted block, with 10% of the chain corrupted.
+    for (u64 pos = 0 ; pos < chain_length ; pos++) {
+        if (ent_test_rand(&state) % 10 == 0) {
+            set_bit(pos, corrupted);
+        }
+    }
+    nr_corrupted = bitmap_weight(corrupted, chain_length);
+    start = ktime_get_ns();
+    ent_plan_repair(corrupted, NULL, NULL, chain_length, steps, &nr_steps);
+    kunit_info(test, "ent_plan_repair: %llu ns/block (%llu corrupted, %llu planned)\n",
+               (ktime_get_ns() - start) / max_t(u64, nr_corrupted, 1), nr_corrupted, nr_steps);
+
+    KUNIT_EXPECT_LE(test, nr_steps, nr_corrupted);
+}
+
+static struct kunit_case ent_test_cases[] = {
+    KUNIT_CASE(ent_test_crc32b),
+    KUNIT_CASE(ent_test_xor_block),
+    KUNIT_CASE(ent_test_metadata_decode),
+    KUNIT_CASE(ent_test_chain_append),
+    KUNIT_CASE(ent_test_chain_append_unit),
+    KUNIT_CASE(ent_test_chain_append_anchors),
+    KUNIT_CASE(ent_test_core_init_geometry),
+    KUNIT_CASE(ent_test_chain_handover),
+    KUNIT_CASE(ent_test_repair_plan),
+    KUNIT_CASE(ent_test_repair_dead),
+    KUNIT_CASE_SLOW(ent_test_benchmark),
+    {}
+};
+
+static struct kunit_suite ent_test_suite = {
+    .name = "dm-ent",
+    .test_cases = ent_test_cases,
+};
+
+kunit_test_suite(ent_test_suite);
@@ -0,0 +1,258 @@
+/*
+    Static tracepoints of the entanglement target, under events/dm_ent/ in tracefs.
+    They cover the entry and exit of the write path, the metadata flushes, the synchronous block I/O, the corruption check and every
+    repair step. Exit events carry the duration in nanoseconds, so latency can be attributed with perf, ftrace or bpftrace.
+    Timestamps are only taken when the corresponding event is enabled, so they cost nothing otherwise.
+*/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dm_ent
+
+#if !defined(_ENT_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _ENT_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ent_write_start,
+
+    TP_PROTO(sector_t sector),
+
+    TP_ARGS(sector),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+    ),
+
+    TP_printk("sector=%llu", (unsigned long long)__entry->sector)
+);
+
+// The chain position is the one of the data block. The duration is split into the time spent waiting for the metadata lock,
+// computing the parity XOR, computing the checksums and flushing metadata.
+TRACE_EVENT(ent_write_end,
+
+    TP_PROTO(sector_t sector, u64 chain_pos, u64 lock_ns, u64 xor_ns, u64 crc_ns, u64 flush_ns, u64 duration_ns, int err),
+
+    TP_ARGS(sector, chain_pos, lock_ns, xor_ns, crc_ns, flush_ns, duration_ns, err),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(u64, chain_pos)
+        __field(u64, lock_ns)
+        __field(u64, xor_ns)
+        __field(u64, crc_ns)
+        __field(u64, flush_ns)
+        __field(u64, duration_ns)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->chain_pos = chain_pos;
+        __entry->lock_ns = lock_ns;
+        __entry->xor_ns = xor_ns;
+        __entry->crc_ns = crc_ns;
+        __entry->flush_ns = flush_ns;
+        __entry->duration_ns = duration_ns;
+        __entry->err = err;
+    ),
+
+    TP_printk("sector=%llu chain_pos=%llu lock_ns=%llu xor_ns=%llu crc_ns=%llu flush_ns=%llu duration_ns=%llu err=%d",
+              (unsigned long long)__entry->sector, __entry->chain_pos, __entry->lock_ns, __entry->xor_ns,
+              __entry->crc_ns, __entry->flush_ns, __entry->duration_ns, __entry->err)
+);
+
+TRACE_EVENT(ent_flush_metadata_start,
+
+    TP_PROTO(int type, sector_t sector),
+
+    TP_ARGS(type, sector),
+
+    TP_STRUCT__entry(
+        __field(int, type)
+        __field(sector_t, sector)
+    ),
+
+    TP_fast_assign(
+        __entry->type = type;
+        __entry->sector = sector;
+    ),
+
+    TP_printk("type=%s sector=%llu", __entry->type ? "checksum" : "sector", (unsigned long long)__entry->sector)
+);
+
+TRACE_EVENT(ent_flush_metadata_end,
+
+    TP_PROTO(int type, sector_t sector, u64 duration_ns, int err),
+
+    TP_ARGS(type, sector, duration_ns, err),
+
+    TP_STRUCT__entry(
+        __field(int, type)
+        __field(sector_t, sector)
+        __field(u64, duration_ns)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->type = type;
+        __entry->sector = sector;
+        __entry->duration_ns = duration_ns;
+        __entry->err = err;
+    ),
+
+    TP_printk("type=%s sector=%llu duration_ns=%llu err=%d", __entry->type ? "checksum" : "sector",
+              (unsigned long long)__entry->sector, __entry->duration_ns, __entry->err)
+);
+
+TRACE_EVENT(ent_rw_sector_start,
+
+    TP_PROTO(sector_t sector, int rw),
+
+    TP_ARGS(sector, rw),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(int, rw)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->rw = rw;
+    ),
+
+    TP_printk("sector=%llu %s", (unsigned long long)__entry->sector, __entry->rw == READ ? "read" : "write")
+);
+
+TRACE_EVENT(ent_rw_sector_end,
+
+    TP_PROTO(sector_t sector, int rw, u64 duration_ns, int err),
+
+    TP_ARGS(sector, rw, duration_ns, err),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(int, rw)
+        __field(u64, duration_ns)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->rw = rw;
+        __entry->duration_ns = duration_ns;
+        __entry->err = err;
+    ),
+
+    TP_printk("sector=%llu %s duration_ns=%llu err=%d", (unsigned long long)__entry->sector,
+              __entry->rw == READ ? "read" : "write", __entry->duration_ns, __entry->err)
+);
+
+TRACE_EVENT(ent_check_corruption_start,
+
+    TP_PROTO(sector_t first_sector, sector_t last_sector),
+
+    TP_ARGS(first_sector, last_sector),
+
+    TP_STRUCT__entry(
+        __field(sector_t, first_sector)
+        __field(sector_t, last_sector)
+    ),
+
+    TP_fast_assign(
+        __entry->first_sector = first_sector;
+        __entry->last_sector = last_sector;
+    ),
+
+    TP_printk("sectors=%llu-%llu", (unsigned long long)__entry->first_sector, (unsigned long long)__entry->last_sector)
+);
+
+TRACE_EVENT(ent_check_corruption_end,
+
+    TP_PROTO(u64 checked, u64 corrupted, u64 duration_ns, int err),
+
+    TP_ARGS(checked, corrupted, duration_ns, err),
+
+    TP_STRUCT__entry(
+        __field(u64, checked)
+        __field(u64, corrupted)
+        __field(u64, duration_ns)
+        __field(int, err)
+    ),
+
+    TP_fast_assign(
+        __entry->checked = checked;
+        __entry->corrupted = corrupted;
+        __entry->duration_ns = duration_ns;
+        __entry->err = err;
+    ),
+
+    TP_printk("checked=%llu corrupted=%llu duration_ns=%llu err=%d", __entry->checked, __entry->corrupted,
+              __entry->duration_ns, __entry->err)
+);
+
+/*
+    Repair steps (see ent_plan_repair()). The step is the repair of a data block, or the repair of a parity block from its left 
+    or from its right neighbours in the chain.
+*/
+#define ENT_TRACE_REPAIR_STEPS \
+    { 0, "data" }, { 1, "parity_left" }, { 2, "parity_right" }
+
+TRACE_EVENT(ent_repair_start,
+
+    TP_PROTO(sector_t sector, u64 chain_pos, int step),
+
+    TP_ARGS(sector, chain_pos, step),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(u64, chain_pos)
+        __field(int, step)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->chain_pos = chain_pos;
+        __entry->step = step;
+    ),
+
+    TP_printk("sector=%llu chain_pos=%llu step=%s", (unsigned long long)__entry->sector, __entry->chain_pos,
+              __print_symbolic(__entry->step, ENT_TRACE_REPAIR_STEPS))
+);
+
+TRACE_EVENT(ent_repair_end,
+
+    TP_PROTO(sector_t sector, u64 chain_pos, int step, bool repaired, u64 duration_ns),
+
+    TP_ARGS(sector, chain_pos, step, repaired, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(sector_t, sector)
+        __field(u64, chain_pos)
+        __field(int, step)
+        __field(bool, repaired)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->sector = sector;
+        __entry->chain_pos = chain_pos;
+        __entry->step = step;
+        __entry->repaired = repaired;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("sector=%llu chain_pos=%llu step=%s %s duration_ns=%llu", (unsigned long long)__entry->sector,
+              __entry->chain_pos, __print_symbolic(__entry->step, ENT_TRACE_REPAIR_STEPS),
+              __entry->repaired ? "repaired" : "irrecoverable", __entry->duration_ns)
+);
+
+#endif /* _ENT_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ent_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,91 @@
+#ifndef _ENT_STATS_H_
+#define _ENT_STATS_H_
+
+#include "compat.h"
+
+/*
+    Runtime statistics of an entanglement device, reported through the status interface (dmsetup status).
+    Every counter lives in per-CPU memory, so updating them from the I/O path never bounces a shared cache line.
+    They are only summed over all CPUs when the status is requested.
+*/
+enum ent_counter {
+    ENT_STAT_READS,
+    ENT_STAT_WRITES,
+    ENT_STAT_PARITY_BYTES,
+    ENT_STAT_METADATA_FLUSHES,
+    ENT_STAT_CORRUPTED,
+    ENT_STAT_REPAIRED,
+    ENT_STAT_IRRECOVERABLE,
+    ENT_STAT_INJECTED,
+    ENT_STAT_MEMPOOL_WAITS,
+    ENT_STAT_METADATA_LOCK_WAIT_NS,
+    ENT_STAT_CACHE_HITS,
+    ENT_STAT_CACHE_MISSES,
+    ENT_STAT_CHAIN_PAGE_INS,
+    ENT_STAT_LAG_UNPROTECTED,
+    ENT_STAT_NR
+};
+
+enum ent_histogram {
+    ENT_HIST_READ,
+    ENT_HIST_WRITE,
+    ENT_HIST_FLUSH,
+    ENT_HIST_REPAIR,
+    ENT_HIST_NR
+};
+
+// Latency histograms are log2 based: bucket i counts latencies in [2^i, 2^(i+1)) microseconds (bucket 0 also holds everything below 1us).
+#define ENT_HIST_BUCKETS 32
+
+struct ent_stats {
+    u64 counters[ENT_STAT_NR];
+    u64 histograms[ENT_HIST_NR][ENT_HIST_BUCKETS];
+};
+
+static inline struct ent_stats __percpu *ent_stats_alloc(void) {
+    return alloc_percpu(struct ent_stats);
+}
+
+static inline void ent_stats_free(struct ent_stats __percpu *stats) {
+    free_percpu(stats);
+}
+
+static inline void ent_stats_add(struct ent_stats __percpu *stats, enum ent_counter counter, u64 value) {
+    this_cpu_add(stats->counters[counter], value);
+}
+
+static inline void ent_stats_inc(struct ent_stats __percpu *stats, enum ent_counter counter) {
+    this_cpu_inc(stats->counters[counter]);
+}
+
+// Records the time elapsed since start_ns (taken with ktime_get_ns()) in the given histogram.
+static inline void ent_stats_latency(struct ent_stats __percpu *stats, enum ent_histogram hist, u64 start_ns) {
+    u64 us = (ktime_get_ns() - start_ns) / NSEC_PER_USEC;
+    int bucket = us ? ilog2(us) : 0;
+
+    if (bucket >= ENT_HIST_BUCKETS) {
+        bucket = ENT_HIST_BUCKETS - 1;
+    }
+    this_cpu_inc(stats->histograms[hist][bucket]);
+}
+
+// Sums the per-CPU statistics into sum. Values may be slightly inconsistent with each other, since writers are not stopped.
+static inline void ent_stats_sum(struct ent_stats __percpu *stats, struct ent_stats *sum) {
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        struct ent_stats *s = per_cpu_ptr(stats, cpu);
+
+        for (int i = 0 ; i < ENT_STAT_NR ; i++) {
+            sum->counters[i] += READ_ONCE(s->counters[i]);
+        }
+        for (int h = 0 ; h < ENT_HIST_NR ; h++) {
+            for (int b = 0 ; b < ENT_HIST_BUCKETS ; b++) {
+                sum->histograms[h][b] += READ_ONCE(s->histograms[h][b]);
+            }
+        }
+    }
+}
+
+#endif
@@ -7,619 +7,1403 @@
 #include <linux/bitmap.h>
 #include <linux/bitops.h>
 #include <linux/random.h>
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/moduleparam.h>
+#include <linux/ioprio.h>
+#include <linux/delay.h>
+
+#include "core.h"
+
+#define CREATE_TRACE_POINTS
+#include "ent_trace.h"
+
+// Chain window new devices start with (see the chain_window message). It applies before the chain is loaded, so it also bounds the
+// memory needed to open a device with a long chain.
+static uint chain_window;
+module_param(chain_window, uint, 0644);
+MODULE_PARM_DESC(chain_window, "Chain segments kept in memory by new devices (0 keeps the whole chain)");
+
+// 512-byte sectors in a unit.
+static inline uint ent_unit_sectors(const struct entanglement_device *ent_dev) {
+    return ent_dev->unit_blocks * ENT_DEV_SECTOR_SCALE;
+}
+
+/*
+    Context of the bios the target submits for the core. The I/O of a maintenance operation takes the maintenance priority, and
+    the I/O of the append of a write (metadata flushes, the read of a partially written unit) is charged to the cgroup of the write,
+    with its priority. Other I/O, such as the relaxed parity stage's, is charged to the task that submits it.
+*/
+static void ent_bio_set_origin(struct entanglement_device *ent_dev, struct bio *bio) {
+
+    if (current == READ_ONCE(ent_dev->maintenance.task)) {
+        bio->bi_ioprio = READ_ONCE(ent_dev->maintenance.ioprio);
+    }else if (current == READ_ONCE(ent_dev->append_task)) {
+        bio_clone_blkg_association(bio, ent_dev->append_bio);
+        bio->bi_ioprio = ent_dev->append_bio->bi_ioprio;
+    }
+}
+
+/* Synchronously reads/writes len bytes at the given 4096-byte sector from/to the given device 
+   to/from the provided page */
+static int ent_rw_block(struct entanglement_device *ent_dev, struct block_device *bdev, struct page *page, sector_t sector, 
+                        uint len, int rw)
+{
+        struct bio *bio;
+        blk_opf_t opf;
+        int err;
+        u64 start_ns = trace_ent_rw_sector_end_enabled() ? ktime_get_ns() : 0;
+
+        trace_ent_rw_sector_start(sector, rw);
+
+        /* Synchronous READ/WRITE */
+        opf = ((rw == READ) ? REQ_OP_READ : REQ_OP_WRITE);
+        opf |= REQ_SYNC;
+
+        /* Allocate bio */
+        bio = bio_alloc_bioset(bdev, 1, opf,  GFP_NOIO, &ent_dev->bioset);
+        if (!bio) {
+            pr_err("Could not allocate bio\n");
+            return -ENOMEM;
+        }
+
+        ent_bio_set_origin(ent_dev, bio);
+
+        /* Set sector */
+        bio->bi_iter.bi_sector = sector * ENT_DEV_SECTOR_SCALE;
+        /* Add page */
+        if (!bio_add_page(bio, page, len, 0)) {
+            pr_err("Catastrophe: could not add page to bio! WTF?\n");
+            err = EINVAL;
+            goto out;
+        }
+
+        /* Submit */
+        err = submit_bio_wait(bio);
 
-#include "utils.h"
-#include "device.h"
+out:
+        /* Free and return; */
+        bio_put(bio);
+        if (start_ns) {
+            trace_ent_rw_sector_end(sector, rw, ktime_get_ns() - start_ns, err);
+        }
+        return err;
+}
+
+int ent_dev_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw)
+{
+        return ent_rw_block(ent_dev, ent_dev->dev->bdev, page, sector * ent_dev->unit_blocks, ent_unit_size(ent_dev), rw);
+}
 
-#define BIOSET_SIZE 2048
-#define PAGE_POOL_SIZE 2048
+int ent_meta_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw)
+{
+        struct dm_dev *dev = ent_dev->meta_dev ? ent_dev->meta_dev : ent_dev->dev;
 
-#define NUMBER_OF_SECTORS_IN_BLOCK 4096 / sizeof(sector_t)
+        return ent_rw_block(ent_dev, dev->bdev, page, sector, ENT_BLOCK_SIZE, rw);
+}
 
 /*
-    These constants are used to represent an unused block sector/checksum. 
-    In more detail, these values are present on disk, and when for example you read blocks and their metadata, 
-    if you come across one of these values, it means you got to the end and read all sectors/checksums.  
+    Completion shared by the bios of one ent_dev_rwBatch() call: the submitter waits until the last of them has ended.
 */
-#define DEFAULT_SECTOR_VALUE 0xFFFFFFFFFFFFFFFFULL
-#define DEFAULT_CHECKSUM_VALUE 0xFFFFFFFF
-
-// Enum used to describe a buffer which is being flushed in the writing process.
-enum BufferType {
-    SECTOR,
-    CHECKSUM
+struct ent_batch {
+    atomic_t pending;
+    blk_status_t status;
+    struct completion done;
 };
 
+static void ent_batch_end_io(struct bio *bio) {
+
+    struct ent_batch *batch = bio->bi_private;
+
+    if (bio->bi_status) {
+        WRITE_ONCE(batch->status, bio->bi_status);
+    }
+    bio_put(bio);
+    if (atomic_dec_and_test(&batch->pending)) {
+        complete(&batch->done);
+    }
+}
+
+/* Reads/writes nr units at once: all the bios are submitted under one plug, then waited for together */
+int ent_dev_rwBatch(struct entanglement_device *ent_dev, struct page **pages, const sector_t *sectors, uint nr, int rw)
+{
+        struct ent_batch batch;
+        struct blk_plug plug;
+        struct bio *bio;
+        blk_opf_t opf = ((rw == READ) ? REQ_OP_READ : REQ_OP_WRITE) | REQ_SYNC;
+        int err = 0;
+
+        if (!nr) {
+            return 0;
+        }
+
+        // One extra reference for the submitter, dropped once every bio is submitted.
+        atomic_set(&batch.pending, 1);
+        batch.status = BLK_STS_OK;
+        init_completion(&batch.done);
+
+        blk_start_plug(&plug);
+        for (uint i = 0 ; i < nr ; i++) {
+            bio = bio_alloc_bioset(ent_dev->dev->bdev, 1, opf, GFP_NOIO, &ent_dev->bioset);
+            if (!bio) {
+                pr_err("Could not allocate bio\n");
+                err = -ENOMEM;
+                break;
+            }
+            ent_bio_set_origin(ent_dev, bio);
+            bio->bi_iter.bi_sector = sectors[i] * ent_unit_sectors(ent_dev);
+            bio->bi_end_io = ent_batch_end_io;
+            bio->bi_private = &batch;
+            if (!bio_add_page(bio, pages[i], ent_unit_size(ent_dev), 0)) {
+                bio_put(bio);
+                err = -EINVAL;
+                break;
+            }
+            atomic_inc(&batch.pending);
+            submit_bio(bio);
+        }
+        blk_finish_plug(&plug);
+
+        if (!atomic_dec_and_test(&batch.pending)) {
+            wait_for_completion_io(&batch.done);
+        }
+
+        return err ? err : blk_status_to_errno(READ_ONCE(batch.status));
+}
+
 /*
-    The following two enums are used in the repair of corrupted blocks.
-    They describe the direction to take in the entanglement list, and if a block in the process was repaired or cannot be repaired. 
-*/ 
-enum RepairDirection {
-    LEFT, 
-    RIGHT
-};
-enum RepairState {
-    REPAIRED, 
-    IRRECOVERABLE
+    Per-bio data of this target (see ti->per_io_data_size). Used to measure the map-to-completion latency,
+    and to complete the original bio of a write only once both the data and the parity writes are done. 
+*/
+struct ent_io {
+    struct entanglement_device *ent_dev;
+    u64 start_ns;
+    atomic_t pending;
+    blk_status_t status;
+    // Unit of a write, with units larger than 4KB (see ent_unit_writes()).
+    sector_t unit;
 };
 
-mempool_t *page_pool;
+/*
+    Runtime maintenance, triggered through target messages and run on the maintenance workqueue of the device.
+*/
 
-struct entangled_block {
+static void ent_maintenance_error(struct entanglement_device *ent_dev, int err) {
 
-    sector_t block_sector;
-    uint block_checksum;
-    struct list_head list_node;
-};
+    spin_lock(&ent_dev->maintenance.lock);
+    ent_dev->maintenance.last_error = err;
+    spin_unlock(&ent_dev->maintenance.lock);
+}
 
-int corrupt_blocks(struct entanglement_device *ent_dev, uint corrupt_chance) {
+// Queues a maintenance operation, unless the device is suspended (see entanglement_tgt_postsuspend()).
+static int ent_maintenance_queue(struct entanglement_device *ent_dev, struct work_struct *work) {
 
-    int err;
-    struct entangled_block *block;
-    struct page *page;
-    u8 *page_ptr;
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    int err = 0;
 
-    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
-        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
-        return -EINTR;
+    spin_lock(&m->lock);
+    if (m->suspended) {
+        err = -EBUSY;
+    }else {
+        queue_work(m->wq, work);
     }
+    spin_unlock(&m->lock);
 
-    page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!page) {
-        pr_err("Could not allocate data page.\n");
-        return -ENOMEM;
-    }
-    page_ptr = kmap(page);
+    return err;
+}
 
+// Marks the I/O of the calling work item as maintenance I/O (see ent_bio_set_origin()), until ent_maintenance_end().
+static void ent_maintenance_begin(struct entanglement_device *ent_dev) {
 
-    list_for_each_entry(block, &ent_dev->entanglement, list_node) {
+    WRITE_ONCE(ent_dev->maintenance.task, current);
+}
 
-        uint randomValue;
-        get_random_bytes(&randomValue, sizeof(randomValue));
-        randomValue %= 100;
+static void ent_maintenance_end(struct entanglement_device *ent_dev) {
 
-        if (randomValue < corrupt_chance) {
-            err = ent_dev_rwSector(ent_dev, page, block->block_sector, READ);
-            if (err) {
-                pr_err("Error while reading block in order to corrupt it\n");
-                goto out;
-            }
+    WRITE_ONCE(ent_dev->maintenance.task, NULL);
+}
 
-            page_ptr[1] += 1;
+static bool ent_lag_idle(struct ent_parity_lag *lag);
+static void ent_lag_drain(struct entanglement_device *ent_dev);
 
-            err = ent_dev_rwSector(ent_dev, page, block->block_sector, WRITE);
-            if (err) {
-                pr_err("Error while writing corrupted block back\n");
-                goto out;
-            }
+/*
+    A write is entangled (its checksum and parity are in the chain) before its data and parity reach the disk. Maintenance that reads
+    blocks of the chain therefore holds the metadata buffers lock, so that no write is entangled meanwhile, and waits for the writes
+    entangled before it to be on disk: otherwise a scrub takes the old contents of a block for corruption, and the repair rebuilds it 
+    from a parity that was not written yet. Taken after corrupted_blocks_lock, for the duration of a batch (the scrub only takes it
+    for one batch of reads at a time, see ent_scrub_work()).
+    In relaxed durability, it is the other way around: a write completes before it is entangled, and the repair would roll it back to
+    the contents the chain still has. The relaxed stage is drained first, and again if writes were queued before the lock was taken
+    (the stage needs the lock to entangle them).
+*/
+static void ent_maintenance_lock(struct entanglement_device *ent_dev) {
+
+    for (;;) {
+        ent_lag_drain(ent_dev);
+        mutex_lock(&ent_dev->metadata_buffers_lock);
+        wait_event(ent_dev->unit_wait, !atomic_read(&ent_dev->writes_in_flight));
+        if (ent_lag_idle(&ent_dev->lag)) {
+            return;
         }
+        mutex_unlock(&ent_dev->metadata_buffers_lock);
     }
+}
 
-out:
-    kunmap(page);
-    mempool_free(page, page_pool);
-    mutex_unlock(&ent_dev->entanglement_lock);
-    return err;
+static void ent_maintenance_unlock(struct entanglement_device *ent_dev) {
+
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
 }
 
-int load_entanglement_and_checksums(struct entanglement_device *ent_dev) {
-    
-    struct page *sector_page;
-    u8 *sector_page_ptr;
-    struct page *checksum_page;
-    u8 *checksum_page_ptr;
-    sector_t sector;
-    sector_t checksum_sector;
+// Saves the progress of the scrub on the metadata device (when there is one), after every batch.
+static void ent_scrub_save_checkpoint(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_scrub_checkpoint checkpoint = { .magic = ENT_CHECKPOINT_MAGIC };
     int err;
 
-    int curr_sector_index;
-    int curr_checksum_index;
-    sector_t last_entangled_block_sector;
+    if (!ent_dev->meta_dev) {
+        return;
+    }
 
-    sector_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!sector_page) {
-        pr_err("Could not allocate data page.\n");
-        return -ENOMEM;
+    spin_lock(&m->lock);
+    checkpoint.scrub_pos = m->scrub_pos;
+    checkpoint.scrub_passes = m->scrub_passes;
+    checkpoint.in_progress = m->scrub_pos < ent_dev->dev_size;
+    spin_unlock(&m->lock);
+
+    err = ent_checkpoint_store(ent_dev, &checkpoint);
+    if (err) {
+        ent_maintenance_error(ent_dev, err);
     }
+}
 
-    checksum_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!checksum_page) {
-        pr_err("Could not allocate checksum page.\n");
-        err = -ENOMEM;
-        goto err_page_allocation;
+// A pass that was under way when the device was last taken down is left paused where it stopped: "scrub resume" continues it.
+static void ent_scrub_restore_checkpoint(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_scrub_checkpoint checkpoint;
+
+    if (ent_checkpoint_load(ent_dev, &checkpoint)) {
+        return;
+    }
+
+    spin_lock(&m->lock);
+    m->scrub_pos = checkpoint.scrub_pos;
+    m->scrub_passes = checkpoint.scrub_passes;
+    if (checkpoint.in_progress) {
+        m->scrub_state = ENT_SCRUB_PAUSED;
     }
+    spin_unlock(&m->lock);
+}
+
+// Sleeps as long as needed for the units read since start_ns to stay within the scrub rate.
+static void ent_scrub_throttle(struct entanglement_device *ent_dev, u64 start_ns, u64 units) {
+
+    u64 due_ns = div_u64(units * NSEC_PER_SEC, ent_dev->tuning[ENT_TUNE_SCRUB_RATE]);
+    u64 elapsed_ns = ktime_get_ns() - start_ns;
 
-    sector_page_ptr = kmap(sector_page);
-    checksum_page_ptr = kmap(checksum_page);
+    if (due_ns > elapsed_ns) {
+        msleep(div_u64(due_ns - elapsed_ns, NSEC_PER_MSEC));
+    }
+}
 
-    // Grab the lock for the entanglement list.  
-    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
-        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
-        return -EINTR;
+/*
+    Verifies a scrub_batch of units. The writes are only held off (see ent_maintenance_lock()) for one batch of reads at a time, 
+    rather than for the whole scrub batch, and the scrub is kept within its rate in between.
+*/
+static void ent_scrub_work(struct work_struct *work) {
+
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.scrub_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    sector_t start, end, pos, next;
+    u64 checked = 0;
+    u64 corrupted = 0;
+    u64 start_ns;
+    int err = 0;
+
+    spin_lock(&m->lock);
+    if (m->scrub_state != ENT_SCRUB_RUNNING) {
+        spin_unlock(&m->lock);
+        return;
     }
+    start = m->scrub_pos;
+    spin_unlock(&m->lock);
 
-    // First we load the entanglement. 
-    sector = ent_dev->metadata_start_sector;
-    checksum_sector = ent_dev->metadata_sector_size;
-    int i;
+    end = min_t(sector_t, start + ent_dev->tuning[ENT_TUNE_SCRUB_BATCH], ent_dev->dev_size);
 
-    for (i = 0 ; i < ent_dev->metadata_sector_size ; i++) {
-        err = ent_dev_rwSector(ent_dev, sector_page, sector, READ);
-        if (err) {
-            pr_err("Error while reading block %d at sector %llu which contains information about the entanglement: %d\n", i, sector, err);
-            goto out;
-        }
+    start_ns = ktime_get_ns();
+    ent_maintenance_begin(ent_dev);
+    for (pos = start ; pos < end && !err ; pos = next) {
+        next = min_t(sector_t, pos + ent_io_batch(ent_dev), end);
 
-        // Only read a new checksum block for every two entanglement blocks, since sectors are twice as large as checksums. 
-        if (i % 2 == 0) {
-            err = ent_dev_rwSector(ent_dev, checksum_page, checksum_sector, READ);
-            if (err) {
-                pr_err("Error while reading block %d at sector %llu which contains information about a checksum: %d\n", i, sector+512, err);
-                goto out;
-            }
-            checksum_sector += 1;
-        }
-        
-
-        // Loop through 512 entries in this block. Each entry is a sector for an entangled block.
-        // Here we also load form the checksum blocks, since we have a static correspondence between sectors and checksums. 
-        for (int j = 0 ; j < NUMBER_OF_SECTORS_IN_BLOCK ; j++) {
-            
-            if (checksum_page_ptr[j * sizeof(uint)] == DEFAULT_SECTOR_VALUE) {
-                // We got to the end, just break out of both loops. 
-                curr_sector_index = j;
-                curr_checksum_index = (i % 2 == 0) ? j : j + NUMBER_OF_SECTORS_IN_BLOCK;
-                goto end_loop;
-            }
-            struct entangled_block *new_block = kmalloc(sizeof(struct entangled_block), GFP_KERNEL);
-            if (!new_block) {
-                pr_err("Error while allocating new block.\n");
-                err = -ENOMEM;
-                goto out;
-            }
+        mutex_lock(&ent_dev->corrupted_blocks_lock);
+        ent_maintenance_lock(ent_dev);
+        err = scrub_range(ent_dev, pos, next, &checked, &corrupted);
+        ent_maintenance_unlock(ent_dev);
+        mutex_unlock(&ent_dev->corrupted_blocks_lock);
 
-            // Ensure we are reading the correct checksum. 
-            uint entangled_block_checksum;
-            if (i % 2 == 0) {
-                entangled_block_checksum = checksum_page_ptr[j * sizeof(uint)];
-            }else {
-                entangled_block_checksum = checksum_page_ptr[(j + 512) * sizeof(uint)];
-            }
+        ent_scrub_throttle(ent_dev, start_ns, checked);
+    }
+    ent_maintenance_end(ent_dev);
 
-            sector_t entangled_block_sector = sector_page_ptr[j * sizeof(sector_t)];
-            // Constantly update the sector of last block, so we can read it afterwards. 
-            last_entangled_block_sector = entangled_block_sector;
-            new_block->block_sector = entangled_block_sector;
-            new_block->block_checksum = entangled_block_checksum;
-            INIT_LIST_HEAD(&new_block->list_node);
-            list_add_tail(&new_block->list_node, &ent_dev->entanglement);
+    spin_lock(&m->lock);
+    m->scrub_checked += checked;
+    m->scrub_corrupted += corrupted;
+    if (err) {
+        m->last_error = err;
+        m->scrub_state = ENT_SCRUB_IDLE;
+    }else if (end >= ent_dev->dev_size) {
+        // The pass is finished. Corrupted blocks stay marked until a repair is requested. 
+        m->scrub_pos = end;
+        m->scrub_passes++;
+        m->scrub_state = ENT_SCRUB_IDLE;
+    }else {
+        m->scrub_pos = end;
+        // Only continue if the scrub was not paused (or restarted) while this batch was running.
+        if (m->scrub_state == ENT_SCRUB_RUNNING) {
+            queue_work(m->wq, &m->scrub_work);
         }
+    }
+    spin_unlock(&m->lock);
 
-        sector += 1;
+    if (!err) {
+        ent_scrub_save_checkpoint(ent_dev);
     }
+}
 
-end_loop:
+static void ent_repair_work(struct work_struct *work) {
 
-    memcpy(ent_dev->block_sector_buffer, sector_page_ptr, ENT_BLOCK_SIZE);
-    memcpy(ent_dev->block_checksum_buffer, checksum_page_ptr, ENT_BLOCK_SIZE);
-    
-    ent_dev->next_sector = sector;
-    ent_dev->next_checksum = checksum_sector;
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.repair_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    u64 before, after;
+    int err;
+
+    ent_maintenance_begin(ent_dev);
+    mutex_lock(&ent_dev->corrupted_blocks_lock);
+    ent_maintenance_lock(ent_dev);
+    before = bitmap_weight(ent_dev->corrupted_blocks, ent_dev->dev_size);
+    err = repair_corrupted_blocks(ent_dev);
+    after = bitmap_weight(ent_dev->corrupted_blocks, ent_dev->dev_size);
+    ent_maintenance_unlock(ent_dev);
+    mutex_unlock(&ent_dev->corrupted_blocks_lock);
+    ent_maintenance_end(ent_dev);
 
-    // I use the sector page here because it is unnecessary to allocate a new page for this. 
-    err = ent_dev_rwSector(ent_dev, sector_page, last_entangled_block_sector, READ);
+    spin_lock(&m->lock);
+    m->last_repaired = before - after;
+    m->last_irrecoverable = after;
     if (err) {
-        pr_err("Error while reading data from the last block in the entanglement, while loading the entanglement.\n");
-        goto out;
+        m->last_error = err;
     }
+    spin_unlock(&m->lock);
+}
 
-    // Put the data in the last entangled block buffer. 
-    memcpy(ent_dev->last_entangled_block, sector_page_ptr, ENT_BLOCK_SIZE);
+static void ent_flush_work(struct work_struct *work) {
 
-    err = 0;
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.flush_work);
+    int err;
 
-out:
-    kunmap(sector_page);
-    kunmap(checksum_page);
-    mempool_free(checksum_page, page_pool);
-    mutex_unlock(&ent_dev->entanglement_lock);
-err_page_allocation:
-    mempool_free(sector_page, page_pool);
-    return err;
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+    err = write_metadata_buffers(ent_dev);
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+    if (err) {
+        ent_maintenance_error(ent_dev, err);
+    }
 }
 
-int store_entanglement_and_checksums(struct entanglement_device *ent_dev) {
+static void ent_inject_work(struct work_struct *work) {
 
-    struct page *sector_page;
-    u8 *sector_page_ptr;
-    struct page *checksum_page;
-    u8 *checksum_page_ptr;
-    sector_t sector;
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.inject_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_inject_spec spec;
+    u64 injected;
     int err;
 
-    sector_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!sector_page) {
-        pr_err("Could not allocate data page.\n");
-        return -ENOMEM;
+    spin_lock(&m->lock);
+    spec = m->inject;
+    spin_unlock(&m->lock);
+
+    ent_maintenance_begin(ent_dev);
+    ent_maintenance_lock(ent_dev);
+    err = corrupt_blocks(ent_dev, &spec, &injected);
+    ent_maintenance_unlock(ent_dev);
+    ent_maintenance_end(ent_dev);
+
+    spin_lock(&m->lock);
+    m->last_injected = injected;
+    spin_unlock(&m->lock);
+
+    if (err) {
+        ent_maintenance_error(ent_dev, err);
     }
+}
 
-    checksum_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!checksum_page) {
-        pr_err("Could not allocate checksum page.\n");
-        err = -ENOMEM;
-        goto err_page_allocation;
+static void ent_rebuild_work(struct work_struct *work) {
+
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.rebuild_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_rebuild rebuild;
+    int err;
+
+    spin_lock(&m->lock);
+    if (m->rebuild_state != ENT_SCRUB_RUNNING) {
+        spin_unlock(&m->lock);
+        return;
     }
+    if (m->rebuild_restart) {
+        ent_rebuild_init(ent_dev, &m->rebuild, m->rebuild.start, m->rebuild.end);
+        m->rebuild_restart = false;
+    }
+    rebuild = m->rebuild;
+    spin_unlock(&m->lock);
 
-    sector_page_ptr = kmap(sector_page);
-    checksum_page_ptr = kmap(checksum_page);
+    ent_maintenance_begin(ent_dev);
+    mutex_lock(&ent_dev->corrupted_blocks_lock);
+    ent_maintenance_lock(ent_dev);
+    err = ent_rebuild_step(ent_dev, &rebuild);
+    ent_maintenance_unlock(ent_dev);
+    mutex_unlock(&ent_dev->corrupted_blocks_lock);
+    ent_maintenance_end(ent_dev);
 
-    // Two last writes of the buffers, in case of any leftovers in the buffers. 
-    memcpy(sector_page_ptr, ent_dev->block_sector_buffer, sizeof(ent_dev->block_sector_buffer));
-    err = ent_dev_rwSector(ent_dev, sector_page, ent_dev->next_sector, WRITE);
+    spin_lock(&m->lock);
+    // A restart requested while this batch was running discards it.
+    if (m->rebuild_restart) {
+        spin_unlock(&m->lock);
+        return;
+    }
+    m->rebuild = rebuild;
     if (err) {
-        pr_err("Error while writing block at sector %llu which contains information about the entanglement: %d\n", sector, err);
-        goto out;
+        m->last_error = err;
+        m->rebuild_state = ENT_SCRUB_IDLE;
+    }else if (rebuild.pos >= rebuild.end_pos) {
+        m->rebuild_state = ENT_SCRUB_IDLE;
+    }else if (m->rebuild_state == ENT_SCRUB_RUNNING) {
+        queue_work(m->wq, &m->rebuild_work);
+    }
+    spin_unlock(&m->lock);
+}
+
+/*
+    Compaction batches (see ent_compact_step()), run like the other maintenance (see ent_maintenance_lock()): the batch reads the final
+    contents of the blocks of the writes accepted before it. The batches are kept within the scrub rate, counting the entries walked.
+*/
+static void ent_compact_work(struct work_struct *work) {
+
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, maintenance.compact_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_compact progress = { 0 };
+    u64 chain_length = 0;
+    u64 start_ns = ktime_get_ns();
+    bool done = false;
+    int err;
+
+    spin_lock(&m->lock);
+    if (m->compact_state != ENT_SCRUB_RUNNING) {
+        spin_unlock(&m->lock);
+        return;
+    }
+    spin_unlock(&m->lock);
+
+    // The writes of relaxed durability are entangled after their data is written, which the compaction would take for corruption.
+    err = READ_ONCE(ent_dev->lag.relaxed) ? -EBUSY : ent_compact_init(ent_dev);
+    if (!err) {
+        ent_maintenance_begin(ent_dev);
+        mutex_lock(&ent_dev->corrupted_blocks_lock);
+        ent_maintenance_lock(ent_dev);
+        err = ent_compact_step(ent_dev, ent_dev->tuning[ENT_TUNE_SCRUB_BATCH], &done);
+        progress = *ent_dev->compact;
+        chain_length = ent_dev->chain_length;
+        ent_maintenance_unlock(ent_dev);
+        mutex_unlock(&ent_dev->corrupted_blocks_lock);
+        ent_maintenance_end(ent_dev);
+
+        // A compaction that stops keeps its gap in the chain, from where the next one goes on.
+        if (err || done) {
+            ent_compact_exit(ent_dev);
+        }else {
+            ent_scrub_throttle(ent_dev, start_ns, ent_dev->tuning[ENT_TUNE_SCRUB_BATCH]);
+        }
     }
 
-    memcpy(checksum_page_ptr, ent_dev->block_checksum_buffer, sizeof(ent_dev->block_checksum_buffer));
-    err = ent_dev_rwSector(ent_dev, checksum_page, ent_dev->next_checksum, WRITE);
+    spin_lock(&m->lock);
+    if (!err) {
+        m->compact_pos = progress.src;
+        m->compact_end = chain_length;
+        m->compact_moved = progress.moved;
+        m->compact_reclaimed = progress.reclaimed;
+        m->compact_repaired = progress.repaired;
+        m->compact_failed = progress.failed;
+    }
     if (err) {
-        pr_err("Error while writing block at sector %llu which contains information about the entanglement: %d\n", sector, err);
-        goto out;
+        m->last_error = err;
+        m->compact_state = ENT_SCRUB_IDLE;
+    }else if (done) {
+        m->compact_state = ENT_SCRUB_IDLE;
+    }else if (m->compact_state == ENT_SCRUB_RUNNING) {
+        queue_work(m->wq, &m->compact_work);
+    }
+    spin_unlock(&m->lock);
+}
+
+// A compaction interrupted when the device was last taken down is left paused: "compact resume" goes on with it.
+static void ent_compact_restore(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+
+    spin_lock(&m->lock);
+    if (ent_chain_compacting(ent_dev) && m->compact_state == ENT_SCRUB_IDLE) {
+        m->compact_state = ENT_SCRUB_PAUSED;
+        m->compact_pos = ent_dev->gap_end;
+        m->compact_end = ent_dev->chain_length;
     }
+    spin_unlock(&m->lock);
+}
+
+// Starts a compaction from the head of the chain. Called with the maintenance lock held.
+static void ent_compact_start(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
 
-    // Grab the lock for the entanglement list.  
-    if (mutex_lock_interruptible(&ent_dev->entanglement_lock)) {
-        pr_err("Interrupted while waiting for the lock to the entanglement.\n");
-        return -EINTR;
+    m->compact_pos = 0;
+    m->compact_end = 0;
+    m->compact_moved = 0;
+    m->compact_reclaimed = 0;
+    m->compact_repaired = 0;
+    m->compact_failed = 0;
+    m->compact_state = ENT_SCRUB_RUNNING;
+    queue_work(m->wq, &m->compact_work);
+}
+
+/*
+    Starts a compaction once it is due (see ent_compact_due()), so that the chain does not run out of room under a workload that writes
+    the same blocks again and again. Not in relaxed durability, and not over a compaction that was paused or interrupted: those are
+    resumed by a message.
+*/
+static void ent_compact_auto(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+
+    spin_lock(&m->lock);
+    if (!m->suspended && m->compact_state == ENT_SCRUB_IDLE && !READ_ONCE(ent_dev->lag.relaxed)) {
+        ent_compact_start(ent_dev);
     }
+    spin_unlock(&m->lock);
+}
 
-    struct entangled_block *block, *tmp;
-    list_for_each_entry_safe(block, tmp, &ent_dev->entanglement, list_node) {
-        list_del(&block->list_node);
-        // Free the memory that was allocated in load_entanglement_and_checksums() and while this device mapper was being used.
-        kfree(block); 
+// A device that took no write since the last check is idle: the compaction is then due earlier.
+#define ENT_COMPACT_IDLE_MS 10000
+
+static void ent_compact_idle_work(struct work_struct *work) {
+
+    struct entanglement_device *ent_dev = container_of(to_delayed_work(work), struct entanglement_device, maintenance.idle_work);
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    u64 chain_length = READ_ONCE(ent_dev->chain_length);
+
+    if (chain_length == m->idle_chain_length && ent_compact_due(ent_dev, true)) {
+        ent_compact_auto(ent_dev);
     }
+    m->idle_chain_length = chain_length;
 
-    mutex_unlock(&ent_dev->entanglement_lock);
-out:
-    kunmap(checksum_page);
-    kunmap(sector_page);
-    mempool_free(checksum_page, page_pool);
-err_page_allocation:
-    mempool_free(sector_page, page_pool);
-    return err;
+    spin_lock(&m->lock);
+    if (!m->suspended) {
+        queue_delayed_work(m->wq, &m->idle_work, msecs_to_jiffies(ENT_COMPACT_IDLE_MS));
+    }
+    spin_unlock(&m->lock);
 }
 
-// This function is actually called for parity blocks. Data blocks call the repair_block function, which initiates the recursion if needed.
-enum RepairState repair_block_rec(struct entanglement_device *ent_dev, struct entangled_block *block, 
-                                    unsigned long *irrecoverable_blocks_bitmap, enum RepairDirection direction) {
+static int ent_maintenance_init(struct entanglement_device *ent_dev, const char *dev_name) {
 
+    struct ent_maintenance *m = &ent_dev->maintenance;
 
-    enum RepairState result_state = IRRECOVERABLE;
-    struct entangled_block *next_data_block;
-    struct entangled_block *next_parity_block;
-    struct page *data_page;
-    u8 *data_page_ptr;
-    struct page *parity_page;
-    u8 *parity_page_ptr;
-    struct page *repaired_block_page;
-    u8 *repaired_block_page_ptr;
+    // The running XOR of the rebuild.
+    m->rebuild.parity = kzalloc(ent_unit_size(ent_dev), GFP_KERNEL);
+    if (!m->rebuild.parity) {
+        return -ENOMEM;
+    }
 
-    int err;
+    m->wq = alloc_ordered_workqueue("ent_maint_%s", WQ_MEM_RECLAIM, dev_name);
+    if (!m->wq) {
+        kfree(m->rebuild.parity);
+        return -ENOMEM;
+    }
 
-    if (direction == LEFT) {
-        
-        next_data_block = list_entry(block->list_node.prev, struct entangled_block, list_node);
-        // If a data block to the left is corrupted, we ran into a type B or type C failure in our entanglement.
-        // We mark the block as irrecoverable and return. 
-        if (test_bit(next_data_block->block_sector, ent_dev->corrupted_blocks)) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+    spin_lock_init(&m->lock);
+    INIT_WORK(&m->scrub_work, ent_scrub_work);
+    INIT_WORK(&m->repair_work, ent_repair_work);
+    INIT_WORK(&m->flush_work, ent_flush_work);
+    INIT_WORK(&m->inject_work, ent_inject_work);
+    INIT_WORK(&m->rebuild_work, ent_rebuild_work);
+    INIT_WORK(&m->compact_work, ent_compact_work);
+    INIT_DELAYED_WORK(&m->idle_work, ent_compact_idle_work);
+    m->scrub_state = ENT_SCRUB_IDLE;
+    m->rebuild_state = ENT_SCRUB_IDLE;
+    m->compact_state = ENT_SCRUB_IDLE;
+    m->ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+    return 0;
+}
+
+static void ent_maintenance_exit(struct entanglement_device *ent_dev) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+
+    // Stop the scrub, the rebuild and the compaction from queueing further batches, then wait for everything that is queued.
+    spin_lock(&m->lock);
+    m->scrub_state = ENT_SCRUB_IDLE;
+    m->rebuild_state = ENT_SCRUB_IDLE;
+    m->compact_state = ENT_SCRUB_IDLE;
+    spin_unlock(&m->lock);
+
+    cancel_delayed_work_sync(&m->idle_work);
+    destroy_workqueue(m->wq);
+    kfree(m->rebuild.parity);
+}
+
+static int ent_message_scrub(struct entanglement_device *ent_dev, const char *action) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    int err = 0;
+
+    spin_lock(&m->lock);
+    if (m->suspended) {
+        err = -EBUSY;
+    }else if (!strcasecmp(action, "start")) {
+        m->scrub_pos = 0;
+        m->scrub_checked = 0;
+        m->scrub_corrupted = 0;
+        m->scrub_state = ENT_SCRUB_RUNNING;
+        queue_work(m->wq, &m->scrub_work);
+    }else if (!strcasecmp(action, "pause")) {
+        if (m->scrub_state == ENT_SCRUB_RUNNING) {
+            m->scrub_state = ENT_SCRUB_PAUSED;
+        }
+    }else if (!strcasecmp(action, "resume")) {
+        if (m->scrub_state == ENT_SCRUB_PAUSED) {
+            m->scrub_state = ENT_SCRUB_RUNNING;
+            queue_work(m->wq, &m->scrub_work);
         }
+    }else {
+        err = -EINVAL;
+    }
+    spin_unlock(&m->lock);
 
-        // If the data block is fine, but it is the end of the entanglement (in this case the beginning, i.e. the head of the list),
-        // we cannot recover any block in the recursion so far, so we mark the current as irrecoverable, and return. 
-        if (next_data_block->list_node.prev == &ent_dev->entanglement) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+    return err;
+}
+
+// Starts a rebuild of the data blocks in [start, end), or pauses/resumes the one under way (action is NULL for a start).
+static int ent_message_rebuild(struct entanglement_device *ent_dev, const char *action, sector_t start, sector_t end) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    int err = 0;
+
+    spin_lock(&m->lock);
+    if (m->suspended) {
+        err = -EBUSY;
+    }else if (!action) {
+        m->rebuild.start = start;
+        m->rebuild.end = end;
+        m->rebuild.pos = 0;
+        m->rebuild.end_pos = 0;
+        m->rebuild.rebuilt = 0;
+        m->rebuild.failed = 0;
+        m->rebuild_restart = true;
+        m->rebuild_state = ENT_SCRUB_RUNNING;
+        queue_work(m->wq, &m->rebuild_work);
+    }else if (!strcasecmp(action, "pause")) {
+        if (m->rebuild_state == ENT_SCRUB_RUNNING) {
+            m->rebuild_state = ENT_SCRUB_PAUSED;
+        }
+    }else if (!strcasecmp(action, "resume")) {
+        if (m->rebuild_state == ENT_SCRUB_PAUSED) {
+            m->rebuild_state = ENT_SCRUB_RUNNING;
+            queue_work(m->wq, &m->rebuild_work);
+        }
+    }else {
+        err = -EINVAL;
+    }
+    spin_unlock(&m->lock);
+
+    return err;
+}
+
+// Starts (or resumes after its gap, see ent_compact_init()) a compaction of the chain, or pauses/resumes the one under way.
+static int ent_message_compact(struct entanglement_device *ent_dev, const char *action) {
+
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    int err = 0;
+
+    spin_lock(&m->lock);
+    if (m->suspended) {
+        err = -EBUSY;
+    }else if (!strcasecmp(action, "start")) {
+        if (READ_ONCE(ent_dev->lag.relaxed)) {
+            err = -EBUSY;
+        }else if (m->compact_state == ENT_SCRUB_IDLE || m->compact_state == ENT_SCRUB_PAUSED) {
+            ent_compact_start(ent_dev);
+        }
+    }else if (!strcasecmp(action, "pause")) {
+        if (m->compact_state == ENT_SCRUB_RUNNING) {
+            m->compact_state = ENT_SCRUB_PAUSED;
+        }
+    }else if (!strcasecmp(action, "resume")) {
+        if (m->compact_state == ENT_SCRUB_PAUSED) {
+            m->compact_state = ENT_SCRUB_RUNNING;
+            queue_work(m->wq, &m->compact_work);
         }
+    }else {
+        err = -EINVAL;
+    }
+    spin_unlock(&m->lock);
+
+    return err;
+}
+
+/*
+    Relaxed durability: the background stage that entangles the writes queued by process_write_bio_relaxed() and writes their parities.
+*/
+
+struct ent_lag_entry {
+    struct list_head node;
+    sector_t sector;
+    u64 queued_ns;
+    // Copy of the data, which the original bio does not keep once it has completed.
+    struct page *data;
+};
+
+// Milliseconds the oldest pending write has been waiting for its parity. Called with the lag lock held.
+static u64 ent_lag_ms(struct ent_parity_lag *lag) {
+
+    struct ent_lag_entry *oldest;
+
+    if (list_empty(&lag->pending)) {
+        return 0;
+    }
+    oldest = list_first_entry(&lag->pending, struct ent_lag_entry, node);
+    return (ktime_get_ns() - oldest->queued_ns) / NSEC_PER_MSEC;
+}
+
+static bool ent_lag_has_room(struct ent_parity_lag *lag) {
+
+    bool room;
+
+    spin_lock(&lag->lock);
+    room = lag->nr_pending < lag->max_blocks && ent_lag_ms(lag) < lag->max_ms;
+    spin_unlock(&lag->lock);
+    return room;
+}
+
+static bool ent_lag_idle(struct ent_parity_lag *lag) {
+
+    bool idle;
+
+    spin_lock(&lag->lock);
+    idle = !lag->nr_pending;
+    spin_unlock(&lag->lock);
+    return idle;
+}
+
+// A write that fails to be entangled is retried this many times, this many milliseconds apart, before it is left unprotected.
+#define ENT_LAG_RETRIES 8
+#define ENT_LAG_RETRY_MS 10
+
+/*
+    A write whose data is on disk but which cannot be entangled. It has completed already, so it cannot fail any more: its sector is
+    left out of the checksums instead, which makes the chain entries of its older data dead (see ent_repair_mark()), so that neither
+    the scrub nor a repair rolls it back. It stays unprotected until it is written again. Called with the metadata buffers lock held.
+*/
+static void ent_lag_unprotected(struct entanglement_device *ent_dev, sector_t sector, int err) {
 
-        next_parity_block = list_entry(next_data_block->list_node.prev, struct entangled_block, list_node);
-        if (test_bit(next_parity_block->block_sector, ent_dev->corrupted_blocks)) {
-            result_state = repair_block_rec(ent_dev, next_parity_block, irrecoverable_blocks_bitmap, direction);
+    ent_dev->sector_checksum_map[sector] = 0;
+    ent_stats_inc(ent_dev->stats, ENT_STAT_LAG_UNPROTECTED);
+    ent_maintenance_error(ent_dev, err);
+    pr_err_ratelimited("Error while entangling the relaxed write of sector %llu, left unprotected: %d\n",
+                       (unsigned long long) sector, err);
+}
+
+/*
+    Entangles up to a batch of the oldest pending writes, in order, then writes their parities with one batch of I/O. 
+    They only leave the pending list once their parity is on disk, so that the lag covers the parity writes in flight.
+    A write that fails to be entangled for lack of memory or on a metadata I/O error ends the batch, and is retried, still in order,
+    a little later. A parity that fails to be written is counted: its entry is in the chain, so the scrub finds the block and repairs it.
+*/
+static void ent_lag_work(struct work_struct *work) {
+
+    struct entanglement_device *ent_dev = container_of(work, struct entanglement_device, lag.work);
+    struct ent_parity_lag *lag = &ent_dev->lag;
+    struct ent_lag_entry *entries[ENT_IO_BATCH];
+    struct page *parity_pages[ENT_IO_BATCH];
+    sector_t parity_sectors[ENT_IO_BATCH];
+    struct ent_lag_entry *entry;
+    struct ent_append_info info;
+    uint batch = ent_io_batch(ent_dev);
+    uint nr, nr_done, nr_parities, i;
+    uint retries = 0;
+    int err;
+
+    for (;;) {
+        nr = 0;
+        spin_lock(&lag->lock);
+        list_for_each_entry(entry, &lag->pending, node) {
+            if (nr == batch) {
+                break;
+            }
+            entries[nr++] = entry;
         }
+        spin_unlock(&lag->lock);
 
-        // If we cannot repair left_parity, then we cannot repair this one as well, so mark it as irrecoverable, and return.
-        if (result_state == IRRECOVERABLE) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+        if (!nr) {
+            return;
         }
 
-    }else { // Direction is RIGHT.
-        // If this block is at the right end of the entanglement (i.e. end), then we mark it as irrecoverable and return. 
-        // This is because the current block is corrupted, and needs others to be fixed, but there are none. 
-        if (block->list_node.next == &ent_dev->entanglement) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+        nr_parities = 0;
+        mutex_lock(&ent_dev->metadata_buffers_lock);
+        for (nr_done = 0 ; nr_done < nr ; nr_done++) {
+            struct page *parity_page = ent_alloc_page(ent_dev);
+
+            err = -ENOMEM;
+            if (parity_page) {
+                err = ent_chain_append(ent_dev, kmap(entries[nr_done]->data), entries[nr_done]->sector, kmap(parity_page), false,
+                                       &info);
+                kunmap(parity_page);
+                kunmap(entries[nr_done]->data);
+                if (err) {
+                    ent_free_page(ent_dev, parity_page);
+                }
+            }
+            if ((err == -ENOMEM || err == -EIO) && retries < ENT_LAG_RETRIES) {
+                break;
+            }
+            if (err) {
+                ent_lag_unprotected(ent_dev, entries[nr_done]->sector, err);
+                continue;
+            }
+            parity_pages[nr_parities] = parity_page;
+            parity_sectors[nr_parities++] = info.parity_sector;
         }
+        mutex_unlock(&ent_dev->metadata_buffers_lock);
 
-        next_data_block = list_entry(block->list_node.next, struct entangled_block, list_node);
-        if (test_bit(next_data_block->block_sector, ent_dev->corrupted_blocks)) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+        if (nr_parities) {
+            err = ent_dev_rwBatch(ent_dev, parity_pages, parity_sectors, nr_parities, WRITE);
+            if (err) {
+                ent_stats_add(ent_dev->stats, ENT_STAT_LAG_UNPROTECTED, nr_parities);
+                ent_maintenance_error(ent_dev, err);
+                pr_err_ratelimited("Error while writing the parities of %u relaxed writes: %d\n", nr_parities, err);
+            }
+        }
+        for (i = 0 ; i < nr_parities ; i++) {
+            ent_free_page(ent_dev, parity_pages[i]);
         }
 
-        next_parity_block = list_entry(next_data_block->list_node.next, struct entangled_block, list_node);
-        if (test_bit(next_parity_block->block_sector, ent_dev->corrupted_blocks)) {
-            result_state = repair_block_rec(ent_dev, next_parity_block, irrecoverable_blocks_bitmap, direction);
+        spin_lock(&lag->lock);
+        for (i = 0 ; i < nr_done ; i++) {
+            list_del(&entries[i]->node);
         }
+        lag->nr_pending -= nr_done;
+        spin_unlock(&lag->lock);
+        wake_up_all(&lag->wait);
 
-        if (result_state == IRRECOVERABLE) {
-            bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-            return IRRECOVERABLE;
+        for (i = 0 ; i < nr_done ; i++) {
+            __free_page(entries[i]->data);
+            kfree(entries[i]);
         }
-    }
 
-    // If we can repair it, then we repair it. Should be the same steps for both directions.
-    // We allocate pages, read the blocks, do the XOR, and write the repaired block.
-    data_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!data_page) {
-        pr_err("Error while allocating data page for parity repair.\n");
-        goto out;
-    }
-    data_page_ptr = kmap(data_page);
-    
-    parity_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!parity_page) {
-        pr_err("Error while allocating parity page for parity repair.\n");
-        goto err_parity_page_alloc;
+        // The rest of the batch waits for the write that failed, which keeps the writes entangled in the order they completed.
+        if (nr_done < nr) {
+            retries++;
+            msleep(ENT_LAG_RETRY_MS);
+        }else {
+            retries = 0;
+        }
     }
-    parity_page_ptr = kmap(parity_page);
+}
 
-    repaired_block_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!repaired_block_page) {
-        pr_err("Error while allocating parity page for parity repair.\n");
-        goto err_repaired_block_page_alloc;
-    }
-    repaired_block_page_ptr = kmap(repaired_block_page);
+static int ent_lag_init(struct entanglement_device *ent_dev, const char *dev_name) {
 
-    err = ent_dev_rwSector(ent_dev, data_page, next_data_block->block_sector, READ);
-    if (err) {
-        pr_err("Error while reading right block in repair process.\n");
-        goto out_2;
-    }
+    struct ent_parity_lag *lag = &ent_dev->lag;
 
-    err = ent_dev_rwSector(ent_dev, parity_page, next_parity_block->block_sector, READ);
-    if (err) {
-        pr_err("Error while reading right block in repair process.\n");
-        goto out_2;
+    lag->wq = alloc_ordered_workqueue("ent_lag_%s", WQ_MEM_RECLAIM, dev_name);
+    if (!lag->wq) {
+        return -ENOMEM;
     }
 
-    for (int i = 0 ; i < ENT_BLOCK_SIZE ; i++) {
-        repaired_block_page_ptr[i] = data_page_ptr[i] ^ parity_page_ptr[i];
-    }
+    INIT_WORK(&lag->work, ent_lag_work);
+    init_rwsem(&lag->mode_sem);
+    spin_lock_init(&lag->lock);
+    INIT_LIST_HEAD(&lag->pending);
+    init_waitqueue_head(&lag->wait);
+    lag->relaxed = false;
+    lag->max_blocks = ent_dev->tuning[ENT_TUNE_LAG_BLOCKS];
+    lag->max_ms = ent_dev->tuning[ENT_TUNE_LAG_MS];
 
-    err = ent_dev_rwSector(ent_dev, repaired_block_page, block->block_sector, WRITE);
-    if (err) {
-        pr_err("Error while writing the repaired block in repair process.\n");
-        goto out_2;
-    }
+    return 0;
+}
 
-    // Current block is repaired, so clear the bit in the corrupted blocks bitmap.
-    bitmap_clear(ent_dev->corrupted_blocks, block->block_sector, 1);
+// Waits until every queued write is entangled and has its parity on disk.
+static void ent_lag_drain(struct entanglement_device *ent_dev) {
 
-    result_state = REPAIRED;
+    flush_workqueue(ent_dev->lag.wq);
+}
 
-out_2:
-    kunmap(repaired_block_page);
-    mempool_free(repaired_block_page, page_pool);
-err_repaired_block_page_alloc:
-    kunmap(parity_page);
-    mempool_free(parity_page, page_pool);
-err_parity_page_alloc:
-    kunmap(data_page);
-    mempool_free(data_page, page_pool);
-out:
+static void ent_lag_exit(struct entanglement_device *ent_dev) {
 
-    return result_state;
+    ent_lag_drain(ent_dev);
+    destroy_workqueue(ent_dev->lag.wq);
 }
 
 /*
-    Starts the block repair, calling the recursive repair of adjacent blocks if necessary. 
+    Switches between strict and relaxed durability. No write is between the choice of its path and the chain meanwhile (see
+    entanglement_tgt_map()). Going back to strict waits for the pending writes before any strict write can be entangled, so that the
+    chain keeps the order of the writes, and every write that completed in strict mode has its parity on disk.
 */
-void repair_block(struct entanglement_device *ent_dev, struct entangled_block *block, unsigned long *irrecoverable_blocks_bitmap) {
-    
-    // We use the REPAIRED state as both a signal that a block has been repaired, or that it was never even corrupted.
-    // The end result is the same, we just want to know if we can repair the current block. 
-    enum RepairState left_state = REPAIRED;
-    enum RepairState right_state = REPAIRED;
-    struct entangled_block *left_block;
-    struct entangled_block *right_block;
+static void ent_lag_set_mode(struct entanglement_device *ent_dev, bool relaxed, uint max_blocks, uint max_ms) {
 
-    int err;
-    struct page *left_page;
-    u8 *left_page_ptr;
-    struct page *right_page;
-    u8 *right_page_ptr;
-    struct page *repaired_block_page;
-    u8 *repaired_block_page_ptr;
+    struct ent_parity_lag *lag = &ent_dev->lag;
 
-    if (block->list_node.prev != &ent_dev->entanglement) {
-        left_block = list_entry(block->list_node.prev, struct entangled_block, list_node);
-        if (test_bit(left_block->block_sector, ent_dev->corrupted_blocks)) {
-            left_state = repair_block_rec(ent_dev, left_block, irrecoverable_blocks_bitmap, LEFT);
-        }
+    down_write(&lag->mode_sem);
+    if (!relaxed) {
+        ent_lag_drain(ent_dev);
     }
 
-    // The check if we are at the end of the entanglement is not needed, since we only call this function for data blocks.
-    right_block = list_entry(block->list_node.prev, struct entangled_block, list_node);
-    if (test_bit(right_block->block_sector, ent_dev->corrupted_blocks)) {
-        right_state = repair_block_rec(ent_dev, right_block, irrecoverable_blocks_bitmap, RIGHT);
+    spin_lock(&lag->lock);
+    lag->relaxed = relaxed;
+    if (relaxed) {
+        lag->max_blocks = max_blocks;
+        lag->max_ms = max_ms;
     }
-    
-    
-    // If even one of the adjacent blocks is irrecoverable, it means we ran into one of the irrecoverable types of failure.
-    if (left_state == IRRECOVERABLE || right_state == IRRECOVERABLE) {
-        bitmap_set(irrecoverable_blocks_bitmap, block->block_sector, 1);
-        return;
+    spin_unlock(&lag->lock);
+    up_write(&lag->mode_sem);
+    wake_up_all(&lag->wait);
+}
+
+// Names of the I/O priority classes, indexed by class.
+static const char * const ent_ioprio_class_names[] = {
+    [IOPRIO_CLASS_NONE] = "none",
+    [IOPRIO_CLASS_RT]   = "rt",
+    [IOPRIO_CLASS_BE]   = "be",
+    [IOPRIO_CLASS_IDLE] = "idle",
+};
+
+/*
+    Target messages (dmsetup message <dev> 0 <message>). All operations but cache_size, chain_window, durability and maint_ioprio are queued, and run asynchronously 
+    on the live device:
+        scrub start|pause|resume    Verify the checksums of all blocks, marking the corrupted ones.
+        repair                      Repair the blocks marked as corrupted.
+        rebuild [<start> <end>]     Rebuild every data block (in the given range of units) from the parities, walking the chain in order.
+        rebuild pause|resume        Pause or resume the rebuild under way.
+        compact start|pause|resume  Compact the chain: drop the entries of blocks written again since, and recompute the parities of the
+                                    others along the shorter chain, a scrub_batch of entries at a time. A compaction interrupted by a
+                                    reload is resumed by start or resume. Repair, rebuild and inject are refused until it is finished.
+                                    A compaction also starts on its own once the chain fills compact_fill percent of the room the
+                                    last one left it, or half as much while the device is idle (see ent_compact_auto()).
+        flush-metadata              Write the metadata buffers to disk.
+        inject <percent>            Corrupt the given percentage of the blocks in the entanglement, uniformly (for testing).
+        inject <pattern> <percent> <seed> [<burst length>]
+                                    Same, with a pattern (uniform, burst, data, parity or pair) and a seed, so that runs can be reproduced.
+        cache_size <units>          Set the capacity of the cache of recent chain blocks (0 disables it).
+        chain_window <segments>     Keep at most this many chain segments (512 blocks each) in memory, paging the others in from the
+                                    metadata log when needed (0 keeps the whole chain, the default).
+        durability strict           Complete writes once both their data and their parity are on disk (the default).
+        durability relaxed [<max lag blocks> <max lag ms>]
+                                    Complete writes once their data is on disk, their parity following within the given lag
+                                    (by default lag_blocks and lag_ms, see ent_tune()). Only with 4KB units, and not during a compaction.
+        maint_ioprio <class> [<level>]
+                                    Set the I/O priority of the scrub, repair, rebuild, compaction and fault injection: none (that of the
+                                    workqueue), rt, be or idle (the default), with a level from 0 (highest) to 7.
+    Their progress and results are reported by the status. Queued operations are refused with -EBUSY while the device is suspended.
+*/
+static int entanglement_tgt_message(struct dm_target *ti, unsigned int argc, char **argv,
+                                    char *result, unsigned int maxlen) {
+
+    struct entanglement_device *ent_dev = ti->private;
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_inject_spec spec = { .burst_length = 1 };
+    uint cache_pages, window, max_blocks, max_ms, level = 0;
+    u64 start, end;
+    int pattern, err;
+
+    if (argc == 2 && !strcasecmp(argv[0], "scrub")) {
+        err = ent_message_scrub(ent_dev, argv[1]);
+        if (err == -EINVAL) {
+            pr_err("Invalid scrub action: %s\n", argv[1]);
+        }
+        return err;
     }
 
-    repaired_block_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!repaired_block_page) {
-        pr_err("Error while allocating new page for the block being repaired.\n");
-        return;
+    if (argc == 1 && !strcasecmp(argv[0], "repair")) {
+        return ent_maintenance_queue(ent_dev, &m->repair_work);
     }
-    repaired_block_page_ptr = kmap(repaired_block_page);
 
-    right_page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!right_page) {
-        pr_err("Error while allocating right page during block repair. \n");
-        goto err_right_page_alloc;
+    if (argc == 1 && !strcasecmp(argv[0], "rebuild")) {
+        return ent_message_rebuild(ent_dev, NULL, 0, ent_dev->dev_size);
     }
-    right_page_ptr = kmap(right_page);
 
-    // Repair the current block, in the case that both adjacent block have the REPAIRED state. 
-    if (block->list_node.prev == &ent_dev->entanglement) {
-        // Just copy the right adjacent block, this means we are at the first data block, so it is the same as the parity next to it.
-        err = ent_dev_rwSector(ent_dev, right_page, right_block->block_sector, READ);
-        if (err) {
-            pr_err("Error while reading right block in repair process.\n");
-            goto out_2;
+    if (argc == 2 && !strcasecmp(argv[0], "rebuild")) {
+        err = ent_message_rebuild(ent_dev, argv[1], 0, 0);
+        if (err == -EINVAL) {
+            pr_err("Invalid rebuild action: %s\n", argv[1]);
         }
+        return err;
+    }
 
-        memcpy(repaired_block_page_ptr, right_page_ptr, ENT_BLOCK_SIZE);
+    if (argc == 3 && !strcasecmp(argv[0], "rebuild")) {
+        if (kstrtou64(argv[1], 10, &start) || kstrtou64(argv[2], 10, &end) || start >= end || end > ent_dev->dev_size) {
+            pr_err("Invalid rebuild range: %s %s\n", argv[1], argv[2]);
+            return -EINVAL;
+        }
+        return ent_message_rebuild(ent_dev, NULL, start, end);
+    }
 
-        err = ent_dev_rwSector(ent_dev, repaired_block_page, block->block_sector, WRITE);
-        if (err) {
-            pr_err("Error while writing the repaired block in repair process.\n");
-            goto out_2;
+    if (argc == 2 && !strcasecmp(argv[0], "compact")) {
+        err = ent_message_compact(ent_dev, argv[1]);
+        if (err == -EINVAL) {
+            pr_err("Invalid compact action: %s\n", argv[1]);
+        }else if (err == -EBUSY && READ_ONCE(ent_dev->lag.relaxed)) {
+            pr_err("The chain cannot be compacted with relaxed durability.\n");
         }
+        return err;
+    }
 
-    }else {
-        // Do the XOR operation between the adjacent blocks. 
+    if (argc == 1 && !strcasecmp(argv[0], "flush-metadata")) {
+        return ent_maintenance_queue(ent_dev, &m->flush_work);
+    }
 
-        left_page = mempool_alloc(page_pool, GFP_NOIO);
-        if (!left_page) {
-            pr_err("Error while allocating left page during block repair. \n");
-            goto out_2;
+    if (argc == 2 && !strcasecmp(argv[0], "inject")) {
+        if (kstrtouint(argv[1], 10, &spec.percent) || spec.percent > 100) {
+            pr_err("Invalid corruption percentage: %s\n", argv[1]);
+            return -EINVAL;
         }
-        left_page_ptr = kmap(left_page);
+        spec.pattern = ENT_INJECT_UNIFORM;
+        spec.seed = get_random_u64();
+        goto queue_inject;
+    }
 
-        err = ent_dev_rwSector(ent_dev, left_page, left_block->block_sector, READ);
-        if (err) {
-            pr_err("Error while reading right block in repair process.\n");
-            goto out;
+    if ((argc == 4 || argc == 5) && !strcasecmp(argv[0], "inject")) {
+        pattern = ent_inject_pattern_parse(argv[1]);
+        if (pattern < 0) {
+            pr_err("Invalid corruption pattern: %s\n", argv[1]);
+            return -EINVAL;
+        }
+        spec.pattern = pattern;
+        if (kstrtouint(argv[2], 10, &spec.percent) || spec.percent > 100) {
+            pr_err("Invalid corruption percentage: %s\n", argv[2]);
+            return -EINVAL;
+        }
+        if (kstrtou64(argv[3], 10, &spec.seed)) {
+            pr_err("Invalid corruption seed: %s\n", argv[3]);
+            return -EINVAL;
+        }
+        if (argc == 5 && (kstrtouint(argv[4], 10, &spec.burst_length) || !spec.burst_length)) {
+            pr_err("Invalid burst length: %s\n", argv[4]);
+            return -EINVAL;
         }
+        goto queue_inject;
+    }
 
-        err = ent_dev_rwSector(ent_dev, right_page, right_block->block_sector, READ);
-        if (err) {
-            pr_err("Error while reading right block in repair process.\n");
-            goto out;
+    if (argc == 2 && !strcasecmp(argv[0], "cache_size")) {
+        if (kstrtouint(argv[1], 10, &cache_pages)) {
+            pr_err("Invalid cache size: %s\n", argv[1]);
+            return -EINVAL;
         }
+        ent_cache_resize(&ent_dev->cache, cache_pages);
+        return 0;
+    }
 
-        for (int i = 0 ; i < ENT_BLOCK_SIZE ; i++) {
-            repaired_block_page_ptr[i] = left_page_ptr[i] ^ right_page_ptr[i];
+    if (argc == 2 && !strcasecmp(argv[0], "chain_window")) {
+        if (kstrtouint(argv[1], 10, &window)) {
+            pr_err("Invalid chain window: %s\n", argv[1]);
+            return -EINVAL;
         }
+        ent_chain_set_window(ent_dev, window);
+        return 0;
+    }
 
-        err = ent_dev_rwSector(ent_dev, repaired_block_page, block->block_sector, WRITE);
-        if (err) {
-            pr_err("Error while writing the repaired block in repair process.\n");
-            goto out;
+    if ((argc == 2 || argc == 3) && !strcasecmp(argv[0], "maint_ioprio")) {
+        int class = match_string(ent_ioprio_class_names, ARRAY_SIZE(ent_ioprio_class_names), argv[1]);
+
+        if (class < 0 || (argc == 3 && (kstrtouint(argv[2], 10, &level) || level >= IOPRIO_NR_LEVELS))) {
+            pr_err("Invalid maintenance I/O priority.\n");
+            return -EINVAL;
         }
+        WRITE_ONCE(m->ioprio, class == IOPRIO_CLASS_NONE ? 0 : IOPRIO_PRIO_VALUE(class, level));
+        return 0;
     }
 
-    // Current block is repaired, so clear the bit in the corrupted blocks bitmap.
-    bitmap_clear(ent_dev->corrupted_blocks, block->block_sector, 1);
-    
-out:
-    kunmap(left_page);
-    mempool_free(left_page, page_pool);
-out_2:
-    kunmap(right_page);
-    mempool_free(right_page, page_pool);
-err_right_page_alloc:
-    kunmap(repaired_block_page);
-    mempool_free(repaired_block_page, page_pool);
-    return;
+    if (argc == 2 && !strcasecmp(argv[0], "durability") && !strcasecmp(argv[1], "strict")) {
+        ent_lag_set_mode(ent_dev, false, 0, 0);
+        return 0;
+    }
 
+    if ((argc == 2 || argc == 4) && !strcasecmp(argv[0], "durability") && !strcasecmp(argv[1], "relaxed")) {
+        // The background stage has no read-modify-write of partially written units.
+        if (ent_dev->unit_blocks > 1) {
+            pr_err("Relaxed durability needs 4KB units.\n");
+            return -EOPNOTSUPP;
+        }
+        if (ent_chain_compacting(ent_dev) || READ_ONCE(m->compact_state) != ENT_SCRUB_IDLE) {
+            pr_err("Relaxed durability cannot be set during a compaction.\n");
+            return -EBUSY;
+        }
+        max_blocks = ent_dev->tuning[ENT_TUNE_LAG_BLOCKS];
+        max_ms = ent_dev->tuning[ENT_TUNE_LAG_MS];
+        if (argc == 4 && (kstrtouint(argv[2], 10, &max_blocks) || !max_blocks || 
+                          kstrtouint(argv[3], 10, &max_ms) || !max_ms)) {
+            pr_err("Invalid lag bounds: %s %s\n", argv[2], argv[3]);
+            return -EINVAL;
+        }
+        ent_lag_set_mode(ent_dev, true, max_blocks, max_ms);
+        return 0;
+    }
+
+    pr_err("Unrecognised message received.\n");
+    return -EINVAL;
+
+queue_inject:
+    spin_lock(&m->lock);
+    m->inject = spec;
+    spin_unlock(&m->lock);
+    return ent_maintenance_queue(ent_dev, &m->inject_work);
+}
+
+/*
+    The chain block cache only holds copies of blocks that are on disk, so all of it can be given back under memory pressure.
+*/
+static unsigned long ent_cache_shrinker_count(struct shrinker *shrinker, struct shrink_control *sc) {
+
+    struct entanglement_device *ent_dev = shrinker->private_data;
+
+    return READ_ONCE(ent_dev->cache.nr_pages);
 }
 
-int repair_corrupted_blocks(struct entanglement_device *ent_dev) {
+static unsigned long ent_cache_shrinker_scan(struct shrinker *shrinker, struct shrink_control *sc) {
 
-    int err;
-    unsigned long *irrecoverable_blocks_bitmap;
-    struct entangled_block *block;
+    struct entanglement_device *ent_dev = shrinker->private_data;
+
+    return ent_cache_shrink(&ent_dev->cache, sc->nr_to_scan);
+}
+
+static int ent_cache_shrinker_init(struct entanglement_device *ent_dev, const char *name) {
 
-    irrecoverable_blocks_bitmap = bitmap_alloc(ent_dev->dev_size, GFP_KERNEL);
-    if (!irrecoverable_blocks_bitmap) {
-        pr_err("Error while allocating bitmap for irrecoverable blocks.\n");
+    ent_dev->cache_shrinker = shrinker_alloc(0, "dm-ent-cache:%s", name);
+    if (!ent_dev->cache_shrinker) {
         return -ENOMEM;
     }
+    ent_dev->cache_shrinker->count_objects = ent_cache_shrinker_count;
+    ent_dev->cache_shrinker->scan_objects = ent_cache_shrinker_scan;
+    ent_dev->cache_shrinker->private_data = ent_dev;
+    shrinker_register(ent_dev->cache_shrinker);
 
-    // Iterate through list and repair blocks. We call the repair_block() recursion only on corrupted, recoverable data blocks. 
-    list_for_each_entry(block, &ent_dev->entanglement, list_node) {
-        if (test_bit(block->block_sector, ent_dev->corrupted_blocks) && 
-            !test_bit(block->block_sector, irrecoverable_blocks_bitmap) && 
-            block->block_sector % 2 == 0) {
+    return 0;
+}
 
-            repair_block(ent_dev, block, irrecoverable_blocks_bitmap);
-        }
+/*
+    Tuning from the queue limits of the underlying device. A rotational disk gets batches of as many blocks as one request can hold,
+    longer scrub batches and a wider parity lag window, so that the parities (half a disk away) are written in fewer seeks. Other devices
+    get batches that leave half of their queue to the writes. The parity placement is part of the on-disk layout, and is not tuned.
+*/
+static const char * const ent_tunable_names[] = {
+    [ENT_TUNE_QUEUE_DEPTH] = "queue_depth",
+    [ENT_TUNE_IO_BATCH]    = "io_batch",
+    [ENT_TUNE_SCRUB_BATCH] = "scrub_batch",
+    [ENT_TUNE_SCRUB_RATE]  = "scrub_rate",
+    [ENT_TUNE_LAG_BLOCKS]  = "lag_blocks",
+    [ENT_TUNE_LAG_MS]      = "lag_ms",
+    [ENT_TUNE_ANCHOR_INTERVAL] = "anchor_interval",
+    [ENT_TUNE_COMPACT_FILL] = "compact_fill",
+};
+
+// Parses a <name>=<value> constructor argument into the tuning overrides of ent_dev.
+static int ent_parse_tunable(struct entanglement_device *ent_dev, const char *arg) {
+
+    const char *value = strchr(arg, '=');
+    uint v;
+    int i;
+
+    if (!value) {
+        return -EINVAL;
     }
 
-    // At this point I have repaired all blocks that can be repaired. 
-    bitmap_free(irrecoverable_blocks_bitmap);
+    for (i = 0 ; i < ENT_TUNE_NR ; i++) {
+        if (strlen(ent_tunable_names[i]) == value - arg && !strncmp(arg, ent_tunable_names[i], value - arg)) {
+            break;
+        }
+    }
+    if (i == ENT_TUNE_NR || kstrtouint(value + 1, 10, &v) || !v || (i == ENT_TUNE_IO_BATCH && v > ENT_IO_BATCH) ||
+        (i == ENT_TUNE_COMPACT_FILL && v > 100)) {
+        return -EINVAL;
+    }
 
-    return err;
+    ent_dev->tuning_overrides[i] = v;
+    return 0;
 }
 
-int check_corruption(struct entanglement_device *ent_dev) {
+/*
+    Parses the value of the unit_kb=<size> constructor argument into the unit of ent_dev: 4 (the default), 16, 64 or 256, or any other
+    power of two in between. The unit is part of the on-disk layout: a device has to be opened with the unit it was initialized with.
+*/
+static int ent_parse_unit(struct entanglement_device *ent_dev, const char *value) {
 
-    int err;
-    sector_t sector; 
-    struct page *page;
-    u8 *page_ptr;
+    uint kb;
 
-    page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!page) {
-        pr_err("Error while allocating page from pool.\n");
-        return -ENOMEM;
+    if (kstrtouint(value, 10, &kb) || kb % (ENT_BLOCK_SIZE / 1024) || !is_power_of_2(kb) ||
+        kb / (ENT_BLOCK_SIZE / 1024) > ENT_MAX_UNIT_BLOCKS) {
+        return -EINVAL;
     }
 
-    page_ptr = kmap(page);
+    ent_dev->unit_blocks = kb / (ENT_BLOCK_SIZE / 1024);
+    return 0;
+}
+
+// Derives the tuning of ent_dev, whose queue depth ent_core_init() has already set, then applies the overrides.
+static void ent_tune(struct entanglement_device *ent_dev) {
+
+    struct block_device *bdev = ent_dev->dev->bdev;
+    uint max_blocks = queue_max_sectors(bdev_get_queue(bdev)) / ent_unit_sectors(ent_dev);
+    uint opt_blocks = bdev_io_opt(bdev) / ent_unit_size(ent_dev);
+    uint *t = ent_dev->tuning;
+    int i;
+
+    ent_dev->rotational = !bdev_nonrot(bdev);
+    t[ENT_TUNE_QUEUE_DEPTH] = ent_dev->queue_depth;
+    t[ENT_TUNE_SCRUB_RATE] = ENT_DEFAULT_SCRUB_RATE / ent_dev->unit_blocks;
+    if (ent_dev->rotational) {
+        t[ENT_TUNE_IO_BATCH] = clamp_t(uint, max_blocks, 8 / ent_dev->unit_blocks, ENT_IO_BATCH);
+        t[ENT_TUNE_SCRUB_BATCH] = 4 * ENT_DEFAULT_SCRUB_BATCH;
+        t[ENT_TUNE_LAG_BLOCKS] = 4 * ENT_DEFAULT_LAG_BLOCKS;
+        t[ENT_TUNE_LAG_MS] = 5 * ENT_DEFAULT_LAG_MS;
+    }else {
+        t[ENT_TUNE_IO_BATCH] = clamp_t(uint, ent_dev->queue_depth / 2, 1, ENT_IO_BATCH);
+        t[ENT_TUNE_SCRUB_BATCH] = ENT_DEFAULT_SCRUB_BATCH;
+        t[ENT_TUNE_LAG_BLOCKS] = ENT_DEFAULT_LAG_BLOCKS;
+        t[ENT_TUNE_LAG_MS] = ENT_DEFAULT_LAG_MS;
+    }
 
-    // Grab the lock for the corrupted blocks bitmap.  
-    if (mutex_lock_interruptible(&ent_dev->corrupted_blocks_lock)) {
-        pr_err("Interrupted while waiting for the lock to the corrputed blocks bitmap.\n");
-        return -EINTR;
+    // Whole optimal I/Os (a RAID stripe, for instance) per batch, when they fit in one.
+    if (opt_blocks && opt_blocks <= t[ENT_TUNE_IO_BATCH]) {
+        t[ENT_TUNE_IO_BATCH] = rounddown(t[ENT_TUNE_IO_BATCH], opt_blocks);
     }
- 
-    for (sector = ent_dev->metadata_size ; sector < ent_dev->dev_size ; sector += 1) {
-        if (ent_dev->sector_checksum_map[sector] != 0) {
-            err = ent_dev_rwSector(ent_dev, page, sector, READ);
-            if (err) {
-                pr_err("Error while reading block at sector %llu which contains data: %d\n", sector, err);
-                goto out;
-            }
 
-            uint checksum = crc32b((unsigned char *)page_ptr);
-            if (checksum != ent_dev->sector_checksum_map[sector]) {
-                // Set the bit corresponding to the sector of this block. 
-                bitmap_set(ent_dev->corrupted_blocks, sector, 1);
-            }
+    for (i = ENT_TUNE_IO_BATCH ; i < ENT_TUNE_NR ; i++) {
+        if (ent_dev->tuning_overrides[i]) {
+            t[i] = ent_dev->tuning_overrides[i];
         }
+    }
+}
+
+/*
+    Live table reloads. dm loads the new table while the old one is still live, suspends the old one, then resumes the new one and only
+    then destroys the old one. A constructor that finds a live device on the same devices therefore does not load the chain: the preresume
+    of the new table takes the chain, the checksums and the tail block over from the suspended old table instead, which takes milliseconds
+    whatever the length of the chain. The settings changed by messages (durability, maintenance I/O priority, cache size and chain window)
+    go with it.
+*/
+static LIST_HEAD(ent_devices);
+static DEFINE_MUTEX(ent_devices_lock);
+
+static struct block_device *ent_meta_bdev(struct entanglement_device *ent_dev) {
+    return ent_dev->meta_dev ? ent_dev->meta_dev->bdev : NULL;
+}
+
+// Returns the live device holding the chain of the same devices as ent_dev, or NULL. Called with ent_devices_lock held.
+static struct entanglement_device *ent_find_chain_owner(struct entanglement_device *ent_dev) {
+
+    struct entanglement_device *other;
 
-        sector += 1;
+    list_for_each_entry(other, &ent_devices, dev_node) {
+        if (other != ent_dev && other->owns_chain && other->dev->bdev == ent_dev->dev->bdev &&
+            ent_meta_bdev(other) == ent_meta_bdev(ent_dev) && other->dev_size == ent_dev->dev_size &&
+            other->unit_blocks == ent_dev->unit_blocks) {
+            return other;
+        }
     }
+    return NULL;
+}
 
-    err = repair_corrupted_blocks(ent_dev);
+/*
+    Carries the scrub, the rebuild, the compaction, the maintenance results the status reports, and the maintenance I/O priority, over
+    to the table that takes the chain.
+*/
+static void ent_maintenance_handover(struct entanglement_device *to, struct entanglement_device *from) {
+
+    struct ent_maintenance *m = &to->maintenance;
+    struct ent_maintenance *old = &from->maintenance;
+    enum ent_scrub_state scrub_state, rebuild_state, compact_state;
+    struct ent_rebuild rebuild;
+    bool rebuild_restart;
+    sector_t scrub_pos;
+    u64 scrub_checked, scrub_corrupted, scrub_passes, last_repaired, last_irrecoverable, last_injected;
+    u64 compact_pos, compact_end, compact_moved, compact_reclaimed, compact_repaired, compact_failed;
+    unsigned short ioprio;
+    int last_error;
+
+    spin_lock(&old->lock);
+    scrub_state = old->scrub_state;
+    scrub_pos = old->scrub_pos;
+    scrub_checked = old->scrub_checked;
+    scrub_corrupted = old->scrub_corrupted;
+    scrub_passes = old->scrub_passes;
+    last_repaired = old->last_repaired;
+    last_irrecoverable = old->last_irrecoverable;
+    last_injected = old->last_injected;
+    last_error = old->last_error;
+    rebuild_state = old->rebuild_state;
+    rebuild = old->rebuild;
+    rebuild_restart = old->rebuild_restart;
+    compact_state = old->compact_state;
+    compact_pos = old->compact_pos;
+    compact_end = old->compact_end;
+    compact_moved = old->compact_moved;
+    compact_reclaimed = old->compact_reclaimed;
+    compact_repaired = old->compact_repaired;
+    compact_failed = old->compact_failed;
+    ioprio = old->ioprio;
+    old->scrub_state = ENT_SCRUB_IDLE;
+    old->rebuild_state = ENT_SCRUB_IDLE;
+    old->compact_state = ENT_SCRUB_IDLE;
+    spin_unlock(&old->lock);
+
+    // The running XOR stays with the old table: the rebuild reads the previous parity again where it goes on.
+    rebuild.parity = m->rebuild.parity;
+    rebuild.parity_valid = false;
+
+    spin_lock(&m->lock);
+    m->scrub_state = scrub_state;
+    m->scrub_pos = scrub_pos;
+    m->scrub_checked = scrub_checked;
+    m->scrub_corrupted = scrub_corrupted;
+    m->scrub_passes = scrub_passes;
+    m->last_repaired = last_repaired;
+    m->last_irrecoverable = last_irrecoverable;
+    m->last_injected = last_injected;
+    m->last_error = last_error;
+    m->rebuild_state = rebuild_state;
+    m->rebuild = rebuild;
+    m->rebuild_restart = rebuild_restart;
+    m->compact_state = compact_state;
+    m->compact_pos = compact_pos;
+    m->compact_end = compact_end;
+    m->compact_moved = compact_moved;
+    m->compact_reclaimed = compact_reclaimed;
+    m->compact_repaired = compact_repaired;
+    m->compact_failed = compact_failed;
+    m->ioprio = ioprio;
+    spin_unlock(&m->lock);
+}
 
-out:
-    kunmap(page);
-    mempool_free(page, page_pool);
-    mutex_unlock(&ent_dev->corrupted_blocks_lock);
+// Carries the durability mode, with its lag bounds, over to the table that takes the chain. The old table has drained its stage.
+static void ent_lag_handover(struct entanglement_device *to, struct entanglement_device *from) {
 
-    return err;
+    struct ent_parity_lag *old = &from->lag;
+    uint max_blocks, max_ms;
+    bool relaxed;
+
+    spin_lock(&old->lock);
+    relaxed = old->relaxed;
+    max_blocks = old->max_blocks;
+    max_ms = old->max_ms;
+    spin_unlock(&old->lock);
+
+    ent_lag_set_mode(to, relaxed, max_blocks, max_ms);
 }
 
 static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **argv) {
@@ -627,15 +1411,19 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
     struct entanglement_device *ent_dev;
     int err;
     char *dev_path;
+    char *meta_path = NULL;
     uint dev_size;
+    uint queue_depth;
     int redundancy_flag;
 
     uint corrupt_chance;
 
     int init_flag;
 
-    // We have four arguments here: the device path, size of the device as number of 4KB blocks, redundancy flag, and the init flag. 
-    if (argc != 5) {
+    // We have five arguments here: the device path, size of the device as number of 4KB blocks, redundancy flag, the init flag 
+    // and the corruption chance, optionally followed by the path of a separate metadata device, by the entanglement unit
+    // (unit_kb=<size>, see ent_parse_unit()) and by tuning overrides (<name>=<value>, see ent_tune()).
+    if (argc < 5) {
         ti->error = "Invaid argument count";
         return -EINVAL;
     }
@@ -652,25 +1440,25 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
         goto err_dev_allocation;
     }
 
-    ent_dev->dev_size = dev_size;
-
-    // Number of blocks for metadata. Calculated as number of 4KB blocks (dev_size) * 0.002929688.
-    // This number (0.002929688) we get from the fact that for every 4096 bytes, we have a 12-byte overhead. (12/4096) 
-    ent_dev->metadata_size = (dev_size * 3U) >> 10;
-    ent_dev->metadata_sector_size = (ent_dev->metadata_size * 2U) / 3U;
-    ent_dev->metadata_checksum_size = (ent_dev->metadata_size * 1U) / 3U;
+    ent_dev->redundancy_flag = redundancy_flag;
+    ent_dev->init_flag = init_flag;
+    ent_dev->corrupt_chance = corrupt_chance;
 
-    // Calculating the starting sector of the metadata, and the scale with which we redirect the writes of parity blocks.
-    ent_dev->metadata_start_sector = ((dev_size - ent_dev->metadata_size) / 2) / 8 * 8;
-    ent_dev->write_sector_scale = ((dev_size - ent_dev->metadata_size)/2 / 8 * 8) + ent_dev->metadata_size;
-
-    // We have this initialization here and also in the load function, 
-    // since we do not call load in the case when the device is being opened for the first time.
-    ent_dev->next_sector = ent_dev->metadata_start_sector;
-    ent_dev->next_checksum = ent_dev->metadata_start_sector + ent_dev->metadata_sector_size;
-
-    mutex_init(&ent_dev->entanglement_lock);
-    INIT_LIST_HEAD(&ent_dev->entanglement);
+    for (int i = 5 ; i < argc ; i++) {
+        if (!strncmp(argv[i], "unit_kb=", 8)) {
+            err = ent_parse_unit(ent_dev, argv[i] + 8);
+        }else if (strchr(argv[i], '=')) {
+            err = ent_parse_tunable(ent_dev, argv[i]);
+        }else {
+            err = (i == 5) ? 0 : -EINVAL;
+            meta_path = argv[i];
+        }
+        if (err) {
+            pr_err("Invalid argument: %s\n", argv[i]);
+            ti->error = "Invalid tuning argument";
+            goto err_args;
+        }
+    }
 
     err = dm_get_device(ti, dev_path, dm_table_get_mode(ti->table), &ent_dev->dev);
     if (err) {
@@ -678,49 +1466,60 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
         goto err_dm_get_dev;
     }
 
-    mutex_init(&ent_dev->corrupted_blocks_lock);
-
-    ent_dev->corrupted_blocks = bitmap_alloc(dev_size, GFP_KERNEL);
-    if (!ent_dev->corrupted_blocks) {
-        pr_err("Error while allocating bitmap for corrupted blocks.\n");
-        err = -ENOMEM;
-        goto err_bitmap_alloc;
+    // The metadata device must be known before the layout is computed.
+    if (meta_path) {
+        err = dm_get_device(ti, meta_path, dm_table_get_mode(ti->table), &ent_dev->meta_dev);
+        if (err) {
+            pr_err("Error when calling dm_get_device for the metadata device: %d\n", err);
+            ti->error = "Could not open the metadata device";
+            goto err_dm_get_meta_dev;
+        }
     }
 
-    ent_dev->sector_checksum_map = kzalloc(dev_size * sizeof(uint), GFP_KERNEL);
-    if (!ent_dev->sector_checksum_map) {
-        pr_err("Error while allocating sector->checksum map.\n");
-        err = -ENOMEM;
-        goto err_sector_checksum_map_alloc;
+    // The pools are sized from the number of requests the underlying device queues (0 for bio-based devices: use the default),
+    // unless the table gives the queue depth.
+    queue_depth = ent_dev->tuning_overrides[ENT_TUNE_QUEUE_DEPTH];
+    if (!queue_depth) {
+        queue_depth = bdev_get_queue(ent_dev->dev->bdev)->nr_requests;
     }
+    err = ent_core_init(ent_dev, dev_size, queue_depth);
+    if (err) {
+        pr_err("Error while initializing the entanglement: %d\n", err);
+        goto err_core_init;
+    }
+    ent_tune(ent_dev);
 
-    ent_dev->last_entangled_block = kzalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
-    if (!ent_dev->last_entangled_block) {
-        pr_err("Error while allocating the last_entangled_block buffer.\n");
-        err = -ENOMEM;
-        goto err_last_buffer_alloc;
+    if (ent_dev->meta_dev && 
+        bdev_nr_sectors(ent_dev->meta_dev->bdev) < ent_meta_dev_blocks(ent_dev) * ENT_DEV_SECTOR_SCALE) {
+        pr_err("The metadata device needs at least %llu blocks.\n", (u64)ent_meta_dev_blocks(ent_dev));
+        ti->error = "Metadata device too small";
+        err = -EINVAL;
+        goto err_meta_dev_size;
     }
 
-    mutex_init(&ent_dev->metadata_buffers_lock);
+    ent_dev->chain_window = READ_ONCE(chain_window);
+    init_waitqueue_head(&ent_dev->unit_wait);
+    atomic_set(&ent_dev->writes_in_flight, 0);
 
-    ent_dev->block_sector_buffer = kmalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
-    if (!ent_dev->block_sector_buffer) {
-        pr_err("Error while allocating the buffer for periodically writing block sectors to disk.\n");
-        err = -ENOMEM;
-        goto err_sector_buffer_alloc;
+    // Every write in flight needs a data bio (a clone in relaxed durability) and a parity bio, and the core submits up to a batch of bios at once.
+    ent_dev->bioset_size = 2 * ent_dev->queue_depth + ENT_IO_BATCH;
+    err = bioset_init(&ent_dev->bioset, ent_dev->bioset_size, 0, BIOSET_NEED_BVECS);
+    if (err) {
+        pr_err("Error while initializing the bioset: %d\n", err);
+        goto err_bioset_init;
     }
-    ent_dev->sector_buffer_size = 0;
 
-    ent_dev->block_checksum_buffer = kmalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
-    if (!ent_dev->block_checksum_buffer) {
-        pr_err("Error while allocating the buffer for periodically writing block checksums to disk.\n");
-        err = -ENOMEM;
-        goto err_checksum_buffer_alloc;
+    // On a reload of a live device (without fault injection, which works on a loaded chain), the chain is taken over from the table
+    // being replaced by entanglement_tgt_preresume().
+    if (!init_flag && !corrupt_chance) {
+        mutex_lock(&ent_devices_lock);
+        ent_dev->handover_pending = ent_find_chain_owner(ent_dev) != NULL;
+        mutex_unlock(&ent_devices_lock);
     }
-    ent_dev->checksum_buffer_size = 0;
+    ent_dev->owns_chain = !ent_dev->handover_pending;
 
     // We are only NOT loading the entanglement if this is the first time this device is being opened. 
-    if (!init_flag) {
+    if (!init_flag && !ent_dev->handover_pending) {
         err = load_entanglement_and_checksums(ent_dev);
         if (err) {
             pr_err("Error while loading entanglement and checksums: %d\n", err);
@@ -729,7 +1528,15 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
     }
 
     if (corrupt_chance > 0) {
-        err = corrupt_blocks(ent_dev, corrupt_chance);
+        struct ent_inject_spec spec = {
+            .pattern = ENT_INJECT_UNIFORM,
+            .percent = corrupt_chance,
+            .burst_length = 1,
+            .seed = get_random_u64(),
+        };
+        u64 injected;
+
+        err = corrupt_blocks(ent_dev, &spec, &injected);
         if (err) {
             pr_err("Error while corrupting blocks: %d\n", err);
             goto err_corruption;
@@ -737,7 +1544,7 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
     }
     
 
-    if (redundancy_flag) {
+    if (redundancy_flag && !ent_dev->handover_pending) {
         err = check_corruption(ent_dev);
         if (err) {
             pr_err("Error while checking for corruption: %d\n", err);
@@ -745,32 +1552,64 @@ static int entanglement_tgt_ctr(struct dm_target *ti, unsigned int argc, char **
         }
     }
 
-    ti->max_io_len = ENT_BLOCK_SIZE;
-    ti->num_flush_bios = 1;
+    err = ent_maintenance_init(ent_dev, dm_device_name(dm_table_get_md(ti->table)));
+    if (err) {
+        pr_err("Error while creating the maintenance workqueue: %d\n", err);
+        goto err_maintenance_init;
+    }
+
+    ent_scrub_restore_checkpoint(ent_dev);
+    ent_compact_restore(ent_dev);
+
+    err = ent_lag_init(ent_dev, dm_device_name(dm_table_get_md(ti->table)));
+    if (err) {
+        pr_err("Error while creating the parity workqueue: %d\n", err);
+        goto err_lag_init;
+    }
+
+    err = ent_cache_shrinker_init(ent_dev, dm_device_name(dm_table_get_md(ti->table)));
+    if (err) {
+        pr_err("Error while registering the cache shrinker: %d\n", err);
+        goto err_shrinker_init;
+    }
+
+    // At most one unit per bio, in 512-byte sectors: dm splits larger bios on unit boundaries.
+    ti->max_io_len = ent_unit_sectors(ent_dev);
+    // With a metadata device, flushes have to reach it too (see the map function).
+    ti->num_flush_bios = ent_dev->meta_dev ? 2 : 1;
     ti->num_secure_erase_bios = 1;
     ti->num_write_zeroes_bios = 1;
     ti->num_discard_bios = 1;
+    ti->per_io_data_size = sizeof(struct ent_io);
     ti->private = ent_dev;
 
+    mutex_lock(&ent_devices_lock);
+    list_add(&ent_dev->dev_node, &ent_devices);
+    mutex_unlock(&ent_devices_lock);
+
     return 0;
 
 
+err_shrinker_init:
+    ent_lag_exit(ent_dev);
+err_lag_init:
+    ent_maintenance_exit(ent_dev);
+err_maintenance_init:
 err_check_corruption:
 err_corruption:
 err_loading:
-    kfree(ent_dev->block_checksum_buffer);
-err_checksum_buffer_alloc:
-    kfree(ent_dev->block_sector_buffer);
-err_sector_buffer_alloc:
-    kfree(ent_dev->last_entangled_block);
-err_buffer_alloc:
-err_dm_get_dev:
-err_last_buffer_alloc:
-    kfree(ent_dev->sector_checksum_map);
-err_sector_checksum_map_alloc:
-    kfree(ent_dev->corrupted_blocks);
-err_bitmap_alloc:
+    bioset_exit(&ent_dev->bioset);
+err_bioset_init:
+err_meta_dev_size:
+    ent_core_exit(ent_dev);
+err_core_init:
+    if (ent_dev->meta_dev) {
+        dm_put_device(ti, ent_dev->meta_dev);
+    }
+err_dm_get_meta_dev:
     dm_put_device(ti, ent_dev->dev);
+err_dm_get_dev:
+err_args:
     kfree(ent_dev);
 err_dev_allocation:
     return err;
@@ -780,393 +1619,816 @@ static void entanglement_tgt_dtr(struct dm_target *ti) {
 
     struct entanglement_device *ent_dev = (struct entanglement_device *) ti->private;
 
-    // Store the entanglement list and checksums. Actually just flushes the buffers in case of leftover metadata. 
-    store_entanglement_and_checksums(ent_dev);
+    mutex_lock(&ent_devices_lock);
+    list_del(&ent_dev->dev_node);
+    mutex_unlock(&ent_devices_lock);
 
+    // Wait for the parities still to be written and for queued maintenance operations, which use everything below.
+    ent_lag_exit(ent_dev);
+    ent_maintenance_exit(ent_dev);
+    shrinker_free(ent_dev->cache_shrinker);
+
+    // Store the entanglement and checksums. Actually just flushes the buffers in case of leftover metadata. 
+    // Not when the chain was handed over to the table that replaced this one, or never loaded: the metadata is not ours to write.
+    if (ent_dev->owns_chain) {
+        store_entanglement_and_checksums(ent_dev);
+    }
+
+    bioset_exit(&ent_dev->bioset);
+    ent_core_exit(ent_dev);
+    if (ent_dev->meta_dev) {
+        dm_put_device(ti, ent_dev->meta_dev);
+    }
     dm_put_device(ti, ent_dev->dev);
-    kfree(ent_dev->block_checksum_buffer);
-    kfree(ent_dev->block_sector_buffer);
-    kfree(ent_dev->last_entangled_block);
-    kfree(ent_dev->sector_checksum_map);
-    bitmap_free(ent_dev->corrupted_blocks);
     kfree(ent_dev);
 }
 /*
     Functions that process read/write requests. 
 */
 
-static void ent_dev_read_end_io(struct bio *bio) {
+/*
+    Called once for every bio that was submitted on behalf of an original bio. The last one completes the original bio 
+    and records its map-to-completion latency in the given histogram. 
+*/
+static void ent_io_put(struct bio *orig_bio, blk_status_t status, enum ent_histogram hist) {
+
+    struct ent_io *io = dm_per_bio_data(orig_bio, sizeof(struct ent_io));
+
+    if (unlikely(status)) {
+        WRITE_ONCE(io->status, status);
+    }
+
+    if (!atomic_dec_and_test(&io->pending)) {
+        return;
+    }
+
+    ent_stats_latency(io->ent_dev->stats, hist, io->start_ns);
+    if (atomic_dec_and_test(&io->ent_dev->writes_in_flight)) {
+        wake_up_all(&io->ent_dev->unit_wait);
+    }
+
+    orig_bio->bi_status = READ_ONCE(io->status);
+    bio_endio(orig_bio);
+}
+
+/*
+    Reads go straight to the underlying device: the bio is remapped rather than cloned, so that dm submits it itself and can poll it
+    (REQ_POLLED), and nothing on the way can block a REQ_NOWAIT read. Its latency is accounted by entanglement_tgt_end_io().
+*/
+static int process_read_bio(struct entanglement_device *ent_dev, struct bio *bio) {
+
+    bio_set_dev(bio, ent_dev->dev->bdev);
+    ent_stats_inc(ent_dev->stats, ENT_STAT_READS);
+
+    return DM_MAPIO_REMAPPED;
+}
+
+static void ent_dev_write_end_io(struct bio *bio) {
 
     struct bio *orig_bio = bio->bi_private;
+    struct ent_io *io = dm_per_bio_data(orig_bio, sizeof(struct ent_io));
+    blk_status_t status = bio->bi_status;
+
+    // The parity page has to be returned before the bio (and its bio_vec) is freed.
+    ent_free_page(io->ent_dev, bio->bi_io_vec->bv_page);
+    bio_put(bio);
 
     bio_put(orig_bio);
-    bio_endio(orig_bio);
+    ent_io_put(orig_bio, status, ENT_HIST_WRITE);
+}
+
+// Counter of the in-flight writes of the slot of a unit.
+static inline atomic_t *ent_unit_writes(struct entanglement_device *ent_dev, sector_t unit) {
+    return &ent_dev->unit_writes[unit % ENT_UNIT_WRITE_SLOTS];
+}
+
+// Data write of a unit: releases its slot, for the writes of a part of the unit waiting to read it (see ent_fill_unit()).
+static void ent_dev_write_end_io_unit(struct bio *bio) {
+
+    struct ent_io *io = dm_per_bio_data(bio->bi_private, sizeof(struct ent_io));
+    struct entanglement_device *ent_dev = io->ent_dev;
+
+    atomic_dec(ent_unit_writes(ent_dev, io->unit));
+    wake_up_all(&ent_dev->unit_wait);
+
+    ent_dev_write_end_io(bio);
+}
+
+static void ent_dev_write_end_io_clone(struct bio *bio) {
+
+    struct bio *orig_bio = bio->bi_private;
+    blk_status_t status = bio->bi_status;
 
     bio_put(bio);
+
+    bio_put(orig_bio);
+    ent_io_put(orig_bio, status, ENT_HIST_WRITE);
 }
 
-int process_read_bio(struct entanglement_device *ent_dev, struct bio *bio) {
+/*
+    Once a write is accepted, the bios the target submits for it must neither be turned away (the chain already holds the block) nor be 
+    polled (dm only polls the bios it submits itself), whatever the original bio asked for.
+*/
+#define ENT_OWN_BIO_CLEAR (REQ_NOWAIT | REQ_POLLED)
 
-    int err;
-    struct bio *cloned_bio;
+/*
+    Write path of the relaxed durability mode: the data is copied for the background stage, which entangles it later (see ent_lag_work()),
+    and the original bio completes with the data write alone. Writers wait while the stage is beyond its bounds, and writes that
+    carry a flush for the stage to catch up, since the flush covers the parities of the writes before it. REQ_NOWAIT writes are 
+    turned away instead. Returns a DM_MAPIO_* value, like process_write_bio().
+*/
+static int process_write_bio_relaxed(struct entanglement_device *ent_dev, struct bio *bio) {
 
-    bio_get(bio);
+    struct ent_parity_lag *lag = &ent_dev->lag;
+    bool nowait = bio->bi_opf & REQ_NOWAIT;
+    gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_NOIO;
+    struct ent_lag_entry *entry;
+    struct bio *data_bio;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
+    size_t offset = 0;
+    u8 *data_ptr;
+    int err;
 
-    cloned_bio = bio_alloc_clone(ent_dev->dev->bdev, bio, GFP_NOIO, &bioset);
-    if (!cloned_bio) {
-        pr_err("Error while cloning bio for read.\n");
-        err = -ENOMEM;
-        goto err_bio_cloning;
+    entry = kmalloc(sizeof(*entry), gfp);
+    if (!entry) {
+        goto err_entry_alloc;
+    }
+    entry->data = alloc_page(gfp);
+    if (!entry->data) {
+        kfree(entry);
+        goto err_entry_alloc;
     }
 
-    cloned_bio->bi_end_io = ent_dev_read_end_io;
-    cloned_bio->bi_private = bio;
+    if (nowait) {
+        if (!((bio->bi_opf & REQ_PREFLUSH) ? ent_lag_idle(lag) : ent_lag_has_room(lag))) {
+            __free_page(entry->data);
+            kfree(entry);
+            bio_wouldblock_error(bio);
+            return DM_MAPIO_SUBMITTED;
+        }
+    }else if (bio->bi_opf & REQ_PREFLUSH) {
+        wait_event(lag->wait, ent_lag_idle(lag));
+    }else {
+        wait_event(lag->wait, ent_lag_has_room(lag));
+    }
 
-    submit_bio(cloned_bio);
-    
-    return 0;
+    bio_get(bio);
 
-err_bio_cloning:
-    bio_put(bio);
+    data_bio = bio_alloc_clone(ent_dev->dev->bdev, bio, gfp, &ent_dev->bioset);
+    if (!data_bio) {
+        err = nowait ? -EAGAIN : -ENOMEM;
+        if (!nowait) {
+            pr_err("Error while cloning bio for write.\n");
+        }
+        goto err_bio_cloning;
+    }
+    data_bio->bi_opf &= ~ENT_OWN_BIO_CLEAR;
 
-    return err;
-}
+    entry->sector = bio->bi_iter.bi_sector / ENT_DEV_SECTOR_SCALE;
+    entry->queued_ns = ktime_get_ns();
+    // The bio is only contiguous in the sectors: its data is copied segment by segment, as in ent_fill_unit().
+    data_ptr = kmap(entry->data);
+    bio_for_each_segment(bvec, bio, iter) {
+        memcpy_from_bvec(data_ptr + offset, &bvec);
+        offset += bvec.bv_len;
+    }
+    kunmap(entry->data);
 
-static void ent_dev_write_end_io(struct bio *bio) {
+    data_bio->bi_iter.bi_sector = entry->sector * ENT_DEV_SECTOR_SCALE;
+    data_bio->bi_end_io = ent_dev_write_end_io_clone;
+    data_bio->bi_private = bio;
+    atomic_set(&((struct ent_io *) dm_per_bio_data(bio, sizeof(struct ent_io)))->pending, 1);
+    atomic_inc(&ent_dev->writes_in_flight);
 
-    struct bio *orig_bio = bio->bi_private;
+    spin_lock(&lag->lock);
+    list_add_tail(&entry->node, &lag->pending);
+    lag->nr_pending++;
+    lag->peak_blocks = max(lag->peak_blocks, lag->nr_pending);
+    spin_unlock(&lag->lock);
+    queue_work(lag->wq, &lag->work);
 
-    bio_put(orig_bio);
-    bio_endio(orig_bio);
+    submit_bio(data_bio);
+    return DM_MAPIO_SUBMITTED;
 
+err_bio_cloning:
     bio_put(bio);
-    mempool_free(bio->bi_io_vec->bv_page, page_pool);
-}
-
-static void ent_dev_write_end_io_clone(struct bio *bio) {
+    __free_page(entry->data);
+    kfree(entry);
 
-    struct bio *orig_bio = bio->bi_private;
-
-    bio_put(orig_bio);
-    bio_endio(orig_bio);
+    bio->bi_status = (err == -EAGAIN) ? BLK_STS_AGAIN : BLK_STS_IOERR;
+    bio_endio(bio);
+    return DM_MAPIO_SUBMITTED;
 
-    bio_put(bio);
+err_entry_alloc:
+    if (nowait) {
+        bio_wouldblock_error(bio);
+        return DM_MAPIO_SUBMITTED;
+    }
+    pr_err("Error while allocating a lag entry.\n");
+    return DM_MAPIO_KILL;
 }
 
-int flush_metadata(struct entanglement_device *ent_dev, enum BufferType type) {
+/*
+    Builds the content of the unit written by bio into the unit page. A bio that covers part of the unit only is merged into the unit read
+    from the device, once the writes of its slot in flight are done: the read must see the data of the writes entangled before it.
+    Called with the metadata buffers lock held, which orders the reads against the appends. REQ_NOWAIT writes of a part of a unit
+    are turned away.
+*/
+static int ent_fill_unit(struct entanglement_device *ent_dev, struct bio *bio, sector_t unit, struct page *unit_page, bool nowait) {
 
-    char *buffer = (type == SECTOR) ? ent_dev->block_sector_buffer : ent_dev->block_checksum_buffer;
-    sector_t sector = (type == SECTOR) ? ent_dev->next_sector : ent_dev->next_checksum;
-    struct page *page;
-    u8 *page_ptr;
+    u8 *unit_ptr = page_address(unit_page);
+    size_t offset = (bio->bi_iter.bi_sector - unit * ent_unit_sectors(ent_dev)) << SECTOR_SHIFT;
+    struct bio_vec bvec;
+    struct bvec_iter iter;
     int err;
 
-    page = mempool_alloc(page_pool, GFP_NOIO);
-    if (!page) {
-        pr_err("Error while allocating new page for parity.\n");
-        return -ENOMEM;
-    }
-
-    page_ptr = kmap(page);
-    memcpy(page_ptr, buffer, ENT_BLOCK_SIZE);
+    if (bio->bi_iter.bi_size != ent_unit_size(ent_dev)) {
+        if (nowait) {
+            return -EAGAIN;
+        }
+        wait_event(ent_dev->unit_wait, !atomic_read(ent_unit_writes(ent_dev, unit)));
 
-    err = ent_dev_rwSector(ent_dev, page, sector, WRITE);
-    if (err) {
-        pr_err("Error while flushing buffer of type %d.\n", type);
-        goto out;
+        err = ent_dev_rwSector(ent_dev, unit_page, unit, READ);
+        if (err) {
+            pr_err("Error while reading unit %llu for a partial write.\n", (unsigned long long) unit);
+            return err;
+        }
     }
 
-    // Reset buffer. 
-    if (type == SECTOR) {
-        memset(buffer, 0xFF, sizeof(buffer));
-        ent_dev->sector_buffer_size = 0;
-
-        // Update sector. 
-        ent_dev->next_sector += 1;
-    }else {
-        memset(buffer, 0xFF, sizeof(buffer));
-        ent_dev->checksum_buffer_size = 0;
-
-        // Update sector. 
-        ent_dev->next_checksum += 1;
+    bio_for_each_segment(bvec, bio, iter) {
+        memcpy_from_bvec(unit_ptr + offset, &bvec);
+        offset += bvec.bv_len;
     }
 
-out:   
-    kunmap(page);
-    // Free the page. 
-    mempool_free(page, page_pool);
-
-    return err;
+    return 0;
 }
 
-int process_write_bio(struct entanglement_device *ent_dev, struct bio *bio) {
+/*
+    Write path of strict durability (process_write_bio_relaxed() is the other). A REQ_NOWAIT write is completed with BLK_STS_AGAIN
+    instead of waiting: for a page of the pool, for the metadata buffers lock, for maintenance work holding the chain, or for a
+    metadata flush or chain segment allocation of its append (see ent_chain_append_would_block()). io_uring then retries it from a
+    context that can block.
+    Returns DM_MAPIO_SUBMITTED once the bio is submitted or completed, whether it failed or not, and DM_MAPIO_KILL when it failed
+    before being touched, for dm to complete it.
+    The data unit is built in a page of the pool (see ent_fill_unit()) rather than cloned from the bio: the bio may spread it over several
+    segments, and it is entangled, and its checksum computed, as one buffer.
+*/
+static int process_write_bio(struct entanglement_device *ent_dev, struct bio *bio) {
 
+    bool nowait = bio->bi_opf & REQ_NOWAIT;
+    gfp_t gfp = nowait ? GFP_NOWAIT | __GFP_NOWARN : GFP_NOIO;
     struct bio *data_bio;
     struct bio *parity_bio;
     sector_t data_sector;
-    sector_t parity_sector;
     int err;
     
-    char *data_buffer;
+    struct page *data_page;
     struct page *parity_page;
     u8 *parity_page_ptr;
-    char *parity_buffer;
-    struct bio_vec bvec;
-    struct bvec_iter iter;
+    struct ent_append_info info = { 0 };
+    u64 lock_start_ns;
+    u64 lock_ns;
+    bool compact;
 
-    struct page *sector_page;
-    struct page *checksum_page;
-    u8 *sector_page_ptr;
-    u8 *checksum_page_ptr;
+    // Breakdown of the write duration, only measured when the ent_write_end tracepoint is enabled.
+    bool traced = trace_ent_write_end_enabled();
+    u64 start_ns = traced ? ktime_get_ns() : 0;
+
+    trace_ent_write_start(bio->bi_iter.bi_sector);
+
+    // The core works with units, the bio with 512-byte sectors.
+    data_sector = bio->bi_iter.bi_sector / ent_unit_sectors(ent_dev);
+
+    data_page = nowait ? ent_try_alloc_page(ent_dev) : ent_alloc_page(ent_dev);
+    if (!data_page) {
+        if (nowait) {
+            goto err_would_block_no_page;
+        }
+        pr_err("Error while allocating new page for a data unit.\n");
+        return DM_MAPIO_KILL;
+    }
 
     // Allocation of the new page needed for the parity block. 
-    parity_page = mempool_alloc(page_pool, GFP_NOIO);
+    parity_page = nowait ? ent_try_alloc_page(ent_dev) : ent_alloc_page(ent_dev);
     if (!parity_page) {
+        ent_free_page(ent_dev, data_page);
+        if (nowait) {
+            goto err_would_block_no_page;
+        }
         pr_err("Error while allocating new page for parity.\n");
-        return -ENOMEM;
+        return DM_MAPIO_KILL;
     }
 
     parity_page_ptr = kmap(parity_page);
 
     // Grab the lock for the metadata buffers. 
-    if (mutex_lock_interruptible(&ent_dev->metadata_buffers_lock)) {
+    lock_start_ns = ktime_get_ns();
+    if (nowait) {
+        if (!mutex_trylock(&ent_dev->metadata_buffers_lock)) {
+            goto err_would_block;
+        }
+        // The repair, rebuild and fault injection hold the chain across their I/O.
+        if (ent_chain_append_would_block(ent_dev) || mutex_is_locked(&ent_dev->entanglement_lock)) {
+            mutex_unlock(&ent_dev->metadata_buffers_lock);
+            goto err_would_block;
+        }
+    }else if (mutex_lock_interruptible(&ent_dev->metadata_buffers_lock)) {
         pr_err("Interrupted while waiting for the lock to the metadata buffers.\n");
-        return -EINTR;
+        kunmap(parity_page);
+        ent_free_page(ent_dev, parity_page);
+        ent_free_page(ent_dev, data_page);
+        return DM_MAPIO_KILL;
     }
+    lock_ns = ktime_get_ns() - lock_start_ns;
+    ent_stats_add(ent_dev->stats, ENT_STAT_METADATA_LOCK_WAIT_NS, lock_ns);
+
+    // The I/O of the append is this write's (see ent_bio_set_origin()).
+    ent_dev->append_bio = bio;
+    WRITE_ONCE(ent_dev->append_task, current);
 
     bio_get(bio);
 
-    data_bio = bio_alloc_clone(ent_dev->dev->bdev, bio, GFP_NOIO, &bioset);
+    err = ent_fill_unit(ent_dev, bio, data_sector, data_page, nowait);
+    if (err) {
+        goto err_bio_cloning;
+    }
+    data_bio = bio_alloc_bioset(ent_dev->dev->bdev, 1, bio->bi_opf & ~ENT_OWN_BIO_CLEAR, gfp, &ent_dev->bioset);
+    if (data_bio && !bio_add_page(data_bio, data_page, ent_unit_size(ent_dev), 0)) {
+        bio_put(data_bio);
+        data_bio = NULL;
+    }
+    if (data_bio) {
+        bio_clone_blkg_association(data_bio, bio);
+        data_bio->bi_ioprio = bio->bi_ioprio;
+    }
     if (!data_bio) {
-        pr_err("Error while cloning bio for write.\n");
-        err = -ENOMEM;
+        err = nowait ? -EAGAIN : -ENOMEM;
+        if (!nowait) {
+            pr_err("Error while cloning bio for write.\n");
+        }
         goto err_bio_cloning;
     }
 
     bio_get(bio);
 
-    parity_bio = bio_alloc_bioset(ent_dev->dev->bdev, bio_segments(bio), bio->bi_opf, GFP_NOIO, &bioset);
+    parity_bio = bio_alloc_bioset(ent_dev->dev->bdev, 1, bio->bi_opf & ~ENT_OWN_BIO_CLEAR, gfp, &ent_dev->bioset);
     if (!parity_bio) {
-        pr_err("Error while allocating new bio for a parity.\n");
-        err = -ENOMEM;
+        err = nowait ? -EAGAIN : -ENOMEM;
+        if (!nowait) {
+            pr_err("Error while allocating new bio for a parity.\n");
+        }
         goto err_bio_allocation;
     }
+    // The parity is charged to the cgroup of the write, with its priority, like the data.
+    bio_clone_blkg_association(parity_bio, bio);
+    parity_bio->bi_ioprio = bio->bi_ioprio;
 
-    parity_buffer = kmalloc(ENT_BLOCK_SIZE, GFP_KERNEL);
-    if (!parity_buffer) {
-        pr_err("Error while allocating buffer for calculating new parity when writing.\n");
-        err = -ENOMEM;
-        goto err_parity_buffer_alloc;
+    if (!bio_add_page(parity_bio, parity_page, ent_unit_size(ent_dev), 0)) {
+        pr_err("Catastrophe: could not add page to parity bio! WTF?\n");
+        err = -EINVAL;
+        goto err_no_data;
     }
 
-    if (!bio_data(data_bio)) {
-        goto err_parity_buffer_alloc;
+    // Computes the parity directly into the parity page, and adds both blocks to the entanglement.
+    err = ent_chain_append(ent_dev, page_address(data_page), data_sector, parity_page_ptr, traced, &info);
+    if (err) {
+        goto err_no_data;
     }
-    data_buffer = (char *) bio_data(data_bio);
 
-    // Using this function from utils.h because I had a weird error with memcmp.
-    // If this is empty, it means we are at the start of the entanglement, and the first parity is just the first data block copied. 
-    if (is_buffer_empty(ent_dev->last_entangled_block, ENT_BLOCK_SIZE)) {
-        memcpy(parity_buffer, data_buffer, ENT_BLOCK_SIZE);
-    }else {
-        for (int i = 0 ; i < ENT_BLOCK_SIZE ; i++) {
-            parity_buffer[i] = data_buffer[i] ^ ent_dev->last_entangled_block[i];
-        }
-    }
+    data_bio->bi_iter.bi_sector = data_sector * ent_unit_sectors(ent_dev);
+    parity_bio->bi_iter.bi_sector = info.parity_sector * ent_unit_sectors(ent_dev);
+
+    parity_bio->bi_end_io = ent_dev_write_end_io;
+    parity_bio->bi_private = bio;
 
-    memcpy(parity_page_ptr, parity_buffer, sizeof(parity_buffer));
+    data_bio->bi_end_io = ent_dev_write_end_io_unit;
+    data_bio->bi_private = bio;
 
-    if (!bio_add_page(parity_bio, parity_page, ENT_BLOCK_SIZE, 0)) {
-        pr_err("Catastrophe: could not add page to parity bio! WTF?\n");
-        err = -EINVAL;
-        goto err_adding_page;
+    // The original bio completes only once both the data and the parity writes are done.
+    atomic_set(&((struct ent_io *) dm_per_bio_data(bio, sizeof(struct ent_io)))->pending, 2);
+    atomic_inc(&ent_dev->writes_in_flight);
+
+    // The unit page is returned by the completion of its bio, which releases the slot of the unit taken here.
+    ((struct ent_io *) dm_per_bio_data(bio, sizeof(struct ent_io)))->unit = data_sector;
+    atomic_inc(ent_unit_writes(ent_dev, data_sector));
+
+    submit_bio(data_bio);
+    submit_bio(parity_bio);
+
+    compact = ent_compact_due(ent_dev, false);
+    kunmap(parity_page);
+    WRITE_ONCE(ent_dev->append_task, NULL);
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+    if (unlikely(compact)) {
+        ent_compact_auto(ent_dev);
     }
 
-    // Update bio sectors.
-    data_sector = bio->bi_iter.bi_sector;
-    parity_sector = data_sector + ent_dev->write_sector_scale;
+    if (traced) {
+        trace_ent_write_end(data_sector, info.chain_pos, lock_ns, info.xor_ns, info.crc_ns, info.flush_ns,
+                            ktime_get_ns() - start_ns, 0);
+    }
 
-    data_bio->bi_iter.bi_sector = data_sector;
-    parity_bio->bi_iter.bi_sector = parity_sector;
+    return DM_MAPIO_SUBMITTED;
 
-    // Create new entangled blocks, and add them to the entanglement (list).
-    struct entangled_block *new_data_block;
-    struct entangled_block *new_parity_block;
+err_no_data:
+    bio_put(parity_bio);
+err_bio_allocation:
+    bio_put(data_bio);
+    bio_put(bio);
+err_bio_cloning:
+    kunmap(parity_page);
+    ent_free_page(ent_dev, parity_page);
+    ent_free_page(ent_dev, data_page);
+    bio_put(bio);
+    WRITE_ONCE(ent_dev->append_task, NULL);
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
 
-    new_data_block = kmalloc(sizeof(struct entangled_block), GFP_KERNEL);
-    if (!new_data_block) {
-        pr_err("Error while allocating new data block.\n");
-        err = -ENOMEM;
-        goto err_new_data_allocation;
+    if (traced) {
+        trace_ent_write_end(data_sector, ent_dev->chain_length, lock_ns, info.xor_ns, info.crc_ns, info.flush_ns,
+                            ktime_get_ns() - start_ns, err);
     }
 
-    new_parity_block = kmalloc(sizeof(struct entangled_block), GFP_KERNEL);
-    if (!new_parity_block) {
-        pr_err("Error while allocating new parity block.\n");
-        err = -ENOMEM;
-        goto err_new_parity_allocation;
+    bio->bi_status = (err == -EAGAIN) ? BLK_STS_AGAIN : BLK_STS_IOERR;
+    bio_endio(bio);
+
+    return DM_MAPIO_SUBMITTED;
+
+err_would_block:
+    kunmap(parity_page);
+    ent_free_page(ent_dev, parity_page);
+    ent_free_page(ent_dev, data_page);
+err_would_block_no_page:
+    if (traced) {
+        trace_ent_write_end(data_sector, ent_dev->chain_length, 0, 0, 0, 0, ktime_get_ns() - start_ns, -EAGAIN);
     }
+    bio_wouldblock_error(bio);
+    return DM_MAPIO_SUBMITTED;
+}
 
-    // Calculate checksums and add them to the buffer, flushing the buffer if needed. When flushing, update next_checksum. Also update curr_buffer_size.
-    uint data_checksum = crc32b(data_buffer);
-    uint parity_checksum = crc32b(parity_buffer);
+/*
+    Map function of this target. Handles the processing of each bio that comes from upper layers. 
+*/
+static int entanglement_tgt_map(struct dm_target *ti, struct bio *bio) {
 
-    // Add sectors and checksums to blocks. Add them to the entanglement list. 
-    new_data_block->block_sector = data_sector;
-    new_data_block->block_checksum = data_checksum;
-    new_parity_block->block_sector = parity_sector;
-    new_parity_block->block_checksum = parity_checksum;
-    INIT_LIST_HEAD(&new_data_block->list_node);
-    INIT_LIST_HEAD(&new_parity_block->list_node);
+    if (!bio) {
+        return DM_MAPIO_KILL;
+    }
 
-    list_add_tail(&new_data_block->list_node, &ent_dev->entanglement);
-    list_add_tail(&new_parity_block->list_node, &ent_dev->entanglement);
+    if (unlikely(!bio_has_data(bio))) {
+        struct entanglement_device *ent_dev = ti->private;
+
+        // In relaxed durability, a flush also covers the parities of the writes that completed before it.
+        if (op_is_flush(bio->bi_opf) && READ_ONCE(ent_dev->lag.relaxed)) {
+            if (bio->bi_opf & REQ_NOWAIT) {
+                if (!ent_lag_idle(&ent_dev->lag)) {
+                    bio_wouldblock_error(bio);
+                    return DM_MAPIO_SUBMITTED;
+                }
+            }else {
+                wait_event(ent_dev->lag.wait, ent_lag_idle(&ent_dev->lag));
+            }
+        }
 
-    // Add the data sector and checksum, and flush buffers if needed.
-    if (ent_dev->sector_buffer_size + sizeof(data_sector) < ENT_BLOCK_SIZE) {
-        memcpy(ent_dev->block_sector_buffer + ent_dev->sector_buffer_size, &data_sector, sizeof(data_sector));
-        ent_dev->sector_buffer_size += sizeof(data_sector);
-    }else {
-        err = flush_metadata(ent_dev, SECTOR);
-        if (err) {
-            goto err_metadata_flush;
+        // The second flush bio is for the metadata device, when there is one.
+        if (ent_dev->meta_dev && op_is_flush(bio->bi_opf) && dm_bio_get_target_bio_nr(bio) == 1) {
+            bio_set_dev(bio, ent_dev->meta_dev->bdev);
         }
-        // Put the ongoing write in the buffer.
-        memcpy(ent_dev->block_sector_buffer + ent_dev->sector_buffer_size, &data_sector, sizeof(data_sector));
-        ent_dev->sector_buffer_size += sizeof(data_sector);
+        return DM_MAPIO_REMAPPED;
     }
 
-    if (ent_dev->checksum_buffer_size + sizeof(data_checksum) < ENT_BLOCK_SIZE) {
-        memcpy(ent_dev->block_checksum_buffer + ent_dev->checksum_buffer_size, &data_checksum, sizeof(data_checksum));
-        ent_dev->checksum_buffer_size += sizeof(data_checksum);
-    }else {
-        err = flush_metadata(ent_dev, CHECKSUM);
-        if (err) {
-            goto err_metadata_flush;
-        }
+    int ret;
+    struct ent_io *io = dm_per_bio_data(bio, sizeof(struct ent_io));
+    struct ent_parity_lag *lag;
 
-        // Put the ongoing write in the buffer. 
-        memcpy(ent_dev->block_checksum_buffer + ent_dev->checksum_buffer_size, data_checksum, sizeof(data_checksum));
-        ent_dev->checksum_buffer_size += sizeof(data_checksum);
+    io->ent_dev = ti->private;
+    io->start_ns = ktime_get_ns();
+    io->status = BLK_STS_OK;
+
+    if (bio_data_dir(bio) == READ) {
+        return process_read_bio(ti->private, bio);
     }
 
-    // Add the parity sector and checksum, and flush buffers if needed.
-    if (ent_dev->sector_buffer_size + sizeof(parity_sector) < ENT_BLOCK_SIZE) {
-        memcpy(ent_dev->block_sector_buffer + ent_dev->sector_buffer_size, &parity_sector, sizeof(parity_sector));
-        ent_dev->sector_buffer_size += sizeof(parity_sector);
-    }else {
-        err = flush_metadata(ent_dev, SECTOR);
-        if (err) {
-            goto err_metadata_flush;
+    // The durability mode cannot change until the write is entangled, or queued for the background stage (see ent_lag_set_mode()).
+    lag = &io->ent_dev->lag;
+    if (bio->bi_opf & REQ_NOWAIT) {
+        if (!down_read_trylock(&lag->mode_sem)) {
+            bio_wouldblock_error(bio);
+            return DM_MAPIO_SUBMITTED;
         }
-        // Put the ongoing write in the buffer. 
-        memcpy(ent_dev->block_sector_buffer + ent_dev->sector_buffer_size, &parity_sector, sizeof(parity_sector));
-        ent_dev->sector_buffer_size += sizeof(parity_sector);
+    }else {
+        down_read(&lag->mode_sem);
+    }
+    // A write that failed after being taken over has been completed already: only the others are left to dm.
+    ret = lag->relaxed ? process_write_bio_relaxed(io->ent_dev, bio) : process_write_bio(io->ent_dev, bio);
+    up_read(&lag->mode_sem);
+    if (ret == DM_MAPIO_KILL) {
+        pr_err("Error while processing write bio.\n");
     }
 
-    if (ent_dev->checksum_buffer_size + sizeof(parity_checksum) < ENT_BLOCK_SIZE) {
-        memcpy(ent_dev->block_checksum_buffer + ent_dev->checksum_buffer_size, &parity_checksum, sizeof(parity_checksum));
-        ent_dev->checksum_buffer_size += sizeof(parity_checksum);
-    }else {
-        err = flush_metadata(ent_dev, CHECKSUM);
-        if (err) {
-            goto err_metadata_flush;
-        }
+    return ret;
+}
 
-        // Put the ongoing write in the buffer. 
-        memcpy(ent_dev->block_checksum_buffer + ent_dev->checksum_buffer_size, &parity_checksum, sizeof(parity_checksum));
-        ent_dev->checksum_buffer_size += sizeof(parity_checksum);
-    }
+/*
+    Completion of the bios this target mapped. Only reads need accounting here: writes are accounted when both their data and their 
+    parity writes are done (see ent_io_put()).
+*/
+static int entanglement_tgt_end_io(struct dm_target *ti, struct bio *bio, blk_status_t *error) {
 
-    // Update the last_entangled_block. 
-    memcpy(ent_dev->last_entangled_block, parity_buffer, ENT_BLOCK_SIZE);
+    struct ent_io *io = dm_per_bio_data(bio, sizeof(struct ent_io));
 
-    // Update the sector-checksum map. 
-    ent_dev->sector_checksum_map[data_sector] = data_checksum;
-    ent_dev->sector_checksum_map[parity_sector] = parity_checksum;
+    if (bio_has_data(bio) && bio_data_dir(bio) == READ) {
+        ent_stats_latency(io->ent_dev->stats, ENT_HIST_READ, io->start_ns);
+    }
+    return DM_ENDIO_DONE;
+}
 
-    parity_bio->bi_end_io = ent_dev_write_end_io;
-    parity_bio->bi_private = bio;
+/*
+    Inform DM about the size of the block, since we are working with 4096-byte blocks. 
+*/
+/*
+    Suspend and resume. dm stops sending bios and waits for those in flight between the presuspend and the postsuspend.
+*/
 
-    data_bio->bi_end_io = ent_dev_write_end_io_clone;
-    data_bio->bi_private = bio;
+// Starts again a scrub, a rebuild or a compaction stopped by a suspend, and lets maintenance operations be queued again.
+static void ent_maintenance_restart(struct entanglement_device *ent_dev) {
 
-    submit_bio(data_bio);
-    submit_bio(parity_bio);
+    struct ent_maintenance *m = &ent_dev->maintenance;
 
-    kunmap(parity_page);
-    kfree(parity_buffer);
-    mutex_unlock(&ent_dev->metadata_buffers_lock);
+    spin_lock(&m->lock);
+    m->suspended = false;
+    if (m->scrub_state == ENT_SCRUB_SUSPENDED) {
+        m->scrub_state = ENT_SCRUB_RUNNING;
+        queue_work(m->wq, &m->scrub_work);
+    }
+    if (m->rebuild_state == ENT_SCRUB_SUSPENDED) {
+        m->rebuild_state = ENT_SCRUB_RUNNING;
+        queue_work(m->wq, &m->rebuild_work);
+    }
+    if (m->compact_state == ENT_SCRUB_SUSPENDED) {
+        m->compact_state = ENT_SCRUB_RUNNING;
+        queue_work(m->wq, &m->compact_work);
+    }
+    m->idle_chain_length = READ_ONCE(ent_dev->chain_length);
+    queue_delayed_work(m->wq, &m->idle_work, msecs_to_jiffies(ENT_COMPACT_IDLE_MS));
+    spin_unlock(&m->lock);
+}
 
-    return 0;
+static void entanglement_tgt_presuspend(struct dm_target *ti) {
 
-err_metadata_flush:
-    list_del(&new_parity_block->list_node);
-    list_del(&new_data_block->list_node);
-    kfree(new_parity_block);
-err_new_parity_allocation:
-    kfree(new_data_block);
-err_new_data_allocation:
-err_adding_page:
-    kunmap(parity_page);
-    kfree(parity_buffer);
-err_parity_buffer_alloc:
-err_bio_allocation:
-    bio_put(bio);
-err_bio_cloning:
-    mempool_free(parity_page, page_pool);
-    bio_put(bio);
-    mutex_unlock(&ent_dev->metadata_buffers_lock);
+    struct entanglement_device *ent_dev = ti->private;
+    struct ent_maintenance *m = &ent_dev->maintenance;
 
-    bio->bi_status = BLK_STS_IOERR;
-    bio_endio(bio);
+    // The scrub, the rebuild and the compaction stop after their current batch.
+    spin_lock(&m->lock);
+    if (m->scrub_state == ENT_SCRUB_RUNNING) {
+        m->scrub_state = ENT_SCRUB_SUSPENDED;
+    }
+    if (m->rebuild_state == ENT_SCRUB_RUNNING) {
+        m->rebuild_state = ENT_SCRUB_SUSPENDED;
+    }
+    if (m->compact_state == ENT_SCRUB_RUNNING) {
+        m->compact_state = ENT_SCRUB_SUSPENDED;
+    }
+    spin_unlock(&m->lock);
+}
 
-    return err;
+static void entanglement_tgt_presuspend_undo(struct dm_target *ti) {
+
+    ent_maintenance_restart(ti->private);
 }
 
 /*
-    Map function of this target. Handles the processing of each bio that comes from upper layers. 
+    No bio is in flight anymore: write the parities still queued in relaxed mode, wait for the queued maintenance operations and flush the
+    metadata buffers, so that the device is consistent on disk (and its chain can be handed over) while it is suspended.
 */
-static int entanglement_tgt_map(struct dm_target *ti, struct bio *bio) {
+static void entanglement_tgt_postsuspend(struct dm_target *ti) {
 
-    if (!bio) {
-        return DM_MAPIO_KILL;
+    struct entanglement_device *ent_dev = ti->private;
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    int err;
+
+    spin_lock(&m->lock);
+    m->suspended = true;
+    spin_unlock(&m->lock);
+
+    ent_lag_drain(ent_dev);
+    cancel_delayed_work_sync(&m->idle_work);
+    flush_workqueue(m->wq);
+
+    if (!ent_dev->owns_chain) {
+        return;
     }
 
-    if (unlikely(!bio_has_data(bio))) {
-        return DM_MAPIO_REMAPPED;
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+    err = write_metadata_buffers(ent_dev);
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+    if (err) {
+        pr_err("Error while flushing the metadata on suspend: %d\n", err);
+        ent_maintenance_error(ent_dev, err);
     }
 
-    int err; 
+    ent_scrub_save_checkpoint(ent_dev);
+}
 
-    if (bio_data_dir(bio) == READ) {
-        err = process_read_bio(ti->private, bio);
-        if (err) {
-            pr_err("Error while processing a read bio.\n");
-            return DM_MAPIO_KILL;
+/*
+    Takes the chain over from the suspended table this one replaces, or loads it from disk when that table is gone (as the constructor
+    would have). An error fails the resume.
+*/
+static int entanglement_tgt_preresume(struct dm_target *ti) {
+
+    struct entanglement_device *ent_dev = ti->private;
+    struct entanglement_device *owner;
+    int err = 0;
+
+    if (!ent_dev->handover_pending) {
+        return 0;
+    }
+
+    mutex_lock(&ent_devices_lock);
+    owner = ent_find_chain_owner(ent_dev);
+    if (owner) {
+        spin_lock(&owner->maintenance.lock);
+        if (!owner->maintenance.suspended) {
+            err = -EBUSY;
         }
-        return DM_MAPIO_SUBMITTED;
+        spin_unlock(&owner->maintenance.lock);
     }
+    if (owner && !err) {
+        ent_core_handover(ent_dev, owner);
+        ent_maintenance_handover(ent_dev, owner);
+        ent_lag_handover(ent_dev, owner);
+        owner->owns_chain = false;
+    }
+    mutex_unlock(&ent_devices_lock);
 
-    err = process_write_bio(ti->private, bio);
     if (err) {
-        pr_err("Error while processing write bio.\n");
-        return DM_MAPIO_KILL;
+        pr_err("The chain is still in use by a live table.\n");
+        return err;
     }
 
-    return DM_MAPIO_SUBMITTED;
+    if (!owner) {
+        err = load_entanglement_and_checksums(ent_dev);
+        if (!err && ent_dev->redundancy_flag) {
+            err = check_corruption(ent_dev);
+        }
+        if (err) {
+            pr_err("Error while loading entanglement and checksums: %d\n", err);
+            return err;
+        }
+        ent_compact_restore(ent_dev);
+    }
+
+    ent_dev->handover_pending = false;
+    ent_dev->owns_chain = true;
+    return 0;
+}
+
+static void entanglement_tgt_resume(struct dm_target *ti) {
+
+    ent_maintenance_restart(ti->private);
 }
 
-/*
-    Inform DM about the size of the block, since we are working with 4096-byte blocks. 
-*/
 static void entanglement_tgt_io_hints(struct dm_target *ti, struct queue_limits *limits) {
 
+    struct entanglement_device *ent_dev = ti->private;
+
     limits->logical_block_size = ENT_BLOCK_SIZE;
 	limits->physical_block_size = ENT_BLOCK_SIZE;
 
-	limits->io_min = ENT_BLOCK_SIZE;
-	limits->io_opt = ENT_BLOCK_SIZE;
+    // Writes of whole units are not read back first (see process_write_bio()).
+	limits->io_min = ent_unit_size(ent_dev);
+	limits->io_opt = ent_unit_size(ent_dev);
+}
+
+static const char * const ent_scrub_state_names[] = {
+    [ENT_SCRUB_IDLE]      = "idle",
+    [ENT_SCRUB_RUNNING]   = "running",
+    [ENT_SCRUB_PAUSED]    = "paused",
+    [ENT_SCRUB_SUSPENDED] = "suspended",
+};
+
+// Integer percentage of part in total, 0 when total is 0.
+static u64 ent_percent(u64 part, u64 total) {
+    return total ? div64_u64(part * 100, total) : 0;
+}
+
+static unsigned int ent_emit_histogram(char *result, unsigned int maxlen, unsigned int sz, const char *name, const u64 *buckets) {
+
+    // Trailing empty buckets are not printed, to keep the status line short.
+    int last = ENT_HIST_BUCKETS - 1;
+    while (last > 0 && !buckets[last]) {
+        last--;
+    }
+
+    DMEMIT(" %s=", name);
+    for (int b = 0 ; b <= last ; b++) {
+        DMEMIT(b ? ",%llu" : "%llu", buckets[b]);
+    }
+
+    return sz;
+}
+
+/*
+    Reports the runtime statistics and the progress of maintenance operations (dmsetup status), or the constructor arguments (dmsetup table).
+    Histograms are printed as comma-separated log2 buckets of microseconds, starting from [0, 2us).
+*/
+static void entanglement_tgt_status(struct dm_target *ti, status_type_t type, unsigned int status_flags,
+                                    char *result, unsigned int maxlen) {
+
+    struct entanglement_device *ent_dev = ti->private;
+    struct ent_maintenance *m = &ent_dev->maintenance;
+    struct ent_stats *sum;
+    unsigned int sz = 0;
+
+    switch (type) {
+    case STATUSTYPE_INFO:
+        // Too large for the stack.
+        sum = kmalloc(sizeof(struct ent_stats), GFP_KERNEL);
+        if (!sum) {
+            DMEMIT("-");
+            break;
+        }
+        ent_stats_sum(ent_dev->stats, sum);
+
+        DMEMIT("reads=%llu writes=%llu parity_bytes=%llu metadata_flushes=%llu chain_length=%llu",
+               sum->counters[ENT_STAT_READS], sum->counters[ENT_STAT_WRITES], sum->counters[ENT_STAT_PARITY_BYTES],
+               sum->counters[ENT_STAT_METADATA_FLUSHES], READ_ONCE(ent_dev->chain_length));
+        DMEMIT(" corrupted=%llu repaired=%llu irrecoverable=%llu injected=%llu mempool_waits=%llu metadata_lock_wait_ns=%llu",
+               sum->counters[ENT_STAT_CORRUPTED], sum->counters[ENT_STAT_REPAIRED], sum->counters[ENT_STAT_IRRECOVERABLE],
+               sum->counters[ENT_STAT_INJECTED], sum->counters[ENT_STAT_MEMPOOL_WAITS], 
+               sum->counters[ENT_STAT_METADATA_LOCK_WAIT_NS]);
+        DMEMIT(" unit_kb=%zu queue_depth=%u page_pool=%d/%u page_pool_peak=%d bioset=%u",
+               ent_unit_size(ent_dev) / 1024, ent_dev->queue_depth, atomic_read(&ent_dev->pages_in_use), ent_dev->page_pool_size,
+               READ_ONCE(ent_dev->pages_peak), ent_dev->bioset_size);
+        DMEMIT(" rotational=%d io_batch=%u scrub_batch=%u scrub_rate=%u lag_window=%u/%u", ent_dev->rotational,
+               ent_dev->tuning[ENT_TUNE_IO_BATCH], ent_dev->tuning[ENT_TUNE_SCRUB_BATCH], ent_dev->tuning[ENT_TUNE_SCRUB_RATE],
+               ent_dev->tuning[ENT_TUNE_LAG_BLOCKS], ent_dev->tuning[ENT_TUNE_LAG_MS]);
+        DMEMIT(" maint_ioprio=%s/%u", ent_ioprio_class_names[IOPRIO_PRIO_CLASS(READ_ONCE(m->ioprio))],
+               (uint) IOPRIO_PRIO_LEVEL(READ_ONCE(m->ioprio)));
+        DMEMIT(" cache=%u/%u cache_hits=%llu cache_misses=%llu cache_hit_pct=%llu",
+               READ_ONCE(ent_dev->cache.nr_pages), READ_ONCE(ent_dev->cache.capacity), sum->counters[ENT_STAT_CACHE_HITS],
+               sum->counters[ENT_STAT_CACHE_MISSES],
+               ent_percent(sum->counters[ENT_STAT_CACHE_HITS], sum->counters[ENT_STAT_CACHE_HITS] + sum->counters[ENT_STAT_CACHE_MISSES]));
+        DMEMIT(" chain_segments=%u/%llu chain_window=%u chain_page_ins=%llu",
+               READ_ONCE(ent_dev->nr_resident_segments), DIV_ROUND_UP(READ_ONCE(ent_dev->chain_length), ENT_SECTORS_PER_BLOCK),
+               READ_ONCE(ent_dev->chain_window), sum->counters[ENT_STAT_CHAIN_PAGE_INS]);
+        DMEMIT(" anchor_interval=%u chain_anchors=%llu", ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL], READ_ONCE(ent_dev->nr_anchors));
+
+        sz = ent_emit_histogram(result, maxlen, sz, "read_lat_us", sum->histograms[ENT_HIST_READ]);
+        sz = ent_emit_histogram(result, maxlen, sz, "write_lat_us", sum->histograms[ENT_HIST_WRITE]);
+        sz = ent_emit_histogram(result, maxlen, sz, "flush_lat_us", sum->histograms[ENT_HIST_FLUSH]);
+        sz = ent_emit_histogram(result, maxlen, sz, "repair_lat_us", sum->histograms[ENT_HIST_REPAIR]);
+
+        spin_lock(&ent_dev->lag.lock);
+        DMEMIT(" durability=%s parity_lag_blocks=%u parity_lag_ms=%llu parity_lag_max=%u/%u parity_lag_peak=%u"
+               " parity_lag_unprotected=%llu",
+               ent_dev->lag.relaxed ? "relaxed" : "strict", ent_dev->lag.nr_pending, ent_lag_ms(&ent_dev->lag),
+               ent_dev->lag.max_blocks, ent_dev->lag.max_ms, ent_dev->lag.peak_blocks, sum->counters[ENT_STAT_LAG_UNPROTECTED]);
+        spin_unlock(&ent_dev->lag.lock);
+
+        kfree(sum);
+
+        spin_lock(&m->lock);
+        DMEMIT(" scrub=%s scrub_pos=%llu/%u scrub_checked=%llu scrub_corrupted=%llu scrub_passes=%llu",
+               ent_scrub_state_names[m->scrub_state], (unsigned long long)m->scrub_pos, ent_dev->dev_size,
+               m->scrub_checked, m->scrub_corrupted, m->scrub_passes);
+        DMEMIT(" rebuild=%s rebuild_pos=%llu/%llu rebuilt=%llu rebuild_failed=%llu",
+               ent_scrub_state_names[m->rebuild_state], m->rebuild.pos, m->rebuild.end_pos, m->rebuild.rebuilt, m->rebuild.failed);
+        // Each entry of the chain takes 12 bytes of metadata (its sector and its checksum).
+        DMEMIT(" compact=%s compact_pos=%llu/%llu compact_moved=%llu compact_reclaimed=%llu compact_reclaimed_kb=%llu"
+               " compact_repaired=%llu compact_failed=%llu chain_gap=%llu compact_fill=%u chain_capacity=%llu",
+               ent_scrub_state_names[m->compact_state], m->compact_pos, m->compact_end, m->compact_moved, m->compact_reclaimed,
+               m->compact_reclaimed * (sizeof(u64) + sizeof(u32)) / 1024, m->compact_repaired, m->compact_failed,
+               (unsigned long long)(READ_ONCE(ent_dev->gap_end) - READ_ONCE(ent_dev->gap_start)), ent_dev->tuning[ENT_TUNE_COMPACT_FILL],
+               (u64)ent_dev->nr_segment_slots * ENT_SECTORS_PER_BLOCK);
+        DMEMIT(" last_repaired=%llu last_irrecoverable=%llu inject_pattern=%s last_injected=%llu maintenance_error=%d",
+               m->last_repaired, m->last_irrecoverable, ent_inject_pattern_names[m->inject.pattern], m->last_injected,
+               m->last_error);
+        spin_unlock(&m->lock);
+        break;
+
+    case STATUSTYPE_TABLE:
+        DMEMIT("%s %u %d %d %u", ent_dev->dev->name, ent_dev->dev_size, ent_dev->redundancy_flag,
+               ent_dev->init_flag, ent_dev->corrupt_chance);
+        if (ent_dev->meta_dev) {
+            DMEMIT(" %s", ent_dev->meta_dev->name);
+        }
+        if (ent_dev->unit_blocks > 1) {
+            DMEMIT(" unit_kb=%zu", ent_unit_size(ent_dev) / 1024);
+        }
+        for (int i = 0 ; i < ENT_TUNE_NR ; i++) {
+            if (ent_dev->tuning_overrides[i]) {
+                DMEMIT(" %s=%u", ent_tunable_names[i], ent_dev->tuning_overrides[i]);
+            }
+        }
+        break;
+
+    case STATUSTYPE_IMA:
+        *result = '\0';
+        break;
+    }
 }
 
 static int entanglement_tgt_iterateDevices(struct dm_target *ti, iterate_devices_callout_fn fn,
@@ -1178,16 +2440,29 @@ static int entanglement_tgt_iterateDevices(struct dm_target *ti, iterate_devices
 		return -EINVAL;
 	}
     
-	return fn(ti, ent_dev->dev, 0, ent_dev->dev_size * ENT_DEV_SECTOR_SCALE, data);
+	return fn(ti, ent_dev->dev, 0, (sector_t)ent_dev->dev_size * ent_unit_sectors(ent_dev), data);
 }
 
+/*
+    REQ_NOWAIT is honoured by both the read and the write paths. Polling needs nothing more from the target than remapping the reads:
+    dm enables it when the underlying devices support it (see entanglement_tgt_iterateDevices()).
+*/
 struct target_type entanglement_target = {
     .name               = "entanglement", 
-    .version            = {1, 0, 0}, 
+    .version            = {1, 2, 0}, 
+    .features           = DM_TARGET_NOWAIT,
     .module             = THIS_MODULE, 
     .ctr                = entanglement_tgt_ctr, 
     .dtr                = entanglement_tgt_dtr, 
     .map                = entanglement_tgt_map, 
+    .end_io             = entanglement_tgt_end_io,
+    .status             = entanglement_tgt_status, 
+    .message            = entanglement_tgt_message, 
+    .presuspend         = entanglement_tgt_presuspend,
+    .presuspend_undo    = entanglement_tgt_presuspend_undo,
+    .postsuspend        = entanglement_tgt_postsuspend,
+    .preresume          = entanglement_tgt_preresume,
+    .resume             = entanglement_tgt_resume,
     .io_hints           = entanglement_tgt_io_hints,
     .iterate_devices    = entanglement_tgt_iterateDevices, 
 };
@@ -1197,43 +2472,19 @@ struct target_type entanglement_target = {
 */
 int dm_entanglement_init(void) {
 
-    // Initialize the bioset.
-    int err = bioset_init(&bioset, BIOSET_SIZE, 0, BIOSET_NEED_BVECS);
-    if (err) {
-        pr_err("Error while initializing the bioset: %d\n", err);
-        goto err_bioset_alloc;
-    }
-
-    // Initialize the page pool.
-	page_pool = mempool_create_page_pool(PAGE_POOL_SIZE, 0);
-	if (!page_pool) {
-		pr_err("Error while creating the page pool\n");
-		err = -ENOMEM;
-        goto err_pagepool_creation;
-	}
-
-    err = dm_register_target(&entanglement_target);
+    // The page pools and biosets belong to the devices (see the constructor).
+    int err = dm_register_target(&entanglement_target);
 
     if (err < 0) {
         pr_err("Target registration failed: %d", err);
-        goto err_target_registration;
     }
 
     return err;
-
-err_pagepool_creation:
-    bioset_exit(&bioset);
-err_bioset_alloc:
-    dm_unregister_target(&entanglement_target);
-err_target_registration:
-    return err;
 }
 
 void dm_entanglement_exit(void) {
 
     dm_unregister_target(&entanglement_target);
-    bioset_exit(&bioset);
-    mempool_destroy(page_pool);
 }
 
 module_init(dm_entanglement_init);
@@ -0,0 +1,405 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "blkio.h"
+
+/*****************************************************
+ *                     RANDOMNESS                    *
+ *****************************************************/
+
+// xorshift64*, seeded by the harness so that fault injection is reproducible.
+static u64 random_state = 0x9E3779B97F4A7C15ULL;
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ent_seed_random(u64 seed) {
+
+    pthread_mutex_lock(&random_lock);
+    random_state = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    pthread_mutex_unlock(&random_lock);
+}
+
+void get_random_bytes(void *buf, size_t len) {
+
+    u8 *out = buf;
+
+    pthread_mutex_lock(&random_lock);
+    while (len) {
+        u64 x = random_state;
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        random_state = x;
+        x *= 0x2545F4914F6CDD1DULL;
+
+        size_t n = len < sizeof(x) ? len : sizeof(x);
+        memcpy(out, &x, n);
+        out += n;
+        len -= n;
+    }
+    pthread_mutex_unlock(&random_lock);
+}
+
+/*****************************************************
+ *                     CHECKSUMS                     *
+ *****************************************************/
+
+// Slice-by-8 CRC-32 (reflected, polynomial 0xEDB88320), as lib/crc32.c does it: 8 bytes per step, through 8 tables of 256 entries.
+static u32 crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void) {
+
+    for (u32 i = 0 ; i < 256 ; i++) {
+        u32 c = i;
+
+        for (int j = 0 ; j < 8 ; j++) {
+            c = (c >> 1) ^ (0xEDB88320 & -(c & 1));
+        }
+        crc32_table[0][i] = c;
+    }
+    for (u32 i = 0 ; i < 256 ; i++) {
+        for (int k = 1 ; k < 8 ; k++) {
+            crc32_table[k][i] = (crc32_table[k - 1][i] >> 8) ^ crc32_table[0][crc32_table[k - 1][i] & 0xFF];
+        }
+    }
+}
+
+static inline u32 crc32_load_le(const unsigned char *p) {
+    return p[0] | (u32)p[1] << 8 | (u32)p[2] << 16 | (u32)p[3] << 24;
+}
+
+u32 crc32_le(u32 crc, const unsigned char *p, size_t len) {
+
+    pthread_once(&crc32_once, crc32_init);
+
+    for ( ; len >= 8 ; p += 8, len -= 8) {
+        u32 lo = crc32_load_le(p) ^ crc;
+        u32 hi = crc32_load_le(p + 4);
+
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^ crc32_table[5][(lo >> 16) & 0xFF] ^
+              crc32_table[4][lo >> 24] ^ crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+    }
+    for ( ; len ; p++, len--) {
+        crc = crc32_table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/*****************************************************
+ *                      BACKEND                      *
+ *****************************************************/
+
+static void blkio_init(struct dm_dev *dev, u64 nr_blocks) {
+
+    dev->nr_blocks = nr_blocks;
+    // No modeled latency unless the caller sets one.
+    memset(&dev->latency, 0, sizeof(dev->latency));
+    pthread_mutex_init(&dev->lock, NULL);
+    // So that the first access is not counted as a seek.
+    dev->last_block = (sector_t)-1;
+    memset(&dev->stats, 0, sizeof(dev->stats));
+}
+
+int ent_blkio_open_file(struct dm_dev *dev, const char *path, u64 nr_blocks) {
+
+    struct stat st;
+
+    dev->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (dev->fd < 0) {
+        pr_err("Could not open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    dev->mem = NULL;
+
+    // Grow the file to the size of the device, leaving it sparse. 
+    if (fstat(dev->fd, &st) == 0 && (u64)st.st_size < nr_blocks * ENT_BLOCK_SIZE) {
+        if (ftruncate(dev->fd, nr_blocks * ENT_BLOCK_SIZE)) {
+            int err = -errno;
+            pr_err("Could not resize %s: %s\n", path, strerror(errno));
+            close(dev->fd);
+            return err;
+        }
+    }
+
+    blkio_init(dev, nr_blocks);
+    return 0;
+}
+
+int ent_blkio_open_device(struct dm_dev *dev, const char *path, bool writable) {
+
+    struct stat st;
+    u64 size;
+
+    dev->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (dev->fd < 0) {
+        pr_err("Could not open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    dev->mem = NULL;
+
+    if (fstat(dev->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        if (ioctl(dev->fd, BLKGETSIZE64, &size) < 0) {
+            size = 0;
+        }
+    }else {
+        size = st.st_size;
+    }
+    if (size < ENT_BLOCK_SIZE) {
+        pr_err("Could not get the size of %s.\n", path);
+        close(dev->fd);
+        return -EINVAL;
+    }
+
+    blkio_init(dev, size / ENT_BLOCK_SIZE);
+    return 0;
+}
+
+int ent_blkio_open_memory(struct dm_dev *dev, u64 nr_blocks) {
+
+    dev->fd = -1;
+    dev->mem = calloc(nr_blocks, ENT_BLOCK_SIZE);
+    if (!dev->mem) {
+        pr_err("Could not allocate %llu blocks of memory.\n", nr_blocks);
+        return -ENOMEM;
+    }
+
+    blkio_init(dev, nr_blocks);
+    return 0;
+}
+
+void ent_blkio_close(struct dm_dev *dev) {
+
+    if (dev->fd >= 0) {
+        close(dev->fd);
+    }
+    free(dev->mem);
+    pthread_mutex_destroy(&dev->lock);
+}
+
+// Accounts for the modeled cost of one access, and spends it if asked to.
+static void blkio_latency(struct dm_dev *dev, sector_t block, int rw) {
+
+    struct ent_latency_model *l = &dev->latency;
+    u64 cost = (rw == READ) ? l->read_ns : l->write_ns;
+
+    pthread_mutex_lock(&dev->lock);
+    if (rw == READ) {
+        dev->stats.reads++;
+    }else {
+        dev->stats.writes++;
+    }
+    if (dev->last_block != (sector_t)-1 && block != dev->last_block + 1) {
+        dev->stats.seeks++;
+        cost += l->seek_ns;
+    }
+    dev->last_block = block;
+    dev->stats.modeled_ns += cost;
+    pthread_mutex_unlock(&dev->lock);
+
+    if (l->spin && cost) {
+        u64 end = ktime_get_ns() + cost;
+        while (ktime_get_ns() < end) {
+            ;
+        }
+    }
+}
+
+/* Synchronously reads/writes nr 4096-byte sectors from/to the given device 
+   to/from the provided page */
+static int blkio_rw(struct dm_dev *dev, struct page *page, sector_t sector, uint nr, int rw) {
+
+    u8 *page_ptr = page->addr;
+    size_t len = (size_t)nr * ENT_BLOCK_SIZE;
+    ssize_t done;
+
+    if (sector + nr > dev->nr_blocks) {
+        pr_err("Access to block %llu, past the end of the device (%llu blocks).\n", sector + nr - 1, dev->nr_blocks);
+        return -EIO;
+    }
+
+    blkio_latency(dev, sector, rw);
+
+    if (dev->mem) {
+        if (rw == READ) {
+            memcpy(page_ptr, dev->mem + sector * ENT_BLOCK_SIZE, len);
+        }else {
+            memcpy(dev->mem + sector * ENT_BLOCK_SIZE, page_ptr, len);
+        }
+        return 0;
+    }
+
+    if (rw == READ) {
+        done = pread(dev->fd, page_ptr, len, sector * ENT_BLOCK_SIZE);
+    }else {
+        done = pwrite(dev->fd, page_ptr, len, sector * ENT_BLOCK_SIZE);
+    }
+    if (done != (ssize_t)len) {
+        return done < 0 ? -errno : -EIO;
+    }
+    return 0;
+}
+
+int ent_dev_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw) {
+    return blkio_rw(ent_dev->dev, page, sector * ent_dev->unit_blocks, ent_dev->unit_blocks, rw);
+}
+
+int ent_meta_rwSector(struct entanglement_device *ent_dev, struct page *page, sector_t sector, int rw) {
+    return blkio_rw(ent_dev->meta_dev ? ent_dev->meta_dev : ent_dev->dev, page, sector, 1, rw);
+}
+
+// There is no request queue to fill here: the batch is simply issued block by block, each one paying its modeled latency.
+int ent_dev_rwBatch(struct entanglement_device *ent_dev, struct page **pages, const sector_t *sectors, uint nr, int rw) {
+
+    for (uint i = 0 ; i < nr ; i++) {
+        int err = ent_dev_rwSector(ent_dev, pages[i], sectors[i], rw);
+
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+/*****************************************************
+ *                      LIBRARY                      *
+ *****************************************************/
+
+uint ent_user_chain_window;
+uint ent_user_unit_blocks;
+
+/*
+    Opens an entanglement on the given backend, like the constructor of the target: the chain is loaded from the metadata 
+    unless init_flag is set. The metadata is kept on meta_dev when it is not NULL. No corruption check is done here, see check_corruption().
+*/
+struct entanglement_device *ent_user_open(struct dm_dev *dev, struct dm_dev *meta_dev, int init_flag, int *errp) {
+
+    struct entanglement_device *ent_dev;
+    int err;
+
+    ent_dev = kzalloc(sizeof(struct entanglement_device), GFP_KERNEL);
+    if (!ent_dev) {
+        err = -ENOMEM;
+        goto err_dev_allocation;
+    }
+    ent_dev->init_flag = init_flag;
+    ent_dev->redundancy_flag = 1;
+
+    ent_dev->meta_dev = meta_dev;
+    ent_dev->unit_blocks = ent_user_unit_blocks;
+
+    err = ent_core_init(ent_dev, dev->nr_blocks, 0);
+    if (err) {
+        goto err_core_init;
+    }
+    ent_dev->dev = dev;
+
+    if (meta_dev && meta_dev->nr_blocks < ent_meta_dev_blocks(ent_dev)) {
+        pr_err("The metadata device needs at least %llu blocks.\n", (u64)ent_meta_dev_blocks(ent_dev));
+        err = -EINVAL;
+        goto err_loading;
+    }
+
+    ent_dev->chain_window = ent_user_chain_window;
+
+    if (!init_flag) {
+        err = load_entanglement_and_checksums(ent_dev);
+        if (err) {
+            pr_err("Error while loading entanglement and checksums: %d\n", err);
+            goto err_loading;
+        }
+    }
+
+    return ent_dev;
+
+err_loading:
+    ent_core_exit(ent_dev);
+err_core_init:
+    kfree(ent_dev);
+err_dev_allocation:
+    *errp = err;
+    return NULL;
+}
+
+// The write path of the target: the data unit and its parity are written synchronously, one after the other. block is a unit index.
+int ent_user_write(struct entanglement_device *ent_dev, sector_t block, const u8 *data) {
+
+    struct ent_append_info info;
+    struct page *data_page;
+    struct page *parity_page;
+    int err;
+
+    if (block >= ent_dev->metadata_start_sector) {
+        return -EINVAL;
+    }
+
+    data_page = ent_alloc_page(ent_dev);
+    parity_page = ent_alloc_page(ent_dev);
+    if (!data_page || !parity_page) {
+        err = -ENOMEM;
+        goto out;
+    }
+    memcpy(kmap(data_page), data, ent_unit_size(ent_dev));
+
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+
+    err = ent_chain_append(ent_dev, data, block, kmap(parity_page), false, &info);
+    if (!err) {
+        err = ent_dev_rwSector(ent_dev, data_page, block, WRITE);
+    }
+    if (!err) {
+        err = ent_dev_rwSector(ent_dev, parity_page, info.parity_sector, WRITE);
+    }
+
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+out:
+    ent_free_page(ent_dev, parity_page);
+    ent_free_page(ent_dev, data_page);
+    return err;
+}
+
+int ent_user_read(struct entanglement_device *ent_dev, sector_t block, u8 *data) {
+
+    struct page *page;
+    int err;
+
+    if (block >= ent_dev->metadata_start_sector) {
+        return -EINVAL;
+    }
+
+    page = ent_alloc_page(ent_dev);
+    if (!page) {
+        return -ENOMEM;
+    }
+
+    err = ent_dev_rwSector(ent_dev, page, block, READ);
+    if (!err) {
+        memcpy(data, kmap(page), ent_unit_size(ent_dev));
+    }
+
+    ent_free_page(ent_dev, page);
+    return err;
+}
+
+// Frees the entanglement without writing anything to the device. The backend stays open.
+void ent_user_release(struct entanglement_device *ent_dev) {
+
+    ent_core_exit(ent_dev);
+    kfree(ent_dev);
+}
+
+// Like the destructor of the target: writes the leftover metadata and frees the entanglement. The backend stays open.
+int ent_user_close(struct entanglement_device *ent_dev) {
+
+    int err;
+
+    err = store_entanglement_and_checksums(ent_dev);
+    ent_core_exit(ent_dev);
+    kfree(ent_dev);
+    return err;
+}
@@ -0,0 +1,68 @@
+#ifndef _ENT_USER_BLKIO_H_
+#define _ENT_USER_BLKIO_H_
+
+/*
+    Userspace backend of the entanglement core (libentcore). The underlying device is either a (sparse) file or a buffer in memory,
+    accessed in 4KB blocks. Every access goes through an optional latency model, so that the cost of the core's I/O pattern
+    can be studied without a real disk.
+*/
+
+#include "core.h"
+
+/*
+    Latency model of the backend. Every read/write costs read_ns/write_ns, plus seek_ns when it does not follow the previous access.
+    With spin set, the time is actually spent (busy waiting), otherwise it is only added to the modeled time of the device.
+*/
+struct ent_latency_model {
+    u64 read_ns;
+    u64 write_ns;
+    u64 seek_ns;
+    bool spin;
+};
+
+struct ent_blkio_stats {
+    u64 reads;
+    u64 writes;
+    u64 seeks;
+    u64 modeled_ns;
+};
+
+// The underlying device, as seen by the core (ent_dev->dev).
+struct dm_dev {
+    // File descriptor of the backing file, or -1 when backed by memory.
+    int fd;
+    u8 *mem;
+    // Size of the device in 4KB blocks.
+    u64 nr_blocks;
+
+    struct ent_latency_model latency;
+
+    pthread_mutex_t lock;
+    sector_t last_block;
+    struct ent_blkio_stats stats;
+};
+
+int ent_blkio_open_file(struct dm_dev *dev, const char *path, u64 nr_blocks);
+// Opens an existing file or block device, of whatever size it has. Read only unless writable is set.
+int ent_blkio_open_device(struct dm_dev *dev, const char *path, bool writable);
+int ent_blkio_open_memory(struct dm_dev *dev, u64 nr_blocks);
+void ent_blkio_close(struct dm_dev *dev);
+
+// Seeds the generator behind get_random_bytes(), which the core uses for fault injection.
+void ent_seed_random(u64 seed);
+
+// Library interface, mirroring the constructor, the write path and the destructor of the target.
+
+// Chain window the devices opened by ent_user_open() start with, like the chain_window parameter of the module (0 keeps the whole chain).
+extern uint ent_user_chain_window;
+// Entanglement unit of the devices opened by ent_user_open(), in 4KB blocks, like the unit_kb argument of the target (0 for 4KB).
+// ent_user_write() and ent_user_read() then take unit indices and whole units of data.
+extern uint ent_user_unit_blocks;
+
+struct entanglement_device *ent_user_open(struct dm_dev *dev, struct dm_dev *meta_dev, int init_flag, int *errp);
+int ent_user_write(struct entanglement_device *ent_dev, sector_t block, const u8 *data);
+int ent_user_read(struct entanglement_device *ent_dev, sector_t block, u8 *data);
+int ent_user_close(struct entanglement_device *ent_dev);
+void ent_user_release(struct entanglement_device *ent_dev);
+
+#endif
@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "blkio.h"
+#include "fsck.h"
+#include "uring.h"
+
+/*****************************************************
+ *                    VERIFICATION                   *
+ *****************************************************/
+
+// Blocks handed out to a verification thread at once.
+#define ENT_FSCK_CHUNK 4096
+
+struct ent_fsck_ctx {
+    struct entanglement_device *ent_dev;
+    // Descriptor of the verification reads, opened with O_DIRECT when the device allows it.
+    int fd;
+    unsigned int queue_depth;
+
+    sector_t next_chunk;
+    u64 checked;
+    u64 corrupted;
+    bool io_uring;
+    int err;
+};
+
+static void ent_fsck_verify_block(struct ent_fsck_ctx *ctx, sector_t sector, const u8 *block, u64 *checked, u64 *corrupted) {
+
+    struct entanglement_device *ent_dev = ctx->ent_dev;
+
+    (*checked)++;
+    if (crc32b(block, ent_unit_size(ent_dev)) != ent_dev->sector_checksum_map[sector]) {
+        set_bit(sector, ent_dev->corrupted_blocks);
+        (*corrupted)++;
+    }
+}
+
+static void *ent_fsck_worker(void *arg) {
+
+    struct ent_fsck_ctx *ctx = arg;
+    struct entanglement_device *ent_dev = ctx->ent_dev;
+    size_t unit_size = ent_unit_size(ent_dev);
+    struct ent_uring ring;
+    struct io_uring_cqe cqe;
+    sector_t *slot_sectors = NULL;
+    uint *free_slots = NULL;
+    u8 *buffers = NULL;
+    uint nr_free, queued = 0, in_flight = 0;
+    u64 checked = 0, corrupted = 0;
+    bool uring;
+    int err = 0;
+
+    uring = ent_uring_init(&ring, ctx->queue_depth) == 0;
+    if (!uring) {
+        __atomic_store_n(&ctx->io_uring, false, __ATOMIC_RELAXED);
+    }
+    nr_free = uring ? min_t(uint, ring.entries, ctx->queue_depth) : 1;
+
+    slot_sectors = calloc(nr_free, sizeof(sector_t));
+    free_slots = calloc(nr_free, sizeof(uint));
+    if (!slot_sectors || !free_slots || posix_memalign((void **)&buffers, ENT_BLOCK_SIZE, nr_free * unit_size)) {
+        buffers = NULL;
+        err = -ENOMEM;
+        goto out;
+    }
+    for (uint i = 0 ; i < nr_free ; i++) {
+        free_slots[i] = i;
+    }
+
+    for (;;) {
+        sector_t start = __atomic_fetch_add(&ctx->next_chunk, ENT_FSCK_CHUNK, __ATOMIC_RELAXED);
+        sector_t end = min_t(sector_t, start + ENT_FSCK_CHUNK, ent_dev->dev_size);
+
+        if (start >= (sector_t)ent_dev->dev_size || READ_ONCE(ctx->err)) {
+            break;
+        }
+
+        for (sector_t sector = start ; sector < end ; sector++) {
+            uint slot;
+
+            // Same rule as scrub_range(): only blocks with a checksum have been written.
+            if (!ent_dev->sector_checksum_map[sector]) {
+                continue;
+            }
+
+            if (!uring) {
+                if (pread(ctx->fd, buffers, unit_size, sector * unit_size) != (ssize_t)unit_size) {
+                    err = -EIO;
+                    goto out;
+                }
+                ent_fsck_verify_block(ctx, sector, buffers, &checked, &corrupted);
+                continue;
+            }
+
+            // Every slot is in flight: submit what is queued, and wait for at least one read to come back.
+            if (!nr_free) {
+                err = ent_uring_enter(&ring, queued, 1);
+                if (err) {
+                    goto out;
+                }
+                queued = 0;
+                while (ent_uring_reap(&ring, &cqe)) {
+                    slot = cqe.user_data;
+                    in_flight--;
+                    free_slots[nr_free++] = slot;
+                    if (cqe.res != (int)unit_size) {
+                        err = cqe.res < 0 ? cqe.res : -EIO;
+                        goto out;
+                    }
+                    ent_fsck_verify_block(ctx, slot_sectors[slot], buffers + slot * unit_size, &checked, &corrupted);
+                }
+            }
+
+            slot = free_slots[--nr_free];
+            slot_sectors[slot] = sector;
+            ent_uring_prep_read(&ring, ctx->fd, buffers + slot * unit_size, unit_size, sector * unit_size, slot);
+            queued++;
+            in_flight++;
+        }
+    }
+
+out:
+    // Drain the reads still in flight, even after an error: their buffers are about to be freed.
+    while (uring && in_flight) {
+        if (ent_uring_enter(&ring, queued, 1)) {
+            break;
+        }
+        queued = 0;
+        while (ent_uring_reap(&ring, &cqe)) {
+            uint slot = cqe.user_data;
+
+            in_flight--;
+            if (!err && cqe.res == (int)unit_size) {
+                ent_fsck_verify_block(ctx, slot_sectors[slot], buffers + slot * unit_size, &checked, &corrupted);
+            }else if (!err) {
+                err = cqe.res < 0 ? cqe.res : -EIO;
+            }
+        }
+    }
+    if (uring) {
+        ent_uring_exit(&ring);
+    }
+
+    __atomic_fetch_add(&ctx->checked, checked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ctx->corrupted, corrupted, __ATOMIC_RELAXED);
+    if (err) {
+        WRITE_ONCE(ctx->err, err);
+    }
+
+    free(buffers);
+    free(free_slots);
+    free(slot_sectors);
+    return NULL;
+}
+
+static int ent_fsck_verify(struct entanglement_device *ent_dev, const char *path, const struct ent_fsck_opts *opts,
+                           struct ent_fsck_report *report) {
+
+    struct ent_fsck_ctx ctx = {
+        .ent_dev = ent_dev,
+        .queue_depth = opts->queue_depth ? opts->queue_depth : ENT_FSCK_DEFAULT_QUEUE_DEPTH,
+        .io_uring = true,
+    };
+    uint nr_threads = opts->threads ? opts->threads : ENT_FSCK_DEFAULT_THREADS;
+    pthread_t *threads;
+    uint nr_started;
+
+    // The reads bypass the page cache where possible (not every file system supports O_DIRECT).
+    ctx.fd = open(path, O_RDONLY | O_DIRECT);
+    if (ctx.fd < 0) {
+        ctx.fd = open(path, O_RDONLY);
+    }
+    if (ctx.fd < 0) {
+        return -errno;
+    }
+
+    threads = calloc(nr_threads, sizeof(pthread_t));
+    if (!threads) {
+        close(ctx.fd);
+        return -ENOMEM;
+    }
+
+    for (nr_started = 0 ; nr_started < nr_threads ; nr_started++) {
+        if (pthread_create(&threads[nr_started], NULL, ent_fsck_worker, &ctx)) {
+            break;
+        }
+    }
+    if (!nr_started) {
+        ent_fsck_worker(&ctx);
+    }
+    for (uint i = 0 ; i < nr_started ; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    report->checked = ctx.checked;
+    report->corrupted = ctx.corrupted;
+    report->io_uring = ctx.io_uring;
+
+    free(threads);
+    close(ctx.fd);
+    return ctx.err;
+}
+
+/*****************************************************
+ *                       REPAIR                      *
+ *****************************************************/
+
+// Runs the repair planner on the corrupted blocks, to report what can be repaired and list the blocks that cannot.
+static int ent_fsck_plan(struct entanglement_device *ent_dev, struct ent_fsck_report *report) {
+
+    struct ent_repair_step *steps;
+    unsigned long *corrupted, *dead, *anchors = NULL;
+    sector_t sector;
+    u64 chain_length = ent_dev->chain_length;
+    u64 nr_corrupted, nr_steps = 0, i = 0, pos;
+    int err = 0;
+
+    if (!chain_length) {
+        return 0;
+    }
+
+    // The chain has a gap until the compaction is over, and no block can be repaired meanwhile.
+    if (ent_chain_compacting(ent_dev)) {
+        pr_err("A compaction of the chain is under way: no repair can be planned until it is over.\n");
+        return 0;
+    }
+
+    corrupted = bitmap_zalloc(chain_length, GFP_KERNEL);
+    dead = bitmap_zalloc(chain_length, GFP_KERNEL);
+    if (ent_dev->nr_anchors) {
+        anchors = bitmap_zalloc(chain_length, GFP_KERNEL);
+    }
+    if (!corrupted || !dead || (ent_dev->nr_anchors && !anchors)) {
+        err = -ENOMEM;
+        goto out_free;
+    }
+
+    mutex_lock(&ent_dev->entanglement_lock);
+
+    // Like repair_corrupted_blocks(): only the live entries of a corrupted block are repaired, and no repair crosses an anchor.
+    err = ent_repair_mark(ent_dev, chain_length, corrupted, dead, anchors);
+    if (err) {
+        goto out;
+    }
+
+    nr_corrupted = bitmap_weight(corrupted, chain_length);
+    if (!nr_corrupted) {
+        goto out;
+    }
+
+    steps = kvmalloc_array(nr_corrupted, sizeof(*steps), GFP_KERNEL);
+    if (!steps) {
+        err = -ENOMEM;
+        goto out;
+    }
+    ent_plan_repair(corrupted, dead, anchors, chain_length, steps, &nr_steps);
+    kvfree(steps);
+
+    report->repairable = nr_steps;
+    report->irrecoverable = nr_corrupted - nr_steps;
+    if (report->irrecoverable) {
+        report->irrecoverable_blocks = calloc(report->irrecoverable, sizeof(u64));
+        if (!report->irrecoverable_blocks) {
+            err = -ENOMEM;
+            goto out;
+        }
+        for_each_set_bit(pos, corrupted, chain_length) {
+            err = ent_chain_record(ent_dev, pos, &sector, NULL);
+            if (err) {
+                goto out;
+            }
+            report->irrecoverable_blocks[i++] = sector;
+        }
+    }
+
+out:
+    mutex_unlock(&ent_dev->entanglement_lock);
+out_free:
+    bitmap_free(anchors);
+    bitmap_free(dead);
+    bitmap_free(corrupted);
+    return err;
+}
+
+int ent_fsck_device(const char *path, const struct ent_fsck_opts *opts, struct ent_fsck_report *report) {
+
+    struct entanglement_device *ent_dev;
+    struct ent_stats sum;
+    struct dm_dev dev, meta_dev;
+    u64 start_ns;
+    int err;
+
+    memset(report, 0, sizeof(*report));
+
+    // Only a repair writes to the device: fsck does not even store the metadata back.
+    err = ent_blkio_open_device(&dev, path, opts->repair);
+    if (err) {
+        return err;
+    }
+    report->dev_blocks = dev.nr_blocks;
+
+    // The metadata is only ever read.
+    if (opts->meta_path) {
+        err = ent_blkio_open_device(&meta_dev, opts->meta_path, false);
+        if (err) {
+            goto err_meta_open;
+        }
+    }
+
+    start_ns = ktime_get_ns();
+    ent_dev = ent_user_open(&dev, opts->meta_path ? &meta_dev : NULL, 0, &err);
+    if (!ent_dev) {
+        goto err_open;
+    }
+    report->chain_length = ent_dev->chain_length;
+    report->chain_anchors = ent_dev->nr_anchors;
+    report->load_ns = ktime_get_ns() - start_ns;
+
+    start_ns = ktime_get_ns();
+    err = ent_fsck_verify(ent_dev, path, opts, report);
+    report->verify_ns = ktime_get_ns() - start_ns;
+    if (err) {
+        pr_err("Error while verifying the blocks of %s: %d\n", path, err);
+        goto out;
+    }
+
+    start_ns = ktime_get_ns();
+    err = ent_fsck_plan(ent_dev, report);
+    if (err || !opts->repair || !report->corrupted) {
+        goto out;
+    }
+
+    mutex_lock(&ent_dev->corrupted_blocks_lock);
+    err = repair_corrupted_blocks(ent_dev);
+    mutex_unlock(&ent_dev->corrupted_blocks_lock);
+    if (!err && fdatasync(dev.fd) < 0) {
+        err = -errno;
+    }
+
+    ent_stats_sum(ent_dev->stats, &sum);
+    report->repaired = sum.counters[ENT_STAT_REPAIRED];
+    report->repair_ns = ktime_get_ns() - start_ns;
+
+out:
+    ent_user_release(ent_dev);
+err_open:
+    if (opts->meta_path) {
+        ent_blkio_close(&meta_dev);
+    }
+err_meta_open:
+    ent_blkio_close(&dev);
+    return err;
+}
+
+void ent_fsck_report_free(struct ent_fsck_report *report) {
+
+    free(report->irrecoverable_blocks);
+    report->irrecoverable_blocks = NULL;
+}
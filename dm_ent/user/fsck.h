@@ -0,0 +1,54 @@
+#ifndef _ENT_USER_FSCK_H_
+#define _ENT_USER_FSCK_H_
+
+/*
+    Offline check and repair of an entanglement device, straight from the underlying device (which must not be in use by the target).
+    The chain is loaded from the metadata region like the constructor does, then every written block is read and its checksum verified
+    by several threads, each keeping queue_depth reads in flight with io_uring (plain pread() where io_uring is not available).
+    The corrupted blocks are then run through the repair planner of the core: fsck only reports what it would repair, repair also does it.
+
+    This header only uses standard types, so that it can be included by programs that do not include the kernel compatibility layer
+    (such as entanglement_app).
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ent_fsck_opts {
+    // Verification threads, and reads in flight per thread.
+    unsigned int threads;
+    unsigned int queue_depth;
+    // Repair the corrupted blocks instead of only reporting them.
+    bool repair;
+    // Separate metadata device of the entanglement, NULL when the metadata is on the device itself.
+    const char *meta_path;
+};
+
+#define ENT_FSCK_DEFAULT_THREADS 4
+#define ENT_FSCK_DEFAULT_QUEUE_DEPTH 64
+
+struct ent_fsck_report {
+    uint64_t dev_blocks;
+    uint64_t chain_length;
+    // Anchors of the chain: no repair crosses one.
+    uint64_t chain_anchors;
+    uint64_t checked;
+    uint64_t corrupted;
+    // Outcome of the repair plan. With repair set, repaired is what was actually written back, once checked against its checksum.
+    uint64_t repairable;
+    uint64_t repaired;
+    uint64_t irrecoverable;
+    // Blocks that cannot be repaired, in chain order (nr_irrecoverable of them). Freed by ent_fsck_report_free().
+    uint64_t *irrecoverable_blocks;
+
+    bool io_uring;
+    uint64_t load_ns;
+    uint64_t verify_ns;
+    uint64_t repair_ns;
+};
+
+// Returns 0 when the check (and repair) could run, whatever it found, or a negative errno.
+int ent_fsck_device(const char *path, const struct ent_fsck_opts *opts, struct ent_fsck_report *report);
+void ent_fsck_report_free(struct ent_fsck_report *report);
+
+#endif
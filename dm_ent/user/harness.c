@@ -0,0 +1,615 @@
+/*
+    Benchmark and test harness of the entanglement core, running on a sparse file or on memory instead of a block device.
+    A run writes a number of blocks (sequentially or in a random order), optionally writes some of them again, keeps writing them over
+    (compacting the chain whenever it is due, as the target does on its own) and compacts the chain, reopens the device (loading the chain from its metadata), corrupts a percentage of the blocks with one of the injection patterns, detects and repairs them
+    (or rebuilds all the data blocks from the parities), and verifies the contents of every written block.
+    With a unit larger than 4KB, blocks are whole units. Results are printed as key=value lines.
+*/
+
+#include <getopt.h>
+#include <unistd.h>
+
+#include "blkio.h"
+
+struct harness_opts {
+    const char *file;
+    u64 nr_blocks;
+    u64 nr_writes;
+    bool random;
+    // Percentage of the blocks written a second time (the first ones), with other contents.
+    uint overwrite;
+    // Overwrite like relaxed durability: the data is written at once, and entangled only when the next phase drains the overwrites.
+    bool relaxed;
+    // Blocks written over after the overwrites, cycling over the written ones, and the compact_fill tunable (0: never compact meanwhile).
+    u64 nr_churn;
+    uint compact_fill;
+    // Compact the chain after the writes.
+    bool compact;
+    struct ent_inject_spec inject;
+    bool reopen;
+    // Rebuild every data block with a streaming rebuild after the corruption, instead of detecting and repairing it.
+    bool rebuild;
+    bool verify;
+    // Capacity of the chain block cache, -1 for the default.
+    long cache_pages;
+    // Chain segments kept in memory, 0 for the whole chain.
+    uint chain_window;
+    // Keep the metadata on a separate (memory, latency free) metadata device.
+    bool meta_dev;
+    // Entanglement unit, in KB.
+    uint unit_kb;
+    // Data blocks between two anchors of the chain, 0 for none.
+    uint anchor_interval;
+    u64 seed;
+    struct ent_latency_model latency;
+};
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --file PATH        back the device with a (sparse) file, default: memory\n"
+        "  --blocks N         size of the device in 4KB blocks (default 65536)\n"
+        "  --writes N         number of data blocks to write (default: all data blocks)\n"
+        "  --pattern seq|rand write order (default seq)\n"
+        "  --overwrite PERCENT\n"
+        "                     write this percentage of the blocks (the first ones) again after the first writes\n"
+        "  --relaxed          overwrite with relaxed durability: the overwrites are entangled by the next phase, which drains them first\n"
+        "  --churn N          write N more blocks over the written ones, compacting the chain whenever it is due\n"
+        "  --compact-fill PERCENT\n"
+        "                     fill of the chain that starts a compaction during the churn, 0 for none (default 75)\n"
+        "  --compact          compact the chain after the writes\n"
+        "  --corrupt PERCENT  corrupt this percentage of the blocks, then repair them\n"
+        "  --inject PATTERN   uniform, burst, data, parity or pair (default uniform)\n"
+        "  --burst N          length of the bursts of the burst pattern (default 8)\n"
+        "  --cache PAGES      capacity of the chain block cache, 0 to disable it (default 1024)\n"
+        "  --chain-window N   chain segments (512 blocks each) kept in memory, 0 for the whole chain (default 0)\n"
+        "  --meta-dev         keep the metadata on a separate in-memory device, without latency\n"
+        "  --unit KB          entanglement unit: 4, 16, 64 or 256 (default 4)\n"
+        "  --anchor N         restart the chain every N data blocks (default 0: never)\n"
+        "  --reopen           close and reopen the device after writing, loading the chain from disk\n"
+        "  --rebuild          rebuild all the data blocks from the parities instead of detecting and repairing\n"
+        "  --verify           read back and verify every written block at the end\n"
+        "  --read-ns N, --write-ns N, --seek-ns N\n"
+        "                     latency model of the backend (default 0)\n"
+        "  --spin             spend the modeled latency instead of only accounting for it\n"
+        "  --seed N           seed of the block contents, write order and fault injection (default 1)\n",
+        prog);
+}
+
+static int parse_opts(int argc, char **argv, struct harness_opts *opts) {
+
+    static const struct option long_opts[] = {
+        { "file", required_argument, NULL, 'f' },
+        { "blocks", required_argument, NULL, 'b' },
+        { "writes", required_argument, NULL, 'w' },
+        { "pattern", required_argument, NULL, 'p' },
+        { "overwrite", required_argument, NULL, 'o' },
+        { "relaxed", no_argument, NULL, 'L' },
+        { "churn", required_argument, NULL, 'H' },
+        { "compact-fill", required_argument, NULL, 'F' },
+        { "compact", no_argument, NULL, 'K' },
+        { "corrupt", required_argument, NULL, 'c' },
+        { "inject", required_argument, NULL, 'i' },
+        { "burst", required_argument, NULL, 'B' },
+        { "cache", required_argument, NULL, 'C' },
+        { "chain-window", required_argument, NULL, 'N' },
+        { "meta-dev", no_argument, NULL, 'M' },
+        { "unit", required_argument, NULL, 'u' },
+        { "anchor", required_argument, NULL, 'A' },
+        { "reopen", no_argument, NULL, 'r' },
+        { "rebuild", no_argument, NULL, 'G' },
+        { "verify", no_argument, NULL, 'v' },
+        { "read-ns", required_argument, NULL, 'R' },
+        { "write-ns", required_argument, NULL, 'W' },
+        { "seek-ns", required_argument, NULL, 'S' },
+        { "spin", no_argument, NULL, 'x' },
+        { "seed", required_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt, pattern;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->nr_blocks = 65536;
+    opts->seed = 1;
+    opts->inject.burst_length = 8;
+    opts->cache_pages = -1;
+    opts->unit_kb = ENT_BLOCK_SIZE / 1024;
+    opts->compact_fill = ENT_DEFAULT_COMPACT_FILL;
+
+    while ((opt = getopt_long(argc, argv, "f:b:w:p:o:LH:F:Kc:i:B:C:N:Mu:A:rGvR:W:S:xs:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'f': opts->file = optarg; break;
+        case 'b': opts->nr_blocks = strtoull(optarg, NULL, 0); break;
+        case 'w': opts->nr_writes = strtoull(optarg, NULL, 0); break;
+        case 'p':
+            if (!strcmp(optarg, "rand")) {
+                opts->random = true;
+            }else if (strcmp(optarg, "seq")) {
+                return -EINVAL;
+            }
+            break;
+        case 'o': opts->overwrite = strtoul(optarg, NULL, 0); break;
+        case 'L': opts->relaxed = true; break;
+        case 'H': opts->nr_churn = strtoull(optarg, NULL, 0); break;
+        case 'F': opts->compact_fill = strtoul(optarg, NULL, 0); break;
+        case 'K': opts->compact = true; break;
+        case 'c': opts->inject.percent = strtoul(optarg, NULL, 0); break;
+        case 'i':
+            pattern = ent_inject_pattern_parse(optarg);
+            if (pattern < 0) {
+                return -EINVAL;
+            }
+            opts->inject.pattern = pattern;
+            break;
+        case 'B': opts->inject.burst_length = strtoul(optarg, NULL, 0); break;
+        case 'C': opts->cache_pages = strtol(optarg, NULL, 0); break;
+        case 'N': opts->chain_window = strtoul(optarg, NULL, 0); break;
+        case 'M': opts->meta_dev = true; break;
+        case 'u': opts->unit_kb = strtoul(optarg, NULL, 0); break;
+        case 'A': opts->anchor_interval = strtoul(optarg, NULL, 0); break;
+        case 'r': opts->reopen = true; break;
+        case 'G': opts->rebuild = true; break;
+        case 'v': opts->verify = true; break;
+        case 'R': opts->latency.read_ns = strtoull(optarg, NULL, 0); break;
+        case 'W': opts->latency.write_ns = strtoull(optarg, NULL, 0); break;
+        case 'S': opts->latency.seek_ns = strtoull(optarg, NULL, 0); break;
+        case 'x': opts->latency.spin = true; break;
+        case 's': opts->seed = strtoull(optarg, NULL, 0); break;
+        default: return -EINVAL;
+        }
+    }
+
+    if (opts->inject.percent > 100 || opts->overwrite > 100 || opts->compact_fill > 100 || !opts->inject.burst_length || opts->nr_blocks < 1024 || opts->unit_kb % (ENT_BLOCK_SIZE / 1024)) {
+        return -EINVAL;
+    }
+    opts->inject.seed = opts->seed;
+    return 0;
+}
+
+// Size of the blocks written and verified: one unit of the device.
+static size_t block_size = ENT_BLOCK_SIZE;
+
+// splitmix64, whose output is not linear over GF(2), unlike xorshift's.
+static u64 splitmix64(u64 *state) {
+
+    u64 z = (*state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+    Contents of a data block, derived from the seed and the block number so that they can be verified without keeping a copy. The
+    words come from a non-linear generator: with a linear one, blocks XOR to zero (every 4 aligned consecutive ones did), and so do
+    the parities of the chain, which then hide what the compaction, rebuild and repair do.
+*/
+static void fill_block(u8 *buf, u64 seed, sector_t block) {
+
+    u64 state = seed;
+
+    state = splitmix64(&state) ^ block;
+    for (size_t i = 0 ; i < block_size ; i += sizeof(u64)) {
+        u64 x = splitmix64(&state);
+
+        memcpy(buf + i, &x, sizeof(x));
+    }
+}
+
+// Write of relaxed durability: only the data is written, and relaxed_drain() entangles it later.
+static int relaxed_write(struct entanglement_device *ent_dev, sector_t block, const u8 *data) {
+
+    struct page *page = ent_alloc_page(ent_dev);
+    int err;
+
+    if (!page) {
+        return -ENOMEM;
+    }
+    memcpy(kmap(page), data, block_size);
+    kunmap(page);
+    err = ent_dev_rwSector(ent_dev, page, block, WRITE);
+    ent_free_page(ent_dev, page);
+    return err;
+}
+
+/*
+    Entangles the relaxed overwrites still pending, blocks [*drained, nr_overwrites), as the relaxed stage of the target does. Every phase 
+    that reads the chain drains them first, like the maintenance of the target (see ent_maintenance_lock() in target.c): a scrub would
+    otherwise take them for corruption, and the repair would write their previous contents back. Their data is written again, unchanged.
+*/
+static int relaxed_drain(struct entanglement_device *ent_dev, u64 seed, u64 *drained, u64 nr_overwrites, u8 *buf) {
+
+    int err;
+
+    for ( ; *drained < nr_overwrites ; (*drained)++) {
+        fill_block(buf, seed + 1, *drained);
+        err = ent_user_write(ent_dev, *drained, buf);
+        if (err) {
+            pr_err("Error while entangling block %llu: %d\n", *drained, err);
+            return err;
+        }
+    }
+    return 0;
+}
+
+// Compacts the whole chain, as the compaction of the target does a batch at a time, and returns its outcome in result.
+static int compact_chain(struct entanglement_device *ent_dev, struct ent_compact *result) {
+
+    bool done;
+    int err;
+
+    err = ent_compact_init(ent_dev);
+    for (done = false ; !err && !done ; ) {
+        mutex_lock(&ent_dev->corrupted_blocks_lock);
+        mutex_lock(&ent_dev->metadata_buffers_lock);
+        err = ent_compact_step(ent_dev, ent_dev->tuning[ENT_TUNE_SCRUB_BATCH], &done);
+        mutex_unlock(&ent_dev->metadata_buffers_lock);
+        mutex_unlock(&ent_dev->corrupted_blocks_lock);
+    }
+    if (err) {
+        pr_err("Error while compacting the chain: %d\n", err);
+    }else {
+        *result = *ent_dev->compact;
+    }
+    ent_compact_exit(ent_dev);
+    return err;
+}
+
+// Write order: every block is written once, so that every entry of the chain stays valid for the repair.
+static sector_t *write_order(const struct harness_opts *opts, u64 nr_writes) {
+
+    sector_t *order = malloc(nr_writes * sizeof(sector_t));
+
+    if (!order) {
+        return NULL;
+    }
+    for (u64 i = 0 ; i < nr_writes ; i++) {
+        order[i] = i;
+    }
+    if (opts->random) {
+        for (u64 i = nr_writes - 1 ; i > 0 ; i--) {
+            u64 j;
+            get_random_bytes(&j, sizeof(j));
+            j %= i + 1;
+            sector_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+    }
+    return order;
+}
+
+static void print_phase(const char *phase, u64 ops, u64 ns, const struct dm_dev *dev, const struct ent_blkio_stats *before) {
+
+    double s = ns / 1e9;
+
+    printf("%s_ops=%llu\n", phase, ops);
+    printf("%s_ns=%llu\n", phase, ns);
+    printf("%s_blocks_per_s=%.0f\n", phase, s > 0 ? ops / s : 0.0);
+    printf("%s_mib_per_s=%.2f\n", phase, s > 0 ? ops * (double)block_size / (1 << 20) / s : 0.0);
+    printf("%s_dev_reads=%llu\n", phase, dev->stats.reads - before->reads);
+    printf("%s_dev_writes=%llu\n", phase, dev->stats.writes - before->writes);
+    printf("%s_dev_seeks=%llu\n", phase, dev->stats.seeks - before->seeks);
+    printf("%s_modeled_ns=%llu\n", phase, dev->stats.modeled_ns - before->modeled_ns);
+}
+
+int main(int argc, char **argv) {
+
+    struct harness_opts opts;
+    struct dm_dev dev, meta_dev;
+    struct entanglement_device *ent_dev;
+    struct ent_blkio_stats before;
+    struct ent_stats sum;
+    struct ent_rebuild rebuild = { 0 };
+    struct ent_compact result;
+    sector_t *order;
+    u8 *buf, *expected;
+    u64 nr_writes, nr_overwrites, relaxed_drained, start_ns, injected, checked = 0, corrupted = 0, mismatches = 0;
+    int err;
+
+    if (parse_opts(argc, argv, &opts)) {
+        usage(argv[0]);
+        return 2;
+    }
+    ent_seed_random(opts.seed);
+    ent_user_chain_window = opts.chain_window;
+    ent_user_unit_blocks = opts.unit_kb / (ENT_BLOCK_SIZE / 1024);
+
+    err = opts.file ? ent_blkio_open_file(&dev, opts.file, opts.nr_blocks) : ent_blkio_open_memory(&dev, opts.nr_blocks);
+    if (err) {
+        goto err_blkio;
+    }
+    dev.latency = opts.latency;
+
+    // The checkpoint and the records (12 bytes per block), with room to spare: ent_user_open() checks the actual size needed.
+    if (opts.meta_dev) {
+        err = ent_blkio_open_memory(&meta_dev, ENT_CHECKPOINT_BLOCKS + ((opts.nr_blocks * 3) >> 10) + 8);
+        if (err) {
+            goto err_meta_blkio;
+        }
+    }
+
+    ent_dev = ent_user_open(&dev, opts.meta_dev ? &meta_dev : NULL, 1, &err);
+    if (!ent_dev) {
+        goto err_open;
+    }
+    if (opts.cache_pages >= 0) {
+        ent_cache_resize(&ent_dev->cache, opts.cache_pages);
+    }
+    ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL] = opts.anchor_interval;
+
+    nr_writes = opts.nr_writes ? opts.nr_writes : ent_dev->metadata_start_sector;
+    if (nr_writes > ent_dev->metadata_start_sector) {
+        pr_err("Only %llu data blocks fit on the device.\n", (u64)ent_dev->metadata_start_sector);
+        err = -EINVAL;
+        goto err_run;
+    }
+
+    block_size = ent_unit_size(ent_dev);
+    buf = malloc(block_size);
+    expected = malloc(block_size);
+    rebuild.parity = malloc(block_size);
+    order = write_order(&opts, nr_writes);
+    if (!buf || !expected || !rebuild.parity || !order) {
+        err = -ENOMEM;
+        goto err_alloc;
+    }
+
+    printf("backend=%s\n", opts.file ? "file" : "memory");
+    printf("dev_blocks=%llu\n", opts.nr_blocks);
+    printf("unit_kb=%u\n", opts.unit_kb);
+    printf("anchor_interval=%u\n", opts.anchor_interval);
+    printf("data_blocks=%llu\n", (u64)ent_dev->metadata_start_sector);
+    printf("pattern=%s\n", opts.random ? "rand" : "seq");
+    printf("seed=%llu\n", opts.seed);
+
+    // Write phase.
+    before = dev.stats;
+    start_ns = ktime_get_ns();
+    for (u64 i = 0 ; i < nr_writes ; i++) {
+        fill_block(buf, opts.seed, order[i]);
+        err = ent_user_write(ent_dev, order[i], buf);
+        if (err) {
+            pr_err("Error while writing block %llu: %d\n", order[i], err);
+            goto err_alloc;
+        }
+    }
+    print_phase("write", nr_writes, ktime_get_ns() - start_ns, &dev, &before);
+
+    // Overwrite phase: the first blocks are written again, with the contents of the next seed.
+    nr_overwrites = nr_writes * opts.overwrite / 100;
+    relaxed_drained = opts.relaxed ? 0 : nr_overwrites;
+    if (nr_overwrites) {
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        for (u64 i = 0 ; i < nr_overwrites ; i++) {
+            fill_block(buf, opts.seed + 1, i);
+            err = opts.relaxed ? relaxed_write(ent_dev, i, buf) : ent_user_write(ent_dev, i, buf);
+            if (err) {
+                pr_err("Error while writing block %llu again: %d\n", i, err);
+                goto err_alloc;
+            }
+        }
+        print_phase("overwrite", nr_overwrites, ktime_get_ns() - start_ns, &dev, &before);
+        printf("relaxed_pending=%llu\n", nr_overwrites - relaxed_drained);
+    }
+
+    /*
+        Churn phase: the written blocks are written over and over, with the contents they already have, so that only the chain grows.
+        A compaction runs whenever one is due, as the target starts one on its own, and the chain never runs out of room.
+    */
+    if (opts.nr_churn) {
+        u64 nr_compactions = 0, reclaimed = 0;
+
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        ent_dev->tuning[ENT_TUNE_COMPACT_FILL] = opts.compact_fill;
+        err = relaxed_drain(ent_dev, opts.seed, &relaxed_drained, nr_overwrites, buf);
+        for (u64 i = 0 ; !err && i < opts.nr_churn ; i++) {
+            sector_t block = order[i % nr_writes];
+
+            fill_block(buf, (block < nr_overwrites) ? opts.seed + 1 : opts.seed, block);
+            err = ent_user_write(ent_dev, block, buf);
+            if (err) {
+                pr_err("Error while writing block %llu over: %d\n", block, err);
+                break;
+            }
+            if (opts.compact_fill && ent_compact_due(ent_dev, false)) {
+                err = compact_chain(ent_dev, &result);
+                nr_compactions++;
+                reclaimed += result.reclaimed;
+            }
+        }
+        if (err) {
+            goto err_alloc;
+        }
+        print_phase("churn", opts.nr_churn, ktime_get_ns() - start_ns, &dev, &before);
+        printf("churn_compactions=%llu\n", nr_compactions);
+        printf("churn_reclaimed=%llu\n", reclaimed);
+    }
+
+    // Compact phase: its throughput is over the chain entries walked.
+    if (opts.compact) {
+        u64 chain_length = ent_dev->chain_length;
+
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        // The target refuses to compact with relaxed durability: going back to strict drains the overwrites.
+        err = relaxed_drain(ent_dev, opts.seed, &relaxed_drained, nr_overwrites, buf);
+        if (!err) {
+            err = compact_chain(ent_dev, &result);
+        }
+        if (err) {
+            goto err_alloc;
+        }
+        print_phase("compact", chain_length, ktime_get_ns() - start_ns, &dev, &before);
+        printf("compact_reclaimed=%llu\n", result.reclaimed);
+        printf("compact_repaired=%llu\n", result.repaired);
+        printf("compact_failed=%llu\n", result.failed);
+    }
+
+    // Reopen phase: store the metadata and load the chain back from it.
+    if (opts.reopen) {
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        // Like the destructor of the target, which drains the relaxed stage.
+        err = relaxed_drain(ent_dev, opts.seed, &relaxed_drained, nr_overwrites, buf);
+        if (err) {
+            goto err_alloc;
+        }
+        err = ent_user_close(ent_dev);
+        if (err) {
+            pr_err("Error while closing the device: %d\n", err);
+            ent_dev = NULL;
+            goto err_alloc;
+        }
+        ent_dev = ent_user_open(&dev, opts.meta_dev ? &meta_dev : NULL, 0, &err);
+        if (!ent_dev) {
+            goto err_alloc;
+        }
+        if (opts.cache_pages >= 0) {
+            ent_cache_resize(&ent_dev->cache, opts.cache_pages);
+        }
+        // Like the table argument, the interval is not stored with the chain: the anchors already placed are.
+        ent_dev->tuning[ENT_TUNE_ANCHOR_INTERVAL] = opts.anchor_interval;
+        print_phase("reopen", ent_dev->chain_length, ktime_get_ns() - start_ns, &dev, &before);
+    }
+
+    /*
+        Corrupt, detect and repair phases. Detection is a scrub of the whole device, repair runs on the blocks it marked:
+        both are timed separately, and their throughput is over the blocks of the chain.
+    */
+    if (opts.inject.percent) {
+        printf("inject=%s\n", ent_inject_pattern_names[opts.inject.pattern]);
+        printf("inject_percent=%u\n", opts.inject.percent);
+        if (opts.inject.pattern == ENT_INJECT_BURST) {
+            printf("inject_burst=%u\n", opts.inject.burst_length);
+        }
+
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        err = corrupt_blocks(ent_dev, &opts.inject, &injected);
+        if (err) {
+            pr_err("Error while corrupting blocks: %d\n", err);
+            goto err_alloc;
+        }
+        print_phase("inject", injected, ktime_get_ns() - start_ns, &dev, &before);
+    }
+
+    // Rebuild phase: the whole chain is walked, and its throughput is over the data blocks rebuilt.
+    if (opts.inject.percent && opts.rebuild) {
+        mutex_lock(&ent_dev->corrupted_blocks_lock);
+
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        err = relaxed_drain(ent_dev, opts.seed, &relaxed_drained, nr_overwrites, buf);
+        ent_rebuild_init(ent_dev, &rebuild, 0, ent_dev->dev_size);
+        while (!err && rebuild.pos < rebuild.end_pos) {
+            err = ent_rebuild_step(ent_dev, &rebuild);
+            if (err) {
+                break;
+            }
+        }
+
+        mutex_unlock(&ent_dev->corrupted_blocks_lock);
+
+        if (err) {
+            pr_err("Error while rebuilding: %d\n", err);
+            goto err_alloc;
+        }
+        print_phase("rebuild", rebuild.rebuilt, ktime_get_ns() - start_ns, &dev, &before);
+        printf("injected=%llu\n", injected);
+        printf("rebuilt=%llu\n", rebuild.rebuilt);
+        printf("rebuild_failed=%llu\n", rebuild.failed);
+    }else if (opts.inject.percent) {
+        mutex_lock(&ent_dev->corrupted_blocks_lock);
+
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        // Relaxed overwrites may still be pending: the scrub would take them for corruption, and the repair roll them back.
+        err = relaxed_drain(ent_dev, opts.seed, &relaxed_drained, nr_overwrites, buf);
+        if (!err) {
+            err = scrub_range(ent_dev, 0, ent_dev->dev_size, &checked, &corrupted);
+        }
+        if (!err) {
+            print_phase("detect", ent_dev->chain_length, ktime_get_ns() - start_ns, &dev, &before);
+
+            before = dev.stats;
+            start_ns = ktime_get_ns();
+            err = repair_corrupted_blocks(ent_dev);
+        }
+
+        mutex_unlock(&ent_dev->corrupted_blocks_lock);
+
+        if (err) {
+            pr_err("Error while checking for corruption: %d\n", err);
+            goto err_alloc;
+        }
+        print_phase("repair", ent_dev->chain_length, ktime_get_ns() - start_ns, &dev, &before);
+
+        ent_stats_sum(ent_dev->stats, &sum);
+        printf("injected=%llu\n", injected);
+        printf("corrupted=%llu\n", corrupted);
+        printf("repaired=%llu\n", sum.counters[ENT_STAT_REPAIRED]);
+        printf("irrecoverable=%llu\n", sum.counters[ENT_STAT_IRRECOVERABLE]);
+    }
+
+    // Verify phase.
+    if (opts.verify) {
+        before = dev.stats;
+        start_ns = ktime_get_ns();
+        for (u64 i = 0 ; i < nr_writes ; i++) {
+            err = ent_user_read(ent_dev, i, buf);
+            if (err) {
+                pr_err("Error while reading block %llu: %d\n", i, err);
+                goto err_alloc;
+            }
+            fill_block(expected, (i < nr_overwrites) ? opts.seed + 1 : opts.seed, i);
+            if (memcmp(buf, expected, block_size)) {
+                mismatches++;
+            }
+        }
+        print_phase("verify", nr_writes, ktime_get_ns() - start_ns, &dev, &before);
+        printf("mismatches=%llu\n", mismatches);
+    }
+
+    ent_stats_sum(ent_dev->stats, &sum);
+    printf("metadata_flushes=%llu\n", sum.counters[ENT_STAT_METADATA_FLUSHES]);
+    printf("chain_length=%llu\n", ent_dev->chain_length);
+    printf("chain_anchors=%llu\n", ent_dev->nr_anchors);
+    printf("page_pool=%u\n", ent_dev->page_pool_size);
+    printf("page_pool_peak=%d\n", ent_dev->pages_peak);
+    printf("page_pool_in_use=%d\n", atomic_read(&ent_dev->pages_in_use));
+    printf("mempool_waits=%llu\n", sum.counters[ENT_STAT_MEMPOOL_WAITS]);
+    printf("cache=%u/%u\n", ent_dev->cache.nr_pages, ent_dev->cache.capacity);
+    printf("cache_hits=%llu\n", sum.counters[ENT_STAT_CACHE_HITS]);
+    printf("cache_misses=%llu\n", sum.counters[ENT_STAT_CACHE_MISSES]);
+    printf("chain_segments=%u/%llu\n", ent_dev->nr_resident_segments, DIV_ROUND_UP(ent_dev->chain_length, ENT_SECTORS_PER_BLOCK));
+    printf("chain_page_ins=%llu\n", sum.counters[ENT_STAT_CHAIN_PAGE_INS]);
+    if (opts.meta_dev) {
+        printf("meta_dev_reads=%llu\n", meta_dev.stats.reads);
+        printf("meta_dev_writes=%llu\n", meta_dev.stats.writes);
+    }
+
+    err = 0;
+
+err_alloc:
+    free(order);
+    free(rebuild.parity);
+    free(expected);
+    free(buf);
+err_run:
+    if (ent_dev) {
+        ent_user_close(ent_dev);
+    }
+err_open:
+    if (opts.meta_dev) {
+        ent_blkio_close(&meta_dev);
+    }
+err_meta_blkio:
+    ent_blkio_close(&dev);
+err_blkio:
+    return (err || mismatches) ? 1 : 0;
+}
@@ -0,0 +1,438 @@
+#ifndef _ENT_USER_KCOMPAT_H_
+#define _ENT_USER_KCOMPAT_H_
+
+/*
+    Userspace replacements for the small subset of the kernel API used by the entanglement core.
+    Only what core.c, device.h, stats.h and utils.h need is provided, with the same semantics as in the kernel.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*****************************************************
+ *                      TYPES                        *
+ *****************************************************/
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int64_t s64;
+typedef unsigned long long sector_t;
+typedef unsigned int gfp_t;
+
+#define READ 0
+#define WRITE 1
+
+#define GFP_KERNEL 0x1u
+#define GFP_NOIO 0x2u
+#define GFP_NOWAIT 0x4u
+#define __GFP_NOWARN 0x8u
+
+#define NSEC_PER_USEC 1000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+
+#define BITS_PER_LONG (8 * sizeof(long))
+
+/*****************************************************
+ *                      MACROS                       *
+ *****************************************************/
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) ((type)(a) < (type)(b) ? (type)(a) : (type)(b))
+#define max_t(type, a, b) ((type)(a) > (type)(b) ? (type)(a) : (type)(b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define div_u64(n, d) ((u64)(n) / (d))
+#define swap(a, b) do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define pr_err(fmt, ...) fprintf(stderr, "dm-ent: " fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, "dm-ent: " fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, "dm-ent: " fmt, ##__VA_ARGS__)
+#ifdef DEBUG
+#define pr_debug(fmt, ...) fprintf(stderr, "dm-ent: " fmt, ##__VA_ARGS__)
+#else
+#define pr_debug(fmt, ...) do { } while (0)
+#endif
+
+static inline int ilog2(u64 n) {
+    return 63 - __builtin_clzll(n);
+}
+
+static inline bool is_power_of_2(unsigned long n) {
+    return n && !(n & (n - 1));
+}
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*****************************************************
+ *                 MEMORY ALLOCATION                 *
+ *****************************************************/
+
+#define kmalloc(size, gfp) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kmalloc_array(n, size, gfp) malloc((n) * (size))
+#define kfree(ptr) free(ptr)
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define kvzalloc(size, gfp) calloc(1, size)
+#define kvmalloc_array(n, size, gfp) malloc((n) * (size))
+#define vfree(ptr) free(ptr)
+#define kvfree(ptr) free(ptr)
+
+/*
+    Pages are plain 4096-byte aligned buffers, of 4096 << order bytes. The page pool is only a name here: every allocation goes to malloc,
+    which never fails in the way a mempool reserve can.
+*/
+struct page {
+    void *addr;
+};
+
+typedef struct mempool_s {
+    size_t min_nr;
+    int order;
+} mempool_t;
+
+// There is no bio in userspace, but the device structure still embeds a bio_set.
+struct bio_set {
+    int unused;
+};
+
+static inline void *kmap(struct page *page) {
+    return page->addr;
+}
+
+static inline void kunmap(struct page *page) {
+    (void)page;
+}
+
+static inline void *page_address(struct page *page) {
+    return page->addr;
+}
+
+static inline struct page *alloc_pages(gfp_t gfp, unsigned int order) {
+    struct page *page = malloc(sizeof(struct page));
+
+    (void)gfp;
+    if (!page) {
+        return NULL;
+    }
+    if (posix_memalign(&page->addr, 4096, (size_t)4096 << order)) {
+        free(page);
+        return NULL;
+    }
+    return page;
+}
+
+static inline struct page *alloc_page(gfp_t gfp) {
+    return alloc_pages(gfp, 0);
+}
+
+static inline void __free_pages(struct page *page, unsigned int order) {
+    (void)order;
+    free(page->addr);
+    free(page);
+}
+
+static inline void __free_page(struct page *page) {
+    __free_pages(page, 0);
+}
+
+static inline mempool_t *mempool_create_page_pool(int min_nr, int order) {
+    mempool_t *pool = malloc(sizeof(mempool_t));
+
+    if (pool) {
+        pool->min_nr = min_nr;
+        pool->order = order;
+    }
+    return pool;
+}
+
+static inline void mempool_destroy(mempool_t *pool) {
+    free(pool);
+}
+
+static inline void *mempool_alloc(mempool_t *pool, gfp_t gfp) {
+    return alloc_pages(gfp, pool->order);
+}
+
+static inline void mempool_free(void *element, mempool_t *pool) {
+    if (element) {
+        __free_pages(element, pool->order);
+    }
+}
+
+/*****************************************************
+ *                      LISTS                        *
+ *****************************************************/
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+    list->next = list;
+    list->prev = list;
+}
+
+static inline void __list_add(struct list_head *new, struct list_head *prev, struct list_head *next) {
+    next->prev = new;
+    new->next = next;
+    new->prev = prev;
+    prev->next = new;
+}
+
+static inline void list_add(struct list_head *new, struct list_head *head) {
+    __list_add(new, head, head->next);
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head) {
+    __list_add(new, head->prev, head);
+}
+
+static inline void list_del(struct list_head *entry) {
+    entry->next->prev = entry->prev;
+    entry->prev->next = entry->next;
+    entry->next = NULL;
+    entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head) {
+    return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(ptr, type, member) list_entry((ptr)->next, type, member)
+#define list_last_entry(ptr, type, member) list_entry((ptr)->prev, type, member)
+#define list_next_entry(pos, member) list_entry((pos)->member.next, __typeof__(*(pos)), member)
+#define list_prev_entry(pos, member) list_entry((pos)->member.prev, __typeof__(*(pos)), member)
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member); &pos->member != (head); pos = list_next_entry(pos, member))
+
+#define list_for_each_entry_safe(pos, n, head, member) \
+    for (pos = list_first_entry(head, __typeof__(*pos), member), n = list_next_entry(pos, member); \
+         &pos->member != (head); pos = n, n = list_next_entry(n, member))
+
+/*****************************************************
+ *                      LOCKING                      *
+ *****************************************************/
+
+struct mutex {
+    pthread_mutex_t lock;
+};
+
+static inline void mutex_init(struct mutex *m) {
+    pthread_mutex_init(&m->lock, NULL);
+}
+
+static inline void mutex_lock(struct mutex *m) {
+    pthread_mutex_lock(&m->lock);
+}
+
+static inline int mutex_lock_interruptible(struct mutex *m) {
+    pthread_mutex_lock(&m->lock);
+    return 0;
+}
+
+static inline void mutex_unlock(struct mutex *m) {
+    pthread_mutex_unlock(&m->lock);
+}
+
+typedef struct mutex spinlock_t;
+#define spin_lock_init(l) mutex_init(l)
+#define spin_lock(l) mutex_lock(l)
+#define spin_unlock(l) mutex_unlock(l)
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+#define atomic_set(a, v) __atomic_store_n(&(a)->counter, (v), __ATOMIC_RELAXED)
+#define atomic_read(a) __atomic_load_n(&(a)->counter, __ATOMIC_RELAXED)
+#define atomic_inc(a) __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_inc_return(a) __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec(a) __atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(a) (__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+/*
+    Maintenance work items, wait queues and semaphores only exist in the kernel target. They are declared here so that device.h compiles.
+*/
+struct work_struct {
+    void (*func)(struct work_struct *work);
+};
+struct delayed_work {
+    struct work_struct work;
+};
+struct workqueue_struct;
+typedef struct {
+    int unused;
+} wait_queue_head_t;
+struct rw_semaphore {
+    int unused;
+};
+
+/*****************************************************
+ *                      PER-CPU                      *
+ *****************************************************/
+
+// A single "CPU". Updates are atomic, so the counters can be shared by several threads.
+#define __percpu
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr) free(ptr)
+#define per_cpu_ptr(ptr, cpu) ((void)(cpu), (ptr))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0 ; (cpu) < 1 ; (cpu)++)
+#define this_cpu_add(var, v) __atomic_fetch_add(&(var), (v), __ATOMIC_RELAXED)
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+/*****************************************************
+ *                      BITMAPS                      *
+ *****************************************************/
+
+#define BITS_TO_LONGS(nr) DIV_ROUND_UP(nr, BITS_PER_LONG)
+
+static inline unsigned long *bitmap_zalloc(unsigned int nbits, gfp_t gfp) {
+    (void)gfp;
+    return calloc(BITS_TO_LONGS(nbits), sizeof(unsigned long));
+}
+
+// Kernel bitmap_alloc() does not zero the bitmap, but callers must not rely on garbage either.
+#define bitmap_alloc(nbits, gfp) bitmap_zalloc(nbits, gfp)
+
+static inline void bitmap_free(unsigned long *bitmap) {
+    free(bitmap);
+}
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr) {
+    return (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG)) & 1UL;
+}
+
+static inline void set_bit(unsigned long nr, unsigned long *addr) {
+    __atomic_fetch_or(&addr[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+static inline void clear_bit(unsigned long nr, unsigned long *addr) {
+    __atomic_fetch_and(&addr[nr / BITS_PER_LONG], ~(1UL << (nr % BITS_PER_LONG)), __ATOMIC_RELAXED);
+}
+
+static inline int test_and_set_bit(unsigned long nr, unsigned long *addr) {
+    return (__atomic_fetch_or(&addr[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG), __ATOMIC_RELAXED) >> (nr % BITS_PER_LONG)) & 1UL;
+}
+
+// Index of the first set bit in [offset, size), or size if there is none.
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long offset) {
+    for ( ; offset < size ; offset++) {
+        if (test_bit(offset, addr)) {
+            return offset;
+        }
+    }
+    return size;
+}
+
+// Index of the last set bit in [0, size), or size if there is none.
+static inline unsigned long find_last_bit(const unsigned long *addr, unsigned long size) {
+    for (unsigned long i = size ; i > 0 ; i--) {
+        if (test_bit(i - 1, addr)) {
+            return i - 1;
+        }
+    }
+    return size;
+}
+
+#define for_each_set_bit(bit, addr, size) \
+    for ((bit) = find_next_bit((addr), (size), 0) ; (bit) < (size) ; (bit) = find_next_bit((addr), (size), (bit) + 1))
+
+static inline void bitmap_set(unsigned long *map, unsigned int start, unsigned int nbits) {
+    for (unsigned int i = start ; i < start + nbits ; i++) {
+        set_bit(i, map);
+    }
+}
+
+static inline void bitmap_clear(unsigned long *map, unsigned int start, unsigned int nbits) {
+    for (unsigned int i = start ; i < start + nbits ; i++) {
+        clear_bit(i, map);
+    }
+}
+
+static inline void bitmap_zero(unsigned long *map, unsigned int nbits) {
+    memset(map, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline unsigned int bitmap_weight(const unsigned long *map, unsigned int nbits) {
+    unsigned int weight = 0;
+    unsigned int i;
+
+    for (i = 0 ; i < nbits / BITS_PER_LONG ; i++) {
+        weight += __builtin_popcountl(map[i]);
+    }
+    if (nbits % BITS_PER_LONG) {
+        weight += __builtin_popcountl(map[i] & ((1UL << (nbits % BITS_PER_LONG)) - 1));
+    }
+    return weight;
+}
+
+/*****************************************************
+ *                     RANDOMNESS                    *
+ *****************************************************/
+
+// Provided by the block I/O backend (user/blkio.c), so that runs can be reproduced from a seed.
+void get_random_bytes(void *buf, size_t len);
+
+/*****************************************************
+ *                     CHECKSUMS                     *
+ *****************************************************/
+
+// Provided by the block I/O backend (user/blkio.c), with the semantics of the kernel's: no inversion of the CRC on entry or exit.
+u32 crc32_le(u32 crc, const unsigned char *p, size_t len);
+
+/*****************************************************
+ *                    TRACEPOINTS                    *
+ *****************************************************/
+
+// Tracepoints compile to nothing in userspace.
+#define ENT_TRACE_STUB(name) \
+    static inline bool trace_##name##_enabled(void) { return false; }
+
+ENT_TRACE_STUB(ent_flush_metadata_start)
+ENT_TRACE_STUB(ent_flush_metadata_end)
+ENT_TRACE_STUB(ent_check_corruption_start)
+ENT_TRACE_STUB(ent_check_corruption_end)
+ENT_TRACE_STUB(ent_repair_start)
+ENT_TRACE_STUB(ent_repair_end)
+
+// The arguments are still evaluated, as in the kernel, so that variables only used for tracing are not reported as unused.
+#define trace_ent_flush_metadata_start(type, sector) ((void)(type), (void)(sector))
+#define trace_ent_flush_metadata_end(type, sector, ns, err) ((void)(type), (void)(sector), (void)(ns), (void)(err))
+#define trace_ent_check_corruption_start(first, last) ((void)(first), (void)(last))
+#define trace_ent_check_corruption_end(checked, corrupted, ns, err) ((void)(checked), (void)(corrupted), (void)(ns), (void)(err))
+#define trace_ent_repair_start(sector, pos, step) ((void)(sector), (void)(pos), (void)(step))
+#define trace_ent_repair_end(sector, pos, step, repaired, ns) ((void)(sector), (void)(pos), (void)(step), (void)(repaired), (void)(ns))
+
+#endif
@@ -0,0 +1,769 @@
+/*
+    Userspace entanglement daemon, for hosts that cannot load the module: serves an entanglement device through the kernel NBD client
+    (/dev/nbdX), which is handed one end of a socket pair. The device has the on-disk format of the target (the same core is built
+    into both), so a volume can be served by either of them in turn: --init formats it like "entanglement_app init" does, and
+    without it the chain is loaded from the metadata, like the constructor does.
+
+    The main thread reads the requests from the socket and queues them for the worker threads. Every worker has its own io_uring
+    (plain pread()/pwrite() where io_uring is not available). Reads go straight to the underlying device. Writes are split in units,
+    entangled in order under the metadata buffers lock like process_write_bio() does, and the data and parity writes of a batch of
+    units are then submitted at once, outside of the lock, so that the workers overlap their I/O. Flushes and FUA writes sync the
+    underlying (and metadata) device. The counters are printed as key=value lines once the device is disconnected.
+*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/nbd.h>
+
+#include "blkio.h"
+#include "uring.h"
+
+#define NBD_DEFAULT_THREADS 4
+#define NBD_DEFAULT_QUEUE_DEPTH 64
+
+struct nbd_opts {
+    const char *path;
+    const char *nbd_path;
+    const char *meta_path;
+    bool init;
+    // Entanglement unit, in KB.
+    uint unit_kb;
+    uint chain_window;
+    // Worker threads, and I/Os in flight per worker.
+    uint threads;
+    uint queue_depth;
+};
+
+// A request of the NBD client, from the time it is received until it is answered.
+struct nbd_req {
+    struct nbd_req *next;
+    u32 cmd;
+    u32 flags;
+    char handle[8];
+    u64 offset;
+    u32 len;
+    // Payload of a write, or the data of a read, aligned for O_DIRECT.
+    u8 *data;
+};
+
+struct nbd_server {
+    struct entanglement_device *ent_dev;
+    struct dm_dev dev;
+    struct dm_dev meta_dev;
+    bool has_meta_dev;
+    // Bytes of the data region, exported to the client.
+    u64 size;
+    int nbd_fd;
+    // Our end of the socket pair.
+    int sock;
+
+    // Requests waiting for a worker, oldest first.
+    pthread_mutex_t queue_lock;
+    pthread_cond_t queue_cond;
+    struct nbd_req *head;
+    struct nbd_req *tail;
+    bool stopping;
+
+    // Replies are sent by all the workers.
+    pthread_mutex_t reply_lock;
+
+    // Data writes in flight of units larger than 4KB, in slots hashed on the unit, like ent_unit_writes() in the target: a write that
+    // covers only part of a unit reads the rest of it back once no write of its slot is in flight anymore.
+    pthread_mutex_t unit_lock;
+    pthread_cond_t unit_cond;
+    uint unit_writes[ENT_UNIT_WRITE_SLOTS];
+
+    uint queue_depth;
+
+    // Counters, updated atomically by the workers.
+    u64 reads;
+    u64 writes;
+    u64 flushes;
+    u64 read_bytes;
+    u64 write_bytes;
+    u64 units;
+    u64 errors;
+};
+
+struct nbd_io {
+    bool write;
+    void *buf;
+    u32 len;
+    u64 offset;
+};
+
+struct nbd_worker {
+    struct nbd_server *srv;
+    pthread_t thread;
+    struct ent_uring ring;
+    bool uring;
+    // Units entangled per batch, with a data and a parity buffer each (the data buffers are only used with units larger than 4KB).
+    uint batch;
+    u8 *data;
+    u8 *parities;
+    struct nbd_io *ios;
+};
+
+static struct nbd_server server;
+
+static void usage(const char *prog) {
+
+    fprintf(stderr,
+        "Usage: %s [options] <device> <nbd device>\n"
+        "  --init             format the device (the chain starts empty) instead of loading its chain\n"
+        "  --meta PATH        separate metadata device of the entanglement\n"
+        "  --unit KB          entanglement unit of the device: 4, 16, 64 or 256 (default 4)\n"
+        "  --chain-window N   chain segments (512 blocks each) kept in memory, 0 for the whole chain (default 0)\n"
+        "  --threads N        worker threads (default %d)\n"
+        "  --queue-depth N    I/Os in flight per worker (default %d)\n",
+        prog, NBD_DEFAULT_THREADS, NBD_DEFAULT_QUEUE_DEPTH);
+}
+
+static int parse_opts(int argc, char **argv, struct nbd_opts *opts) {
+
+    static const struct option long_opts[] = {
+        { "init", no_argument, NULL, 'i' },
+        { "meta", required_argument, NULL, 'm' },
+        { "unit", required_argument, NULL, 'u' },
+        { "chain-window", required_argument, NULL, 'N' },
+        { "threads", required_argument, NULL, 't' },
+        { "queue-depth", required_argument, NULL, 'q' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+
+    memset(opts, 0, sizeof(*opts));
+    opts->unit_kb = ENT_BLOCK_SIZE / 1024;
+    opts->threads = NBD_DEFAULT_THREADS;
+    opts->queue_depth = NBD_DEFAULT_QUEUE_DEPTH;
+
+    while ((opt = getopt_long(argc, argv, "im:u:N:t:q:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+        case 'i': opts->init = true; break;
+        case 'm': opts->meta_path = optarg; break;
+        case 'u': opts->unit_kb = strtoul(optarg, NULL, 0); break;
+        case 'N': opts->chain_window = strtoul(optarg, NULL, 0); break;
+        case 't': opts->threads = strtoul(optarg, NULL, 0); break;
+        case 'q': opts->queue_depth = strtoul(optarg, NULL, 0); break;
+        default: return -EINVAL;
+        }
+    }
+
+    if (argc - optind != 2 || !opts->threads || opts->queue_depth < 2 || opts->unit_kb % (ENT_BLOCK_SIZE / 1024)) {
+        return -EINVAL;
+    }
+    opts->path = argv[optind];
+    opts->nbd_path = argv[optind + 1];
+    return 0;
+}
+
+/*****************************************************
+ *                        I/O                        *
+ *****************************************************/
+
+// Runs the given I/Os on the underlying device, all in flight at once with io_uring. Returns 0 once all of them are done.
+static int nbd_do_io(struct nbd_worker *w, struct nbd_io *ios, uint nr) {
+
+    int fd = w->srv->dev.fd;
+    struct io_uring_cqe cqe;
+    uint done = 0;
+    int err = 0;
+    ssize_t ret;
+
+    if (!w->uring) {
+        for (uint i = 0 ; i < nr ; i++) {
+            ret = ios[i].write ? pwrite(fd, ios[i].buf, ios[i].len, ios[i].offset) : pread(fd, ios[i].buf, ios[i].len, ios[i].offset);
+            if (ret != ios[i].len) {
+                err = ret < 0 ? -errno : -EIO;
+            }
+        }
+        return err;
+    }
+
+    for (uint i = 0 ; i < nr ; i++) {
+        if (ios[i].write) {
+            ent_uring_prep_write(&w->ring, fd, ios[i].buf, ios[i].len, ios[i].offset, i);
+        }else {
+            ent_uring_prep_read(&w->ring, fd, ios[i].buf, ios[i].len, ios[i].offset, i);
+        }
+    }
+    ret = ent_uring_enter(&w->ring, nr, nr);
+    if (ret) {
+        return ret;
+    }
+    while (done < nr) {
+        if (!ent_uring_reap(&w->ring, &cqe)) {
+            ret = ent_uring_enter(&w->ring, 0, 1);
+            if (ret) {
+                return ret;
+            }
+            continue;
+        }
+        if (cqe.res != (int)ios[cqe.user_data].len) {
+            err = cqe.res < 0 ? cqe.res : -EIO;
+        }
+        done++;
+    }
+    return err;
+}
+
+static int nbd_sync(struct nbd_server *srv) {
+
+    if (fdatasync(srv->dev.fd) < 0) {
+        return -errno;
+    }
+    if (srv->has_meta_dev && fdatasync(srv->meta_dev.fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static void nbd_unit_wait(struct nbd_server *srv, sector_t unit) {
+
+    pthread_mutex_lock(&srv->unit_lock);
+    while (srv->unit_writes[unit % ENT_UNIT_WRITE_SLOTS]) {
+        pthread_cond_wait(&srv->unit_cond, &srv->unit_lock);
+    }
+    pthread_mutex_unlock(&srv->unit_lock);
+}
+
+static void nbd_unit_add(struct nbd_server *srv, sector_t first, uint nr, int delta) {
+
+    pthread_mutex_lock(&srv->unit_lock);
+    for (uint i = 0 ; i < nr ; i++) {
+        srv->unit_writes[(first + i) % ENT_UNIT_WRITE_SLOTS] += delta;
+    }
+    if (delta < 0) {
+        pthread_cond_broadcast(&srv->unit_cond);
+    }
+    pthread_mutex_unlock(&srv->unit_lock);
+}
+
+/*****************************************************
+ *                     REQUESTS                      *
+ *****************************************************/
+
+/*
+    Entangles nr units of a write, starting at unit first, then writes their data and parities. The units a write only covers
+    part of are read back and merged, and their slots are only taken once the whole batch is entangled, so that a batch never waits
+    for its own units.
+*/
+static int nbd_write_units(struct nbd_worker *w, struct nbd_req *req, sector_t first, uint nr) {
+
+    struct entanglement_device *ent_dev = w->srv->ent_dev;
+    size_t unit_size = ent_unit_size(ent_dev);
+    struct ent_append_info info;
+    uint i;
+    int err = 0;
+
+    mutex_lock(&ent_dev->metadata_buffers_lock);
+    for (i = 0 ; i < nr ; i++) {
+        sector_t unit = first + i;
+        u64 start = unit * unit_size;
+        u64 from = max_t(u64, start, req->offset);
+        u64 to = min_t(u64, start + unit_size, req->offset + req->len);
+        u8 *data;
+
+        if (ent_dev->unit_blocks <= 1) {
+            // NBD requests are aligned on the 4KB blocks of the export.
+            data = req->data + (from - req->offset);
+        }else {
+            data = w->data + i * unit_size;
+            if (to - from != unit_size) {
+                struct nbd_io io = { .write = false, .buf = data, .len = unit_size, .offset = start };
+
+                nbd_unit_wait(w->srv, unit);
+                err = nbd_do_io(w, &io, 1);
+                if (err) {
+                    pr_err("Error while reading unit %llu for a partial write.\n", (unsigned long long) unit);
+                    break;
+                }
+            }
+            memcpy(data + (from - start), req->data + (from - req->offset), to - from);
+        }
+
+        err = ent_chain_append(ent_dev, data, unit, w->parities + i * unit_size, false, &info);
+        if (err) {
+            break;
+        }
+        w->ios[2 * i] = (struct nbd_io) { .write = true, .buf = data, .len = unit_size, .offset = start };
+        w->ios[2 * i + 1] = (struct nbd_io) { .write = true, .buf = w->parities + i * unit_size, .len = unit_size,
+                                              .offset = info.parity_sector * unit_size };
+    }
+    if (ent_dev->unit_blocks > 1) {
+        nbd_unit_add(w->srv, first, i, 1);
+    }
+    mutex_unlock(&ent_dev->metadata_buffers_lock);
+
+    // The units entangled before an error are in the chain already: they are written all the same.
+    if (i) {
+        int io_err = nbd_do_io(w, w->ios, 2 * i);
+        err = err ? err : io_err;
+    }
+    if (ent_dev->unit_blocks > 1) {
+        nbd_unit_add(w->srv, first, i, -1);
+    }
+    __atomic_fetch_add(&w->srv->units, i, __ATOMIC_RELAXED);
+    return err;
+}
+
+static int nbd_write(struct nbd_worker *w, struct nbd_req *req) {
+
+    size_t unit_size = ent_unit_size(w->srv->ent_dev);
+    sector_t unit = req->offset / unit_size;
+    sector_t last = (req->offset + req->len - 1) / unit_size;
+    int err = 0;
+
+    while (!err && unit <= last) {
+        uint nr = min_t(u64, w->batch, last - unit + 1);
+
+        err = nbd_write_units(w, req, unit, nr);
+        unit += nr;
+    }
+    if (!err && (req->flags & NBD_CMD_FLAG_FUA)) {
+        err = nbd_sync(w->srv);
+    }
+    return err;
+}
+
+static int nbd_write_all(int fd, const void *buf, size_t len) {
+
+    const u8 *p = buf;
+
+    while (len) {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int nbd_read_all(int fd, void *buf, size_t len) {
+
+    u8 *p = buf;
+
+    while (len) {
+        ssize_t ret = read(fd, p, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (!ret) {
+            return -ECONNRESET;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// Answers a request, with the data of a read. err is a negative errno, which NBD carries as a positive one.
+static void nbd_reply(struct nbd_server *srv, struct nbd_req *req, int err) {
+
+    struct nbd_reply reply = { .magic = htobe32(NBD_REPLY_MAGIC), .error = htobe32(-err) };
+    int ret;
+
+    memcpy(reply.handle, req->handle, sizeof(reply.handle));
+
+    pthread_mutex_lock(&srv->reply_lock);
+    ret = nbd_write_all(srv->sock, &reply, sizeof(reply));
+    if (!ret && !err && req->cmd == NBD_CMD_READ) {
+        ret = nbd_write_all(srv->sock, req->data, req->len);
+    }
+    pthread_mutex_unlock(&srv->reply_lock);
+
+    if (ret) {
+        pr_err("Error while answering a request: %d\n", ret);
+    }
+}
+
+static void nbd_handle(struct nbd_worker *w, struct nbd_req *req) {
+
+    struct nbd_server *srv = w->srv;
+    struct nbd_io io = { .write = false, .buf = req->data, .len = req->len, .offset = req->offset };
+    int err;
+
+    switch (req->cmd) {
+    case NBD_CMD_READ:
+        err = nbd_do_io(w, &io, 1);
+        __atomic_fetch_add(&srv->reads, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&srv->read_bytes, req->len, __ATOMIC_RELAXED);
+        break;
+    case NBD_CMD_WRITE:
+        err = nbd_write(w, req);
+        __atomic_fetch_add(&srv->writes, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&srv->write_bytes, req->len, __ATOMIC_RELAXED);
+        break;
+    case NBD_CMD_FLUSH:
+        // The writes answered before the flush are on the device already: only its cache is left.
+        err = nbd_sync(srv);
+        __atomic_fetch_add(&srv->flushes, 1, __ATOMIC_RELAXED);
+        break;
+    default:
+        err = -EINVAL;
+        break;
+    }
+
+    if (err) {
+        __atomic_fetch_add(&srv->errors, 1, __ATOMIC_RELAXED);
+    }
+    nbd_reply(srv, req, err);
+}
+
+static void nbd_req_free(struct nbd_req *req) {
+
+    free(req->data);
+    free(req);
+}
+
+static void *nbd_worker_main(void *arg) {
+
+    struct nbd_worker *w = arg;
+    struct nbd_server *srv = w->srv;
+    struct nbd_req *req;
+
+    for (;;) {
+        pthread_mutex_lock(&srv->queue_lock);
+        while (!srv->head && !srv->stopping) {
+            pthread_cond_wait(&srv->queue_cond, &srv->queue_lock);
+        }
+        req = srv->head;
+        if (req) {
+            srv->head = req->next;
+            if (!srv->head) {
+                srv->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&srv->queue_lock);
+
+        // The requests queued before the disconnection are still answered.
+        if (!req) {
+            return NULL;
+        }
+        nbd_handle(w, req);
+        nbd_req_free(req);
+    }
+}
+
+static void nbd_queue(struct nbd_server *srv, struct nbd_req *req) {
+
+    pthread_mutex_lock(&srv->queue_lock);
+    req->next = NULL;
+    if (srv->tail) {
+        srv->tail->next = req;
+    }else {
+        srv->head = req;
+    }
+    srv->tail = req;
+    pthread_cond_signal(&srv->queue_cond);
+    pthread_mutex_unlock(&srv->queue_lock);
+}
+
+// Reads the requests of the client until it disconnects. Malformed requests are answered right away.
+static int nbd_receive(struct nbd_server *srv) {
+
+    struct nbd_request request;
+    struct nbd_req *req;
+    u32 type;
+    int err;
+
+    for (;;) {
+        err = nbd_read_all(srv->sock, &request, sizeof(request));
+        if (err) {
+            return err == -ECONNRESET ? 0 : err;
+        }
+        if (be32toh(request.magic) != NBD_REQUEST_MAGIC) {
+            pr_err("Bad request magic: 0x%x\n", be32toh(request.magic));
+            return -EPROTO;
+        }
+
+        type = be32toh(request.type);
+        if ((type & 0xffff) == NBD_CMD_DISC) {
+            return 0;
+        }
+
+        req = calloc(1, sizeof(*req));
+        if (!req) {
+            return -ENOMEM;
+        }
+        req->cmd = type & 0xffff;
+        req->flags = type & ~0xffff;
+        memcpy(req->handle, request.handle, sizeof(req->handle));
+        req->offset = be64toh(request.from);
+        req->len = be32toh(request.len);
+
+        if (req->cmd == NBD_CMD_READ || req->cmd == NBD_CMD_WRITE) {
+            bool valid = req->len && !(req->offset % ENT_BLOCK_SIZE) && !(req->len % ENT_BLOCK_SIZE) &&
+                         req->offset + req->len <= srv->size;
+
+            if (posix_memalign((void **)&req->data, ENT_BLOCK_SIZE, max_t(u32, req->len, ENT_BLOCK_SIZE))) {
+                free(req);
+                return -ENOMEM;
+            }
+            // The payload of a write has to be read off the socket even when the write is refused.
+            if (req->cmd == NBD_CMD_WRITE) {
+                err = nbd_read_all(srv->sock, req->data, req->len);
+                if (err) {
+                    nbd_req_free(req);
+                    return err;
+                }
+            }
+            if (!valid) {
+                nbd_reply(srv, req, -EINVAL);
+                nbd_req_free(req);
+                continue;
+            }
+        }
+        nbd_queue(srv, req);
+    }
+}
+
+/*****************************************************
+ *                       SETUP                       *
+ *****************************************************/
+
+static int nbd_worker_init(struct nbd_worker *w, struct nbd_server *srv) {
+
+    size_t unit_size = ent_unit_size(srv->ent_dev);
+
+    memset(w, 0, sizeof(*w));
+    w->srv = srv;
+    w->uring = ent_uring_init(&w->ring, srv->queue_depth) == 0;
+    // A data and a parity write per unit.
+    w->batch = max_t(uint, (w->uring ? min_t(uint, w->ring.entries, srv->queue_depth) : srv->queue_depth) / 2, 1);
+
+    w->ios = calloc(2 * w->batch, sizeof(*w->ios));
+    if (!w->ios || posix_memalign((void **)&w->parities, ENT_BLOCK_SIZE, w->batch * unit_size) ||
+        posix_memalign((void **)&w->data, ENT_BLOCK_SIZE, w->batch * unit_size)) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void nbd_worker_exit(struct nbd_worker *w) {
+
+    if (w->uring) {
+        ent_uring_exit(&w->ring);
+    }
+    free(w->ios);
+    free(w->parities);
+    free(w->data);
+}
+
+// Reopens the device with O_DIRECT when it allows it, so that the daemon does its I/O like the target does.
+static void nbd_reopen_direct(struct dm_dev *dev, const char *path) {
+
+    int fd = open(path, O_RDWR | O_DIRECT);
+
+    if (fd >= 0) {
+        close(dev->fd);
+        dev->fd = fd;
+    }
+}
+
+static void *nbd_do_it(void *arg) {
+
+    struct nbd_server *srv = arg;
+
+    // Returns once the client disconnects.
+    if (ioctl(srv->nbd_fd, NBD_DO_IT) < 0 && errno != EPIPE) {
+        pr_err("NBD_DO_IT failed: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+static void nbd_signal(int sig) {
+
+    (void)sig;
+    ioctl(server.nbd_fd, NBD_DISCONNECT);
+}
+
+// Connects the kernel NBD client to the other end of the socket pair, for an export of srv->size bytes.
+static int nbd_connect(struct nbd_server *srv, const char *nbd_path, int *client_sock) {
+
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        return -errno;
+    }
+    srv->sock = sv[0];
+    *client_sock = sv[1];
+
+    srv->nbd_fd = open(nbd_path, O_RDWR);
+    if (srv->nbd_fd < 0) {
+        pr_err("Could not open %s: %s\n", nbd_path, strerror(errno));
+        goto err;
+    }
+    ioctl(srv->nbd_fd, NBD_CLEAR_SOCK);
+    if (ioctl(srv->nbd_fd, NBD_SET_BLKSIZE, (unsigned long)ENT_BLOCK_SIZE) < 0 ||
+        ioctl(srv->nbd_fd, NBD_SET_SIZE_BLOCKS, (unsigned long)(srv->size / ENT_BLOCK_SIZE)) < 0 ||
+        ioctl(srv->nbd_fd, NBD_SET_FLAGS, (unsigned long)(NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA)) < 0 ||
+        ioctl(srv->nbd_fd, NBD_SET_SOCK, (unsigned long)sv[1]) < 0) {
+        pr_err("Could not set up %s: %s\n", nbd_path, strerror(errno));
+        close(srv->nbd_fd);
+        goto err;
+    }
+    return 0;
+
+err:
+    close(sv[0]);
+    close(sv[1]);
+    return -errno;
+}
+
+int main(int argc, char **argv) {
+
+    struct nbd_server *srv = &server;
+    struct nbd_opts opts;
+    struct nbd_worker *workers;
+    struct sigaction sa = { .sa_handler = nbd_signal, .sa_flags = SA_RESTART };
+    pthread_t do_it;
+    int client_sock = -1;
+    u64 start_ns;
+    uint i;
+    int err;
+
+    if (parse_opts(argc, argv, &opts)) {
+        usage(argv[0]);
+        return 2;
+    }
+    ent_user_chain_window = opts.chain_window;
+    ent_user_unit_blocks = opts.unit_kb / (ENT_BLOCK_SIZE / 1024);
+
+    pthread_mutex_init(&srv->queue_lock, NULL);
+    pthread_cond_init(&srv->queue_cond, NULL);
+    pthread_mutex_init(&srv->reply_lock, NULL);
+    pthread_mutex_init(&srv->unit_lock, NULL);
+    pthread_cond_init(&srv->unit_cond, NULL);
+    srv->queue_depth = opts.queue_depth;
+
+    err = ent_blkio_open_device(&srv->dev, opts.path, true);
+    if (err) {
+        goto err_blkio;
+    }
+    nbd_reopen_direct(&srv->dev, opts.path);
+    if (opts.meta_path) {
+        err = ent_blkio_open_device(&srv->meta_dev, opts.meta_path, true);
+        if (err) {
+            goto err_meta_blkio;
+        }
+        nbd_reopen_direct(&srv->meta_dev, opts.meta_path);
+        srv->has_meta_dev = true;
+    }
+
+    start_ns = ktime_get_ns();
+    srv->ent_dev = ent_user_open(&srv->dev, srv->has_meta_dev ? &srv->meta_dev : NULL, opts.init, &err);
+    if (!srv->ent_dev) {
+        goto err_open;
+    }
+    // The data region, as the target exposes it.
+    srv->size = (u64)srv->ent_dev->metadata_start_sector * ent_unit_size(srv->ent_dev);
+    printf("load_ns=%llu\n", ktime_get_ns() - start_ns);
+    printf("chain_length=%llu\n", srv->ent_dev->chain_length);
+    printf("size_bytes=%llu\n", srv->size);
+
+    workers = calloc(opts.threads, sizeof(*workers));
+    if (!workers) {
+        err = -ENOMEM;
+        goto err_workers;
+    }
+    for (i = 0 ; i < opts.threads ; i++) {
+        err = nbd_worker_init(&workers[i], srv);
+        if (err) {
+            goto err_worker_init;
+        }
+    }
+    printf("io_uring=%d\n", workers[0].uring);
+    fflush(stdout);
+
+    err = nbd_connect(srv, opts.nbd_path, &client_sock);
+    if (err) {
+        goto err_worker_init;
+    }
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = 0 ; i < opts.threads ; i++) {
+        pthread_create(&workers[i].thread, NULL, nbd_worker_main, &workers[i]);
+    }
+    pthread_create(&do_it, NULL, nbd_do_it, srv);
+
+    start_ns = ktime_get_ns();
+    err = nbd_receive(srv);
+    if (err) {
+        pr_err("Error while receiving requests: %d\n", err);
+    }
+
+    // Answer what is queued, then let the client go.
+    pthread_mutex_lock(&srv->queue_lock);
+    srv->stopping = true;
+    pthread_cond_broadcast(&srv->queue_cond);
+    pthread_mutex_unlock(&srv->queue_lock);
+    for (i = 0 ; i < opts.threads ; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    shutdown(srv->sock, SHUT_RDWR);
+    pthread_join(do_it, NULL);
+    ioctl(srv->nbd_fd, NBD_CLEAR_QUE);
+    ioctl(srv->nbd_fd, NBD_CLEAR_SOCK);
+    close(srv->nbd_fd);
+    close(client_sock);
+    close(srv->sock);
+
+    printf("served_ns=%llu\n", ktime_get_ns() - start_ns);
+    printf("reads=%llu\nread_bytes=%llu\n", srv->reads, srv->read_bytes);
+    printf("writes=%llu\nwrite_bytes=%llu\nunits=%llu\n", srv->writes, srv->write_bytes, srv->units);
+    printf("flushes=%llu\nerrors=%llu\n", srv->flushes, srv->errors);
+    printf("chain_length=%llu\n", srv->ent_dev->chain_length);
+
+    // Like the destructor of the target: the leftover metadata is stored, and the device can be opened by either of them.
+    err = ent_user_close(srv->ent_dev);
+    if (!err) {
+        err = nbd_sync(srv);
+    }
+    if (err) {
+        pr_err("Error while storing the metadata: %d\n", err);
+    }
+
+    for (i = 0 ; i < opts.threads ; i++) {
+        nbd_worker_exit(&workers[i]);
+    }
+    free(workers);
+    if (srv->has_meta_dev) {
+        ent_blkio_close(&srv->meta_dev);
+    }
+    ent_blkio_close(&srv->dev);
+    return err ? 1 : 0;
+
+err_worker_init:
+    for (uint j = 0 ; j < opts.threads ; j++) {
+        nbd_worker_exit(&workers[j]);
+    }
+    free(workers);
+err_workers:
+    ent_user_close(srv->ent_dev);
+err_open:
+    if (srv->has_meta_dev) {
+        ent_blkio_close(&srv->meta_dev);
+    }
+err_meta_blkio:
+    ent_blkio_close(&srv->dev);
+err_blkio:
+    pr_err("Could not serve %s: %d\n", opts.path, err);
+    return 1;
+}
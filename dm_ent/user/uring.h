@@ -0,0 +1,46 @@
+#ifndef _ENT_USER_URING_H_
+#define _ENT_USER_URING_H_
+
+/*
+    A minimal io_uring, driven through the raw system calls (liburing is not required): the rings are mapped once,
+    reads and writes are queued on the submission ring and reaped from the completion ring by the single thread that owns it.
+    Used by the offline fsck and by the NBD daemon.
+*/
+
+#include <linux/io_uring.h>
+
+#include "kcompat.h"
+
+struct ent_uring {
+    int fd;
+    unsigned int entries;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// Returns a negative errno when io_uring is not available, in which case the callers fall back to pread()/pwrite().
+int ent_uring_init(struct ent_uring *ring, unsigned int entries);
+void ent_uring_exit(struct ent_uring *ring);
+
+// Queue one read or write. The caller never has more than ring->entries of them queued or in flight.
+void ent_uring_prep_read(struct ent_uring *ring, int fd, void *buf, unsigned int len, u64 offset, u64 user_data);
+void ent_uring_prep_write(struct ent_uring *ring, int fd, const void *buf, unsigned int len, u64 offset, u64 user_data);
+
+// Submits the queued I/O, and waits until at least min_complete of them have completed.
+int ent_uring_enter(struct ent_uring *ring, unsigned int to_submit, unsigned int min_complete);
+bool ent_uring_reap(struct ent_uring *ring, struct io_uring_cqe *cqe);
+
+#endif
@@ -1,94 +1,36 @@
 #ifndef _ENT_UTILS_H_
 #define _ENT_UTILS_H_
 
-#include <linux/bio.h>
-#include <linux/errno.h>
-
-#include <linux/printk.h>
-
-#include "device.h"
+#include "compat.h"
 
 #define ENT_BLOCK_SIZE 4096
 #define ENT_DEV_SECTOR_SCALE 8 // (4096 / kernel_sector_size (which is 512 bytes))
 
-struct bio_set bioset;
-
-/* Synchronously reads/writes one 4096-byte sector from/to the underlying device 
-   to/from the provided page */
-int ent_dev_rwSector(struct entanglement_device * ent_dev, struct page * page, sector_t sector, int rw)
-{
-        struct bio *bio;
-        blk_opf_t opf;
-        int err;
-
-        /* Synchronous READ/WRITE */
-        opf = ((rw == READ) ? REQ_OP_READ : REQ_OP_WRITE);
-        opf |= REQ_SYNC;
-
-        /* Allocate bio */
-        bio = bio_alloc_bioset(ent_dev->dev->bdev, 1, opf,  GFP_NOIO, &bioset);
-        if (!bio) {
-            pr_err("Could not allocate bio\n");
-            return -ENOMEM;
-        }
-
-        /* Set sector */
-        bio->bi_iter.bi_sector = sector * ENT_DEV_SECTOR_SCALE;
-        /* Add page */
-        if (!bio_add_page(bio, page, ENT_BLOCK_SIZE, 0)) {
-            pr_err("Catastrophe: could not add page to bio! WTF?\n");
-            err = EINVAL;
-            goto out;
-        }
-
-        /* Submit */
-        err = submit_bio_wait(bio);
+// CRC-32 (IEEE 802.3) of a block. The kernel's crc32_le() is sliced or hardware accelerated, and user/blkio.c provides a sliced one.
+static inline unsigned int crc32b(const unsigned char *message, size_t len) {
 
-out:
-        /* Free and return; */
-        bio_put(bio);
-        return err;
+    // The message is a whole block, which may contain zero bytes anywhere: it is not a NUL-terminated string.
+    return ~crc32_le(0xFFFFFFFF, message, len);
 }
 
+// dst = a ^ b, for len bytes (a multiple of the word size). Works a word at a time, since blocks are page buffers and always word aligned.
+static inline void ent_xor_buffer(u8 *dst, const u8 *a, const u8 *b, size_t len) {
 
-/*
-    Found the crc32b function on Stack Overflow. 
-*/
-
-// ----------------------------- crc32b --------------------------------
-
-/* This is the basic CRC-32 calculation with some optimization but no
-table lookup. The the byte reversal is avoided by shifting the crc reg
-right instead of left and by using a reversed 32-bit word to represent
-the polynomial.
-   When compiled to Cyclops with GCC, this function executes in 8 + 72n
-instructions, where n is the number of bytes in the input message. It
-should be doable in 4 + 61n instructions.
-   If the inner loop is strung out (approx. 5*8 = 40 instructions),
-it would take about 6 + 46n instructions. */
-
-unsigned int crc32b(unsigned char *message) {
+    unsigned long *d = (unsigned long *)dst;
+    const unsigned long *x = (const unsigned long *)a;
+    const unsigned long *y = (const unsigned long *)b;
 
-    int i, j;
-    unsigned int byte, crc, mask;
-
-    i = 0;
-    crc = 0xFFFFFFFF;
-    while (message[i] != 0) {
-        byte = message[i];            // Get next byte.
-        crc = crc ^ byte;
-        for (j = 7; j >= 0; j--) {    // Do eight times.
-            mask = -(crc & 1);
-            crc = (crc >> 1) ^ (0xEDB88320 & mask);
-        }
-        i = i + 1;
+    for (size_t i = 0 ; i < len / sizeof(unsigned long) ; i++) {
+        d[i] = x[i] ^ y[i];
     }
-
-    return ~crc;
 }
 
+// Same, for whole 4KB blocks.
+static inline void ent_xor_block(u8 *dst, const u8 *a, const u8 *b) {
+    ent_xor_buffer(dst, a, b, ENT_BLOCK_SIZE);
+}
 
-int is_buffer_empty(char *arr, size_t size) {
+static inline int is_buffer_empty(char *arr, size_t size) {
     for (size_t i = 0; i < size; ++i) {
         if (arr[i] != '\0') {
             return 0;  // Not empty
@@ -0,0 +1,148 @@
+#!/bin/bash
+
+# Cgroup and I/O priority benchmark of the entanglement target, on a loop device with the BFQ scheduler.
+#   tenants: two writers in their own cgroups, one of them limited with io.max on the loop device. The parity and metadata writes are
+#            charged to the writer, so the limited tenant stays within its limit counting them, and the io.stat of each cgroup on the
+#            loop device shows about twice the bytes its fio job wrote.
+#   scrub:   random reads while a scrub runs, with the maintenance I/O in the idle class (the default) and in the best-effort class
+#            (maint_ioprio message). With BFQ, the reads should lose much less to an idle class scrub.
+# Prints one JSON object per run.
+#
+# Usage: sudo ./cgroup_bench.sh [-s size_in_GiB] [-t runtime_in_s] [-l limit_in_MiB_per_s] [-q iodepth] [-o results_dir]
+#
+# Requires fio, jq, dmsetup, cgroup v2 with the io controller, and the built module (dm_ent/bin/dm-ent.ko).
+
+set -euo pipefail
+
+script_dir="$(cd "$(dirname "$0")" && pwd)"
+repo_dir="$(dirname "$script_dir")"
+
+size_gib=2
+runtime=30
+limit_mib=20
+iodepth=16
+results_dir="${script_dir}/results/cgroup-$(date +%Y%m%d-%H%M%S)"
+
+cgroup_root="/sys/fs/cgroup/ent_bench"
+ent_dev_name="ent_cgroup"
+loop_file=""
+base_dev=""
+
+while getopts "s:t:l:q:o:" opt; do
+    case "$opt" in
+        s) size_gib="$OPTARG" ;;
+        t) runtime="$OPTARG" ;;
+        l) limit_mib="$OPTARG" ;;
+        q) iodepth="$OPTARG" ;;
+        o) results_dir="$OPTARG" ;;
+        *) sed -n '3,13p' "$0"; exit 2 ;;
+    esac
+done
+
+for tool in fio jq dmsetup losetup; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "Missing required tool: $tool" >&2
+        exit 1
+    fi
+done
+
+cleanup() {
+    set +e
+    dmsetup remove "$ent_dev_name" 2> /dev/null
+    rmdir "${cgroup_root}"/* "$cgroup_root" 2> /dev/null
+    if [ -n "$base_dev" ]; then
+        losetup -d "$base_dev"
+        rm -f "$loop_file"
+    fi
+}
+trap cleanup EXIT
+
+# in_cgroup <name> <command...>: runs the command in the given cgroup.
+in_cgroup() {
+    local name="$1"
+    shift
+    mkdir -p "${cgroup_root}/${name}"
+    (echo "$BASHPID" > "${cgroup_root}/${name}/cgroup.procs" && "$@")
+}
+
+# written_bytes <cgroup>: bytes the cgroup wrote to the loop device.
+written_bytes() {
+    awk -v dev="$devno" '$1 == dev { for (i = 2 ; i <= NF ; i++) if ($i ~ /^wbytes=/) { sub("wbytes=", "", $i); print $i } }' \
+        "${cgroup_root}/$1/io.stat" | grep . || echo 0
+}
+
+mkdir -p "$results_dir"
+if ! dmsetup targets | grep -q '^entanglement'; then
+    insmod "${repo_dir}/dm_ent/bin/dm-ent.ko"
+fi
+
+loop_file="$(mktemp /var/tmp/ent_cgroup.XXXXXX)"
+truncate -s "${size_gib}G" "$loop_file"
+base_dev="$(losetup --find --show --direct-io=on "$loop_file")"
+echo bfq > "/sys/block/$(basename "$base_dev")/queue/scheduler"
+devno="$(lsblk -dno MAJ:MIN "$base_dev" | tr -d ' ')"
+
+# Same layout as the core: the data region is half of what the metadata leaves, aligned to 8 blocks.
+blocks=$(( $(blockdev --getsize64 "$base_dev") / 4096 ))
+meta=$(( blocks * 3 / 1024 ))
+sectors=$(( (blocks - meta) / 2 / 8 * 8 * 8 ))
+dmsetup create "$ent_dev_name" --table "0 ${sectors} entanglement ${base_dev} ${blocks} 1 1 0"
+udevadm settle
+
+echo "+io" > /sys/fs/cgroup/cgroup.subtree_control
+mkdir -p "$cgroup_root"
+echo "+io" > "${cgroup_root}/cgroup.subtree_control"
+mkdir -p "${cgroup_root}/limited" "${cgroup_root}/free"
+echo "${devno} wbps=$(( limit_mib * 1048576 ))" > "${cgroup_root}/limited/io.max"
+
+fio_job() {
+    fio --name="$1" --filename="/dev/mapper/${ent_dev_name}" --rw="$2" --bs=4k --direct=1 --ioengine=libaio --iodepth="$iodepth" \
+        --time_based --runtime="$runtime" --offset="$3" --size=40% --randrepeat=1 --randseed=1 --output-format=json \
+        --output="${results_dir}/$1.json"
+}
+
+# Tenants: both writers at once.
+limited_before="$(written_bytes limited)"
+free_before="$(written_bytes free)"
+in_cgroup limited fio_job limited randwrite 0 &
+in_cgroup free fio_job free randwrite 50% &
+wait
+for tenant in limited free; do
+    before="${tenant}_before"
+    jq -c --arg tenant "$tenant" --argjson dev_bytes "$(( $(written_bytes "$tenant") - ${!before} ))" --argjson limit "$limit_mib" '
+        .jobs[0].write as $w | {
+            run: "tenants",
+            tenant: $tenant,
+            limit_mib_per_s: (if $tenant == "limited" then $limit else null end),
+            user_mib_per_s: ($w.bw_bytes / 1048576),
+            dev_mib_per_s: ($dev_bytes / 1048576 / ($w.runtime / 1000)),
+            dev_bytes_per_user_byte: (if $w.io_bytes > 0 then $dev_bytes / $w.io_bytes else 0 end)
+        }' "${results_dir}/${tenant}.json" | tee -a "${results_dir}/summary.jsonl"
+done
+
+# Scrub: random reads alone, then with a scrub in the idle and in the best-effort class.
+scrub_checked() {
+    dmsetup status "$ent_dev_name" | grep -o 'scrub_checked=[0-9]*' | cut -d= -f2
+}
+
+for class in none idle be; do
+    checked_before="$(scrub_checked)"
+    if [ "$class" != "none" ]; then
+        dmsetup message "$ent_dev_name" 0 maint_ioprio "$class"
+        dmsetup message "$ent_dev_name" 0 scrub start
+    fi
+    in_cgroup free fio_job "read-${class}" randread 0
+    if [ "$class" != "none" ]; then
+        dmsetup message "$ent_dev_name" 0 scrub pause
+    fi
+    scrubbed=$(( $(scrub_checked) - checked_before ))
+
+    jq -c --arg class "$class" --arg scrubbed "$scrubbed" '
+        .jobs[0].read as $r | {
+            run: "scrub",
+            scrub_class: (if $class == "none" then null else $class end),
+            read_iops: $r.iops,
+            read_p99_us: ($r.clat_ns.percentile["99.000000"] / 1000),
+            scrub_checked: ($scrubbed | tonumber)
+        }' "${results_dir}/read-${class}.json" | tee -a "${results_dir}/summary.jsonl"
+done
@@ -0,0 +1,205 @@
+#!/bin/bash
+
+# fio benchmark suite of the entanglement target. 
+# Sets up a loop or null_blk device, and runs the same fio jobs on the raw device and on the entanglement device on top of it.
+# Every job writes its fio JSON output to the results directory, which is then summarized by fio_report.sh (one JSON object per job).
+#
+# Usage: sudo ./fio_bench.sh [-b loop|null_blk] [-s size_in_GiB] [-t runtime_in_s] [-o results_dir] [-q] [-n] [-c baseline.jsonl]
+#   -q  quick run: fewer queue depths and job counts, for a smoke test
+#   -n  also run the jobs on the userspace daemon (dm_ent/user/ent_nbd) serving the same base device on /dev/nbd0, labeled nbd
+#   -c  compare the results against a baseline: the summary.jsonl of an earlier run, stored e.g. as speed_tests/baseline/<machine>.jsonl
+#
+# Requires fio, jq, the built module (dm_ent/bin/dm-ent.ko) and user_app/entanglement_app, and with -n the nbd module and ent_nbd.
+
+set -euo pipefail
+
+script_dir="$(cd "$(dirname "$0")" && pwd)"
+repo_dir="$(dirname "$script_dir")"
+
+backend="loop"
+size_gib=4
+runtime=30
+results_dir="${script_dir}/results/$(date +%Y%m%d-%H%M%S)"
+quick=0
+with_nbd=0
+baseline=""
+
+ent_dev_name="ent_dev"
+loop_file=""
+base_dev=""
+nbd_pid=""
+
+while getopts "b:s:t:o:qnc:" opt; do
+    case "$opt" in
+        b) backend="$OPTARG" ;;
+        s) size_gib="$OPTARG" ;;
+        t) runtime="$OPTARG" ;;
+        o) results_dir="$OPTARG" ;;
+        q) quick=1 ;;
+        n) with_nbd=1 ;;
+        c) baseline="$OPTARG" ;;
+        *) sed -n '3,13p' "$0"; exit 2 ;;
+    esac
+done
+
+for tool in fio jq losetup; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "Missing required tool: $tool" >&2
+        exit 1
+    fi
+done
+
+if [ "$quick" -eq 1 ]; then
+    iodepths=(1 16)
+    numjobs_list=(1)
+else
+    iodepths=(1 4 16 64)
+    numjobs_list=(1 4)
+fi
+# Read percentage of the mixed random workloads.
+mix_ratios=(70 50 30)
+
+cleanup() {
+    set +e
+    if [ -n "$nbd_pid" ]; then
+        kill -TERM "$nbd_pid"
+        wait "$nbd_pid"
+    fi
+    if [ -e "/dev/mapper/${ent_dev_name}" ]; then
+        "${repo_dir}/user_app/entanglement_app" close "$base_dev" > /dev/null
+    fi
+    if [ "$backend" = "loop" ] && [ -n "$base_dev" ]; then
+        losetup -d "$base_dev"
+        rm -f "$loop_file"
+    elif [ "$backend" = "null_blk" ]; then
+        modprobe -r null_blk
+    fi
+}
+trap cleanup EXIT
+
+setup_base_dev() {
+    case "$backend" in
+        loop)
+            loop_file="$(mktemp /var/tmp/ent_bench.XXXXXX)"
+            truncate -s "${size_gib}G" "$loop_file"
+            base_dev="$(losetup --find --show --direct-io=on "$loop_file")"
+            ;;
+        null_blk)
+            # memory_backed, since the target reads back its metadata and parities.
+            modprobe null_blk nr_devices=1 gb="$size_gib" bs=4096 memory_backed=1 queue_mode=2 submit_queues="$(nproc)"
+            base_dev="/dev/nullb0"
+            ;;
+        *)
+            echo "Unknown backend: $backend" >&2
+            exit 2
+            ;;
+    esac
+}
+
+setup_ent_dev() {
+    if ! dmsetup targets | grep -q '^entanglement'; then
+        insmod "${repo_dir}/dm_ent/bin/dm-ent.ko"
+    fi
+    "${repo_dir}/user_app/entanglement_app" init "$base_dev" 1
+    udevadm settle
+}
+
+# The daemon formats the base device (the kernel device on it must be closed first), and serves it until it is sent SIGTERM.
+setup_nbd_dev() {
+    if [ ! -e /dev/nbd0 ]; then
+        modprobe nbd nbds_max=1
+    fi
+    "${repo_dir}/dm_ent/user/ent_nbd" --init "$base_dev" /dev/nbd0 > "${results_dir}/ent_nbd.txt" &
+    nbd_pid=$!
+    while [ "$(cat /sys/block/nbd0/size)" = "0" ]; do
+        kill -0 "$nbd_pid"
+        sleep 0.1
+    done
+}
+
+teardown_nbd_dev() {
+    kill -TERM "$nbd_pid"
+    wait "$nbd_pid"
+    nbd_pid=""
+}
+
+# Only the first 80% of the data region is used, so that jobs never reach the end of the virtual device.
+job_size() {
+    local dev="$1"
+    echo $(( $(blockdev --getsize64 "$dev") / 100 * 80 / 4096 * 4096 ))
+}
+
+# run_job <device label> <device> <profile name> <fio arguments...>
+run_job() {
+    local label="$1" dev="$2" profile="$3"
+    shift 3
+
+    local out="${results_dir}/${label}__${profile}.json"
+    echo "[$label] $profile"
+
+    fio --name="$profile" --filename="$dev" --size="$(job_size "$dev")" \
+        --direct=1 --bs=4k --ioengine=libaio --time_based --runtime="$runtime" --ramp_time=2 \
+        --group_reporting --randrepeat=1 --randseed=1 --percentile_list=50:99:99.9 \
+        --output-format=json --output="$out" "$@"
+
+    # Keep the parameters of the job next to its results, for the report.
+    jq --arg device "$label" --arg profile "$profile" '. + {ent_device: $device, ent_profile: $profile}' "$out" > "${out}.tmp"
+    mv "${out}.tmp" "$out"
+}
+
+run_suite() {
+    local label="$1" dev="$2"
+
+    for qd in "${iodepths[@]}"; do
+        for nj in "${numjobs_list[@]}"; do
+            for rw in read write randread randwrite; do
+                run_job "$label" "$dev" "${rw}-qd${qd}-j${nj}" --rw="$rw" --iodepth="$qd" --numjobs="$nj"
+            done
+            for mix in "${mix_ratios[@]}"; do
+                run_job "$label" "$dev" "randrw${mix}-qd${qd}-j${nj}" --rw=randrw --rwmixread="$mix" --iodepth="$qd" --numjobs="$nj"
+            done
+        done
+    done
+
+    # fsync heavy: every write is followed by an fsync, then one fsync every 32 writes.
+    run_job "$label" "$dev" "fsync1-j1" --rw=randwrite --ioengine=psync --fsync=1 --numjobs=1
+    run_job "$label" "$dev" "fsync32-j4" --rw=randwrite --ioengine=psync --fsync=32 --numjobs=4
+}
+
+mkdir -p "$results_dir"
+{
+    echo "date=$(date -Iseconds)"
+    echo "kernel=$(uname -r)"
+    echo "backend=$backend"
+    echo "size_gib=$size_gib"
+    echo "runtime=$runtime"
+    echo "commit=$(git -C "$repo_dir" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+    echo "fio=$(fio --version)"
+} > "${results_dir}/environment.txt"
+
+setup_base_dev
+run_suite raw "$base_dev"
+
+setup_ent_dev
+run_suite ent "/dev/mapper/${ent_dev_name}"
+
+if [ "$with_nbd" -eq 1 ]; then
+    "${repo_dir}/user_app/entanglement_app" close "$base_dev" > /dev/null
+    setup_nbd_dev
+    run_suite nbd /dev/nbd0
+    teardown_nbd_dev
+fi
+
+"${script_dir}/fio_report.sh" summarize "$results_dir" > "${results_dir}/summary.jsonl"
+echo "Results: ${results_dir}/summary.jsonl"
+
+if [ "$with_nbd" -eq 1 ]; then
+    echo "Kernel target:"
+    "${script_dir}/fio_report.sh" overhead "${results_dir}/summary.jsonl" ent
+    echo "Userspace daemon:"
+    "${script_dir}/fio_report.sh" overhead "${results_dir}/summary.jsonl" nbd
+fi
+
+if [ -n "$baseline" ]; then
+    "${script_dir}/fio_report.sh" compare "$baseline" "${results_dir}/summary.jsonl"
+fi
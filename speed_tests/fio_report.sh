@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# Reports of the fio benchmark suite (fio_bench.sh).
+#
+# Usage:
+#   ./fio_report.sh summarize <results_dir>
+#       One JSON object per job: IOPS, bandwidth (KiB/s), p50/p99/p99.9 completion latency (us) for reads and writes,
+#       and the CPU time per I/O (us). This is the format of the stored baselines. Runs of replay_bench.sh also report their
+#       write amplification and the CPU time of the whole system per I/O.
+#   ./fio_report.sh overhead <summary.jsonl> [device]
+#       IOPS and p99 latency of the entanglement device (ent, or the given label, e.g. nbd) relative to the raw device, per job.
+#   ./fio_report.sh compare <baseline.jsonl> <summary.jsonl> [tolerance_percent]
+#       Compares every job with the baseline. Exits with 1 if the IOPS dropped, or the p99 latency grew, by more than
+#       the tolerance (default 5%).
+
+set -euo pipefail
+
+summarize() {
+    local dir="$1"
+
+    for f in "$dir"/*__*.json; do
+        jq -c '
+            def pct($d; $p): (($d.clat_ns.percentile[$p] // 0) / 1000 | floor);
+            .jobs[0] as $j
+            | ($j.read.total_ios + $j.write.total_ios) as $ios
+            | {
+                device: .ent_device,
+                profile: .ent_profile,
+                read_iops: ($j.read.iops | floor),
+                read_bw_kib: $j.read.bw,
+                read_p50_us: pct($j.read; "50.000000"),
+                read_p99_us: pct($j.read; "99.000000"),
+                read_p999_us: pct($j.read; "99.900000"),
+                write_iops: ($j.write.iops | floor),
+                write_bw_kib: $j.write.bw,
+                write_p50_us: pct($j.write; "50.000000"),
+                write_p99_us: pct($j.write; "99.000000"),
+                write_p999_us: pct($j.write; "99.900000"),
+                cpu_us_per_io: (if $ios > 0 then (($j.usr_cpu + $j.sys_cpu) / 100 * $j.job_runtime * 1000 / $ios * 100 | round) / 100 else 0 end)
+            } + (.ent_extra // {})' "$f"
+    done
+}
+
+overhead() {
+    jq -rs --arg dev "${2:-ent}" '
+        (map(select(.device == "raw")) | INDEX(.profile)) as $raw
+        | ["profile", "iops_raw", "iops_ent", "iops_ratio", "p99_raw_us", "p99_ent_us"],
+          (.[] | select(.device == $dev) | . as $e | $raw[$e.profile] as $r | select($r != null)
+           | ($r.read_iops + $r.write_iops) as $ri | ($e.read_iops + $e.write_iops) as $ei
+           | [$e.profile, $ri, $ei, (if $ri > 0 then ($ei / $ri * 100 | round) / 100 else 0 end),
+              ([$r.read_p99_us, $r.write_p99_us] | max), ([$e.read_p99_us, $e.write_p99_us] | max)])
+        | @tsv' "$1"
+}
+
+compare() {
+    local baseline="$1" current="$2" tolerance="${3:-5}"
+    local report
+
+    report="$(jq -rn --slurpfile base "$baseline" --slurpfile cur "$current" --argjson tol "$tolerance" '
+        def key: .device + "/" + .profile;
+        def iops: .read_iops + .write_iops;
+        def p99: [.read_p99_us, .write_p99_us] | max;
+        def delta($old; $new): if $old > 0 then (($new - $old) / $old * 1000 | round) / 10 else 0 end;
+        ($base | INDEX(key)) as $b
+        | ["job", "iops_base", "iops_now", "iops_delta_%", "p99_base_us", "p99_now_us", "p99_delta_%", "status"],
+          ($cur[] | . as $c | $b[$c | key] as $o | select($o != null)
+           | delta($o | iops; $c | iops) as $di | delta($o | p99; $c | p99) as $dp
+           | [($c | key), ($o | iops), ($c | iops), $di, ($o | p99), ($c | p99), $dp,
+              (if $di < -$tol or $dp > $tol then "REGRESSION" else "ok" end)])
+        | @tsv')"
+
+    echo "$report"
+    if echo "$report" | grep -q 'REGRESSION$'; then
+        return 1
+    fi
+}
+
+case "${1:-}" in
+    summarize) summarize "$2" ;;
+    overhead) overhead "$2" "${3:-ent}" ;;
+    compare) compare "$2" "$3" "${4:-5}" ;;
+    *) sed -n '3,15p' "$0"; exit 2 ;;
+esac
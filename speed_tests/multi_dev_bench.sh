@@ -0,0 +1,133 @@
+#!/bin/bash
+
+# Multi-device benchmark of the entanglement target: runs the same fio job on 1, 2, 4... independent entanglement devices at once
+# (each on its own loop or null_blk device), and reports the aggregate throughput against the single-device one.
+# With per-device page pools and biosets, the aggregate should scale linearly until the host runs out of CPUs or bandwidth.
+# Prints one JSON object per device count, with the pool usage of every device (page_pool_peak, mempool_waits) from its status.
+#
+# Usage: sudo ./multi_dev_bench.sh [-b loop|null_blk] [-n "device counts"] [-s size_in_GiB] [-t runtime_in_s] [-w fio rw] [-q iodepth] [-o results_dir]
+#
+# Requires fio, jq, dmsetup and the built module (dm_ent/bin/dm-ent.ko).
+
+set -euo pipefail
+
+script_dir="$(cd "$(dirname "$0")" && pwd)"
+repo_dir="$(dirname "$script_dir")"
+
+backend="loop"
+counts="1 2 4 8"
+size_gib=1
+runtime=30
+rw="randwrite"
+iodepth=32
+results_dir="${script_dir}/results/multi-$(date +%Y%m%d-%H%M%S)"
+
+base_devs=()
+ent_devs=()
+loop_files=()
+
+while getopts "b:n:s:t:w:q:o:" opt; do
+    case "$opt" in
+        b) backend="$OPTARG" ;;
+        n) counts="$OPTARG" ;;
+        s) size_gib="$OPTARG" ;;
+        t) runtime="$OPTARG" ;;
+        w) rw="$OPTARG" ;;
+        q) iodepth="$OPTARG" ;;
+        o) results_dir="$OPTARG" ;;
+        *) sed -n '3,10p' "$0"; exit 2 ;;
+    esac
+done
+
+for tool in fio jq dmsetup losetup; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "Missing required tool: $tool" >&2
+        exit 1
+    fi
+done
+
+teardown() {
+    set +e
+    for name in "${ent_devs[@]}"; do
+        dmsetup remove "$name"
+    done
+    if [ "$backend" = "loop" ]; then
+        for dev in "${base_devs[@]}"; do
+            losetup -d "$dev"
+        done
+        rm -f "${loop_files[@]}"
+    elif [ "${#base_devs[@]}" -gt 0 ]; then
+        modprobe -r null_blk
+    fi
+    base_devs=()
+    ent_devs=()
+    loop_files=()
+    set -e
+}
+trap teardown EXIT
+
+# setup <count>: count base devices, each with an entanglement device on top (initialized, no corruption).
+setup() {
+    local count="$1" i base blocks meta sectors
+
+    if [ "$backend" = "null_blk" ]; then
+        modprobe null_blk nr_devices="$count" gb="$size_gib" bs=4096 memory_backed=1 queue_mode=2 submit_queues="$(nproc)"
+    fi
+
+    for ((i = 0 ; i < count ; i++)); do
+        if [ "$backend" = "loop" ]; then
+            loop_files+=("$(mktemp /var/tmp/ent_multi.XXXXXX)")
+            truncate -s "${size_gib}G" "${loop_files[-1]}"
+            base="$(losetup --find --show --direct-io=on "${loop_files[-1]}")"
+        else
+            base="/dev/nullb${i}"
+        fi
+        base_devs+=("$base")
+
+        # Same layout as the core: the data region is half of what the metadata leaves, aligned to 8 blocks.
+        blocks=$(( $(blockdev --getsize64 "$base") / 4096 ))
+        meta=$(( blocks * 3 / 1024 ))
+        sectors=$(( (blocks - meta) / 2 / 8 * 8 * 8 ))
+
+        dmsetup create "ent_multi${i}" --table "0 ${sectors} entanglement ${base} ${blocks} 1 1 0"
+        ent_devs+=("ent_multi${i}")
+    done
+    udevadm settle
+}
+
+mkdir -p "$results_dir"
+if ! dmsetup targets | grep -q '^entanglement'; then
+    insmod "${repo_dir}/dm_ent/bin/dm-ent.ko"
+fi
+
+single_iops=""
+for count in $counts; do
+    setup "$count"
+
+    # One job per device, all running at once; without group_reporting, fio reports every job (device) on its own.
+    jobs=()
+    for name in "${ent_devs[@]}"; do
+        jobs+=(--name="$name" --filename="/dev/mapper/${name}")
+    done
+    out="${results_dir}/devices${count}.json"
+    fio --rw="$rw" --bs=4k --direct=1 --ioengine=libaio --iodepth="$iodepth" --time_based --runtime="$runtime" --ramp_time=2 \
+        --size=80% --randrepeat=1 --randseed=1 --output-format=json --output="$out" "${jobs[@]}"
+
+    status="$(for name in "${ent_devs[@]}"; do dmsetup status "$name"; done)"
+    pools="$(echo "$status" | grep -o 'page_pool_peak=[0-9]*\|mempool_waits=[0-9]*' | tr '\n' ' ')"
+
+    iops="$(jq '[.jobs[] | .read.iops + .write.iops] | add' "$out")"
+    single_iops="${single_iops:-$(jq -n "$iops / $count")}"
+
+    jq -c -n --argjson devices "$count" --argjson iops "$iops" --argjson single "$single_iops" --arg pools "$pools" \
+          --slurpfile fio "$out" '{
+        devices: $devices,
+        aggregate_iops: $iops,
+        per_device_iops: [$fio[0].jobs[] | .read.iops + .write.iops],
+        aggregate_mib_per_s: ([$fio[0].jobs[] | .read.bw_bytes + .write.bw_bytes] | add / 1048576),
+        scaling: ($iops / ($single * $devices)),
+        pools: $pools
+    }' | tee -a "${results_dir}/summary.jsonl"
+
+    teardown
+done
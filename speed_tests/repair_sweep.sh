@@ -0,0 +1,70 @@
+#!/bin/bash
+
+# Repair benchmark of the entanglement core, run in userspace through dm_ent/user/ent_harness.
+# Sweeps corruption rates and injection patterns, and prints one JSON object per run with the detection and repair times,
+# their throughput and the number of repaired and irrecoverable blocks. Runs are seeded, so the same seed gives the same corruption.
+# With several anchor intervals, each rate and pattern runs once per interval: repair_dev_reads, repaired and irrecoverable show
+# what shorter runs between anchors save in repair I/O and cost in recoverability (anchors take no space: they are a flag of the records).
+#
+# Usage: ./repair_sweep.sh [-b blocks] [-r "rates"] [-p "patterns"] [-a "anchor_intervals"] [-l burst_length] [-s seed] [-f file]
+#                          [-- harness options]
+#   -a  data blocks between two anchors of the chain, 0 for none (default 0)
+#   -f  back the device with this (sparse) file instead of memory
+#   Options after -- are passed to every harness run, e.g. the latency model: -- --read-ns 100000 --write-ns 100000
+
+set -euo pipefail
+
+script_dir="$(cd "$(dirname "$0")" && pwd)"
+repo_dir="$(dirname "$script_dir")"
+harness="${repo_dir}/dm_ent/user/ent_harness"
+
+blocks=65536
+rates="1 2 5 10 20 30"
+patterns="uniform burst data parity pair"
+burst=8
+seed=1
+file=""
+anchors="0"
+
+while getopts "b:r:p:a:l:s:f:" opt; do
+    case "$opt" in
+        b) blocks="$OPTARG" ;;
+        r) rates="$OPTARG" ;;
+        p) patterns="$OPTARG" ;;
+        a) anchors="$OPTARG" ;;
+        l) burst="$OPTARG" ;;
+        s) seed="$OPTARG" ;;
+        f) file="$OPTARG" ;;
+        *) sed -n '3,13p' "$0"; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ ! -x "$harness" ]; then
+    make -C "${repo_dir}/dm_ent" harness > /dev/null
+fi
+
+backend_opts=()
+if [ -n "$file" ]; then
+    backend_opts=(--file "$file")
+fi
+
+for pattern in $patterns; do
+    for rate in $rates; do
+        for anchor in $anchors; do
+            # The harness exits with 1 when blocks could not be repaired, which is an expected outcome here.
+            out="$("$harness" --blocks "$blocks" --corrupt "$rate" --inject "$pattern" --burst "$burst" --anchor "$anchor" \
+                              --seed "$seed" --verify "${backend_opts[@]}" "$@")" || true
+            if [ -n "$file" ]; then
+                rm -f "$file"
+            fi
+
+            # key=value lines to one JSON object, numbers unquoted.
+            echo "$out" | awk -F= '
+                BEGIN { printf "{" }
+                NR > 1 { printf "," }
+                { v = ($2 ~ /^-?[0-9]+(\.[0-9]+)?$/) ? $2 : "\"" $2 "\""; printf "\"%s\":%s", $1, v }
+                END { print "}" }'
+        done
+    done
+done
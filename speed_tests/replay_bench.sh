@@ -0,0 +1,241 @@
+#!/bin/bash
+
+# Trace replay benchmark of the entanglement target: replays block traces captured on a real host (blkparse text output) on a raw loop
+# device and on the entanglement device on top of it, with the original timing and as fast as possible.
+# Every run writes its fio JSON output to the results directory, extended with the write amplification (bytes written to the underlying
+# device per user byte, and the data/parity/metadata breakdown from the status of the target) and the CPU time of the whole system per I/O.
+# The summary (summary.jsonl) has the format of fio_report.sh, so runs can be compared with fio_report.sh overhead/compare.
+#
+# Usage: sudo ./replay_bench.sh [-s size_in_GiB] [-q iodepth] [-a Q|D] [-x time_scale_percent] [-m timed|fast|both] [-o results_dir] trace.txt...
+#        sudo ./replay_bench.sh capture <device> <seconds> <trace.txt>
+#   -a  blkparse action replayed: Q (queued, what the applications asked for, the default) or D (issued to the driver)
+#   -x  timed replay at this percentage of the original pace (default 100)
+#
+# Requires fio, jq, blktrace (for capture), the built module (dm_ent/bin/dm-ent.ko) and user_app/entanglement_app.
+
+set -euo pipefail
+
+script_dir="$(cd "$(dirname "$0")" && pwd)"
+repo_dir="$(dirname "$script_dir")"
+
+size_gib=4
+iodepth=32
+action="Q"
+time_scale=100
+modes="both"
+results_dir="${script_dir}/results/replay-$(date +%Y%m%d-%H%M%S)"
+
+ent_dev_name="ent_dev"
+loop_file=""
+base_dev=""
+
+# capture <device> <seconds> <trace.txt>: traces the device for the given time, and writes the blkparse text output.
+capture() {
+    local dev="$1" seconds="$2" out="$3" tmp
+
+    tmp="$(mktemp -d)"
+    blktrace -d "$dev" -w "$seconds" -D "$tmp" -o trace
+    blkparse -i trace -D "$tmp" -o "$out" > /dev/null
+    rm -rf "$tmp"
+    echo "Trace: $out ($(grep -c " ${action} " "$out") ${action} events)"
+}
+
+if [ "${1:-}" = "capture" ]; then
+    [ $# -eq 4 ] || { sed -n '9,13p' "$0"; exit 2; }
+    capture "$2" "$3" "$4"
+    exit 0
+fi
+
+while getopts "s:q:a:x:m:o:" opt; do
+    case "$opt" in
+        s) size_gib="$OPTARG" ;;
+        q) iodepth="$OPTARG" ;;
+        a) action="$OPTARG" ;;
+        x) time_scale="$OPTARG" ;;
+        m) modes="$OPTARG" ;;
+        o) results_dir="$OPTARG" ;;
+        *) sed -n '9,13p' "$0"; exit 2 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ $# -eq 0 ]; then
+    sed -n '9,13p' "$0"
+    exit 2
+fi
+
+for tool in fio jq losetup dmsetup; do
+    if ! command -v "$tool" > /dev/null; then
+        echo "Missing required tool: $tool" >&2
+        exit 1
+    fi
+done
+
+case "$modes" in
+    both) modes="timed fast" ;;
+    timed|fast) ;;
+    *) echo "Unknown replay mode: $modes" >&2; exit 2 ;;
+esac
+
+cleanup() {
+    set +e
+    if [ -e "/dev/mapper/${ent_dev_name}" ]; then
+        "${repo_dir}/user_app/entanglement_app" close "$base_dev" > /dev/null
+    fi
+    if [ -n "$base_dev" ]; then
+        losetup -d "$base_dev"
+        rm -f "$loop_file"
+    fi
+}
+trap cleanup EXIT
+
+# to_iolog <trace.txt> <span_bytes> <iolog>: converts the blkparse events of the replayed action into a fio iolog (version 3, with
+# millisecond timestamps). The target only takes whole 4KB blocks, so requests are widened to 4KB boundaries, and folded into the first
+# span_bytes of the device, which both the raw and the entanglement device have. A flush before a write (F first in the RWBS field) is
+# replayed as a sync before it, a FUA write (F after the W) as a sync after it. Discards are dropped: the target does not take them.
+to_iolog() {
+    awk -v action="$action" -v span="$2" '
+        BEGIN { print "fio version 3 iolog"; print "0 trace add"; print "0 trace open"; t0 = -1 }
+        $6 == action && $7 ~ /^[FRWDNSMAE]+$/ {
+            if (t0 < 0) { t0 = $4 }
+            ms = int(($4 - t0) * 1000)
+            rwbs = $7
+            if (rwbs ~ /D/) { discards++; next }
+            has_range = ($8 ~ /^[0-9]+$/ && $9 == "+" && $10 > 0)
+            if (rwbs ~ /^F/) { print ms, "trace sync 0 0"; syncs++ }
+            if (has_range && rwbs ~ /[RW]/) {
+                start = int($8 * 512 / 4096) * 4096
+                end = int(($8 + $10) * 512 / 4096 + 0.999999) * 4096
+                offset = start % span
+                len = end - start
+                if (offset + len > span) { len = span - offset }
+                print ms, "trace", (rwbs ~ /R/) ? "read" : "write", offset, len
+                ios++
+            }
+            if (rwbs ~ /^[RW]+F/) { print ms, "trace sync 0 0"; syncs++ }
+            last = ms
+        }
+        END {
+            print last + 1, "trace close"
+            printf("%d I/Os, %d syncs, %d discards dropped, %.1f s\n", ios, syncs, discards, last / 1000) > "/dev/stderr"
+        }' "$1" > "$3"
+}
+
+# Sum of the busy time of all CPUs, in microseconds.
+cpu_busy_us() {
+    awk -v hz="$(getconf CLK_TCK)" '$1 == "cpu" { printf("%.0f\n", ($2 + $3 + $4 + $7 + $8 + $9) * 1000000 / hz) }' /proc/stat
+}
+
+# Bytes written to a block device since it was set up.
+dev_written_bytes() {
+    awk '{ print $7 * 512 }' "/sys/class/block/$(basename "$(readlink -f "$1")")/stat"
+}
+
+# ent_counter <name>: a counter of the status of the entanglement device.
+ent_counter() {
+    dmsetup status "$ent_dev_name" | tr ' ' '\n' | awk -F= -v name="$1" '$1 == name { print $2 }'
+}
+
+# replay <device label> <device> <trace name> <iolog> <mode>
+replay() {
+    local label="$1" dev="$2" trace="$3" iolog="$4" mode="$5"
+    local profile="${trace}-${mode}" out cpu_before dev_before writes_before parity_before flushes_before
+    local stall=0 extra
+
+    out="${results_dir}/${label}__${profile}.json"
+    echo "[$label] $profile"
+    [ "$mode" = "fast" ] && stall=1
+
+    sync
+    cpu_before="$(cpu_busy_us)"
+    dev_before="$(dev_written_bytes "$base_dev")"
+    if [ "$label" = "ent" ]; then
+        writes_before="$(ent_counter writes)"
+        parity_before="$(ent_counter parity_bytes)"
+        flushes_before="$(ent_counter metadata_flushes)"
+    fi
+
+    fio --name="$profile" --read_iolog="$iolog" --replay_redirect="$dev" --replay_no_stall="$stall" \
+        --replay_time_scale="$time_scale" --direct=1 --ioengine=libaio --iodepth="$iodepth" \
+        --percentile_list=50:90:99:99.9:99.99 --output-format=json --output="$out"
+
+    # The metadata is flushed by the target in the background too: give it a moment, so that it counts for this run.
+    sleep 1
+    extra="$(jq -n --arg mode "$mode" --argjson cpu "$(( $(cpu_busy_us) - cpu_before ))" \
+                   --argjson dev_bytes "$(( $(dev_written_bytes "$base_dev") - dev_before ))" \
+                   --slurpfile fio "$out" '
+        $fio[0].jobs[0] as $j
+        | ($j.read.total_ios + $j.write.total_ios) as $ios
+        | {
+            replay_mode: $mode,
+            user_write_bytes: $j.write.io_bytes,
+            dev_write_bytes: $dev_bytes,
+            write_amplification: (if $j.write.io_bytes > 0 then ($dev_bytes / $j.write.io_bytes * 100 | round) / 100 else 0 end),
+            system_cpu_us_per_io: (if $ios > 0 then ($cpu / $ios * 100 | round) / 100 else 0 end)
+          }')"
+
+    if [ "$label" = "ent" ]; then
+        extra="$(echo "$extra" | jq --argjson data "$(( ($(ent_counter writes) - writes_before) * 4096 ))" \
+                                    --argjson parity "$(( $(ent_counter parity_bytes) - parity_before ))" \
+                                    --argjson metadata "$(( ($(ent_counter metadata_flushes) - flushes_before) * 4096 ))" '
+            . + {
+                data_bytes: $data,
+                parity_bytes: $parity,
+                metadata_bytes: $metadata,
+                ent_write_amplification: (if .user_write_bytes > 0 then (($data + $parity + $metadata) / .user_write_bytes * 100 | round) / 100 else 0 end)
+            }')"
+    fi
+
+    # Keep the parameters of the run next to its results, for the report.
+    jq --arg device "$label" --arg profile "$profile" --argjson extra "$extra" \
+       '. + {ent_device: $device, ent_profile: $profile, ent_extra: $extra}' "$out" > "${out}.tmp"
+    mv "${out}.tmp" "$out"
+}
+
+# run_suite <device label> <device> <trace.txt...>
+run_suite() {
+    local label="$1" dev="$2" trace mode
+    shift 2
+
+    for trace in "$@"; do
+        for mode in $modes; do
+            replay "$label" "$dev" "$(basename "${trace%.*}")" "${results_dir}/$(basename "${trace%.*}").iolog" "$mode"
+        done
+    done
+}
+
+mkdir -p "$results_dir"
+{
+    echo "date=$(date -Iseconds)"
+    echo "kernel=$(uname -r)"
+    echo "size_gib=$size_gib"
+    echo "iodepth=$iodepth"
+    echo "action=$action"
+    echo "time_scale=$time_scale"
+    echo "commit=$(git -C "$repo_dir" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+    echo "fio=$(fio --version)"
+} > "${results_dir}/environment.txt"
+
+loop_file="$(mktemp /var/tmp/ent_replay.XXXXXX)"
+truncate -s "${size_gib}G" "$loop_file"
+base_dev="$(losetup --find --show --direct-io=on "$loop_file")"
+
+# The entanglement device exposes a bit less than half of the underlying one: 40% of it is within reach of both.
+span=$(( $(blockdev --getsize64 "$base_dev") * 40 / 100 / 4096 * 4096 ))
+for trace in "$@"; do
+    echo "Converting $trace"
+    to_iolog "$trace" "$span" "${results_dir}/$(basename "${trace%.*}").iolog"
+done
+
+run_suite raw "$base_dev" "$@"
+
+if ! dmsetup targets | grep -q '^entanglement'; then
+    insmod "${repo_dir}/dm_ent/bin/dm-ent.ko"
+fi
+"${repo_dir}/user_app/entanglement_app" init "$base_dev" 1
+udevadm settle
+run_suite ent "/dev/mapper/${ent_dev_name}" "$@"
+
+"${script_dir}/fio_report.sh" summarize "$results_dir" > "${results_dir}/summary.jsonl"
+echo "Results: ${results_dir}/summary.jsonl"
+"${script_dir}/fio_report.sh" overhead "${results_dir}/summary.jsonl"
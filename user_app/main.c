@@ -1,10 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <linux/fs.h>
+#include <linux/limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 #include <libdevmapper.h>
 
+#include "fsck.h"
+
 
 #define ENT_BLK_SIZE 4096
 // For now, these names are defined here. Maybe later, something about this should be changed. 
@@ -14,8 +26,9 @@
 
 #define DEFAULT_SECTOR_VALUE 0xFFFFFFFFFFFFFFFFULL
 
-unsigned int metadata_size;
-int64_t disk_size;
+// Devices of a manifest are handled by at most this many workers at once, unless told otherwise.
+#define ENT_DEFAULT_WORKERS 8
+#define ENT_MAX_WORKERS 256
 
 #include "log.h"
 
@@ -180,26 +193,11 @@ dup_free:
 }
 
 
-/**
- * Writes a single 4096-byte sector to the disk.
- *
- * @param bdev_path The path of the block device
- * @param sector The index of the desired sector
- * @param The caller-allocated buffer (must hold 4096 bytes) where the data
- *  comes from
- *
- * @return The error code (0 on success)
- */
-int ent_disk_writeSector(char * bdev_path, uint64_t sector, char * buf)
-{
-	return ent_disk_writeManySectors(bdev_path, sector, buf, 1);
-}
-
-
 /**
  * Writes many 4096-byte sectors to the disk.
  *
- * @param bdev_path The path of the block device
+ * @param fd The file descriptor of the block device, kept open by the caller
+ *  (with O_DIRECT, buf must be aligned to the logical block size)
  * @param sector The index of the starting sector
  * @param The caller-allocated buffer where the data
  *  comes from
@@ -207,61 +205,49 @@ int ent_disk_writeSector(char * bdev_path, uint64_t sector, char * buf)
  *
  * @return The error code (0 on success)
  */
-int ent_disk_writeManySectors(char * bdev_path, uint64_t sector, char * buf, size_t num_sectors)
+int ent_disk_writeManySectors(int fd, uint64_t sector, const char * buf, size_t num_sectors)
 {
-    int fd;
-    int err;
-    
-    /* Open file */
-    fd = open(bdev_path, O_WRONLY);
-    if (fd < 0) {
-        ent_log_error("Could not open file %s", bdev_path);
-        perror("Cause: ");
-        err = errno;
-        goto bad_open;
-    }
-    ent_log_debug("Opened file %s", bdev_path);
-
-    /* Set offset in bytes */
-    if (lseek(fd, sector * ENT_BLK_SIZE, SEEK_CUR) < 0) {
-        ent_log_error("Could not lseek file %s to sector %lu", bdev_path, sector);
-        perror("Cause: ");
-        err = errno;
-        goto bad_lseek;
-    }
-    ent_log_debug("Successful lseek on file %s to sector %lu", bdev_path, sector);
-
-    /* Write in a loop */
+    off_t offset = sector * ENT_BLK_SIZE;
     size_t bytes_to_write = ENT_BLK_SIZE * num_sectors;
+
+    /* Write in a loop, at explicit offsets: the file position is never used */
     while (bytes_to_write > 0) {
-    	/* Write syscall */
-		ssize_t bytes_written = write(fd, buf, bytes_to_write);
+		ssize_t bytes_written = pwrite(fd, buf, bytes_to_write, offset);
 		if (bytes_written < 0) {
-			ent_log_red("Could not write file %s at sector %lu", bdev_path, sector);
+			ent_log_red("Could not write at sector %lu", offset / ENT_BLK_SIZE);
 			perror("Cause: ");
-			err = errno;
-			goto bad_write;
+			return errno;
 		}
 
 		/* Partial write? No problem just log */
-		if (bytes_written < bytes_to_write) {
-			ent_log_debug("Partial write to file %s at sector %lu: %ld bytes instead of %ld",
-					bdev_path, sector, bytes_written, bytes_to_write);
+		if ((size_t) bytes_written < bytes_to_write) {
+			ent_log_debug("Partial write at sector %lu: %ld bytes instead of %ld",
+					offset / ENT_BLK_SIZE, bytes_written, bytes_to_write);
 		}
 
 		/* Advance loop */
 		bytes_to_write -= bytes_written;
 		buf += bytes_written;
+		offset += bytes_written;
     }
 
-    // No prob
-    err = 0;
+    return 0;
+}
 
-bad_write:
-bad_lseek:
-    close(fd);
-bad_open:
-    return err;
+
+/**
+ * Writes a single 4096-byte sector to the disk.
+ *
+ * @param fd The file descriptor of the block device
+ * @param sector The index of the desired sector
+ * @param The caller-allocated buffer (must hold 4096 bytes) where the data
+ *  comes from
+ *
+ * @return The error code (0 on success)
+ */
+int ent_disk_writeSector(int fd, uint64_t sector, const char * buf)
+{
+	return ent_disk_writeManySectors(fd, sector, buf, 1);
 }
 
 
@@ -302,71 +288,649 @@ bad_open:
     return ret;
 }
 
+/*
+    Queue limits of a block device, as the target reads them to tune itself (see ent_tune() in the module). Limits that cannot be
+    read are left at 0.
+*/
+struct ent_queue_limits {
+    bool rotational;
+    unsigned int nr_requests;
+    unsigned int max_sectors_kb;
+    unsigned int optimal_io_size;
+};
+
+static unsigned int ent_sysfs_read_uint(const char * dir, const char * name)
+{
+    char path[PATH_MAX];
+    unsigned int value = 0;
+    FILE * file;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    file = fopen(path, "r");
+    if (!file) {
+        return 0;
+    }
+    if (fscanf(file, "%u", &value) != 1) {
+        value = 0;
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * Reads the queue limits of a block device from sysfs (those of the whole disk for a partition).
+ *
+ * @param bdev_path The path of the block device
+ * @param limits Filled in with the limits
+ *
+ * @return The error code (0 on success, -ENOTBLK if the path is not a block device, such as an image file)
+ */
+int ent_get_queue_limits(const char * bdev_path, struct ent_queue_limits * limits)
+{
+    char dir[PATH_MAX];
+    struct stat st;
+
+    memset(limits, 0, sizeof(*limits));
+    if (stat(bdev_path, &st) < 0) {
+        return -errno;
+    }
+    if (!S_ISBLK(st.st_mode)) {
+        return -ENOTBLK;
+    }
+
+    snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/queue", major(st.st_rdev), minor(st.st_rdev));
+    if (access(dir, F_OK) != 0) {
+        snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/../queue", major(st.st_rdev), minor(st.st_rdev));
+    }
+
+    limits->rotational = ent_sysfs_read_uint(dir, "rotational") != 0;
+    limits->nr_requests = ent_sysfs_read_uint(dir, "nr_requests");
+    limits->max_sectors_kb = ent_sysfs_read_uint(dir, "max_sectors_kb");
+    limits->optimal_io_size = ent_sysfs_read_uint(dir, "optimal_io_size");
+    return 0;
+}
+
+/*
+    Verification threads and reads in flight per thread for fsck, when not given. A rotational disk is read by one thread, so that its
+    reads stay in order, with up to a queue of them in flight. Other devices get the default threads, sharing the queue of the device.
+*/
+static void ent_fsck_tune(const char * dev_path, struct ent_fsck_opts * opts)
+{
+    struct ent_queue_limits limits;
+    unsigned int threads;
+
+    if (ent_get_queue_limits(dev_path, &limits) != 0 || !limits.nr_requests) {
+        return;
+    }
+
+    threads = limits.rotational ? 1 : ENT_FSCK_DEFAULT_THREADS;
+    if (!opts->threads) {
+        opts->threads = threads;
+    }
+    if (!opts->queue_depth) {
+        opts->queue_depth = limits.nr_requests / opts->threads;
+        if (opts->queue_depth < 8) {
+            opts->queue_depth = 8;
+        }else if (opts->queue_depth > 256) {
+            opts->queue_depth = 256;
+        }
+    }
+}
+
+static double ent_elapsed_ms(const struct timespec * start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+    On-disk layout, computed exactly like the target does (see ent_core_init()), in 4096-byte blocks: the data region,
+    then the metadata (the sector records, then their checksums), then the parities.
+    With a metadata device, the data device only holds the data region and the parities, and the metadata device holds
+    the scrub checkpoint block followed by the metadata.
+*/
+struct ent_layout {
+    uint64_t disk_size;
+    uint64_t metadata_size;
+    uint64_t metadata_sector_size;
+    uint64_t metadata_checksum_size;
+    uint64_t metadata_start_sector;
+    // First block of the sector records, on the device holding the metadata.
+    uint64_t metadata_base;
+};
+
+// Blocks in front of the metadata on a metadata device (ENT_CHECKPOINT_BLOCKS of the target).
+#define ENT_META_CHECKPOINT_BLOCKS 1
+
+void ent_layout_compute(uint64_t disk_size, bool meta_dev, struct ent_layout * layout)
+{
+    layout->disk_size = disk_size;
+    // 12 bytes of metadata (an 8-byte sector and a 4-byte checksum) for every 4KB block.
+    layout->metadata_size = (disk_size * 3) >> 10;
+    layout->metadata_sector_size = (layout->metadata_size * 2) / 3;
+    layout->metadata_checksum_size = layout->metadata_size / 3;
+    if (meta_dev) {
+        // 512 sector records per block, and an extra block for the end marker.
+        layout->metadata_start_sector = (disk_size / 2) / 8 * 8;
+        layout->metadata_base = ENT_META_CHECKPOINT_BLOCKS;
+        layout->metadata_sector_size = (2 * layout->metadata_start_sector + 511) / 512 + 1;
+        layout->metadata_checksum_size = (layout->metadata_sector_size + 1) / 2;
+        layout->metadata_size = layout->metadata_sector_size + layout->metadata_checksum_size;
+    }else {
+        layout->metadata_start_sector = ((disk_size - layout->metadata_size) / 2) / 8 * 8;
+        layout->metadata_base = layout->metadata_start_sector;
+    }
+}
+
+/**
+ * Splits a device argument. A device can be given as "<dev_path>,<meta_dev_path>" to keep its metadata
+ * (sector/checksum records and scrub checkpoint) on a separate, smaller and faster, device.
+ *
+ * @param path The device argument
+ * @param dev_path Filled in with the path of the device (PATH_MAX bytes)
+ * @param meta_path Filled in with the path of the metadata device, or an empty string (PATH_MAX bytes)
+ *
+ * @return The error code (0 on success)
+ */
+int ent_split_dev_path(const char * path, char * dev_path, char * meta_path)
+{
+    const char *comma = strchr(path, ',');
+    size_t len = comma ? (size_t) (comma - path) : strlen(path);
+
+    if (len == 0 || len >= PATH_MAX || (comma && (comma[1] == '\0' || strlen(comma + 1) >= PATH_MAX))) {
+        return EINVAL;
+    }
+    memcpy(dev_path, path, len);
+    dev_path[len] = '\0';
+    strcpy(meta_path, comma ? comma + 1 : "");
+    return 0;
+}
+
+// Size of the writes of the format, large enough to stream at the full bandwidth of the device.
+#define ENT_FORMAT_CHUNK (8 << 20)
+
+/**
+ * Formats the metadata region of a device, so that it holds an empty entanglement.
+ *
+ * The target stops loading at the first unused (all ones) sector record, so every block of the sector records must start
+ * out filled with them: a crash right after a metadata block was flushed would otherwise expose whatever the next block
+ * held before. Zeroes are valid records, so these blocks are written with large aligned O_DIRECT writes.
+ * The checksum blocks are only read for valid sector records: they are discarded (or zeroed out) when the device
+ * supports it, and left alone otherwise.
+ *
+ * With a metadata device, the metadata is formatted there instead, and its scrub checkpoint block is zeroed.
+ *
+ * @param dev_path The path of the block device
+ * @param meta_path The path of the metadata device, or NULL
+ * @param disk_size The size of the device, in 4096-byte sectors
+ *
+ * @return The error code (0 on success)
+ */
+int ent_disk_format(const char * dev_path, const char * meta_path, uint64_t disk_size)
+{
+    const char *format_path = meta_path ? meta_path : dev_path;
+    struct ent_layout layout;
+    struct timespec start;
+    uint64_t range[2];
+    const char *checksum_method = "none";
+    char *buf;
+    int fd;
+    int err;
+
+    ent_layout_compute(disk_size, meta_path != NULL, &layout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (meta_path) {
+        int64_t meta_size = get_disk_size((char *) meta_path);
+
+        if (meta_size < 0) {
+            return (int) -meta_size;
+        }
+        if ((uint64_t) meta_size < layout.metadata_base + layout.metadata_size) {
+            ent_log_error("Metadata device %s is too small: %lu blocks needed", meta_path,
+                          layout.metadata_base + layout.metadata_size);
+            return ENOSPC;
+        }
+    }
+
+    /* One descriptor for the whole format. O_EXCL fails if the device is mounted or held by a target. */
+    fd = open(format_path, O_RDWR | O_DIRECT | O_EXCL);
+    if (fd < 0) {
+        ent_log_error("Could not open %s for formatting", format_path);
+        return errno;
+    }
+
+    if (posix_memalign((void **) &buf, ENT_BLK_SIZE, ENT_FORMAT_CHUNK)) {
+        err = ENOMEM;
+        goto bad_alloc;
+    }
+    memset(buf, 0xFF, ENT_FORMAT_CHUNK);
+
+    /* Checksum blocks: their contents do not matter, so give them back to the device if it can take them. */
+    range[0] = (layout.metadata_base + layout.metadata_sector_size) * ENT_BLK_SIZE;
+    range[1] = layout.metadata_checksum_size * ENT_BLK_SIZE;
+    if (range[1] && ioctl(fd, BLKDISCARD, range) == 0) {
+        checksum_method = "discard";
+    }else if (range[1] && ioctl(fd, BLKZEROOUT, range) == 0) {
+        checksum_method = "zeroout";
+    }
+
+    /* Sector record blocks: all ones. */
+    for (uint64_t done = 0; done < layout.metadata_sector_size; ) {
+        size_t nr = layout.metadata_sector_size - done;
+
+        if (nr > ENT_FORMAT_CHUNK / ENT_BLK_SIZE) {
+            nr = ENT_FORMAT_CHUNK / ENT_BLK_SIZE;
+        }
+        err = ent_disk_writeManySectors(fd, layout.metadata_base + done, buf, nr);
+        if (err) {
+            goto bad_write;
+        }
+        done += nr;
+    }
+
+    /* No scrub checkpoint yet. */
+    if (meta_path) {
+        memset(buf, 0, ENT_BLK_SIZE * ENT_META_CHECKPOINT_BLOCKS);
+        err = ent_disk_writeManySectors(fd, 0, buf, ENT_META_CHECKPOINT_BLOCKS);
+        if (err) {
+            goto bad_write;
+        }
+    }
+
+    /* O_DIRECT bypasses the page cache, not the cache of the device. */
+    if (fdatasync(fd) < 0) {
+        err = errno;
+        goto bad_write;
+    }
+
+    printf("format %s metadata_blocks=%lu written_mib=%lu checksums=%s ms=%.1f\n", format_path, layout.metadata_size,
+           layout.metadata_sector_size * ENT_BLK_SIZE >> 20, checksum_method, ent_elapsed_ms(&start));
+    err = 0;
+
+bad_write:
+    free(buf);
+bad_alloc:
+    close(fd);
+    return err;
+}
+
+/**
+ * Runs one command (init/open/close/corrupt) on one entanglement device.
+ *
+ * @param command The command
+ * @param name The name of the virtual device under /dev/mapper
+ * @param path The path of the underlying block device, optionally followed by ",<metadata device path>"
+ * @param redundancy_flag Whether the device checks for (and repairs) corruption when opened
+ * @param corrupt_chance Percentage of the blocks corrupted when opened (corrupt only)
+ *
+ * @return The error code (0 on success, -EINVAL for an unknown command)
+ */
+int ent_dev_command(const char * command, char * name, const char * path, int redundancy_flag, unsigned int corrupt_chance)
+{
+    char dev_path[PATH_MAX];
+    char meta_path[PATH_MAX];
+    char params[2 * PATH_MAX + 128];
+    struct ent_layout layout;
+    struct timespec start;
+    int64_t disk_size;
+    int init_flag;
+    int err;
+
+    if (strcmp(command, "close") == 0) {
+        return ent_dm_destroy(name);
+    }
+
+    if (strcmp(command, "init") == 0) {
+        init_flag = 1;
+        corrupt_chance = 0;
+    }else if (strcmp(command, "open") == 0) {
+        init_flag = 0;
+        corrupt_chance = 0;
+    }else if (strcmp(command, "corrupt") == 0) {
+        init_flag = 0;
+    }else {
+        return -EINVAL;
+    }
+
+    err = ent_split_dev_path(path, dev_path, meta_path);
+    if (err) {
+        ent_log_error("Invalid device %s", path);
+        return err;
+    }
+
+    disk_size = get_disk_size(dev_path);
+    if (disk_size < 0) {
+        return (int) disk_size;
+    }
+    ent_layout_compute(disk_size, meta_path[0] != '\0', &layout);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (init_flag) {
+        err = ent_disk_format(dev_path, meta_path[0] ? meta_path : NULL, disk_size);
+        if (err) {
+            ent_log_error("Error while formatting %s", dev_path);
+            return err;
+        }
+    }
+
+    // The virtual device is the data region, in 512-byte sectors.
+    snprintf(params, sizeof(params), "%s %ld %d %d %u%s%s", dev_path, disk_size, redundancy_flag, init_flag, corrupt_chance,
+             meta_path[0] ? " " : "", meta_path);
+    err = ent_dm_create(name, layout.metadata_start_sector * 8, params);
+
+    if (!err && init_flag) {
+        printf("init %s %s ms=%.1f\n", name, dev_path, ent_elapsed_ms(&start));
+    }
+    return err;
+}
+
+
+/*
+    Manifest of devices, brought up (or down) by one invocation of the app: entanglement_app manifest <file> [<workers>].
+    Every line is "<command> <name> <dev_path>[,<meta_dev_path>] [<redundancy_flag>]", with command init, open or close. Empty lines
+    and lines starting with # are skipped.
+    The devices are handled in parallel by a bounded pool of workers, each with its own dm_task and udev cookie, so bringing up
+    many volumes takes about as long as the slowest of them rather than the sum.
+*/
+struct ent_manifest_entry {
+    char command[16];
+    char name[128];
+    char dev_path[PATH_MAX];
+    int redundancy_flag;
+
+    // Outcome, filled in by the worker.
+    int err;
+    double elapsed_ms;
+};
+
+struct ent_manifest {
+    struct ent_manifest_entry *entries;
+    int nr_entries;
+
+    // Index of the next entry to hand out to a worker.
+    pthread_mutex_t lock;
+    int next;
+};
+
+/**
+ * Parses a manifest file.
+ *
+ * @param path The path of the manifest
+ * @param manifest The manifest to fill in; entries are allocated, and freed by the caller
+ *
+ * @return The error code (0 on success)
+ */
+int ent_manifest_parse(const char * path, struct ent_manifest * manifest)
+{
+    FILE *file;
+    char line[PATH_MAX + 256];
+    int lineno = 0;
+    int capacity = 0;
+    int err = 0;
+
+    file = fopen(path, "r");
+    if (!file) {
+        ent_log_error("Could not open manifest %s", path);
+        return errno;
+    }
+
+    manifest->entries = NULL;
+    manifest->nr_entries = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        struct ent_manifest_entry *entry;
+        char *start = line + strspn(line, " \t");
+        int fields;
+
+        lineno++;
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        if (manifest->nr_entries == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            entry = realloc(manifest->entries, capacity * sizeof(*entry));
+            if (!entry) {
+                err = ENOMEM;
+                break;
+            }
+            manifest->entries = entry;
+        }
+
+        entry = &manifest->entries[manifest->nr_entries];
+        memset(entry, 0, sizeof(*entry));
+        fields = sscanf(start, "%15s %127s %4095s %d", entry->command, entry->name, entry->dev_path, &entry->redundancy_flag);
+        if (fields < 3) {
+            ent_log_error("%s:%d: expected <command> <name> <dev_path> [<redundancy_flag>]", path, lineno);
+            err = EINVAL;
+            break;
+        }
+        if (strcmp(entry->command, "init") && strcmp(entry->command, "open") && strcmp(entry->command, "close")) {
+            ent_log_error("%s:%d: unknown command %s", path, lineno, entry->command);
+            err = EINVAL;
+            break;
+        }
+        manifest->nr_entries++;
+    }
+
+    fclose(file);
+    return err;
+}
+
+static void * ent_manifest_worker(void * arg)
+{
+    struct ent_manifest *manifest = arg;
+    struct ent_manifest_entry *entry;
+    struct timespec start;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&manifest->lock);
+        i = manifest->next++;
+        pthread_mutex_unlock(&manifest->lock);
+        if (i >= manifest->nr_entries) {
+            break;
+        }
+
+        entry = &manifest->entries[i];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        entry->err = ent_dev_command(entry->command, entry->name, entry->dev_path, entry->redundancy_flag, 0);
+        entry->elapsed_ms = ent_elapsed_ms(&start);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs every command of a manifest, on at most nr_workers devices at once, and reports the time taken by each device.
+ *
+ * @param path The path of the manifest
+ * @param nr_workers The number of workers
+ *
+ * @return The number of devices that failed, or an error code if the manifest could not be run at all
+ */
+int ent_manifest_run(const char * path, int nr_workers)
+{
+    struct ent_manifest manifest;
+    pthread_t workers[ENT_MAX_WORKERS];
+    struct timespec start;
+    char driver_version[64];
+    double total_ms, slowest_ms = 0, sum_ms = 0;
+    int nr_started = 0;
+    int failed = 0;
+    int err;
+
+    err = ent_manifest_parse(path, &manifest);
+    if (err) {
+        free(manifest.entries);
+        return err;
+    }
+    if (nr_workers > manifest.nr_entries) {
+        nr_workers = manifest.nr_entries;
+    }
+    pthread_mutex_init(&manifest.lock, NULL);
+    manifest.next = 0;
+
+    // libdevmapper opens the control device lazily, in a global: open it once here, before the workers race for it.
+    if (!dm_driver_version(driver_version, sizeof(driver_version))) {
+        ent_log_error("Cannot talk to the device-mapper driver");
+        err = ENODEV;
+        goto out;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (nr_started = 0; nr_started < nr_workers; nr_started++) {
+        if (pthread_create(&workers[nr_started], NULL, ent_manifest_worker, &manifest)) {
+            ent_log_error("Could not start worker %d", nr_started);
+            break;
+        }
+    }
+    // With no worker at all, nothing would ever run: do the work here instead.
+    if (!nr_started) {
+        ent_manifest_worker(&manifest);
+    }
+    for (int i = 0; i < nr_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    total_ms = ent_elapsed_ms(&start);
+
+    for (int i = 0; i < manifest.nr_entries; i++) {
+        struct ent_manifest_entry *entry = &manifest.entries[i];
+
+        printf("%s %s %s err=%d ms=%.1f\n", entry->name, entry->command, entry->dev_path, entry->err, entry->elapsed_ms);
+        if (entry->err) {
+            failed++;
+        }
+        if (entry->elapsed_ms > slowest_ms) {
+            slowest_ms = entry->elapsed_ms;
+        }
+        sum_ms += entry->elapsed_ms;
+    }
+    printf("devices=%d failed=%d workers=%d total_ms=%.1f slowest_ms=%.1f sum_ms=%.1f\n",
+           manifest.nr_entries, failed, nr_started, total_ms, slowest_ms, sum_ms);
+    err = failed;
+
+out:
+    pthread_mutex_destroy(&manifest.lock);
+    free(manifest.entries);
+    return err;
+}
+
+/**
+ * Checks (fsck) or repairs (repair) an entanglement device offline, and prints the report: the device must not be open.
+ *
+ * @param path The path of the underlying block device, optionally followed by ",<metadata device path>"
+ * @param repair Whether to repair the corrupted blocks, or only report them
+ * @param threads The number of verification threads (0 to derive it from the queue limits of the device)
+ * @param queue_depth The number of reads in flight per thread (0 to derive it from the queue limits of the device)
+ *
+ * @return 0 if the device is clean (or was fully repaired), 1 if blocks are corrupted (or irrecoverable), or an error code
+ */
+int ent_fsck_command(const char * path, bool repair, unsigned int threads, unsigned int queue_depth)
+{
+    char dev_path[PATH_MAX];
+    char meta_path[PATH_MAX];
+    struct ent_fsck_opts opts = {
+        .threads = threads,
+        .queue_depth = queue_depth,
+        .repair = repair,
+    };
+    struct ent_fsck_report report;
+    int err;
+
+    err = ent_split_dev_path(path, dev_path, meta_path);
+    if (err) {
+        ent_log_error("Invalid device %s", path);
+        return err;
+    }
+    opts.meta_path = meta_path[0] ? meta_path : NULL;
+    ent_fsck_tune(dev_path, &opts);
+
+    err = ent_fsck_device(dev_path, &opts, &report);
+    if (err) {
+        ent_log_error("%s of %s failed: %s", repair ? "Repair" : "Check", dev_path, strerror(-err));
+        return -err;
+    }
+
+    printf("device=%s blocks=%lu chain_length=%lu chain_anchors=%lu io=%s threads=%u queue_depth=%u\n", dev_path, report.dev_blocks,
+           report.chain_length, report.chain_anchors, report.io_uring ? "io_uring" : "pread", opts.threads ? opts.threads : ENT_FSCK_DEFAULT_THREADS,
+           opts.queue_depth ? opts.queue_depth : ENT_FSCK_DEFAULT_QUEUE_DEPTH);
+    printf("checked=%lu corrupted=%lu repairable=%lu irrecoverable=%lu repaired=%lu\n", report.checked, report.corrupted,
+           report.repairable, report.irrecoverable, report.repaired);
+    printf("load_ms=%.1f verify_ms=%.1f repair_ms=%.1f verify_mib_per_s=%.1f\n", report.load_ns / 1e6, report.verify_ns / 1e6,
+           report.repair_ns / 1e6, report.verify_ns ? report.checked * (double) ENT_BLK_SIZE / (1 << 20) / (report.verify_ns / 1e9) : 0.0);
+    for (uint64_t i = 0; i < report.irrecoverable; i++) {
+        printf("irrecoverable_block=%lu\n", report.irrecoverable_blocks[i]);
+    }
+
+    err = repair ? (report.irrecoverable || report.repaired < report.repairable) : (report.corrupted != 0);
+    ent_fsck_report_free(&report);
+    return err;
+}
+
 int main(int argc, char const *argv[])
 {
     /*
         Get the size of the disk, and send it to the device-mapper as a parameter. Send the size as number of 4KB blocks.
     */
 
-    char *dev_path;
-    char *command;
+    const char *dev_path;
+    const char *command;
     int redundancy_flag = 0;
-    char params[1024];
-    unsigned int corrupt_chance;
+    unsigned int corrupt_chance = 0;
+    int nr_workers = ENT_DEFAULT_WORKERS;
 
     int err;
 
+    if (argc >= 3 && (strcmp(argv[1], "fsck") == 0 || strcmp(argv[1], "repair") == 0)) {
+        if (argc > 5) {
+            printf("Usage: ./entanglement_app fsck|repair <dev_path>[,<meta_dev_path>] [<threads>] [<queue_depth>]\n");
+            return 1;
+        }
+        return ent_fsck_command(argv[2], strcmp(argv[1], "repair") == 0,
+                                argc > 3 ? strtoul(argv[3], NULL, 10) : 0, argc > 4 ? strtoul(argv[4], NULL, 10) : 0);
+    }
+
+    if (argc >= 3 && strcmp(argv[1], "manifest") == 0) {
+        if (argc == 4) {
+            nr_workers = atoi(argv[3]);
+        }
+        if (argc > 4 || nr_workers < 1 || nr_workers > ENT_MAX_WORKERS) {
+            printf("Usage: ./entanglement_app manifest <file> [<workers (1-%d)>]\n", ENT_MAX_WORKERS);
+            return 1;
+        }
+        return ent_manifest_run(argv[2], nr_workers) ? 1 : 0;
+    }
+
     if (argc != 3 && argc != 4 && argc != 5) {
-        printf("Wrong number of arguments. Usage: ./entanglement_app <command(init/open/close/corrupt)> <dev_path> [<redundancy_flag>] [<corrupt_chance>]\n");
+        printf("Wrong number of arguments. Usage: ./entanglement_app <command(init/open/close/corrupt)> <dev_path>[,<meta_dev_path>] [<redundancy_flag>] [<corrupt_chance>]\n");
+        printf("                                  ./entanglement_app manifest <file> [<workers>]\n");
+        printf("                                  ./entanglement_app fsck|repair <dev_path>[,<meta_dev_path>] [<threads>] [<queue_depth>]\n");
         return 1;
     }
     
     command = argv[1];
     dev_path = argv[2];
-    disk_size = get_disk_size(dev_path);
     if (argc == 4) {
         redundancy_flag = 1;
     }
     if (argc == 5) {
         redundancy_flag = 1;
-        corrupt_chance = argv[4];
+        corrupt_chance = strtoul(argv[4], NULL, 10);
     }
 
-    // The two 8s in the end is to properly align the size for the block size of 4096 bytes. 
-    unsigned int virtual_device_size = (((disk_size-metadata_size)*8) / 2) / 8 * 8;
-    
-    if (strcmp(command, "init") == 0) {
-        sprintf(params, "%s %lu %d %d %u", dev_path, disk_size, redundancy_flag, 1, 0);
-        err = ent_dm_create(ENT_DEV_NAME, virtual_device_size, params);
-        if (err) {
-            perror("Error while creating dm target.\n");
-            return err;
-        }
-    }else if (strcmp(command, "open") == 0) {
-        sprintf(params, "%s %lu %d %d %u", dev_path, disk_size, redundancy_flag, 0, 0);
-        err = ent_dm_create(ENT_DEV_NAME, virtual_device_size, params);
-        if (err) {
-            perror("Error while creating dm target.\n");
-            return err;
-        }
-    }else if (strcmp(command, "close") == 0) {
-        err = ent_dm_destroy(ENT_DEV_NAME);
-        if (err) {
-            perror("Error while destroying dm target.\n");
-            return err;
-        }
-    }else if (strcmp(command, "corrupt") == 0){
-        sprintf(params, "%s %lu %d %d %u", dev_path, disk_size, redundancy_flag, 0, corrupt_chance);
-        err = ent_dm_create(ENT_DEV_NAME, virtual_device_size, params);
-        if (err) {
-            perror("Error while creating dm target.\n");
-            return err;
-        }
-    }else {
-        printf("Wrong command. Usage: ./entanglement_app <command(init/open/close)> <dev_path> [<redundancy>]\n");
+    err = ent_dev_command(command, ENT_DEV_NAME, dev_path, redundancy_flag, corrupt_chance);
+    if (err == -EINVAL) {
+        printf("Wrong command. Usage: ./entanglement_app <command(init/open/close/corrupt)> <dev_path> [<redundancy>]\n");
         return 2;
     }
-    
+    if (err) {
+        perror("Error while running the dm command.\n");
+        return err;
+    }
 
     return 0;
 }